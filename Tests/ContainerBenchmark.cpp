@@ -0,0 +1,207 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "UsbDkUtil.h"
+#include "HostTest.h"
+
+#include <vector>
+
+// Sizes seen by the driver: filters per hub, devices
+// and redirections per host, hide rules of big setups
+static const size_t BenchmarkSizes[] = { 8, 64, 512 };
+
+class CBenchEntry : public CAllocatable<NonPagedPool, 'EBHR'>
+{
+public:
+    CBenchEntry(ULONG Key)
+        : m_Key(Key)
+    {}
+
+    bool operator==(const CBenchEntry &Other) const
+    { return m_Key == Other.m_Key; }
+    bool operator==(ULONG Key) const
+    { return m_Key == Key; }
+
+    static ULONG HashOf(const CBenchEntry &Entry)
+    { return HashOf(Entry.m_Key); }
+    static ULONG HashOf(ULONG Key)
+    { return UsbDkHashBytes(&Key, sizeof(Key)); }
+
+    ULONG Key() const
+    { return m_Key; }
+    void Hit()
+    { m_Hits++; }
+    ULONG Hits() const
+    { return m_Hits; }
+
+private:
+    ULONG m_Key;
+    ULONG m_Hits = 0;
+
+    DECLARE_CWDMLIST_ENTRY(CBenchEntry);
+};
+
+typedef CWdmList<CBenchEntry, CLockedAccess, CCountingObject> TBenchList;
+typedef CWdmSet<CBenchEntry, CLockedAccess, CNonCountingObject> TBenchSet;
+typedef CWdmHashMap<CBenchEntry, CLockedAccess, CNonCountingObject> TBenchHashMap;
+
+// Keys are spread, so entries do not sit in key order
+static ULONG KeyOf(size_t Index)
+{ return static_cast<ULONG>(Index) * 2654435761UL; }
+
+static void BenchmarkPushPop(size_t Size, ULONG Iterations)
+{
+    std::vector<CBenchEntry *> Entries;
+    for (size_t i = 0; i < Size; i++)
+    {
+        Entries.push_back(new CBenchEntry(KeyOf(i)));
+    }
+
+    TBenchList List;
+    HostBenchmark("CWdmList PushBack+Pop", Size, Iterations, [&](ULONG)
+    {
+        for (auto Entry : Entries)
+        {
+            List.PushBack(Entry);
+        }
+
+        for (size_t i = 0; i < Entries.size(); i++)
+        {
+            HOST_CHECK(List.Pop() == Entries[i]);
+        }
+    });
+
+    HOST_CHECK(List.IsEmpty());
+
+    for (auto Entry : Entries)
+    {
+        delete Entry;
+    }
+}
+
+static void BenchmarkForEachIf(size_t Size, ULONG Iterations)
+{
+    TBenchList List;
+    for (size_t i = 0; i < Size; i++)
+    {
+        List.PushBack(new CBenchEntry(KeyOf(i)));
+    }
+
+    ULONG Matched = 0;
+    HostBenchmark("CWdmList ForEachIf", Size, Iterations, [&](ULONG)
+    {
+        List.ForEachIf([](CBenchEntry *Entry) { return (Entry->Key() & 7) == 0; },
+                       [&Matched](CBenchEntry *Entry) { Entry->Hit(); Matched++; return true; });
+    });
+
+    ULONG Expected = 0;
+    for (size_t i = 0; i < Size; i++)
+    {
+        Expected += ((KeyOf(i) & 7) == 0) ? 1 : 0;
+    }
+    HOST_CHECK(Matched == Expected * Iterations);
+}
+
+template <typename TSet>
+static void FillSet(TSet &Set, size_t Size)
+{
+    for (size_t i = 0; i < Size; i++)
+    {
+        HOST_CHECK(Set.Add(new CBenchEntry(KeyOf(i))));
+    }
+}
+
+template <typename TSet>
+static void BenchmarkModifyOne(const char *Name, size_t Size, ULONG Iterations)
+{
+    TSet Set;
+    FillSet(Set, Size);
+
+    HostBenchmark(Name, Size, Iterations, [&](ULONG i)
+    {
+        auto Key = KeyOf(i % Size);
+        HOST_CHECK(Set.ModifyOne(&Key, [](CBenchEntry *Entry) { Entry->Hit(); }));
+    });
+
+    ULONG Hits = 0;
+    Set.ForEach([&Hits](CBenchEntry *Entry) { Hits += Entry->Hits(); return true; });
+    HOST_CHECK(Hits == Iterations);
+}
+
+template <typename TSet>
+static void BenchmarkContains(const char *HitName, const char *MissName, size_t Size, ULONG Iterations)
+{
+    TSet Set;
+    FillSet(Set, Size);
+
+    HostBenchmark(HitName, Size, Iterations, [&](ULONG i)
+    {
+        auto Key = KeyOf(i % Size);
+        HOST_CHECK(Set.Contains(&Key));
+    });
+
+    HostBenchmark(MissName, Size, Iterations, [&](ULONG i)
+    {
+        auto Key = KeyOf(Size + i % Size);
+        HOST_CHECK(!Set.Contains(&Key));
+    });
+}
+
+// Entry churn of redirections and hide rules
+template <typename TSet>
+static void BenchmarkAddDetach(const char *Name, size_t Size, ULONG Iterations)
+{
+    TSet Set;
+    FillSet(Set, Size);
+
+    HostBenchmark(Name, Size, Iterations, [&](ULONG i)
+    {
+        auto Key = KeyOf(i % Size);
+        CBenchEntry *Detached = nullptr;
+        HOST_CHECK(Set.Detach(&Key, [&Detached](CBenchEntry *Entry) { Detached = Entry; }));
+        HOST_CHECK(Set.Add(Detached));
+    });
+}
+
+int main(int argc, char *argv[])
+{
+    auto Scale = HostBenchmarkScale(argc, argv);
+
+    for (auto Size : BenchmarkSizes)
+    {
+        // Keep the work per size roughly constant
+        auto Iterations = static_cast<ULONG>(Scale * 20000 / Size);
+
+        BenchmarkPushPop(Size, Iterations);
+        BenchmarkForEachIf(Size, Iterations);
+        BenchmarkModifyOne<TBenchSet>("CWdmSet ModifyOne", Size, Iterations * 16);
+        BenchmarkModifyOne<TBenchHashMap>("CWdmHashMap ModifyOne", Size, Iterations * 16);
+        BenchmarkContains<TBenchSet>("CWdmSet Contains (hit)", "CWdmSet Contains (miss)", Size, Iterations * 16);
+        BenchmarkContains<TBenchHashMap>("CWdmHashMap Contains (hit)", "CWdmHashMap Contains (miss)", Size, Iterations * 16);
+        BenchmarkAddDetach<TBenchSet>("CWdmSet Detach+Add", Size, Iterations * 16);
+        BenchmarkAddDetach<TBenchHashMap>("CWdmHashMap Detach+Add", Size, Iterations * 16);
+    }
+
+    return HostTestResult("ContainerBenchmark");
+}
@@ -0,0 +1,321 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "UsbDkUtil.h"
+#include "HostTest.h"
+
+#include <set>
+
+class CTestEntry : public CAllocatable<NonPagedPool, 'ETHR'>
+{
+public:
+    CTestEntry(ULONG Key, ULONG Value = 0)
+        : m_Value(Value)
+        , m_Key(Key)
+    { m_Alive++; }
+
+    ~CTestEntry()
+    { m_Alive--; }
+
+    bool operator==(const CTestEntry &Other) const
+    { return m_Key == Other.m_Key; }
+    bool operator==(ULONG Key) const
+    { return m_Key == Key; }
+
+    // Poor hash puts many keys into one bucket
+    static ULONG HashOf(const CTestEntry &Entry)
+    { return HashOf(Entry.m_Key); }
+    static ULONG HashOf(ULONG Key)
+    { return m_PoorHash ? (Key & 3) : UsbDkHashBytes(&Key, sizeof(Key)); }
+
+    void Release()
+    { delete this; }
+
+    ULONG Key() const
+    { return m_Key; }
+
+    ULONG m_Value;
+
+    static LONG m_Alive;
+    static bool m_PoorHash;
+
+private:
+    ULONG m_Key;
+
+    DECLARE_CWDMLIST_ENTRY(CTestEntry);
+};
+
+LONG CTestEntry::m_Alive = 0;
+bool CTestEntry::m_PoorHash = false;
+
+template <typename TAccess>
+using TTestMap = CWdmHashMap<CTestEntry, TAccess, CCountingObject>;
+
+// Map content must be exactly the expected keys
+template <typename TMap>
+static void CheckContent(TMap &Map, const std::set<ULONG> &Expected)
+{
+    std::set<ULONG> Found;
+
+    Map.ForEach([&Found](CTestEntry *Entry)
+                {
+                    HOST_CHECK(Found.insert(Entry->Key()).second);
+                    return true;
+                });
+
+    HOST_CHECK(Found == Expected);
+    HOST_CHECK(Map.GetCount() == Expected.size());
+
+    for (auto Key : Expected)
+    {
+        HOST_CHECK(Map.Contains(&Key));
+    }
+}
+
+template <typename TAccess>
+static void TestAddContains()
+{
+    TTestMap<TAccess> Map;
+    std::set<ULONG> Expected;
+
+    for (ULONG Key = 0; Key < 100; Key++)
+    {
+        HOST_CHECK(Map.Add(new CTestEntry(Key)));
+        Expected.insert(Key);
+    }
+
+    // Duplicates are rejected and stay with the caller
+    CTestEntry Duplicate(42);
+    HOST_CHECK(!Map.Add(&Duplicate));
+
+    ULONG Missing = 1000;
+    HOST_CHECK(!Map.Contains(&Missing));
+    HOST_CHECK(Map.Contains(&Duplicate));
+
+    CheckContent(Map, Expected);
+}
+
+template <typename TAccess>
+static void TestModifyOne()
+{
+    TTestMap<TAccess> Map;
+
+    for (ULONG Key = 0; Key < 50; Key++)
+    {
+        Map.Add(new CTestEntry(Key, Key));
+    }
+
+    for (ULONG Key = 0; Key < 50; Key++)
+    {
+        HOST_CHECK(Map.ModifyOne(&Key, [Key](CTestEntry *Entry)
+                                 {
+                                     HOST_CHECK(Entry->Key() == Key);
+                                     Entry->m_Value += 1000;
+                                 }));
+    }
+
+    ULONG Missing = 50;
+    HOST_CHECK(!Map.ModifyOne(&Missing, [](CTestEntry *) { HOST_CHECK(false); }));
+
+    Map.ForEach([](CTestEntry *Entry) { HOST_CHECK(Entry->m_Value == Entry->Key() + 1000); return true; });
+}
+
+template <typename TAccess>
+static void TestDetachDelete()
+{
+    TTestMap<TAccess> Map;
+    std::set<ULONG> Expected;
+
+    for (ULONG Key = 0; Key < 200; Key++)
+    {
+        Map.Add(new CTestEntry(Key));
+        Expected.insert(Key);
+    }
+
+    // Removal while old table is still being moved
+    for (ULONG Key = 0; Key < 200; Key += 3)
+    {
+        CTestEntry *Detached = nullptr;
+        HOST_CHECK(Map.Detach(&Key, [&Detached](CTestEntry *Entry) { Detached = Entry; }));
+        HOST_CHECK((Detached != nullptr) && (Detached->Key() == Key));
+        delete Detached;
+        Expected.erase(Key);
+
+        HOST_CHECK(!Map.Detach(&Key, [](CTestEntry *) { HOST_CHECK(false); }));
+    }
+
+    for (ULONG Key = 1; Key < 200; Key += 3)
+    {
+        HOST_CHECK(Map.Delete(&Key));
+        Expected.erase(Key);
+    }
+
+    CheckContent(Map, Expected);
+}
+
+// Entries stay reachable through every step of incremental
+// resize, walks see each of them exactly once
+template <typename TAccess>
+static void TestIncrementalResize()
+{
+    TTestMap<TAccess> Map;
+    std::set<ULONG> Expected;
+
+    for (ULONG Key = 0; Key < 5000; Key++)
+    {
+        Map.Add(new CTestEntry(Key));
+        Expected.insert(Key);
+
+        if ((Key % 97) == 0)
+        {
+            CheckContent(Map, Expected);
+        }
+    }
+
+    CheckContent(Map, Expected);
+}
+
+static void TestCollisions()
+{
+    CTestEntry::m_PoorHash = true;
+
+    TTestMap<CLockedAccess> Map;
+    std::set<ULONG> Expected;
+
+    for (ULONG Key = 0; Key < 300; Key++)
+    {
+        Map.Add(new CTestEntry(Key));
+        Expected.insert(Key);
+    }
+
+    for (ULONG Key = 0; Key < 300; Key += 2)
+    {
+        HOST_CHECK(Map.Delete(&Key));
+        Expected.erase(Key);
+    }
+
+    CheckContent(Map, Expected);
+
+    CTestEntry::m_PoorHash = false;
+}
+
+// Failed table allocation keeps the map working with longer chains
+static void TestGrowFailure()
+{
+    TTestMap<CLockedAccess> Map;
+    std::set<ULONG> Expected;
+
+    ShimPoolState().FailAllocations = 1000000;
+    for (ULONG Key = 0; Key < 100; Key++)
+    {
+        // Entries come from the pool too, create them unhindered
+        ShimPoolState().FailAllocations = 0;
+        auto Entry = new CTestEntry(Key);
+        ShimPoolState().FailAllocations = 1000000;
+
+        HOST_CHECK(Map.Add(Entry));
+        Expected.insert(Key);
+    }
+    ShimPoolState().FailAllocations = 0;
+
+    CheckContent(Map, Expected);
+
+    // Growth resumes once allocations succeed again
+    for (ULONG Key = 100; Key < 300; Key++)
+    {
+        Map.Add(new CTestEntry(Key));
+        Expected.insert(Key);
+    }
+
+    CheckContent(Map, Expected);
+}
+
+static void TestDetachAllClear()
+{
+    TTestMap<CLockedAccess> Map;
+
+    for (ULONG Key = 0; Key < 100; Key++)
+    {
+        Map.Add(new CTestEntry(Key));
+    }
+
+    ULONG Detached = 0;
+    Map.DetachAll([&Detached](CTestEntry *Entry) { Detached++; delete Entry; });
+    HOST_CHECK(Detached == 100);
+    HOST_CHECK(Map.GetCount() == 0);
+
+    ULONG Key = 5;
+    HOST_CHECK(!Map.Contains(&Key));
+    HOST_CHECK(Map.Add(new CTestEntry(Key)));
+    HOST_CHECK(Map.Contains(&Key));
+
+    for (ULONG i = 0; i < 100; i++)
+    {
+        Map.Add(new CTestEntry(1000 + i));
+    }
+
+    Map.Clear();
+    HOST_CHECK(Map.GetCount() == 0);
+    HOST_CHECK(CTestEntry::m_Alive == 0);
+}
+
+// Walk stops when the functor returns false
+static void TestForEachStop()
+{
+    TTestMap<CRawAccess> Map;
+
+    for (ULONG Key = 0; Key < 100; Key++)
+    {
+        Map.Add(new CTestEntry(Key));
+    }
+
+    ULONG Visited = 0;
+    HOST_CHECK(!Map.ForEach([&Visited](CTestEntry *) { return ++Visited < 10; }));
+    HOST_CHECK(Visited == 10);
+}
+
+int main()
+{
+    auto PoolBefore = ShimPoolState();
+
+    TestAddContains<CLockedAccess>();
+    TestAddContains<CRawAccess>();
+    TestModifyOne<CLockedAccess>();
+    TestModifyOne<CRawAccess>();
+    TestDetachDelete<CLockedAccess>();
+    TestDetachDelete<CRawAccess>();
+    TestIncrementalResize<CLockedAccess>();
+    TestIncrementalResize<CRawAccess>();
+    TestCollisions();
+    TestGrowFailure();
+    TestDetachAllClear();
+    TestForEachStop();
+
+    // Every entry and bucket table went back to the pool
+    HOST_CHECK(CTestEntry::m_Alive == 0);
+    HOST_CHECK(ShimPoolState().Allocations - PoolBefore.Allocations ==
+               ShimPoolState().Frees - PoolBefore.Frees);
+
+    return HostTestResult("HashMapTest");
+}
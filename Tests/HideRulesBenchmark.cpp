@@ -0,0 +1,351 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+// Hide decisions of CUsbDkHideRulesIndex against the walk over both
+// rule sets it replaced, for policies of thousands of VID/PID rules.
+// Both must decide the same for every device, whatever the order of
+// rules in the sets.
+
+#include "stdafx.h"
+#include "HideRules.h"
+#include "HostTest.h"
+
+#include <vector>
+
+// Rules per policy, from a few manual rules to big security policies
+static const size_t BenchmarkSizes[] = { 16, 256, 4096 };
+
+// More distinct devices than slots of the decision cache
+static const size_t NumDevices = 4096;
+
+typedef CWdmSet<CUsbDkHideRule, CLockedAccess, CNonCountingObject> THideRulesSet;
+
+// Carries what hide rules look at, interface triples are
+// packed as in CUsbDkChildDevice, class in bits 16-23
+class CTestDevice : public CAllocatable<NonPagedPool, 'DTHR'>
+{
+public:
+    CTestDevice(const USB_DEVICE_DESCRIPTOR &DevDescriptor)
+        : m_DevDescriptor(DevDescriptor)
+    {}
+
+    const USB_DEVICE_DESCRIPTOR &DeviceDescriptor() const
+    { return m_DevDescriptor; }
+
+    void AddInterface(UCHAR Class, UCHAR SubClass, UCHAR Protocol)
+    {
+        ASSERT(m_NumInterfaceClasses < ARRAY_SIZE(m_InterfaceClasses));
+        m_InterfaceClasses[m_NumInterfaceClasses++] = (ULONG(Class) << 16) | (ULONG(SubClass) << 8) | Protocol;
+    }
+
+    template <typename TPredicate>
+    bool AnyInterface(TPredicate Predicate) const
+    {
+        for (size_t i = 0; i < m_NumInterfaceClasses; i++)
+        {
+            auto Triple = m_InterfaceClasses[i];
+            if (Predicate(static_cast<UCHAR>(Triple >> 16),
+                          static_cast<UCHAR>(Triple >> 8),
+                          static_cast<UCHAR>(Triple)))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    USB_DEVICE_DESCRIPTOR m_DevDescriptor;
+    ULONG m_InterfaceClasses[4] = {};
+    size_t m_NumInterfaceClasses = 0;
+};
+
+class CRandom
+{
+public:
+    CRandom(ULONG Seed)
+        : m_State(Seed)
+    {}
+
+    ULONG Next(ULONG Limit)
+    {
+        m_State = m_State * 1103515245 + 12345;
+        return (m_State >> 8) % Limit;
+    }
+
+private:
+    ULONG m_State;
+};
+
+static CUsbDkHideRuleMatcher Exact(ULONG Value)
+{ return CUsbDkHideRuleMatcher(Value, Value); }
+
+static CUsbDkHideRuleMatcher Range(ULONG Min, ULONG Max)
+{ return CUsbDkHideRuleMatcher(Min, Max); }
+
+static const CUsbDkHideRuleMatcher Any;
+
+// Vendors are shared by rules and devices, so both exact
+// and wildcard rules match some devices and miss others
+static ULONG VIDOf(CRandom &Random, size_t NumVendors)
+{ return 0x1000 + Random.Next(static_cast<ULONG>(NumVendors)) * 7; }
+
+// Dynamic and persistent rule sets as kept by the control device
+class CPolicy
+{
+public:
+    CPolicy(size_t NumRules, bool WithInterfaces)
+    {
+        CRandom Random(static_cast<ULONG>(NumRules));
+        m_NumVendors = NumRules / 4 + 1;
+
+        // Few class and global rules, the rest are vendor
+        // rules as pushed by security policies
+        for (ULONG i = 0; m_NumRules < NumRules; i++)
+        {
+            auto Hide = Random.Next(3) != 0;
+            auto VID = VIDOf(Random, m_NumVendors);
+            auto Class = Any, VIDMatcher = Exact(VID), PID = Exact(Random.Next(64)), BCD = Any;
+            CUsbDkInterfaceMatcher Interfaces;
+
+            if (i < 2)
+            {
+                Class = Exact(Random.Next(8));
+                VIDMatcher = Any;
+                PID = Any;
+            }
+            else if (i < 4)
+            {
+                VIDMatcher = Any;
+                PID = Any;
+                BCD = Range(0x100, 0x100 + Random.Next(0x100));
+            }
+            else
+            {
+                switch (Random.Next(16))
+                {
+                case 0:
+                    VIDMatcher = Range(VID, VID + Random.Next(64));
+                    PID = Any;
+                    break;
+                case 1:
+                    PID = Any;
+                    break;
+                default:
+                    break;
+                }
+            }
+
+            if (WithInterfaces && ((i % 8) == 5))
+            {
+                Interfaces = CUsbDkInterfaceMatcher(Exact(Random.Next(8)), Any, Any);
+            }
+
+            auto Rule = new CUsbDkHideRule(Hide, Class, VIDMatcher, PID, BCD, Interfaces);
+            auto &Set = (Random.Next(5) == 0) ? m_PersistentRules : m_DynamicRules;
+            if (Set.Add(Rule))
+            {
+                m_NumRules++;
+            }
+            else
+            {
+                delete Rule;
+            }
+        }
+    }
+
+    NTSTATUS BuildIndex(CUsbDkHideRulesIndex &Index)
+    {
+        auto status = Index.Create(m_NumRules);
+        if (NT_SUCCESS(status))
+        {
+            m_DynamicRules.ForEach([&Index](CUsbDkHideRule *Rule)
+                                   { Index.Add(*Rule, CUsbDkHideRulesIndex::DYNAMIC_RULES); return true; });
+            m_PersistentRules.ForEach([&Index](CUsbDkHideRule *Rule)
+                                      { Index.Add(*Rule, CUsbDkHideRulesIndex::PERSISTENT_RULES); return true; });
+            Index.Compile();
+        }
+
+        return status;
+    }
+
+    // Same walk as CUsbDkControlDevice::EvaluateHideRules
+    // does when there is no index
+    bool ShouldHide(const CTestDevice &Dev)
+    {
+        auto Hide = false;
+
+        const auto &HideVisitor = [&Dev, &Hide](CUsbDkHideRule *Entry) -> bool
+        {
+            if (Entry->Match(Dev))
+            {
+                Entry->CountHit();
+                Hide = Entry->ShouldHide();
+                return !Entry->ForceDecision();
+            }
+
+            return true;
+        };
+
+        m_DynamicRules.ForEach(HideVisitor);
+        m_PersistentRules.ForEach(HideVisitor);
+
+        return Hide;
+    }
+
+    std::vector<CTestDevice *> MakeDevices(size_t Count, bool WithInterfaces)
+    {
+        CRandom Random(static_cast<ULONG>(Count * 31 + m_NumRules));
+        std::vector<CTestDevice *> Devices;
+
+        for (size_t i = 0; i < Count; i++)
+        {
+            USB_DEVICE_DESCRIPTOR Descriptor = {};
+            Descriptor.bDeviceClass = static_cast<UCHAR>(Random.Next(8));
+            // Some vendors are unknown to the policy
+            Descriptor.idVendor = static_cast<USHORT>(VIDOf(Random, m_NumVendors + m_NumVendors / 4));
+            Descriptor.idProduct = static_cast<USHORT>(Random.Next(64));
+            Descriptor.bcdDevice = static_cast<USHORT>(Random.Next(0x400));
+
+            auto Device = new CTestDevice(Descriptor);
+            if (WithInterfaces)
+            {
+                for (auto n = Random.Next(5); n > 0; n--)
+                {
+                    Device->AddInterface(static_cast<UCHAR>(Random.Next(8)), 0, 0);
+                }
+            }
+            Devices.push_back(Device);
+        }
+
+        return Devices;
+    }
+
+    size_t NumRules() const
+    { return m_NumRules; }
+
+private:
+    THideRulesSet m_DynamicRules;
+    THideRulesSet m_PersistentRules;
+    size_t m_NumRules = 0;
+    size_t m_NumVendors;
+};
+
+static void DeleteDevices(std::vector<CTestDevice *> &Devices)
+{
+    for (auto Device : Devices)
+    {
+        delete Device;
+    }
+    Devices.clear();
+}
+
+// Index decides as the walk for every device, both from
+// evaluation and from the decision cache
+static void CheckDecisionsMatch(size_t NumRules, bool WithInterfaces)
+{
+    CPolicy Policy(NumRules, WithInterfaces);
+    CUsbDkHideRulesIndex Index;
+    HOST_CHECK(NT_SUCCESS(Policy.BuildIndex(Index)));
+
+    auto Devices = Policy.MakeDevices(NumDevices, WithInterfaces);
+    ULONG Hidden = 0, CachedDecisions = 0;
+
+    auto Check = [&](size_t NumUsed)
+    {
+        for (ULONG Pass = 0; Pass < 2; Pass++)
+        {
+            for (size_t i = 0; i < NumUsed; i++)
+            {
+                auto Cached = false;
+                auto Hide = Index.ShouldHide(*Devices[i], Cached);
+                HOST_CHECK(Hide == Policy.ShouldHide(*Devices[i]));
+
+                Hidden += Hide ? 1 : 0;
+                CachedDecisions += Cached ? 1 : 0;
+            }
+        }
+    };
+
+    // Devices evict each other from the cache, then
+    // few devices are decided again and again
+    Check(Devices.size());
+    Check(16);
+
+    // Policy hides some devices and shows others
+    HOST_CHECK((Hidden > 0) && (Hidden < 2 * (Devices.size() + 16)));
+    HOST_CHECK((CachedDecisions > 0) == !WithInterfaces);
+
+    DeleteDevices(Devices);
+}
+
+template <typename TDecide>
+static void BenchmarkDecisions(const char *Name, size_t NumRules, ULONG Iterations,
+                               const std::vector<CTestDevice *> &Devices, size_t NumUsed, TDecide Decide)
+{
+    ULONG Hidden = 0;
+    HostBenchmark(Name, NumRules, Iterations, [&](ULONG i)
+    {
+        Hidden += Decide(*Devices[(i * 997) % NumUsed]) ? 1 : 0;
+    });
+
+    HOST_CHECK(Hidden < Iterations);
+}
+
+int main(int argc, char *argv[])
+{
+    auto Scale = HostBenchmarkScale(argc, argv);
+
+    for (auto Size : BenchmarkSizes)
+    {
+        CheckDecisionsMatch(Size, false);
+        CheckDecisionsMatch(Size, true);
+    }
+
+    for (auto Size : BenchmarkSizes)
+    {
+        // Walk cost grows with the policy, keep its work per size bounded
+        auto Iterations = static_cast<ULONG>(max(Scale * 500000 / Size, static_cast<size_t>(100)));
+
+        CPolicy Policy(Size, false);
+        CUsbDkHideRulesIndex Index;
+        HOST_CHECK(NT_SUCCESS(Policy.BuildIndex(Index)));
+        auto Devices = Policy.MakeDevices(NumDevices, false);
+
+        BenchmarkDecisions("Hide rules walk", Size, Iterations, Devices, Devices.size(),
+                           [&Policy](const CTestDevice &Device) { return Policy.ShouldHide(Device); });
+
+        // Devices keep evicting each other from the cache
+        BenchmarkDecisions("Hide rules index", Size, Iterations * 16, Devices, Devices.size(),
+                           [&Index](const CTestDevice &Device) { auto Cached = false; return Index.ShouldHide(Device, Cached); });
+
+        // Few device models, decisions come from the cache
+        BenchmarkDecisions("Hide rules index (cached)", Size, Iterations * 16, Devices, 16,
+                           [&Index](const CTestDevice &Device) { auto Cached = false; return Index.ShouldHide(Device, Cached); });
+
+        DeleteDevices(Devices);
+    }
+
+    return HostTestResult("HideRulesBenchmark");
+}
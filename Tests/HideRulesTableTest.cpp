@@ -0,0 +1,273 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+// Hide rules table serializer and parser shared by the driver and
+// CRulesManager: round trips, forward compatible entries and
+// rejection of malformed blobs.
+
+#include "stdafx.h"
+#include "UsbDkUtil.h"
+#include "UsbDkDataHider.h"
+#include "HideRulesRegPublic.h"
+#include "HostTest.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static bool operator==(const USB_DK_HIDE_RULE_V2 &Rule1, const USB_DK_HIDE_RULE_V2 &Rule2)
+{ return RtlEqualMemory(&Rule1, &Rule2, sizeof(Rule1)); }
+
+static USB_DK_HIDE_RULE_MATCHER TestMatcher(ULONG64 Seed)
+{
+    USB_DK_HIDE_RULE_MATCHER Matcher;
+    Matcher.Min = Seed & 0xFFFF;
+    Matcher.Max = ((Seed % 5) == 0) ? USB_DK_HIDE_RULE_MATCH_ALL : Matcher.Min + (Seed & 0xFF);
+    Matcher.Mask = ((Seed % 3) == 0) ? USB_DK_HIDE_RULE_MATCH_ALL : 0xFFF0;
+    return Matcher;
+}
+
+static USB_DK_HIDE_RULE_V2 TestRule(ULONG Index)
+{
+    USB_DK_HIDE_RULE_V2 Rule;
+    auto Seed = static_cast<ULONG64>(Index) * 2654435761ULL;
+
+    Rule.Hide = Index & 1;
+    Rule.Class = TestMatcher(Seed + 1);
+    Rule.VID = TestMatcher(Seed + 2);
+    Rule.PID = TestMatcher(Seed + 3);
+    Rule.BCD = TestMatcher(Seed + 4);
+    Rule.InterfaceClass = TestMatcher(Seed + 5);
+    Rule.InterfaceSubClass = TestMatcher(Seed + 6);
+    Rule.InterfaceProtocol = TestMatcher(Seed + 7);
+    return Rule;
+}
+
+static std::vector<UCHAR> WriteTable(const std::vector<USB_DK_HIDE_RULE_V2> &Rules)
+{
+    auto NumRules = static_cast<ULONG>(Rules.size());
+    std::vector<UCHAR> Table(static_cast<size_t>(HideRulesTableSize(NumRules)));
+
+    HideRulesTableInit(Table.data(), NumRules);
+    for (ULONG i = 0; i < NumRules; i++)
+    {
+        HideRulesTableSetRule(Table.data(), i, Rules[i]);
+    }
+
+    return Table;
+}
+
+static bool ReadTable(const std::vector<UCHAR> &Table, std::vector<USB_DK_HIDE_RULE_V2> &Rules)
+{
+    USB_DK_HIDE_RULES_TABLE_HEADER Header;
+    if (!HideRulesTableParse(Table.data(), Table.size(), Header))
+    {
+        return false;
+    }
+
+    Rules.resize(Header.NumRules);
+    for (ULONG i = 0; i < Header.NumRules; i++)
+    {
+        HideRulesTableGetRule(Table.data(), Header, i, Rules[i]);
+    }
+
+    return true;
+}
+
+static void TestRoundTrip()
+{
+    for (ULONG NumRules : { 0, 1, 2, 17, 1000 })
+    {
+        std::vector<USB_DK_HIDE_RULE_V2> Rules;
+        for (ULONG i = 0; i < NumRules; i++)
+        {
+            Rules.push_back(TestRule(i));
+        }
+
+        auto Table = WriteTable(Rules);
+        HOST_CHECK(Table.size() == sizeof(USB_DK_HIDE_RULES_TABLE_HEADER) + NumRules * sizeof(USB_DK_HIDE_RULE_V2));
+
+        std::vector<USB_DK_HIDE_RULE_V2> Parsed;
+        HOST_CHECK(ReadTable(Table, Parsed));
+        HOST_CHECK(Parsed == Rules);
+
+        // Serializing parsed rules gives the same blob
+        HOST_CHECK(WriteTable(Parsed) == Table);
+    }
+}
+
+// Later versions of the table may append fields to entries
+static void TestLongerEntries()
+{
+    const ULONG NumRules = 5;
+    const ULONG RuleSize = sizeof(USB_DK_HIDE_RULE_V2) + 24;
+
+    std::vector<UCHAR> Table(sizeof(USB_DK_HIDE_RULES_TABLE_HEADER) + NumRules * RuleSize, 0xAB);
+
+    USB_DK_HIDE_RULES_TABLE_HEADER Header;
+    Header.Signature = USBDK_HIDE_RULES_TABLE_SIGNATURE;
+    Header.Version = USBDK_HIDE_RULES_TABLE_VERSION;
+    Header.RuleSize = RuleSize;
+    Header.NumRules = NumRules;
+    memcpy(Table.data(), &Header, sizeof(Header));
+
+    std::vector<USB_DK_HIDE_RULE_V2> Rules;
+    for (ULONG i = 0; i < NumRules; i++)
+    {
+        Rules.push_back(TestRule(i));
+        memcpy(&Table[sizeof(Header) + i * RuleSize], &Rules[i], sizeof(Rules[i]));
+    }
+
+    std::vector<USB_DK_HIDE_RULE_V2> Parsed;
+    HOST_CHECK(ReadTable(Table, Parsed));
+    HOST_CHECK(Parsed == Rules);
+}
+
+static void TestMalformed()
+{
+    std::vector<USB_DK_HIDE_RULE_V2> Rules;
+    for (ULONG i = 0; i < 3; i++)
+    {
+        Rules.push_back(TestRule(i));
+    }
+
+    auto Good = WriteTable(Rules);
+    std::vector<USB_DK_HIDE_RULE_V2> Parsed;
+
+    // Any truncation of the blob is rejected
+    for (size_t Size = 0; Size < Good.size(); Size++)
+    {
+        std::vector<UCHAR> Truncated(Good.begin(), Good.begin() + Size);
+        HOST_CHECK(!ReadTable(Truncated, Parsed));
+    }
+
+    // Trailing bytes after the last entry are tolerated
+    auto Padded = Good;
+    Padded.resize(Padded.size() + 7);
+    HOST_CHECK(ReadTable(Padded, Parsed));
+    HOST_CHECK(Parsed == Rules);
+
+    auto Corrupt = [&Good](size_t Offset, ULONG Value)
+    {
+        auto Table = Good;
+        memcpy(&Table[Offset], &Value, sizeof(Value));
+        return Table;
+    };
+
+    HOST_CHECK(!ReadTable(Corrupt(offsetof(USB_DK_HIDE_RULES_TABLE_HEADER, Signature), 0x12345678), Parsed));
+    HOST_CHECK(!ReadTable(Corrupt(offsetof(USB_DK_HIDE_RULES_TABLE_HEADER, Version), USBDK_HIDE_RULES_TABLE_VERSION + 1), Parsed));
+    HOST_CHECK(!ReadTable(Corrupt(offsetof(USB_DK_HIDE_RULES_TABLE_HEADER, RuleSize), sizeof(USB_DK_HIDE_RULE_V2) - 8), Parsed));
+    HOST_CHECK(!ReadTable(Corrupt(offsetof(USB_DK_HIDE_RULES_TABLE_HEADER, RuleSize), 0), Parsed));
+    HOST_CHECK(!ReadTable(Corrupt(offsetof(USB_DK_HIDE_RULES_TABLE_HEADER, NumRules), 4), Parsed));
+    HOST_CHECK(!ReadTable(Corrupt(offsetof(USB_DK_HIDE_RULES_TABLE_HEADER, NumRules), MAXULONG), Parsed));
+
+    // Huge entry size must not wrap the size check
+    HOST_CHECK(!ReadTable(Corrupt(offsetof(USB_DK_HIDE_RULES_TABLE_HEADER, RuleSize), MAXULONG), Parsed));
+}
+
+// 32-bit registry values keep open-ended bounds and masks
+static void TestRegistryValues()
+{
+    HOST_CHECK(HideRuleUlongMaskToRegistry(USB_DK_HIDE_RULE_MATCH_ALL) == USBDK_REG_HIDE_RULE_MATCH_ALL);
+    HOST_CHECK(HideRuleUlongMaskFromRegistry(USBDK_REG_HIDE_RULE_MATCH_ALL) == USB_DK_HIDE_RULE_MATCH_ALL);
+
+    for (ULONG64 Value : { 0ULL, 1ULL, 0x1234ULL, 0xFFFFULL, 0xFFFFFFFEULL })
+    {
+        HOST_CHECK(HideRuleUlongMaskFromRegistry(HideRuleUlongMaskToRegistry(Value)) == Value);
+    }
+
+    HOST_CHECK(HideRuleBoolFromRegistry(0) == 0);
+    HOST_CHECK(HideRuleBoolFromRegistry(7) == 1);
+}
+
+static void TestV1Conversion()
+{
+    USB_DK_HIDE_RULE Rule;
+    Rule.Hide = 1;
+    Rule.Class = USB_DK_HIDE_RULE_MATCH_ALL;
+    Rule.VID = 0x1234;
+    Rule.PID = 0x5678;
+    Rule.BCD = USB_DK_HIDE_RULE_MATCH_ALL;
+
+    USB_DK_HIDE_RULE_V2 RuleV2;
+    HideRuleV2FromV1(Rule, RuleV2);
+
+    HOST_CHECK(RuleV2.Hide == 1);
+    HOST_CHECK((RuleV2.Class.Min == 0) && (RuleV2.Class.Max == USB_DK_HIDE_RULE_MATCH_ALL));
+    HOST_CHECK((RuleV2.VID.Min == 0x1234) && (RuleV2.VID.Max == 0x1234));
+    HOST_CHECK((RuleV2.PID.Min == 0x5678) && (RuleV2.PID.Max == 0x5678));
+    HOST_CHECK(RuleV2.VID.Mask == USB_DK_HIDE_RULE_MATCH_ALL);
+    HOST_CHECK(RuleV2.InterfaceClass.Max == USB_DK_HIDE_RULE_MATCH_ALL);
+
+    // Converted rules survive the table as well
+    std::vector<USB_DK_HIDE_RULE_V2> Rules(1, RuleV2), Parsed;
+    HOST_CHECK(ReadTable(WriteTable(Rules), Parsed));
+    HOST_CHECK(Parsed == Rules);
+}
+
+// Index value names are stable, well formed and tell rules apart
+static void TestIndexNames()
+{
+    const ULONG NumRules = 4096;
+    std::vector<std::wstring> Names;
+
+    for (ULONG i = 0; i < NumRules; i++)
+    {
+        wchar_t Name[USBDK_HIDE_RULE_INDEX_NAME_LENGTH];
+        HideRuleIndexName(TestRule(i), Name);
+
+        HOST_CHECK(std::wstring(Name).size() == USBDK_HIDE_RULE_INDEX_NAME_LENGTH - 1);
+        HOST_CHECK(std::wstring(Name).compare(0, 8, L"HideRule") == 0);
+        HOST_CHECK(std::wstring(Name).find_first_not_of(L"0123456789ABCDEF", 8) == std::wstring::npos);
+
+        char NarrowName[USBDK_HIDE_RULE_INDEX_NAME_LENGTH];
+        HideRuleIndexName(TestRule(i), NarrowName);
+        HOST_CHECK(std::wstring(NarrowName, NarrowName + strlen(NarrowName)) == Name);
+
+        Names.push_back(Name);
+    }
+
+    std::sort(Names.begin(), Names.end());
+    HOST_CHECK(std::unique(Names.begin(), Names.end()) == Names.end());
+
+    // Rules differing in one field only get different names
+    auto Rule = TestRule(1);
+    auto Other = Rule;
+    Other.Hide = !Rule.Hide;
+    HOST_CHECK(HideRuleHash(Rule) != HideRuleHash(Other));
+    Other = Rule;
+    Other.InterfaceProtocol.Mask ^= 1;
+    HOST_CHECK(HideRuleHash(Rule) != HideRuleHash(Other));
+}
+
+int main()
+{
+    TestRoundTrip();
+    TestLongerEntries();
+    TestMalformed();
+    TestRegistryValues();
+    TestV1Conversion();
+    TestIndexNames();
+
+    return HostTestResult("HideRulesTableTest");
+}
@@ -0,0 +1,75 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+#include <stdio.h>
+
+// Checks keep going after a failure and may run on
+// any thread, test result is returned by HostTestResult()
+static volatile LONG HostTestFailures = 0;
+
+#define HOST_CHECK(e)                                                           \
+    do                                                                          \
+    {                                                                           \
+        if (!(e))                                                               \
+        {                                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #e); \
+            InterlockedIncrement(&HostTestFailures);                            \
+        }                                                                       \
+    } while (0)
+
+static inline int HostTestResult(const char *Name)
+{
+    if (HostTestFailures != 0)
+    {
+        fprintf(stderr, "%s: %d check(s) failed\n", Name, static_cast<int>(HostTestFailures));
+        return 1;
+    }
+
+    printf("%s: passed\n", Name);
+    return 0;
+}
+
+// Benchmarks run Scale times more iterations than ctest does
+static inline ULONG HostBenchmarkScale(int argc, char *argv[])
+{
+    auto Scale = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 1;
+    return (Scale != 0) ? static_cast<ULONG>(Scale) : 1;
+}
+
+// Runs Body Iterations times and prints time per iteration
+template <typename TBody>
+static void HostBenchmark(const char *Name, size_t Size, ULONG Iterations, TBody Body)
+{
+    CWdmStopwatch Stopwatch;
+
+    for (ULONG i = 0; i < Iterations; i++)
+    {
+        Body(i);
+    }
+
+    auto Elapsed = Stopwatch.Elapsed();
+    printf("%-32s %6zu entries %10.1f ns/iteration\n", Name, Size,
+           static_cast<double>(Elapsed) * 100 / Iterations);
+}
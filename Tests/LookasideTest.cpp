@@ -0,0 +1,191 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+// Hit/miss accounting of CLookasideAllocatable against the counting
+// pool of the shim: every miss is one pool allocation, every hit
+// reuses a cached block, and the pool is balanced after draining.
+
+#include "stdafx.h"
+#include "UsbDkUtil.h"
+#include "HostTest.h"
+
+#include <thread>
+#include <vector>
+
+static const USHORT TestDepth = 4;
+
+class CCachedObject : public CLookasideAllocatable<CCachedObject, NonPagedPool, 'OCHR', TestDepth>
+{
+public:
+    ULONG64 m_Payload[4] = {};
+};
+
+// Bigger objects bypass the cache on allocation only
+class CDerivedObject : public CCachedObject
+{
+public:
+    ULONG64 m_More[4] = {};
+};
+
+// Pool and lookaside counters relative to the start of a test
+class CAccounting
+{
+public:
+    CAccounting()
+        : m_Allocations(ShimPoolState().Allocations)
+        , m_Frees(ShimPoolState().Frees)
+        , m_Hits(CCachedObject::LookasideHits())
+        , m_Misses(CCachedObject::LookasideMisses())
+    {}
+
+    ULONG64 Allocations() const { return ShimPoolState().Allocations - m_Allocations; }
+    ULONG64 Frees() const { return ShimPoolState().Frees - m_Frees; }
+    ULONG64 Hits() const { return CCachedObject::LookasideHits() - m_Hits; }
+    ULONG64 Misses() const { return CCachedObject::LookasideMisses() - m_Misses; }
+
+private:
+    LONG64 m_Allocations;
+    LONG64 m_Frees;
+    ULONG64 m_Hits;
+    ULONG64 m_Misses;
+};
+
+static void TestHitsAndMisses()
+{
+    CAccounting Accounting;
+    CCachedObject *Objects[TestDepth * 2];
+
+    // Empty cache, everything comes from the pool
+    for (auto &Object : Objects)
+    {
+        Object = new CCachedObject;
+    }
+    HOST_CHECK(Accounting.Misses() == TestDepth * 2);
+    HOST_CHECK(Accounting.Hits() == 0);
+    HOST_CHECK(Accounting.Allocations() == TestDepth * 2);
+
+    // Cache keeps Depth blocks, the rest goes back to the pool
+    for (auto Object : Objects)
+    {
+        delete Object;
+    }
+    HOST_CHECK(Accounting.Frees() == TestDepth);
+
+    // Cached blocks are reused before the pool is asked again
+    for (auto &Object : Objects)
+    {
+        Object = new CCachedObject;
+    }
+    HOST_CHECK(Accounting.Hits() == TestDepth);
+    HOST_CHECK(Accounting.Misses() == TestDepth * 3);
+    HOST_CHECK(Accounting.Allocations() == TestDepth * 3);
+
+    for (auto Object : Objects)
+    {
+        delete Object;
+    }
+
+    CCachedObject *Null = nullptr;
+    delete Null;
+
+    CCachedObject::DrainLookaside();
+    HOST_CHECK(Accounting.Allocations() == Accounting.Frees());
+}
+
+static void TestDerivedObjects()
+{
+    CAccounting Accounting;
+
+    // Derived object is never served from the cache...
+    auto Cached = new CCachedObject;
+    delete Cached;
+    auto Derived = new CDerivedObject;
+    HOST_CHECK(Accounting.Hits() == 0);
+    HOST_CHECK(Accounting.Misses() == 2);
+    HOST_CHECK(Accounting.Allocations() == 2);
+
+    // ...but its block is big enough to be cached for base objects
+    auto Reused = new CCachedObject;
+    HOST_CHECK(Reused == Cached);
+    delete Derived;
+    auto FromDerived = new CCachedObject;
+    HOST_CHECK(FromDerived == static_cast<CCachedObject *>(Derived));
+    HOST_CHECK(Accounting.Hits() == 2);
+
+    delete Reused;
+    delete FromDerived;
+
+    CCachedObject::DrainLookaside();
+    HOST_CHECK(Accounting.Allocations() == Accounting.Frees());
+}
+
+// Concurrent churn, counters account for every allocation
+static void TestConcurrentChurn(ULONG Scale)
+{
+    CAccounting Accounting;
+
+    const ULONG NumThreads = 4;
+    const ULONG Rounds = 20000 * Scale;
+
+    std::vector<std::thread> Threads;
+    for (ULONG t = 0; t < NumThreads; t++)
+    {
+        Threads.emplace_back([Rounds, t]()
+                             {
+                                 CCachedObject *Held[3] = {};
+                                 for (ULONG i = 0; i < Rounds; i++)
+                                 {
+                                     auto &Slot = Held[(i + t) % ARRAY_SIZE(Held)];
+                                     delete Slot;
+                                     Slot = new CCachedObject;
+                                     Slot->m_Payload[0] = i;
+                                 }
+
+                                 for (auto Object : Held)
+                                 {
+                                     delete Object;
+                                 }
+                             });
+    }
+
+    for (auto &Thread : Threads)
+    {
+        Thread.join();
+    }
+
+    HOST_CHECK(Accounting.Hits() + Accounting.Misses() == NumThreads * Rounds);
+    HOST_CHECK(Accounting.Misses() == Accounting.Allocations());
+    HOST_CHECK(Accounting.Hits() > 0);
+
+    CCachedObject::DrainLookaside();
+    HOST_CHECK(Accounting.Allocations() == Accounting.Frees());
+}
+
+int main(int argc, char *argv[])
+{
+    TestHitsAndMisses();
+    TestDerivedObjects();
+    TestConcurrentChurn(HostBenchmarkScale(argc, argv));
+
+    return HostTestResult("LookasideTest");
+}
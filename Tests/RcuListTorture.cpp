@@ -0,0 +1,253 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+// Readers walk CWdmList<CRcuAccess> without locks while writers keep
+// inserting and removing entries. Entries handed out by the list are
+// marked retired at once and reused later, a reader that ever sees a
+// retired entry or a half initialized one means the grace period or
+// the publication order is broken.
+
+#include "stdafx.h"
+#include "UsbDkUtil.h"
+#include "HostTest.h"
+
+#include <deque>
+#include <thread>
+#include <vector>
+
+class CTortureEntry : public CAllocatable<NonPagedPool, 'TTHR'>
+{
+public:
+    enum : ULONG
+    {
+        LIVE = 0x4C495645,
+        RETIRED = 0xDEADDEAD
+    };
+
+    // Payload is written before the entry is inserted
+    void Prepare(ULONG Key)
+    {
+        m_Key = Key;
+        m_Check = ~Key;
+        m_State = LIVE;
+    }
+
+    void Retire()
+    { m_State = RETIRED; }
+
+    bool IsConsistent() const
+    { return (m_State == LIVE) && (m_Check == ~m_Key); }
+
+    ULONG Key() const
+    { return m_Key; }
+
+private:
+    volatile ULONG m_Key = 0;
+    volatile ULONG m_Check = 0;
+    volatile ULONG m_State = RETIRED;
+
+    DECLARE_CWDMLIST_ENTRY(CTortureEntry);
+};
+
+typedef CWdmList<CTortureEntry, CRcuAccess, CCountingObject> TTortureList;
+
+// Entries owned by one writer, either in the list or retired
+class CWriterPool
+{
+public:
+    explicit CWriterPool(ULONG Id)
+        : m_Id(Id)
+    {
+        for (ULONG i = 0; i < ENTRIES_PER_WRITER; i++)
+        {
+            m_Retired.push_back(new CTortureEntry);
+        }
+    }
+
+    ~CWriterPool()
+    {
+        for (auto Entry : m_Retired)
+        {
+            delete Entry;
+        }
+    }
+
+    void Run(TTortureList &List, ULONG64 Duration)
+    {
+        auto Seed = m_Id * 7919 + 1;
+        CWdmStopwatch Stopwatch;
+
+        for (ULONG i = 0; Stopwatch.Elapsed() < Duration; i++)
+        {
+            Seed = Seed * 1103515245 + 12345;
+            auto Action = (Seed >> 16) % 4;
+            auto Key = (m_Id << 24) | (i & 0xFFFFFF);
+
+            if ((Action < 2) && !m_Retired.empty())
+            {
+                // Oldest retired entry is reused, so retired
+                // ones stay poisoned for a while
+                auto Entry = m_Retired.front();
+                m_Retired.pop_front();
+
+                Entry->Prepare(Key);
+                if (Action == 0)
+                {
+                    List.PushBack(Entry);
+                }
+                else
+                {
+                    List.Push(Entry);
+                }
+                m_Inserted++;
+            }
+            else if ((Action == 2) && (InList() > 0))
+            {
+                // Only own entries may be taken, other
+                // writers keep their ones in the list
+                List.ForEachDetachedIf([this](CTortureEntry *Entry) { return (Entry->Key() >> 24) == m_Id; },
+                                       [this](CTortureEntry *Entry) { Take(Entry); return false; });
+            }
+            else if (InList() > 0)
+            {
+                auto Odd = i & 1;
+                List.ForEachDetachedIf([this, Odd](CTortureEntry *Entry) { return ((Entry->Key() >> 24) == m_Id) && ((Entry->Key() & 1) == Odd); },
+                                       [this](CTortureEntry *Entry) { Take(Entry); return true; });
+            }
+        }
+    }
+
+    // Remaining entries are taken back after all threads stopped
+    void Drain(TTortureList &List)
+    {
+        List.ForEachDetachedIf([this](CTortureEntry *Entry) { return (Entry->Key() >> 24) == m_Id; },
+                               [this](CTortureEntry *Entry) { Take(Entry); return true; });
+    }
+
+    ULONG Inserted() const
+    { return m_Inserted; }
+
+private:
+    enum : ULONG { ENTRIES_PER_WRITER = 256 };
+
+    ULONG InList() const
+    { return ENTRIES_PER_WRITER - static_cast<ULONG>(m_Retired.size()); }
+
+    void Take(CTortureEntry *Entry)
+    {
+        Entry->Retire();
+        m_Retired.push_back(Entry);
+    }
+
+    ULONG m_Id;
+    ULONG m_Inserted = 0;
+    std::deque<CTortureEntry *> m_Retired;
+};
+
+static void Reader(TTortureList &List, volatile bool &Stop, ULONG64 &Walks, ULONG64 &Visited)
+{
+    while (!Stop)
+    {
+        List.ForEach([&Visited](CTortureEntry *Entry)
+                     {
+                         // Reader is preempted while it uses the entry now
+                         // and then, so writers run in the middle of walks
+                         // even on a single CPU
+                         HOST_CHECK(Entry->IsConsistent());
+                         if ((Visited % 16) == 0)
+                         {
+                             sched_yield();
+                         }
+                         HOST_CHECK(Entry->IsConsistent());
+                         Visited++;
+                         return true;
+                     });
+        Walks++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    auto Scale = HostBenchmarkScale(argc, argv);
+
+    const ULONG NumReaders = 6;
+    const ULONG NumWriters = 2;
+
+    TTortureList List;
+    volatile bool Stop = false;
+
+    std::vector<CWriterPool *> Pools;
+    for (ULONG i = 0; i < NumWriters; i++)
+    {
+        Pools.push_back(new CWriterPool(i + 1));
+    }
+
+    std::vector<ULONG64> Walks(NumReaders), Visited(NumReaders);
+    std::vector<std::thread> Readers;
+    for (ULONG i = 0; i < NumReaders; i++)
+    {
+        Readers.emplace_back(Reader, std::ref(List), std::ref(Stop), std::ref(Walks[i]), std::ref(Visited[i]));
+    }
+
+    std::vector<std::thread> Writers;
+    for (auto Pool : Pools)
+    {
+        Writers.emplace_back([&List, Pool, Scale]() { Pool->Run(List, MillisecondsTo100Nanoseconds(500) * Scale); });
+    }
+
+    for (auto &Writer : Writers)
+    {
+        Writer.join();
+    }
+
+    Stop = true;
+    for (auto &Reader : Readers)
+    {
+        Reader.join();
+    }
+
+    ULONG64 TotalWalks = 0, TotalVisited = 0, TotalInserted = 0;
+    for (ULONG i = 0; i < NumReaders; i++)
+    {
+        TotalWalks += Walks[i];
+        TotalVisited += Visited[i];
+    }
+
+    for (auto Pool : Pools)
+    {
+        TotalInserted += Pool->Inserted();
+        Pool->Drain(List);
+        delete Pool;
+    }
+
+    HOST_CHECK(List.IsEmpty());
+    HOST_CHECK(List.GetCount() == 0);
+    HOST_CHECK(TotalWalks > 0);
+
+    printf("%llu insertions, %llu reader walks, %llu entries visited\n",
+           static_cast<unsigned long long>(TotalInserted),
+           static_cast<unsigned long long>(TotalWalks),
+           static_cast<unsigned long long>(TotalVisited));
+
+    return HostTestResult("RcuListTorture");
+}
@@ -0,0 +1,450 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+// CUsbDkRedirectBatch against a simulated hub. A reset device leaves
+// the bus and its redirector attaches after a delay configured per
+// device, so the test sees whether resets and re-enumerations of the
+// batch overlap, whether all devices share one deadline and whether
+// every device gets its own result and rollback.
+
+#include "stdafx.h"
+#include "UsbDkUtil.h"
+#include "RedirectBatch.h"
+#include "HostTest.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static const LONGLONG LongTimeout = SecondsTo100Nanoseconds(10);
+
+struct CSimulatedDevice
+{
+    ULONG DelayMs = 0;
+    bool AutoRedirected = false;
+    bool FailAdd = false;
+    bool FailReset = false;
+    bool NeverReturns = false;
+    bool FailHandle = false;
+};
+
+class CSimulatedRedirection
+{
+public:
+    CSimulatedRedirection(size_t Index)
+        : m_Index(Index)
+    {}
+
+    void Attach()
+    {
+        std::lock_guard<std::mutex> Lock(m_Lock);
+        m_Attached = true;
+        m_AttachedEvent.notify_all();
+    }
+
+    // Deadline is absolute system time as in KeWaitForSingleObject
+    NTSTATUS Wait(LONGLONG Deadline)
+    {
+        std::unique_lock<std::mutex> Lock(m_Lock);
+        for (;;)
+        {
+            if (m_Attached)
+            {
+                return STATUS_SUCCESS;
+            }
+
+            LARGE_INTEGER Now;
+            KeQuerySystemTime(&Now);
+            if (Now.QuadPart >= Deadline)
+            {
+                return STATUS_TIMEOUT;
+            }
+
+            m_AttachedEvent.wait_for(Lock, std::chrono::nanoseconds((Deadline - Now.QuadPart) * 100));
+        }
+    }
+
+    size_t Index() const
+    { return m_Index; }
+
+private:
+    size_t m_Index;
+    bool m_Attached = false;
+    std::mutex m_Lock;
+    std::condition_variable m_AttachedEvent;
+};
+
+// Hub re-enumerates reset devices in background
+class CSimulatedHub
+{
+public:
+    typedef CSimulatedRedirection TRedirection;
+
+    CSimulatedHub(const std::vector<CSimulatedDevice> &Devices)
+        : m_Devices(Devices)
+        , m_Reset(Devices.size())
+        , m_RolledBack(Devices.size())
+        , m_RolledBackWithReset(Devices.size())
+    {}
+
+    ~CSimulatedHub()
+    {
+        for (auto &Thread : m_Enumerations)
+        {
+            Thread.join();
+        }
+
+        for (auto Redirection : m_Redirections)
+        {
+            delete Redirection;
+        }
+    }
+
+    NTSTATUS Claim(const USB_DK_DEVICE_ID &Id, PHANDLE RedirectorHandle)
+    {
+        auto Index = IndexOf(Id);
+        if (!m_Devices[Index].AutoRedirected)
+        {
+            return STATUS_NOT_FOUND;
+        }
+
+        *RedirectorHandle = HandleOf(Index);
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS Add(const USB_DK_DEVICE_ID &Id, CSimulatedRedirection **Redirection)
+    {
+        auto Index = IndexOf(Id);
+        if (m_Devices[Index].FailAdd)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        *Redirection = new CSimulatedRedirection(Index);
+        m_Redirections.push_back(*Redirection);
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS Reset(const USB_DK_DEVICE_ID &Id)
+    {
+        auto Index = IndexOf(Id);
+        HOST_CHECK(!m_Waited);
+
+        m_Reset[Index] = true;
+        if (m_Devices[Index].FailReset)
+        {
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        if (!m_Devices[Index].NeverReturns)
+        {
+            auto Redirection = RedirectionOf(Index);
+            auto DelayMs = m_Devices[Index].DelayMs;
+            m_Enumerations.emplace_back([Redirection, DelayMs]()
+                                        {
+                                            std::this_thread::sleep_for(std::chrono::milliseconds(DelayMs));
+                                            Redirection->Attach();
+                                        });
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS WaitForAttachment(CSimulatedRedirection &Redirection, LONGLONG Deadline)
+    {
+        m_Waited = true;
+        return Redirection.Wait(Deadline);
+    }
+
+    NTSTATUS CreateHandle(CSimulatedRedirection &Redirection, PHANDLE RedirectorHandle)
+    {
+        if (m_Devices[Redirection.Index()].FailHandle)
+        {
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        *RedirectorHandle = HandleOf(Redirection.Index());
+        return STATUS_SUCCESS;
+    }
+
+    void RollBack(const USB_DK_DEVICE_ID &Id, bool WithReset)
+    {
+        auto Index = IndexOf(Id);
+        HOST_CHECK(!m_RolledBack[Index]);
+
+        m_RolledBack[Index] = true;
+        m_RolledBackWithReset[Index] = WithReset;
+    }
+
+    bool IsReset(size_t Index) const
+    { return m_Reset[Index]; }
+    bool IsRolledBack(size_t Index) const
+    { return m_RolledBack[Index]; }
+    bool IsRolledBackWithReset(size_t Index) const
+    { return m_RolledBackWithReset[Index]; }
+
+    static HANDLE HandleOf(size_t Index)
+    { return reinterpret_cast<HANDLE>(0x100 + Index); }
+
+    static void MakeId(size_t Index, USB_DK_DEVICE_ID &Id)
+    {
+        RtlZeroMemory(&Id, sizeof(Id));
+        swprintf(Id.DeviceID, MAX_DEVICE_ID_LEN, L"USB\\VID_1234&PID_%04zX", Index);
+        swprintf(Id.InstanceID, MAX_DEVICE_ID_LEN, L"%zu", Index);
+    }
+
+private:
+    size_t IndexOf(const USB_DK_DEVICE_ID &Id) const
+    {
+        auto Index = static_cast<size_t>(wcstoul(Id.InstanceID, nullptr, 10));
+        HOST_CHECK(Index < m_Devices.size());
+        return Index;
+    }
+
+    CSimulatedRedirection *RedirectionOf(size_t Index) const
+    {
+        for (auto Redirection : m_Redirections)
+        {
+            if (Redirection->Index() == Index)
+            {
+                return Redirection;
+            }
+        }
+
+        HOST_CHECK(!"Device reset before it was added");
+        return nullptr;
+    }
+
+    std::vector<CSimulatedDevice> m_Devices;
+    std::vector<CSimulatedRedirection *> m_Redirections;
+    std::vector<std::thread> m_Enumerations;
+    std::vector<bool> m_Reset;
+    std::vector<bool> m_RolledBack;
+    std::vector<bool> m_RolledBackWithReset;
+    bool m_Waited = false;
+};
+
+// IOCTL input and output share one buffer, results overwrite IDs
+class CBatchBuffer
+{
+public:
+    CBatchBuffer(size_t NumDevices)
+        : m_Buffer(NumDevices * max(sizeof(USB_DK_DEVICE_ID), sizeof(USB_DK_REDIRECT_RESULT)))
+    {
+        for (size_t i = 0; i < NumDevices; i++)
+        {
+            CSimulatedHub::MakeId(i, Ids()[i]);
+        }
+    }
+
+    USB_DK_DEVICE_ID *Ids()
+    { return reinterpret_cast<USB_DK_DEVICE_ID *>(m_Buffer.data()); }
+    USB_DK_REDIRECT_RESULT *Results()
+    { return reinterpret_cast<USB_DK_REDIRECT_RESULT *>(m_Buffer.data()); }
+
+private:
+    std::vector<ULONG64> m_Buffer;
+};
+
+static NTSTATUS RunBatch(CSimulatedHub &Hub, CBatchBuffer &Buffer, size_t NumDevices, LONGLONG Timeout, ULONG64 &ElapsedMs)
+{
+    CUsbDkRedirectBatch<CSimulatedHub> Batch(Hub);
+    CWdmStopwatch Stopwatch;
+
+    auto status = Batch.Run(Buffer.Ids(), Buffer.Results(), NumDevices, Timeout);
+
+    ElapsedMs = Stopwatch.Elapsed() / MillisecondsTo100Nanoseconds(1);
+    return status;
+}
+
+// Re-enumerations overlap, the batch takes about as long as
+// the slowest device instead of the sum of all delays
+static void TestParallelAttachment()
+{
+    const size_t NumDevices = 8;
+    std::vector<CSimulatedDevice> Devices(NumDevices);
+
+    ULONG SumMs = 0, MaxMs = 0;
+    for (size_t i = 0; i < NumDevices; i++)
+    {
+        // Slower devices come first, so waits are not ordered by delay
+        Devices[i].DelayMs = 200 - static_cast<ULONG>(i) * 20;
+        SumMs += Devices[i].DelayMs;
+        MaxMs = max(MaxMs, Devices[i].DelayMs);
+    }
+
+    CBatchBuffer Buffer(NumDevices);
+    ULONG64 ElapsedMs;
+    {
+        CSimulatedHub Hub(Devices);
+        HOST_CHECK(NT_SUCCESS(RunBatch(Hub, Buffer, NumDevices, LongTimeout, ElapsedMs)));
+
+        for (size_t i = 0; i < NumDevices; i++)
+        {
+            HOST_CHECK(Hub.IsReset(i));
+            HOST_CHECK(!Hub.IsRolledBack(i));
+        }
+    }
+
+    for (size_t i = 0; i < NumDevices; i++)
+    {
+        HOST_CHECK(Buffer.Results()[i].Status == static_cast<ULONG>(STATUS_SUCCESS));
+        HOST_CHECK(Buffer.Results()[i].RedirectorHandle == reinterpret_cast<ULONG_PTR>(CSimulatedHub::HandleOf(i)));
+    }
+
+    HOST_CHECK(ElapsedMs + 10 >= MaxMs);
+    HOST_CHECK(ElapsedMs < SumMs / 2);
+
+    printf("%zu devices attached in %llu ms, %u ms one by one\n",
+           NumDevices, static_cast<unsigned long long>(ElapsedMs), SumMs);
+}
+
+// Every failure is reported and rolled back for its own device only
+static void TestPerDeviceResults()
+{
+    enum : size_t
+    {
+        OK_DEVICE,
+        AUTO_REDIRECTED,
+        ADD_FAILS,
+        RESET_FAILS,
+        NEVER_RETURNS,
+        HANDLE_FAILS,
+        SLOW_DEVICE,
+        NUM_DEVICES
+    };
+
+    std::vector<CSimulatedDevice> Devices(NUM_DEVICES);
+    Devices[OK_DEVICE].DelayMs = 10;
+    Devices[AUTO_REDIRECTED].AutoRedirected = true;
+    Devices[ADD_FAILS].FailAdd = true;
+    Devices[RESET_FAILS].FailReset = true;
+    Devices[NEVER_RETURNS].NeverReturns = true;
+    Devices[HANDLE_FAILS].DelayMs = 10;
+    Devices[HANDLE_FAILS].FailHandle = true;
+    Devices[SLOW_DEVICE].DelayMs = 100;
+
+    CBatchBuffer Buffer(NUM_DEVICES);
+    CSimulatedHub Hub(Devices);
+    ULONG64 ElapsedMs;
+    HOST_CHECK(NT_SUCCESS(RunBatch(Hub, Buffer, NUM_DEVICES, MillisecondsTo100Nanoseconds(300), ElapsedMs)));
+
+    auto Results = Buffer.Results();
+    auto Succeeded = [&Results](size_t Index)
+    {
+        return (Results[Index].Status == static_cast<ULONG>(STATUS_SUCCESS)) &&
+               (Results[Index].RedirectorHandle == reinterpret_cast<ULONG_PTR>(CSimulatedHub::HandleOf(Index)));
+    };
+    auto Failed = [&Results](size_t Index, NTSTATUS Status)
+    {
+        return (Results[Index].Status == static_cast<ULONG>(Status)) && (Results[Index].RedirectorHandle == 0);
+    };
+
+    HOST_CHECK(Succeeded(OK_DEVICE));
+    HOST_CHECK(Hub.IsReset(OK_DEVICE) && !Hub.IsRolledBack(OK_DEVICE));
+
+    // Claimed without reset
+    HOST_CHECK(Succeeded(AUTO_REDIRECTED));
+    HOST_CHECK(!Hub.IsReset(AUTO_REDIRECTED) && !Hub.IsRolledBack(AUTO_REDIRECTED));
+
+    HOST_CHECK(Failed(ADD_FAILS, STATUS_INSUFFICIENT_RESOURCES));
+    HOST_CHECK(!Hub.IsReset(ADD_FAILS) && !Hub.IsRolledBack(ADD_FAILS));
+
+    HOST_CHECK(Failed(RESET_FAILS, STATUS_UNSUCCESSFUL));
+    HOST_CHECK(Hub.IsRolledBack(RESET_FAILS) && !Hub.IsRolledBackWithReset(RESET_FAILS));
+
+    HOST_CHECK(Failed(NEVER_RETURNS, STATUS_DEVICE_NOT_CONNECTED));
+    HOST_CHECK(Hub.IsRolledBack(NEVER_RETURNS) && Hub.IsRolledBackWithReset(NEVER_RETURNS));
+
+    HOST_CHECK(Failed(HANDLE_FAILS, STATUS_DEVICE_NOT_CONNECTED));
+    HOST_CHECK(Hub.IsRolledBack(HANDLE_FAILS) && Hub.IsRolledBackWithReset(HANDLE_FAILS));
+
+    // Device waited for after the timed out one still attaches
+    HOST_CHECK(Succeeded(SLOW_DEVICE));
+    HOST_CHECK(!Hub.IsRolledBack(SLOW_DEVICE));
+}
+
+// Devices that never come back time out together
+static void TestSharedDeadline()
+{
+    const size_t NumDevices = 4;
+    const ULONG TimeoutMs = 200;
+
+    std::vector<CSimulatedDevice> Devices(NumDevices);
+    for (auto &Device : Devices)
+    {
+        Device.NeverReturns = true;
+    }
+
+    CBatchBuffer Buffer(NumDevices);
+    CSimulatedHub Hub(Devices);
+    ULONG64 ElapsedMs;
+    HOST_CHECK(NT_SUCCESS(RunBatch(Hub, Buffer, NumDevices, MillisecondsTo100Nanoseconds(TimeoutMs), ElapsedMs)));
+
+    for (size_t i = 0; i < NumDevices; i++)
+    {
+        HOST_CHECK(Buffer.Results()[i].Status == static_cast<ULONG>(STATUS_DEVICE_NOT_CONNECTED));
+        HOST_CHECK(Hub.IsRolledBackWithReset(i));
+    }
+
+    HOST_CHECK(ElapsedMs + 10 >= TimeoutMs);
+    HOST_CHECK(ElapsedMs < 2 * TimeoutMs);
+}
+
+// Batch that cannot be allocated touches no device
+static void TestAllocationFailure()
+{
+    const size_t NumDevices = 2;
+    std::vector<CSimulatedDevice> Devices(NumDevices);
+
+    for (LONG Failures = 1; Failures <= 2; Failures++)
+    {
+        CBatchBuffer Buffer(NumDevices);
+        CSimulatedHub Hub(Devices);
+        ULONG64 ElapsedMs;
+
+        ShimPoolState().FailAllocations = Failures;
+        HOST_CHECK(RunBatch(Hub, Buffer, NumDevices, LongTimeout, ElapsedMs) == STATUS_INSUFFICIENT_RESOURCES);
+        ShimPoolState().FailAllocations = 0;
+
+        for (size_t i = 0; i < NumDevices; i++)
+        {
+            HOST_CHECK(!Hub.IsReset(i));
+        }
+    }
+}
+
+int main()
+{
+    auto PoolBefore = ShimPoolState().Allocations - ShimPoolState().Frees;
+
+    TestParallelAttachment();
+    TestPerDeviceResults();
+    TestSharedDeadline();
+    TestAllocationFailure();
+
+    HOST_CHECK(ShimPoolState().Allocations - ShimPoolState().Frees == PoolBefore);
+
+    return HostTestResult("RedirectBatchTest");
+}
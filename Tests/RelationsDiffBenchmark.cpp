@@ -0,0 +1,336 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+// Bus relations pass of the hub filter on a simulated hub: children
+// that left relations are dropped, new relations are registered and
+// hidden children are wiped. The linear pass walks children for every
+// relation, the indexed one looks both up in CDeviceRelationsIndex.
+// Both passes must leave the same children and the same relations.
+
+#include "stdafx.h"
+#include "UsbDkUtil.h"
+#include "DeviceRelationsIndex.h"
+#include "HostTest.h"
+
+#include <algorithm>
+#include <vector>
+
+// Children per hub, from a single hub to big test rigs
+static const size_t BenchmarkSizes[] = { 16, 128, 1024 };
+
+// PDOs are never dereferenced, spread values make
+// relations come in no particular order
+static PDEVICE_OBJECT PDOOf(size_t Index)
+{
+    ULONG Spread = static_cast<ULONG>((Index + 1) * 2654435761UL);
+    return reinterpret_cast<PDEVICE_OBJECT>(static_cast<ULONG_PTR>(Spread) << 4);
+}
+
+static bool IsHiddenPDO(PDEVICE_OBJECT PDO)
+{ return ((reinterpret_cast<ULONG_PTR>(PDO) >> 4) % 5) == 0; }
+
+class CFakeChild : public CAllocatable<NonPagedPool, 'CFHR'>
+{
+public:
+    CFakeChild(PDEVICE_OBJECT PDO)
+        : m_PDO(PDO)
+    {}
+
+    PDEVICE_OBJECT PDO() const
+    { return m_PDO; }
+    bool Match(PDEVICE_OBJECT PDO) const
+    { return m_PDO == PDO; }
+
+private:
+    PDEVICE_OBJECT m_PDO;
+
+    DECLARE_CWDMLIST_ENTRY(CFakeChild);
+};
+
+// Same walks as CDeviceRelations, over a PDO array
+class CFakeRelations
+{
+public:
+    CFakeRelations(const std::vector<PDEVICE_OBJECT> &Objects)
+        : m_Objects(Objects)
+    {}
+
+    template <typename TPredicate, typename TFunctor>
+    bool ForEachIf(TPredicate Predicate, TFunctor Functor) const
+    {
+        for (auto PDO : m_Objects)
+        {
+            if (Predicate(PDO) && !Functor(PDO))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename TFunctor>
+    bool ForEach(TFunctor Functor) const
+    { return ForEachIf(ConstTrue, Functor); }
+
+    template <typename TPredicate>
+    void WipeIf(TPredicate Predicate)
+    { m_Objects.erase(std::remove_if(m_Objects.begin(), m_Objects.end(), Predicate), m_Objects.end()); }
+
+    bool Contains(const CFakeChild &Dev) const
+    { return !ForEach([&Dev](PDEVICE_OBJECT Relation) { return !Dev.Match(Relation); }); }
+
+    const std::vector<PDEVICE_OBJECT> &Objects() const
+    { return m_Objects; }
+
+private:
+    std::vector<PDEVICE_OBJECT> m_Objects;
+};
+
+// Mirrors CUsbDkHubFilterStrategy bus relations handling
+class CFakeHub
+{
+public:
+    typedef CWdmList<CFakeChild, CLockedAccess, CCountingObject> TChildrenList;
+
+    void LinearPass(CFakeRelations &Relations)
+    {
+        CWdmList<CFakeChild, CRawAccess, CNonCountingObject> ToBeDeleted;
+        m_Children.ForEachDetachedIf([&Relations](CFakeChild *Child) { return !Relations.Contains(*Child); },
+                                     [&ToBeDeleted](CFakeChild *Child) -> bool { ToBeDeleted.PushBack(Child); return true; });
+
+        Relations.ForEachIf([this](PDEVICE_OBJECT PDO){ return !IsChildRegistered(PDO); },
+                            [this](PDEVICE_OBJECT PDO){ RegisterNewChild(PDO); return true; });
+
+        Relations.WipeIf([this](PDEVICE_OBJECT PDO)
+        {
+            bool Hide = false;
+
+            m_Children.ForEachIf([PDO](CFakeChild *Child){ return Child->Match(PDO); },
+                                 [&Hide](CFakeChild *Child)
+                                 {
+                                     Hide = IsHiddenPDO(Child->PDO());
+                                     return false;
+                                 });
+
+            return Hide;
+        });
+    }
+
+    bool IndexedPass(CFakeRelations &Relations)
+    {
+        CDeviceRelationsIndex Index;
+        if (!NT_SUCCESS(Index.Create(Relations)))
+        {
+            return false;
+        }
+
+        CWdmList<CFakeChild, CRawAccess, CNonCountingObject> ToBeDeleted;
+        m_Children.ForEachDetachedIf([&Index](CFakeChild *Child)
+                                     {
+                                         auto Entry = Index.Find(Child->PDO());
+                                         if (Entry == nullptr)
+                                         {
+                                             return true;
+                                         }
+
+                                         Entry->Registered = true;
+                                         return false;
+                                     },
+                                     [&ToBeDeleted](CFakeChild *Child) -> bool { ToBeDeleted.PushBack(Child); return true; });
+
+        Index.ForEach([this](CDeviceRelationsIndex::CEntry &Entry)
+                      {
+                          if (!Entry.Registered)
+                          {
+                              RegisterNewChild(Entry.PDO);
+                          }
+                      });
+
+        m_Children.ForEach([&Index](CFakeChild *Child)
+                           {
+                               auto Entry = Index.Find(Child->PDO());
+                               if (Entry != nullptr)
+                               {
+                                   Entry->Hide = IsHiddenPDO(Child->PDO());
+                               }
+                               return true;
+                           });
+
+        Relations.WipeIf([&Index](PDEVICE_OBJECT PDO)
+                         {
+                             auto Entry = Index.Find(PDO);
+                             return (Entry != nullptr) && Entry->Hide;
+                         });
+        return true;
+    }
+
+    // Children in registration order
+    std::vector<PDEVICE_OBJECT> Children()
+    {
+        std::vector<PDEVICE_OBJECT> PDOs;
+        m_Children.ForEach([&PDOs](CFakeChild *Child) { PDOs.push_back(Child->PDO()); return true; });
+        return PDOs;
+    }
+
+private:
+    bool IsChildRegistered(PDEVICE_OBJECT PDO)
+    { return !m_Children.ForEachIf([PDO](CFakeChild *Child){ return Child->Match(PDO); }, ConstFalse); }
+
+    void RegisterNewChild(PDEVICE_OBJECT PDO)
+    { m_Children.PushBack(new CFakeChild(PDO)); }
+
+    TChildrenList m_Children;
+};
+
+// Relations before and after 10% of devices were replaced
+static void MakeRelations(size_t Size, std::vector<PDEVICE_OBJECT> &Before, std::vector<PDEVICE_OBJECT> &After)
+{
+    Before.clear();
+    After.clear();
+    for (size_t i = 0; i < Size; i++)
+    {
+        Before.push_back(PDOOf(i));
+        if ((i % 10) != 3)
+        {
+            After.push_back(PDOOf(i));
+        }
+    }
+
+    for (size_t i = 0; After.size() < Size; i++)
+    {
+        After.push_back(PDOOf(Size + i));
+    }
+}
+
+static std::vector<PDEVICE_OBJECT> Sorted(std::vector<PDEVICE_OBJECT> PDOs)
+{
+    std::sort(PDOs.begin(), PDOs.end());
+    return PDOs;
+}
+
+// Both passes produce the same relations and children
+static void CheckPassesMatch(size_t Size)
+{
+    std::vector<PDEVICE_OBJECT> Before, After;
+    MakeRelations(Size, Before, After);
+
+    CFakeHub LinearHub, IndexedHub;
+    const std::vector<PDEVICE_OBJECT> *Steps[] = { &Before, &After, &Before, &After, &After };
+
+    for (auto Step : Steps)
+    {
+        CFakeRelations LinearRelations(*Step), IndexedRelations(*Step);
+
+        LinearHub.LinearPass(LinearRelations);
+        HOST_CHECK(IndexedHub.IndexedPass(IndexedRelations));
+
+        // Relation order is kept by both wipes
+        HOST_CHECK(LinearRelations.Objects() == IndexedRelations.Objects());
+        HOST_CHECK(Sorted(LinearHub.Children()) == Sorted(IndexedHub.Children()));
+        HOST_CHECK(Sorted(LinearHub.Children()) == Sorted(*Step));
+
+        for (auto PDO : *Step)
+        {
+            auto Visible = std::find(IndexedRelations.Objects().begin(), IndexedRelations.Objects().end(), PDO) !=
+                           IndexedRelations.Objects().end();
+            HOST_CHECK(Visible == !IsHiddenPDO(PDO));
+        }
+    }
+
+    // Empty relations drop every child
+    std::vector<PDEVICE_OBJECT> Empty;
+    CFakeRelations LinearRelations(Empty), IndexedRelations(Empty);
+    LinearHub.LinearPass(LinearRelations);
+    HOST_CHECK(IndexedHub.IndexedPass(IndexedRelations));
+    HOST_CHECK(LinearHub.Children().empty());
+    HOST_CHECK(IndexedHub.Children().empty());
+}
+
+// Index allocation failure is reported, the driver
+// falls back to the linear pass then
+static void CheckIndexAllocationFailure()
+{
+    std::vector<PDEVICE_OBJECT> Before, After;
+    MakeRelations(16, Before, After);
+
+    CFakeHub Hub;
+    CFakeRelations Relations(Before);
+
+    ShimPoolState().FailAllocations = 1;
+    HOST_CHECK(!Hub.IndexedPass(Relations));
+    HOST_CHECK(ShimPoolState().FailAllocations == 0);
+    HOST_CHECK(Hub.Children().empty());
+    HOST_CHECK(Relations.Objects() == Before);
+
+    HOST_CHECK(Hub.IndexedPass(Relations));
+    HOST_CHECK(Sorted(Hub.Children()) == Sorted(Before));
+}
+
+// Hub keeps switching between two relations sets,
+// so every pass drops and registers the same churn
+template <typename TPass>
+static void BenchmarkPass(const char *Name, size_t Size, ULONG Iterations, TPass Pass)
+{
+    std::vector<PDEVICE_OBJECT> Before, After;
+    MakeRelations(Size, Before, After);
+
+    CFakeHub Hub;
+    CFakeRelations Initial(Before);
+    Pass(Hub, Initial);
+
+    HostBenchmark(Name, Size, Iterations, [&](ULONG i)
+    {
+        CFakeRelations Relations((i % 2) ? Before : After);
+        Pass(Hub, Relations);
+    });
+
+    HOST_CHECK(Sorted(Hub.Children()) == Sorted((Iterations % 2) ? After : Before));
+}
+
+int main(int argc, char *argv[])
+{
+    auto Scale = HostBenchmarkScale(argc, argv);
+
+    for (auto Size : BenchmarkSizes)
+    {
+        CheckPassesMatch(Size);
+    }
+    CheckIndexAllocationFailure();
+
+    auto PoolBefore = ShimPoolState().Allocations - ShimPoolState().Frees;
+
+    for (auto Size : BenchmarkSizes)
+    {
+        // Linear pass is quadratic, keep its work per size bounded
+        auto Iterations = static_cast<ULONG>(max(Scale * 4096 / Size, static_cast<size_t>(2)));
+
+        BenchmarkPass("Bus relations pass (linear)", Size, Iterations,
+                      [](CFakeHub &Hub, CFakeRelations &Relations) { Hub.LinearPass(Relations); });
+        BenchmarkPass("Bus relations pass (indexed)", Size, Iterations,
+                      [](CFakeHub &Hub, CFakeRelations &Relations) { HOST_CHECK(Hub.IndexedPass(Relations)); });
+    }
+
+    HOST_CHECK(ShimPoolState().Allocations - ShimPoolState().Frees == PoolBefore);
+
+    return HostTestResult("RelationsDiffBenchmark");
+}
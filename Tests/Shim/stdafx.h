@@ -0,0 +1,458 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+// User-mode stand-in for the driver's stdafx.h.
+// Provides just enough of the WDM API for the self-contained
+// driver headers (UsbDkUtil.h, Alloc.h, MemoryBuffer.h,
+// DeviceRelationsIndex.h, HideRules.h, HideRulesRegPublic.h,
+// RedirectBatch.h)
+// to build unchanged with g++ or clang on a POSIX host.
+// Semantics follow WDM where the headers depend on them,
+// IRQLs, critical regions and pool types are ignored.
+
+#pragma once
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include <type_traits>
+
+typedef void                VOID;
+typedef void               *PVOID, *PVOID64;
+typedef unsigned char       UCHAR, *PUCHAR;
+typedef unsigned short      USHORT, *PUSHORT;
+typedef int32_t             LONG, *PLONG;
+typedef uint32_t            ULONG, *PULONG;
+typedef uint32_t            DWORD;
+typedef int64_t             LONG64, LONGLONG;
+typedef uint64_t            ULONG64, ULONGLONG;
+typedef uintptr_t           ULONG_PTR;
+typedef size_t              SIZE_T;
+typedef UCHAR               BOOLEAN;
+typedef LONG                NTSTATUS;
+typedef LONG                KPRIORITY;
+typedef UCHAR               KIRQL;
+typedef wchar_t             WCHAR, *PWCH, *PWCHAR, *PWSTR;
+typedef const wchar_t      *PCWCH, *PCWCHAR, *PCWSTR, *NTSTRSAFE_PCWSTR;
+typedef void               *HANDLE, **PHANDLE;
+
+#define TRUE  1
+#define FALSE 0
+
+#define TEXT(s) L##s
+
+#define NT_SUCCESS(Status)              (((NTSTATUS)(Status)) >= 0)
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT                  ((NTSTATUS)0x00000102L)
+#define STATUS_BUFFER_OVERFLOW          ((NTSTATUS)0x80000005L)
+#define STATUS_NO_MORE_ENTRIES          ((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023L)
+#define STATUS_DEVICE_NOT_CONNECTED     ((NTSTATUS)0xC000009DL)
+#define STATUS_NOT_FOUND                ((NTSTATUS)0xC0000225L)
+
+#define NTSTRSAFE_UNICODE_STRING_MAX_CCH 32767
+#define MAX_DEVICE_ID_LEN 200
+#define MAXUCHAR  0xff
+#define MAXUSHORT 0xffff
+#define MAXULONG  0xffffffff
+
+#define ASSERT(e) assert(e)
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#define CONTAINING_RECORD(address, type, field) \
+    ((type *)((PUCHAR)(address) - (ULONG_PTR)(&((type *)0)->field)))
+
+#define RtlCopyBytes(Destination, Source, Length)   memcpy((Destination), (Source), (Length))
+#define RtlCopyMemory(Destination, Source, Length)  memcpy((Destination), (Source), (Length))
+#define RtlMoveMemory(Destination, Source, Length)  memmove((Destination), (Source), (Length))
+#define RtlZeroMemory(Destination, Length)          memset((Destination), 0, (Length))
+#define RtlEqualMemory(Destination, Source, Length) (!memcmp((Destination), (Source), (Length)))
+
+template <typename T1, typename T2>
+static inline typename std::common_type<T1, T2>::type min(T1 a, T2 b)
+{ return (a < b) ? a : b; }
+
+template <typename T1, typename T2>
+static inline typename std::common_type<T1, T2>::type max(T1 a, T2 b)
+{ return (a < b) ? b : a; }
+
+typedef union _LARGE_INTEGER
+{
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+// Device objects and WDF handles are opaque to the headers
+
+typedef struct _DEVICE_OBJECT *PDEVICE_OBJECT;
+typedef struct WDFMEMORY__ *WDFMEMORY;
+
+PVOID WdfMemoryGetBuffer(WDFMEMORY Memory, size_t *BufferSize);
+
+typedef struct _UNICODE_STRING
+{
+    USHORT Length;
+    USHORT MaximumLength;
+    PWCH   Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+// Pool allocations, counted so tests can check for leaks and
+// allocation patterns, FailAllocations makes next allocations fail
+
+typedef enum _POOL_TYPE
+{
+    NonPagedPool,
+    PagedPool
+} POOL_TYPE;
+
+typedef struct _SHIM_POOL_STATE
+{
+    volatile LONG64 Allocations;
+    volatile LONG64 Frees;
+    volatile LONG FailAllocations;
+} SHIM_POOL_STATE;
+
+static inline SHIM_POOL_STATE &ShimPoolState()
+{
+    static SHIM_POOL_STATE State;
+    return State;
+}
+
+static inline PVOID ExAllocatePoolWithTag(POOL_TYPE, SIZE_T NumberOfBytes, ULONG)
+{
+    auto &State = ShimPoolState();
+    if ((__atomic_load_n(&State.FailAllocations, __ATOMIC_RELAXED) > 0) &&
+        (__atomic_sub_fetch(&State.FailAllocations, 1, __ATOMIC_SEQ_CST) >= 0))
+    {
+        return nullptr;
+    }
+
+    __atomic_add_fetch(&State.Allocations, 1, __ATOMIC_SEQ_CST);
+    return malloc(NumberOfBytes);
+}
+
+static inline VOID ExFreePoolWithTag(PVOID P, ULONG)
+{
+    __atomic_add_fetch(&ShimPoolState().Frees, 1, __ATOMIC_SEQ_CST);
+    free(P);
+}
+
+static inline VOID ExFreePool(PVOID P)
+{ ExFreePoolWithTag(P, 0); }
+
+// Interlocked operations, all are full barriers as in WDM
+
+static inline VOID KeMemoryBarrier()
+{ __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+static inline LONG InterlockedIncrement(LONG volatile *Addend)
+{ return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+
+static inline LONG InterlockedDecrement(LONG volatile *Addend)
+{ return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+
+static inline LONG InterlockedExchange(LONG volatile *Target, LONG Value)
+{ return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+
+static inline LONG InterlockedCompareExchange(LONG volatile *Destination, LONG Exchange, LONG Comparand)
+{
+    __atomic_compare_exchange_n(Destination, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+static inline LONG64 InterlockedIncrement64(LONG64 volatile *Addend)
+{ return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+
+static inline LONG64 InterlockedDecrement64(LONG64 volatile *Addend)
+{ return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+
+static inline LONG64 InterlockedExchangeAdd64(LONG64 volatile *Addend, LONG64 Value)
+{ return __atomic_fetch_add(Addend, Value, __ATOMIC_SEQ_CST); }
+
+static inline LONG64 InterlockedCompareExchange64(LONG64 volatile *Destination, LONG64 Exchange, LONG64 Comparand)
+{
+    __atomic_compare_exchange_n(Destination, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+static inline LONG64 InterlockedExchange64(LONG64 volatile *Target, LONG64 Value)
+{ return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+
+static inline PVOID InterlockedExchangePointer(PVOID volatile *Target, PVOID Value)
+{ return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+
+// Spin locks
+
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+static inline VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+{ *SpinLock = 0; }
+
+static inline VOID KeAcquireSpinLock(PKSPIN_LOCK SpinLock, KIRQL *OldIrql)
+{
+    while (__atomic_exchange_n(SpinLock, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        while (__atomic_load_n(SpinLock, __ATOMIC_RELAXED) != 0)
+        {
+            sched_yield();
+        }
+    }
+    *OldIrql = 0;
+}
+
+static inline VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL)
+{ __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE); }
+
+// Executive resources, every release goes through ExReleaseResourceLite
+
+typedef struct _ERESOURCE
+{
+    pthread_rwlock_t Lock;
+} ERESOURCE, *PERESOURCE;
+
+static inline NTSTATUS ExInitializeResourceLite(PERESOURCE Resource)
+{ return (pthread_rwlock_init(&Resource->Lock, nullptr) == 0) ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES; }
+
+static inline NTSTATUS ExDeleteResourceLite(PERESOURCE Resource)
+{ pthread_rwlock_destroy(&Resource->Lock); return STATUS_SUCCESS; }
+
+static inline BOOLEAN ExAcquireResourceExclusiveLite(PERESOURCE Resource, BOOLEAN)
+{ pthread_rwlock_wrlock(&Resource->Lock); return TRUE; }
+
+static inline BOOLEAN ExAcquireResourceSharedLite(PERESOURCE Resource, BOOLEAN)
+{ pthread_rwlock_rdlock(&Resource->Lock); return TRUE; }
+
+static inline VOID ExReleaseResourceLite(PERESOURCE Resource)
+{ pthread_rwlock_unlock(&Resource->Lock); }
+
+static inline VOID KeEnterCriticalRegion() {}
+static inline VOID KeLeaveCriticalRegion() {}
+
+// Doubly linked lists, same layout and semantics as in WDM
+
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+static inline VOID InitializeListHead(PLIST_ENTRY ListHead)
+{ ListHead->Flink = ListHead->Blink = ListHead; }
+
+static inline BOOLEAN IsListEmpty(const LIST_ENTRY *ListHead)
+{ return (BOOLEAN)(ListHead->Flink == ListHead); }
+
+static inline BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+    auto Blink = Entry->Blink;
+    auto Flink = Entry->Flink;
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+    return (BOOLEAN)(Flink == Blink);
+}
+
+static inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead)
+{
+    auto Entry = ListHead->Flink;
+    RemoveEntryList(Entry);
+    return Entry;
+}
+
+static inline PLIST_ENTRY RemoveTailList(PLIST_ENTRY ListHead)
+{
+    auto Entry = ListHead->Blink;
+    RemoveEntryList(Entry);
+    return Entry;
+}
+
+static inline VOID InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    auto Blink = ListHead->Blink;
+    Entry->Flink = ListHead;
+    Entry->Blink = Blink;
+    Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+static inline VOID InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    auto Flink = ListHead->Flink;
+    Entry->Flink = Flink;
+    Entry->Blink = ListHead;
+    Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+// Interlocked singly linked lists. Zero initialized header is an
+// empty list as in WDM, header is guarded by a spin lock instead
+// of a sequenced compare-exchange, which is enough for a host build.
+
+typedef struct _SLIST_ENTRY
+{
+    struct _SLIST_ENTRY *Next;
+} SLIST_ENTRY, *PSLIST_ENTRY;
+
+typedef struct _SLIST_HEADER
+{
+    PSLIST_ENTRY Next;
+    USHORT Depth;
+    KSPIN_LOCK Lock;
+} SLIST_HEADER, *PSLIST_HEADER;
+
+static inline PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER ListHead, PSLIST_ENTRY ListEntry)
+{
+    KIRQL Irql;
+    KeAcquireSpinLock(&ListHead->Lock, &Irql);
+    auto First = ListHead->Next;
+    ListEntry->Next = First;
+    ListHead->Next = ListEntry;
+    ListHead->Depth++;
+    KeReleaseSpinLock(&ListHead->Lock, Irql);
+    return First;
+}
+
+static inline PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER ListHead)
+{
+    KIRQL Irql;
+    KeAcquireSpinLock(&ListHead->Lock, &Irql);
+    auto First = ListHead->Next;
+    if (First != nullptr)
+    {
+        ListHead->Next = First->Next;
+        ListHead->Depth--;
+    }
+    KeReleaseSpinLock(&ListHead->Lock, Irql);
+    return First;
+}
+
+static inline USHORT ExQueryDepthSList(PSLIST_HEADER ListHead)
+{ return __atomic_load_n(&ListHead->Depth, __ATOMIC_RELAXED); }
+
+// Timing
+
+typedef enum _MODE
+{
+    KernelMode,
+    UserMode
+} KPROCESSOR_MODE;
+
+// Counter ticks are 100ns units
+static inline LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency)
+{
+    timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    LARGE_INTEGER Counter;
+    Counter.QuadPart = static_cast<LONGLONG>(Now.tv_sec) * 10 * 1000 * 1000 + Now.tv_nsec / 100;
+
+    if (PerformanceFrequency != nullptr)
+    {
+        PerformanceFrequency->QuadPart = 10 * 1000 * 1000;
+    }
+
+    return Counter;
+}
+
+// System time counts 100ns units since 1601
+static inline VOID KeQuerySystemTime(PLARGE_INTEGER CurrentTime)
+{
+    timespec Now;
+    clock_gettime(CLOCK_REALTIME, &Now);
+
+    CurrentTime->QuadPart = static_cast<LONGLONG>(Now.tv_sec) * 10 * 1000 * 1000 + Now.tv_nsec / 100 +
+                            116444736000000000LL;
+}
+
+// Relative intervals only, as used by the driver
+static inline NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE, BOOLEAN, PLARGE_INTEGER Interval)
+{
+    ASSERT(Interval->QuadPart <= 0);
+
+    auto Delay = -Interval->QuadPart;
+    timespec Sleep;
+    Sleep.tv_sec = static_cast<time_t>(Delay / (10 * 1000 * 1000));
+    Sleep.tv_nsec = static_cast<long>(Delay % (10 * 1000 * 1000)) * 100;
+    nanosleep(&Sleep, nullptr);
+    return STATUS_SUCCESS;
+}
+
+// USB descriptors
+
+#pragma pack(push, 1)
+typedef struct _USB_DEVICE_DESCRIPTOR
+{
+    UCHAR  bLength;
+    UCHAR  bDescriptorType;
+    USHORT bcdUSB;
+    UCHAR  bDeviceClass;
+    UCHAR  bDeviceSubClass;
+    UCHAR  bDeviceProtocol;
+    UCHAR  bMaxPacketSize0;
+    USHORT idVendor;
+    USHORT idProduct;
+    USHORT bcdDevice;
+    UCHAR  iManufacturer;
+    UCHAR  iProduct;
+    UCHAR  iSerialNumber;
+    UCHAR  bNumConfigurations;
+} USB_DEVICE_DESCRIPTOR, *PUSB_DEVICE_DESCRIPTOR;
+#pragma pack(pop)
+
+// Declared only, so inline wrappers in driver headers compile,
+// host programs must not call them
+
+typedef enum _EVENT_TYPE
+{
+    NotificationEvent,
+    SynchronizationEvent
+} EVENT_TYPE;
+
+typedef struct _KEVENT
+{
+    LONG State;
+} KEVENT, *PKEVENT;
+
+#define IO_NO_INCREMENT 0
+
+VOID KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+LONG KeSetEvent(PKEVENT Event, KPRIORITY Increment, BOOLEAN Wait);
+VOID KeClearEvent(PKEVENT Event);
+LONG KeResetEvent(PKEVENT Event);
+
+template <size_t Size>
+int wcsncpy_s(WCHAR (&Destination)[Size], PCWSTR Source, size_t Count);
+
+NTSTATUS RtlUnicodeStringInit(PUNICODE_STRING DestinationString, NTSTRSAFE_PCWSTR pszSrc);
+NTSTATUS RtlUnicodeStringValidate(PCUNICODE_STRING SourceString);
+NTSTATUS RtlIntegerToUnicodeString(ULONG Value, ULONG Base, PUNICODE_STRING String);
@@ -0,0 +1,176 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+// Many readers evaluate CWdmSnapshot content without locks while a
+// writer keeps publishing new versions, the way hide rules are
+// replaced. Objects returned by Publish() are poisoned at once and
+// reused oldest first, readers must never see a poisoned or partially
+// built object, and versions seen by one reader never go back.
+
+#include "stdafx.h"
+#include "UsbDkUtil.h"
+#include "HostTest.h"
+
+#include <deque>
+#include <thread>
+#include <vector>
+
+class CTestSnapshot : public CAllocatable<NonPagedPool, 'STHR'>
+{
+public:
+    enum : ULONG { NUM_RULES = 32 };
+
+    // Built completely before it is published
+    void Build(ULONG Version)
+    {
+        m_Version = Version;
+        for (ULONG i = 0; i < NUM_RULES; i++)
+        {
+            m_Rules[i] = Version * NUM_RULES + i;
+        }
+    }
+
+    void Poison()
+    {
+        for (ULONG i = 0; i < NUM_RULES; i++)
+        {
+            m_Rules[i] = MAXULONG;
+        }
+        m_Version = MAXULONG;
+    }
+
+    bool IsConsistent() const
+    {
+        for (ULONG i = 0; i < NUM_RULES; i++)
+        {
+            if (m_Rules[i] != m_Version * NUM_RULES + i)
+            {
+                return false;
+            }
+        }
+
+        return m_Version != MAXULONG;
+    }
+
+    ULONG Version() const
+    { return m_Version; }
+
+private:
+    volatile ULONG m_Version = MAXULONG;
+    volatile ULONG m_Rules[NUM_RULES] = {};
+};
+
+static void Reader(const CWdmSnapshot<CTestSnapshot> &Snapshot, volatile bool &Stop, ULONG64 &Reads)
+{
+    ULONG LastVersion = 0;
+
+    while (!Stop)
+    {
+        Snapshot.Read([&LastVersion, &Reads](const CTestSnapshot *Current)
+                      {
+                          if (Current == nullptr)
+                          {
+                              return;
+                          }
+
+                          // Object stays in use across preemption
+                          HOST_CHECK(Current->IsConsistent());
+                          if ((Reads % 8) == 0)
+                          {
+                              sched_yield();
+                          }
+                          HOST_CHECK(Current->IsConsistent());
+
+                          auto Version = Current->Version();
+                          HOST_CHECK(Version >= LastVersion);
+                          LastVersion = Version;
+                      });
+        Reads++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    auto Scale = HostBenchmarkScale(argc, argv);
+
+    const ULONG NumReaders = 16;
+
+    CWdmSnapshot<CTestSnapshot> Snapshot;
+    volatile bool Stop = false;
+
+    std::vector<ULONG64> Reads(NumReaders);
+    std::vector<std::thread> Readers;
+    for (ULONG i = 0; i < NumReaders; i++)
+    {
+        Readers.emplace_back(Reader, std::cref(Snapshot), std::ref(Stop), std::ref(Reads[i]));
+    }
+
+    std::deque<CTestSnapshot *> Retired;
+    for (ULONG i = 0; i < 8; i++)
+    {
+        Retired.push_back(new CTestSnapshot);
+    }
+
+    ULONG Version = 0;
+    CWdmStopwatch Stopwatch;
+    while (Stopwatch.Elapsed() < static_cast<ULONG64>(MillisecondsTo100Nanoseconds(500)) * Scale)
+    {
+        auto Next = Retired.front();
+        Retired.pop_front();
+
+        Next->Build(++Version);
+
+        auto Old = Snapshot.Publish(Next);
+        if (Old != nullptr)
+        {
+            Old->Poison();
+            Retired.push_back(Old);
+        }
+    }
+
+    Stop = true;
+    for (auto &Reader : Readers)
+    {
+        Reader.join();
+    }
+
+    // Snapshot destructor frees the current object
+    for (auto Object : Retired)
+    {
+        delete Object;
+    }
+
+    ULONG64 TotalReads = 0;
+    for (auto Count : Reads)
+    {
+        TotalReads += Count;
+    }
+
+    HOST_CHECK(TotalReads > 0);
+
+    printf("%lu versions published, %llu reads\n",
+           static_cast<unsigned long>(Version),
+           static_cast<unsigned long long>(TotalReads));
+
+    return HostTestResult("SnapshotStress");
+}
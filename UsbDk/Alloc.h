@@ -50,6 +50,85 @@ protected:
     ~CAllocatable() {};
 };
 
+// Allocatable for objects created and destroyed at high rate.
+// Up to Depth freed objects of type T are cached in a lock-free list
+// and reused by following allocations, objects of other sizes (i.e.
+// derived types) bypass the cache on allocation. Cache must be
+// drained by DrainLookaside() before driver unload.
+template <typename T, POOL_TYPE PoolType, ULONG Tag, USHORT Depth>
+class CLookasideAllocatable
+{
+public:
+    void* operator new(size_t /* size */, void *ptr) throw()
+        { return ptr; }
+
+    void* operator new(size_t Size) throw()
+    {
+        static_assert(sizeof(T) >= sizeof(SLIST_ENTRY), "Object is too small to be cached");
+
+        if (Size == sizeof(T))
+        {
+            auto Block = InterlockedPopEntrySList(&m_FreeList);
+            if (Block != nullptr)
+            {
+                InterlockedIncrement64(&m_Hits);
+                return Block;
+            }
+        }
+
+        InterlockedIncrement64(&m_Misses);
+        return ExAllocatePoolWithTag(PoolType, Size, Tag);
+    }
+
+    // Any block of T or derived type is big enough for T
+    void operator delete(void *ptr)
+    {
+        if (ptr == nullptr)
+        {
+            return;
+        }
+
+        if (ExQueryDepthSList(&m_FreeList) < Depth)
+        {
+            InterlockedPushEntrySList(&m_FreeList, static_cast<PSLIST_ENTRY>(ptr));
+            return;
+        }
+
+        ExFreePoolWithTag(ptr, Tag);
+    }
+
+    static void DrainLookaside()
+    {
+        PSLIST_ENTRY Block;
+        while ((Block = InterlockedPopEntrySList(&m_FreeList)) != nullptr)
+        {
+            ExFreePoolWithTag(Block, Tag);
+        }
+    }
+
+    static ULONG64 LookasideHits()
+        { return InterlockedCompareExchange64(&m_Hits, 0, 0); }
+    static ULONG64 LookasideMisses()
+        { return InterlockedCompareExchange64(&m_Misses, 0, 0); }
+
+protected:
+    CLookasideAllocatable() {};
+    ~CLookasideAllocatable() {};
+
+private:
+    // Zero initialized header is an empty list
+    static SLIST_HEADER m_FreeList;
+    static volatile LONG64 m_Hits;
+    static volatile LONG64 m_Misses;
+};
+
+template <typename T, POOL_TYPE PoolType, ULONG Tag, USHORT Depth>
+SLIST_HEADER CLookasideAllocatable<T, PoolType, Tag, Depth>::m_FreeList;
+template <typename T, POOL_TYPE PoolType, ULONG Tag, USHORT Depth>
+volatile LONG64 CLookasideAllocatable<T, PoolType, Tag, Depth>::m_Hits = 0;
+template <typename T, POOL_TYPE PoolType, ULONG Tag, USHORT Depth>
+volatile LONG64 CLookasideAllocatable<T, PoolType, Tag, Depth>::m_Misses = 0;
+
 template<typename T>
 class CScalarDeleter
 {
@@ -135,14 +214,40 @@ public:
     size_t Size()
     { return m_NumEntries; }
 
+    size_t EntrySize(size_t Index)
+    {
+        ASSERT(Index < m_NumEntries);
+        return m_Entries[Index].m_NumObjects * sizeof(TObject);
+    }
+
     template <typename TConstructor>
     bool EmplaceEntry(size_t Index, size_t NumObjects, TConstructor EntryConstructor)
     {
         ASSERT(Index < m_NumEntries);
 
         m_Entries[Index] = TAllocator::allocate(NumObjects);
+        if (m_Entries[Index] == nullptr)
+        {
+            return false;
+        }
+
+        // Size is set only for constructed entries, so
+        // failed ones are copied out as empty
         m_Entries[Index].m_NumObjects = NumObjects;
-        return (m_Entries[Index] != nullptr) ? EntryConstructor(m_Entries[Index]) : false;
+        if (!EntryConstructor(m_Entries[Index]))
+        {
+            m_Entries[Index].reset();
+            m_Entries[Index].m_NumObjects = 0;
+            return false;
+        }
+
+        return true;
+    }
+
+    TObject *Entry(size_t Index)
+    {
+        ASSERT(Index < m_NumEntries);
+        return m_Entries[Index];
     }
 
     void CopyEntry(size_t Index, PVOID Buffer, size_t NumObjects)
@@ -180,6 +285,115 @@ private:
     CObjHolder<CBufferHolder, CVectorDeleter<CBufferHolder> > m_Entries;
 };
 
+// Set of buffers placed back to back in one allocation after
+// the table of their offsets. Sizes of all entries are given
+// on creation, entries are filled in place afterwards.
+template <POOL_TYPE PoolType, ULONG Tag, typename TObject>
+class CBufferArena final
+{
+public:
+    explicit CBufferArena(size_t NumEntries)
+        : m_NumEntries(NumEntries)
+    {}
+
+    template <typename TSize>
+    bool Create(const TSize *NumObjects)
+    {
+        if (m_NumEntries == 0)
+        {
+            return true;
+        }
+
+        auto TableSize = m_NumEntries * sizeof(CEntry);
+        auto ArenaSize = TableSize;
+
+        for (size_t i = 0; i < m_NumEntries; i++)
+        {
+            ArenaSize += NumObjects[i] * sizeof(TObject);
+        }
+
+        m_Arena = TAllocator::allocate(ArenaSize);
+        if (!m_Arena)
+        {
+            return false;
+        }
+        m_ArenaSize = ArenaSize;
+
+        auto Offset = TableSize;
+        for (size_t i = 0; i < m_NumEntries; i++)
+        {
+            Table()[i].Offset = Offset;
+            Table()[i].NumObjects = NumObjects[i];
+            Offset += NumObjects[i] * sizeof(TObject);
+        }
+
+        return true;
+    }
+
+    size_t Size()
+    { return m_NumEntries; }
+
+    size_t EntrySize(size_t Index)
+    {
+        ASSERT(Index < m_NumEntries);
+        return Table()[Index].NumObjects * sizeof(TObject);
+    }
+
+    template <typename TConstructor>
+    bool EmplaceEntry(size_t Index, TConstructor EntryConstructor)
+    {
+        ASSERT(Index < m_NumEntries);
+        return EntryConstructor(Entry(Index));
+    }
+
+    TObject *Entry(size_t Index)
+    {
+        ASSERT(Index < m_NumEntries);
+        return reinterpret_cast<TObject *>(static_cast<PUCHAR>(m_Arena) + Table()[Index].Offset);
+    }
+
+    void CopyEntry(size_t Index, PVOID Buffer, size_t NumObjects)
+    {
+        ASSERT(Index < m_NumEntries);
+        RtlCopyBytes(Buffer, Entry(Index), min(NumObjects, Table()[Index].NumObjects) * sizeof(TObject));
+    }
+
+    // Whole arena with the offsets table
+    const VOID *Data()
+    { return m_Arena; }
+    size_t DataSize()
+    { return m_ArenaSize; }
+
+    CBufferArena(CBufferArena<PoolType, Tag, TObject> &Other)
+    {
+        *this = Other;
+    }
+
+    CBufferArena& operator= (CBufferArena<PoolType, Tag, TObject> &Other)
+    {
+        m_NumEntries = Other.m_NumEntries;
+        m_ArenaSize = Other.m_ArenaSize;
+        m_Arena.reset(Other.m_Arena.detach());
+        return *this;
+    }
+
+private:
+    struct CEntry
+    {
+        size_t Offset;
+        size_t NumObjects;
+    };
+
+    CEntry *Table()
+    { return reinterpret_cast<CEntry *>(static_cast<PUCHAR>(m_Arena)); }
+
+    size_t m_NumEntries;
+    size_t m_ArenaSize = 0;
+
+    using TAllocator = CPrimitiveAllocator<PoolType, UCHAR, Tag>;
+    CObjHolder<UCHAR, TAllocator> m_Arena;
+};
+
 template<typename T>
 class CRefCountingHolder : public CAllocatable < NonPagedPool, 'CRHR'>
 {
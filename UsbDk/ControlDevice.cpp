@@ -27,6 +27,7 @@
 #include "DeviceAccess.h"
 #include "WdfRequest.h"
 #include "Registry.h"
+#include "RedirectBatch.h"
 #include "ControlDevice.tmh"
 #include "Public.h"
 
@@ -89,16 +90,46 @@ void CUsbDkControlDeviceQueue::DeviceControl(WDFQUEUE Queue,
             EnumerateDevices(WdfRequest, Queue);
             break;
         }
+        case IOCTL_USBDK_ENUM_DEVICES_V2:
+        {
+            EnumerateDevicesV2(WdfRequest, Queue);
+            break;
+        }
         case IOCTL_USBDK_GET_CONFIG_DESCRIPTOR:
         {
             GetConfigurationDescriptor(WdfRequest, Queue);
             break;
         }
+        case IOCTL_USBDK_GET_ALL_DESCRIPTORS:
+        {
+            GetAllDescriptors(WdfRequest, Queue);
+            break;
+        }
+        case IOCTL_USBDK_GET_DEVICE_STRINGS:
+        {
+            GetDeviceStrings(WdfRequest, Queue);
+            break;
+        }
         case IOCTL_USBDK_UPDATE_REG_PARAMETERS:
         {
             UpdateRegistryParameters(WdfRequest, Queue);
             break;
         }
+        case IOCTL_USBDK_ADD_REDIRECT_RULE:
+        {
+            AddRedirectRule(WdfRequest, Queue);
+            break;
+        }
+        case IOCTL_USBDK_CLEAR_REDIRECT_RULES:
+        {
+            ClearRedirectRules(WdfRequest, Queue);
+            break;
+        }
+        case IOCTL_USBDK_GET_MEMORY_STATISTICS:
+        {
+            GetMemoryStatistics(WdfRequest);
+            break;
+        }
         default:
         {
             TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "Wrong IoControlCode 0x%X\n", IoControlCode);
@@ -123,13 +154,67 @@ void CUsbDkControlDeviceQueue::CountDevices(CWdfRequest &Request, WDFQUEUE Queue
     Request.SetStatus(status);
 }
 
+void CUsbDkControlDeviceQueue::GetMemoryStatistics(CWdfRequest &Request)
+{
+    PUSB_DK_MEMORY_STATISTICS Statistics;
+    auto status = Request.FetchOutputObject(Statistics);
+    if (NT_SUCCESS(status))
+    {
+        CUsbDkDescriptorStore::GetStatistics(*Statistics);
+        CUsbDkIdentityPool::GetStatistics(*Statistics);
+
+        Request.SetOutputDataLen(sizeof(*Statistics));
+    }
+
+    Request.SetStatus(status);
+}
+
 void CUsbDkControlDeviceQueue::UpdateRegistryParameters(CWdfRequest &Request, WDFQUEUE Queue)
 {
     auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
-    auto status = devExt->UsbDkControl->RescanRegistry();
+
+    WDF_REQUEST_PARAMETERS Params;
+    Request.GetParameters(Params);
+
+    // Without input all persistent rules are re-read,
+    // otherwise input describes the only changed rule
+    if (Params.Parameters.DeviceIoControl.InputBufferLength == 0)
+    {
+        Request.SetStatus(devExt->UsbDkControl->RescanRegistry());
+        return;
+    }
+
+    PUSB_DK_HIDE_RULE_UPDATE Update;
+    auto status = Request.FetchInputObject(Update);
+    if (NT_SUCCESS(status))
+    {
+        status = devExt->UsbDkControl->UpdatePersistentHideRules(*Update);
+    }
+
+    Request.SetStatus(status);
+}
+
+void CUsbDkControlDeviceQueue::AddRedirectRule(CWdfRequest &Request, WDFQUEUE Queue)
+{
+    PUSB_DK_REDIRECT_RULE Rule;
+
+    auto status = Request.FetchInputObject(Rule);
+    if (NT_SUCCESS(status))
+    {
+        auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
+        status = devExt->UsbDkControl->AddRedirectRule(*Rule);
+    }
+
     Request.SetStatus(status);
 }
 
+void CUsbDkControlDeviceQueue::ClearRedirectRules(CWdfRequest &Request, WDFQUEUE Queue)
+{
+    auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
+    devExt->UsbDkControl->ClearRedirectRules();
+    Request.SetStatus(STATUS_SUCCESS);
+}
+
 void CUsbDkControlDeviceQueue::EnumerateDevices(CWdfRequest &Request, WDFQUEUE Queue)
 {
     USB_DK_DEVICE_INFO *existingDevices;
@@ -157,6 +242,23 @@ void CUsbDkControlDeviceQueue::EnumerateDevices(CWdfRequest &Request, WDFQUEUE Q
     }
 }
 
+void CUsbDkControlDeviceQueue::EnumerateDevicesV2(CWdfRequest &Request, WDFQUEUE Queue)
+{
+    PUSB_DK_DEVICE_LIST List;
+    size_t BufferLength;
+    size_t OutputLength = 0;
+
+    auto status = Request.FetchOutputObject(List, &BufferLength);
+    if (NT_SUCCESS(status))
+    {
+        auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
+        status = devExt->UsbDkControl->EnumerateDevices(*List, BufferLength, OutputLength);
+    }
+
+    Request.SetOutputDataLen(OutputLength);
+    Request.SetStatus(status);
+}
+
 template <typename TInputObj, typename TOutputObj>
 static void CUsbDkControlDeviceQueue::DoUSBDeviceOp(CWdfRequest &Request,
                                                     WDFQUEUE Queue,
@@ -214,8 +316,19 @@ void CUsbDkControlDeviceQueue::GetConfigurationDescriptor(CWdfRequest &Request,
     DoUSBDeviceOp<USB_DK_CONFIG_DESCRIPTOR_REQUEST, USB_CONFIGURATION_DESCRIPTOR>(Request, Queue, &CUsbDkControlDevice::GetConfigurationDescriptor);
 }
 
+void CUsbDkControlDeviceQueue::GetAllDescriptors(CWdfRequest &Request, WDFQUEUE Queue)
+{
+    DoUSBDeviceOp<USB_DK_DEVICE_ID, USB_DK_DEVICE_DESCRIPTORS>(Request, Queue, &CUsbDkControlDevice::GetAllDescriptors);
+}
+
+void CUsbDkControlDeviceQueue::GetDeviceStrings(CWdfRequest &Request, WDFQUEUE Queue)
+{
+    DoUSBDeviceOp<USB_DK_DEVICE_ID, USB_DK_DEVICE_STRINGS>(Request, Queue, &CUsbDkControlDevice::GetDeviceStrings);
+}
+
 ULONG CUsbDkControlDevice::CountDevices()
 {
+    TSharedLocker Locker(m_StateLock);
     ULONG numberDevices = 0;
 
     m_FilterDevices.ForEach([&numberDevices](CUsbDkFilterDevice *Filter)
@@ -227,14 +340,41 @@ ULONG CUsbDkControlDevice::CountDevices()
     return numberDevices;
 }
 
-bool CUsbDkControlDevice::ShouldHide(const USB_DEVICE_DESCRIPTOR &DevDescriptor) const
+bool CUsbDkControlDevice::ShouldHide(const CUsbDkChildDevice &Dev)
+{
+    CWdmStopwatch Stopwatch;
+
+    auto Cached = false;
+    auto Hide = EvaluateHideRules(Dev, Cached);
+
+    m_HideStatistics.CountDecision(Hide, Cached, Stopwatch.Elapsed());
+    return Hide;
+}
+
+bool CUsbDkControlDevice::EvaluateHideRules(const CUsbDkChildDevice &Dev, bool &Cached)
 {
+    auto Indexed = false;
     auto Hide = false;
 
-    const auto &HideVisitor = [&DevDescriptor, &Hide](CUsbDkHideRule *Entry) -> bool
+    m_HideRulesIndex.Read([&Dev, &Indexed, &Hide, &Cached](const CUsbDkHideRulesIndex *Index)
+                          {
+                              if (Index != nullptr)
+                              {
+                                  Indexed = true;
+                                  Hide = Index->ShouldHide(Dev, Cached);
+                              }
+                          });
+
+    if (Indexed)
+    {
+        return Hide;
+    }
+
+    const auto &HideVisitor = [&Dev, &Hide](CUsbDkHideRule *Entry) -> bool
     {
-        if (Entry->Match(DevDescriptor))
+        if (Entry->Match(Dev))
         {
+            Entry->CountHit();
             Hide = Entry->ShouldHide();
             return !Entry->ForceDecision();
         }
@@ -242,14 +382,139 @@ bool CUsbDkControlDevice::ShouldHide(const USB_DEVICE_DESCRIPTOR &DevDescriptor)
         return true;
     };
 
-    const_cast<HideRulesSet*>(&m_HideRules)->ForEach(HideVisitor);
-    const_cast<HideRulesSet*>(&m_PersistentHideRules)->ForEach(HideVisitor);
+    m_HideRules.ForEach(HideVisitor);
+    m_PersistentHideRules.ForEach(HideVisitor);
 
     return Hide;
 }
 
+bool CUsbDkControlDevice::ShouldAutoRedirect(const CUsbDkChildDevice &Dev) const
+{
+    const auto &NoMatchVisitor = [&Dev](CUsbDkRedirectRule *Entry) -> bool
+                                 { return !Entry->Match(Dev); };
+
+    return !const_cast<RedirectRulesSet*>(&m_RedirectRules)->ForEach(NoMatchVisitor) ||
+           !const_cast<RedirectRulesSet*>(&m_PersistentRedirectRules)->ForEach(NoMatchVisitor);
+}
+
+bool CUsbDkControlDevice::HasInterfaceRules() const
+{
+    const auto &HideVisitor = [](CUsbDkHideRule *Entry) -> bool
+                              { return !Entry->UsesInterfaces(); };
+    const auto &RedirectVisitor = [](CUsbDkRedirectRule *Entry) -> bool
+                                  { return !Entry->UsesInterfaces(); };
+
+    return !const_cast<HideRulesSet*>(&m_HideRules)->ForEach(HideVisitor)                 ||
+           !const_cast<HideRulesSet*>(&m_PersistentHideRules)->ForEach(HideVisitor)       ||
+           !const_cast<RedirectRulesSet*>(&m_RedirectRules)->ForEach(RedirectVisitor)     ||
+           !const_cast<RedirectRulesSet*>(&m_PersistentRedirectRules)->ForEach(RedirectVisitor);
+}
+
+NTSTATUS CUsbDkControlDevice::AddAutoRedirection(const CUsbDkChildDevice &Dev)
+{
+    CObjHolder<CUsbDkRedirection> newRedir(new CUsbDkRedirection());
+
+    if (!newRedir)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! failed. Cannot allocate redirection.");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    auto status = newRedir->Create(Dev);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! failed. Cannot create redirection.");
+        return status;
+    }
+
+    newRedir->MarkAutomatic();
+
+    if (!m_Redirections.Add(newRedir))
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Device already redirected.");
+        return STATUS_OBJECT_NAME_COLLISION;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Success. New redirections list:");
+    m_Redirections.Dump();
+
+    newRedir.detach();
+    return STATUS_SUCCESS;
+}
+
+void CUsbDkControlDevice::DropAutoRedirection(const CUsbDkChildDevice &Dev)
+{
+    // Nobody owns redirector of unclaimed automatic redirection,
+    // so nobody will remove it when device goes away
+    auto Unclaimed = false;
+    m_Redirections.ModifyOne(&Dev, [&Unclaimed](CUsbDkRedirection *R)
+                             {
+                                 if (R->IsAutomatic() && !R->IsClaimed() && !R->IsPreparedForRemove())
+                                 {
+                                     if (R->IsRedirected())
+                                     {
+                                         R->NotifyRedirectionRemovalStarted();
+                                     }
+                                     Unclaimed = true;
+                                 }
+                             });
+
+    if (Unclaimed)
+    {
+        m_Redirections.Delete(&Dev);
+
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Automatic redirection dropped. New redirections list:");
+        m_Redirections.Dump();
+    }
+}
+
+NTSTATUS CUsbDkControlDevice::ClaimAutoRedirection(const USB_DK_DEVICE_ID &DeviceId, PHANDLE RedirectorDevice)
+{
+    CUsbDkRedirection *Redirection = nullptr;
+    m_Redirections.ModifyOne(&DeviceId, [&Redirection](CUsbDkRedirection *R)
+                             {
+                                 if (R->Claim())
+                                 {
+                                     R->AddRef();
+                                     Redirection = R;
+                                 }
+                             });
+
+    if (Redirection == nullptr)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    // Device was attached to redirector on arrival,
+    // normally there is nothing to wait for here
+    auto status = Redirection->WaitForAttachment();
+    if ((status == STATUS_TIMEOUT) || !NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Wait for redirector attachment failed. %!STATUS!", status);
+        status = (status == STATUS_TIMEOUT) ? STATUS_DEVICE_NOT_CONNECTED : status;
+    }
+    else
+    {
+        status = Redirection->CreateRedirectorHandle(RedirectorDevice);
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! CreateRedirectorHandle() failed. %!STATUS!", status);
+            status = STATUS_DEVICE_NOT_CONNECTED;
+        }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        Redirection->Unclaim();
+    }
+
+    Redirection->Release();
+    return status;
+}
+
 bool CUsbDkControlDevice::EnumerateDevices(USB_DK_DEVICE_INFO *outBuff, size_t numberAllocatedDevices, size_t &numberExistingDevices)
 {
+    TSharedLocker Locker(m_StateLock);
     numberExistingDevices = 0;
 
     return UsbDevicesForEachIf(ConstTrue,
@@ -274,6 +539,27 @@ bool CUsbDkControlDevice::EnumerateDevices(USB_DK_DEVICE_INFO *outBuff, size_t n
                                });
 }
 
+NTSTATUS CUsbDkControlDevice::EnumerateDevices(USB_DK_DEVICE_LIST &List, size_t BufferLength, size_t &OutputLength)
+{
+    TSharedLocker Locker(m_StateLock);
+
+    size_t MaxDevices = 0;
+    m_FilterDevices.ForEach([&MaxDevices](CUsbDkFilterDevice *Filter)
+    {
+        MaxDevices += Filter->GetChildrenCount();
+        return true;
+    });
+
+    // Children may come and go while the list is written,
+    // if more of them appear the caller gets overflow and retries
+    CUsbDkDeviceListWriter Writer(List, BufferLength, MaxDevices);
+
+    UsbDevicesForEachIf(ConstTrue, [&Writer](CUsbDkChildDevice *Child) -> bool
+                                   { return Writer.Add(*Child); });
+
+    return Writer.Finish(OutputLength);
+}
+
 // EnumUsbDevicesByID runs over the list of USB devices looking for device by ID.
 // For each device with matching ID Functor() is called.
 // If Functor() returns false EnumUsbDevicesByID() interrupts the loop and exits immediately.
@@ -334,19 +620,68 @@ NTSTATUS CUsbDkControlDevice::GetUsbDeviceConfigurationDescriptor(const USB_DK_D
                                                                   size_t Length)
 {
     bool result = false;
+    auto status = STATUS_SUCCESS;
 
-    if (EnumUsbDevicesByID(DeviceID, [&result, DescriptorIndex, &Descriptor, Length](CUsbDkChildDevice *Child) -> bool
+    if (EnumUsbDevicesByID(DeviceID, [&result, &status, DescriptorIndex, &Descriptor, Length](CUsbDkChildDevice *Child) -> bool
                                      {
-                                        result = Child->ConfigurationDescriptor(DescriptorIndex, Descriptor, Length);
+                                        status = Child->DescriptorsStatus();
+                                        if (NT_SUCCESS(status))
+                                        {
+                                            result = Child->ConfigurationDescriptor(DescriptorIndex, Descriptor, Length);
+                                        }
                                         return false;
                                      }))
     {
         return STATUS_NOT_FOUND;
     }
 
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
     return result ? STATUS_SUCCESS : STATUS_INVALID_DEVICE_REQUEST;
 }
 
+// Descriptors of newly attached devices are fetched in background,
+// requests for descriptors wait for a while until those become available
+
+NTSTATUS CUsbDkControlDevice::WaitForDescriptors(const USB_DK_DEVICE_ID &ID)
+{
+    static const LONGLONG RETRY_TIMEOUT_MS = 20;
+    unsigned int iterationsLeft = 5000 / RETRY_TIMEOUT_MS; //Max timeout is 5 seconds
+
+    LARGE_INTEGER interval;
+    interval.QuadPart = -MillisecondsTo100Nanoseconds(RETRY_TIMEOUT_MS);
+
+    for (;;)
+    {
+        bool Pending = false;
+
+        if (EnumUsbDevicesByID(ID, [&Pending](CUsbDkChildDevice *Child) -> bool
+                                   {
+                                       Pending = Child->IsPending();
+                                       return false;
+                                   }))
+        {
+            return STATUS_NOT_FOUND;
+        }
+
+        if (!Pending)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        if (iterationsLeft-- == 0)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Device descriptors are still not available");
+            return STATUS_DEVICE_BUSY;
+        }
+
+        KeDelayExecutionThread(KernelMode, FALSE, &interval);
+    }
+}
+
 void CUsbDkControlDevice::ContextCleanup(_In_ WDFOBJECT DeviceObject)
 {
     PAGED_CODE();
@@ -406,7 +741,7 @@ NTSTATUS CUsbDkControlDevice::Register()
         return status;
     }
 
-    m_DeviceQueue = new CUsbDkControlDeviceQueue(*this, WdfIoQueueDispatchSequential);
+    m_DeviceQueue = new CUsbDkControlDeviceQueue(*this, WdfIoQueueDispatchParallel);
     if (m_DeviceQueue == nullptr)
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Device queue allocation failed");
@@ -418,6 +753,7 @@ NTSTATUS CUsbDkControlDevice::Register()
     {
         FinishInitializing();
         ReloadPersistentHideRules();
+        ReloadPersistentRedirectRules();
     }
 
     return status;
@@ -442,6 +778,20 @@ void CUsbDkControlDevice::IoInCallerContext(WDFDEVICE Device, WDFREQUEST Request
             WdfRequest.SetStatus(status);
         }
     }
+    else if (Params.Type == WdfRequestTypeDeviceControl &&
+             Params.Parameters.DeviceIoControl.IoControlCode == IOCTL_USBDK_ADD_REDIRECT_BATCH)
+    {
+        USB_DK_DEVICE_ID *DeviceIds;
+        USB_DK_REDIRECT_RESULT *Results;
+        size_t NumDevices;
+        if (FetchBuffersForAddRedirectBatchRequest(WdfRequest, DeviceIds, Results, NumDevices))
+        {
+            auto controlDevice = UsbDkControlGetContext(Device)->UsbDkControl;
+            auto status = controlDevice->AddRedirectBatch(DeviceIds, Results, NumDevices);
+            WdfRequest.SetOutputDataLen(NT_SUCCESS(status) ? NumDevices * sizeof(USB_DK_REDIRECT_RESULT) : 0);
+            WdfRequest.SetStatus(status);
+        }
+    }
     else
     {
         auto status = WdfDeviceEnqueueRequest(Device, WdfRequest);
@@ -501,6 +851,42 @@ bool CUsbDkControlDevice::FetchBuffersForAddRedirectRequest(CWdfRequest &WdfRequ
     return true;
 }
 
+bool CUsbDkControlDevice::FetchBuffersForAddRedirectBatchRequest(CWdfRequest &WdfRequest,
+                                                                 USB_DK_DEVICE_ID *&DeviceIds,
+                                                                 USB_DK_REDIRECT_RESULT *&Results,
+                                                                 size_t &NumDevices)
+{
+    auto status = WdfRequest.FetchInputArray(DeviceIds, NumDevices);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_REDIRECTOR, "%!FUNC! FetchInputArray failed, %!STATUS!", status);
+        WdfRequest.SetStatus(status);
+        WdfRequest.SetOutputDataLen(0);
+        return false;
+    }
+
+    size_t NumResults;
+    status = WdfRequest.FetchOutputArray(Results, NumResults);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to fetch output buffer. %!STATUS!", status);
+        WdfRequest.SetStatus(status);
+        WdfRequest.SetOutputDataLen(0);
+        return false;
+    }
+
+    if ((NumDevices == 0) || (NumResults != NumDevices))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_REDIRECTOR, "%!FUNC! Wrong request buffers size (%llu devices, %llu results)",
+                    NumDevices, NumResults);
+        WdfRequest.SetStatus(STATUS_INVALID_BUFFER_SIZE);
+        WdfRequest.SetOutputDataLen(0);
+        return false;
+    }
+
+    return true;
+}
+
 CRefCountingHolder<CUsbDkControlDevice> *CUsbDkControlDevice::m_UsbDkControlDevice = nullptr;
 
 CUsbDkControlDevice* CUsbDkControlDevice::Reference(WDFDRIVER Driver)
@@ -583,13 +969,124 @@ NTSTATUS CUsbDkControlDevice::GetConfigurationDescriptor(const USB_DK_CONFIG_DES
                                                          PUSB_CONFIGURATION_DESCRIPTOR Descriptor,
                                                          size_t *OutputBuffLen)
 {
-    auto status = GetUsbDeviceConfigurationDescriptor(Request.ID, static_cast<UCHAR>(Request.Index), *Descriptor, *OutputBuffLen);
+    auto status = WaitForDescriptors(Request.ID);
+    if (!NT_SUCCESS(status))
+    {
+        *OutputBuffLen = 0;
+        return status;
+    }
+
+    TSharedLocker Locker(m_StateLock);
+    status = GetUsbDeviceConfigurationDescriptor(Request.ID, static_cast<UCHAR>(Request.Index), *Descriptor, *OutputBuffLen);
     *OutputBuffLen = NT_SUCCESS(status) ? min(Descriptor->wTotalLength, *OutputBuffLen) : 0;
     return status;
 }
 
+// GetAllDescriptors fills the header and all cached configuration descriptors
+// of the device. If output buffer cannot hold all descriptors only the header
+// is returned with STATUS_BUFFER_OVERFLOW, TotalLength tells the size required.
+
+NTSTATUS CUsbDkControlDevice::GetAllDescriptors(const USB_DK_DEVICE_ID &DeviceID,
+                                                USB_DK_DEVICE_DESCRIPTORS *Descriptors,
+                                                size_t *OutputBuffLen)
+{
+    auto status = WaitForDescriptors(DeviceID);
+    if (!NT_SUCCESS(status))
+    {
+        *OutputBuffLen = 0;
+        return status;
+    }
+
+    TSharedLocker Locker(m_StateLock);
+
+    auto BufferLength = *OutputBuffLen;
+
+    if (EnumUsbDevicesByID(DeviceID, [&status, Descriptors, BufferLength, OutputBuffLen](CUsbDkChildDevice *Child) -> bool
+                                     {
+                                         status = Child->DescriptorsStatus();
+                                         if (!NT_SUCCESS(status))
+                                         {
+                                             *OutputBuffLen = 0;
+                                             return false;
+                                         }
+
+                                         size_t TotalLength = sizeof(*Descriptors);
+                                         auto NumConfigurations = Child->NumConfigurations();
+                                         for (UCHAR i = 0; i < NumConfigurations; i++)
+                                         {
+                                             TotalLength += Child->ConfigurationDescriptorSize(i);
+                                         }
+
+                                         Descriptors->TotalLength = TotalLength;
+                                         Descriptors->NumConfigurations = NumConfigurations;
+                                         Descriptors->DeviceDescriptor = Child->DeviceDescriptor();
+
+                                         if (BufferLength < TotalLength)
+                                         {
+                                             *OutputBuffLen = sizeof(*Descriptors);
+                                             status = STATUS_BUFFER_OVERFLOW;
+                                             return false;
+                                         }
+
+                                         auto Position = reinterpret_cast<PUCHAR>(Descriptors + 1);
+                                         for (UCHAR i = 0; i < NumConfigurations; i++)
+                                         {
+                                             auto EntryLength = Child->ConfigurationDescriptorSize(i);
+                                             Child->ConfigurationDescriptor(i, *reinterpret_cast<PUSB_CONFIGURATION_DESCRIPTOR>(Position),
+                                                                            EntryLength);
+                                             Position += EntryLength;
+                                         }
+
+                                         *OutputBuffLen = TotalLength;
+                                         return false;
+                                     }))
+    {
+        *OutputBuffLen = 0;
+        return STATUS_NOT_FOUND;
+    }
+
+    return status;
+}
+
+NTSTATUS CUsbDkControlDevice::GetDeviceStrings(const USB_DK_DEVICE_ID &DeviceID,
+                                               USB_DK_DEVICE_STRINGS *Strings,
+                                               size_t *OutputBuffLen)
+{
+    auto status = WaitForDescriptors(DeviceID);
+    if (!NT_SUCCESS(status))
+    {
+        *OutputBuffLen = 0;
+        return status;
+    }
+
+    TSharedLocker Locker(m_StateLock);
+
+    if (EnumUsbDevicesByID(DeviceID, [&status, Strings](CUsbDkChildDevice *Child) -> bool
+                                     {
+                                         status = Child->DescriptorsStatus();
+                                         if (NT_SUCCESS(status))
+                                         {
+                                             Child->Strings(*Strings);
+                                         }
+                                         return false;
+                                     }))
+    {
+        *OutputBuffLen = 0;
+        return STATUS_NOT_FOUND;
+    }
+
+    *OutputBuffLen = NT_SUCCESS(status) ? sizeof(*Strings) : 0;
+    return status;
+}
+
 NTSTATUS CUsbDkControlDevice::AddRedirect(const USB_DK_DEVICE_ID &DeviceId, PHANDLE RedirectorDevice)
 {
+    auto claimRes = ClaimAutoRedirection(DeviceId, RedirectorDevice);
+    if (claimRes != STATUS_NOT_FOUND)
+    {
+        return claimRes;
+    }
+
     CUsbDkRedirection *Redirection;
     auto addRes = AddDeviceToSet(DeviceId, &Redirection);
     if (!NT_SUCCESS(addRes))
@@ -627,19 +1124,102 @@ NTSTATUS CUsbDkControlDevice::AddRedirect(const USB_DK_DEVICE_ID &DeviceId, PHAN
     return STATUS_SUCCESS;
 }
 
-NTSTATUS CUsbDkControlDevice::AddHideRuleToSet(const USB_DK_HIDE_RULE &UsbDkRule, HideRulesSet &Set)
+// Steps of a single redirection, as done by AddRedirect()
+class CUsbDkControlDevice::CRedirectBatchSteps
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! entry");
+public:
+    typedef CUsbDkRedirection TRedirection;
 
-    auto MatchAllMapper = [](ULONG64 Value) -> ULONG
-    { return Value == USB_DK_HIDE_RULE_MATCH_ALL ? USBDK_REG_HIDE_RULE_MATCH_ALL
-                                                 : static_cast<ULONG>(Value); };
-
-    CObjHolder<CUsbDkHideRule> NewRule(new CUsbDkHideRule(UsbDkRule.Hide ? true : false,
-                                                          MatchAllMapper(UsbDkRule.Class),
-                                                          MatchAllMapper(UsbDkRule.VID),
-                                                          MatchAllMapper(UsbDkRule.PID),
-                                                          MatchAllMapper(UsbDkRule.BCD)));
+    CRedirectBatchSteps(CUsbDkControlDevice &ControlDevice)
+        : m_ControlDevice(ControlDevice)
+    {}
+
+    NTSTATUS Claim(const USB_DK_DEVICE_ID &Id, PHANDLE RedirectorHandle)
+    { return m_ControlDevice.ClaimAutoRedirection(Id, RedirectorHandle); }
+
+    NTSTATUS Add(const USB_DK_DEVICE_ID &Id, CUsbDkRedirection **Redirection)
+    { return m_ControlDevice.AddDeviceToSet(Id, Redirection); }
+
+    NTSTATUS Reset(const USB_DK_DEVICE_ID &Id)
+    {
+        auto resetRes = m_ControlDevice.ResetUsbDevice(Id);
+        if (!NT_SUCCESS(resetRes))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Reset after start redirection failed. %!STATUS!", resetRes);
+        }
+        return resetRes;
+    }
+
+    NTSTATUS WaitForAttachment(CUsbDkRedirection &Redirection, LONGLONG Deadline)
+    {
+        auto waitRes = Redirection.WaitForAttachment(Deadline);
+        if ((waitRes == STATUS_TIMEOUT) || !NT_SUCCESS(waitRes))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Wait for redirector attachment failed. %!STATUS!", waitRes);
+        }
+        return waitRes;
+    }
+
+    NTSTATUS CreateHandle(CUsbDkRedirection &Redirection, PHANDLE RedirectorHandle)
+    {
+        auto handleRes = Redirection.CreateRedirectorHandle(RedirectorHandle);
+        if (!NT_SUCCESS(handleRes))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! CreateRedirectorHandle() failed. %!STATUS!", handleRes);
+        }
+        return handleRes;
+    }
+
+    void RollBack(const USB_DK_DEVICE_ID &Id, bool WithReset)
+    { m_ControlDevice.AddRedirectRollBack(Id, WithReset); }
+
+private:
+    CUsbDkControlDevice &m_ControlDevice;
+};
+
+NTSTATUS CUsbDkControlDevice::AddRedirectBatch(const USB_DK_DEVICE_ID *DeviceIds,
+                                               USB_DK_REDIRECT_RESULT *Results,
+                                               size_t NumDevices)
+{
+    CRedirectBatchSteps Steps(*this);
+    CUsbDkRedirectBatch<CRedirectBatchSteps> Batch(Steps);
+
+    auto status = Batch.Run(DeviceIds, Results, NumDevices, SecondsTo100Nanoseconds(120));
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate batch. %!STATUS!", status);
+        return status;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Done. Redirections list:");
+    m_Redirections.Dump();
+
+    return STATUS_SUCCESS;
+}
+
+CUsbDkHideRule *CUsbDkControlDevice::CreateHideRule(const USB_DK_HIDE_RULE_V2 &UsbDkRule)
+{
+    auto Clamp = [](ULONG64 Value) -> ULONG
+    { return Value > ULONG(-1) ? ULONG(-1) : static_cast<ULONG>(Value); };
+
+    auto MatcherMapper = [&Clamp](const USB_DK_HIDE_RULE_MATCHER &Matcher) -> CUsbDkHideRuleMatcher
+    { return CUsbDkHideRuleMatcher(Clamp(Matcher.Min), Clamp(Matcher.Max), static_cast<ULONG>(Matcher.Mask)); };
+
+    return new CUsbDkHideRule(UsbDkRule.Hide ? true : false,
+                              MatcherMapper(UsbDkRule.Class),
+                              MatcherMapper(UsbDkRule.VID),
+                              MatcherMapper(UsbDkRule.PID),
+                              MatcherMapper(UsbDkRule.BCD),
+                              CUsbDkInterfaceMatcher(MatcherMapper(UsbDkRule.InterfaceClass),
+                                                     MatcherMapper(UsbDkRule.InterfaceSubClass),
+                                                     MatcherMapper(UsbDkRule.InterfaceProtocol)));
+}
+
+NTSTATUS CUsbDkControlDevice::AddHideRuleToSet(const USB_DK_HIDE_RULE_V2 &UsbDkRule, HideRulesSet &Set)
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! entry");
+
+    CObjHolder<CUsbDkHideRule> NewRule(CreateHideRule(UsbDkRule));
     if (!NewRule)
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate new rule");
@@ -659,16 +1239,178 @@ NTSTATUS CUsbDkControlDevice::AddHideRuleToSet(const USB_DK_HIDE_RULE &UsbDkRule
     return STATUS_SUCCESS;
 }
 
+NTSTATUS CUsbDkControlDevice::ReplaceHideRules(const USB_DK_HIDE_RULE_V2 *UsbDkRules, size_t NumRules)
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! entry, %llu rules", NumRules);
+
+    typedef CPrimitiveAllocator<NonPagedPool, CUsbDkHideRule*, 'LHHR'> TRulesArrayAllocator;
+    CObjHolder<CUsbDkHideRule*, TRulesArrayAllocator> NewRules((NumRules != 0) ? TRulesArrayAllocator::allocate(NumRules)
+                                                                               : nullptr);
+    if ((NumRules != 0) && !NewRules)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate rules array");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (size_t i = 0; i < NumRules; i++)
+    {
+        NewRules[i] = CreateHideRule(UsbDkRules[i]);
+        if (NewRules[i] == nullptr)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate new rule");
+            while (i-- > 0)
+            {
+                delete NewRules[i];
+            }
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    // Decision does not depend on rules order, so rules are
+    // kept sorted and duplicates are dropped as neighbours
+    UsbDkHeapSort(static_cast<CUsbDkHideRule**>(NewRules), NumRules,
+                  [](const CUsbDkHideRule *a, const CUsbDkHideRule *b) { return *a < *b; });
+
+    size_t NumUnique = 0;
+    for (size_t i = 0; i < NumRules; i++)
+    {
+        if ((NumUnique != 0) && (*NewRules[NumUnique - 1] == *NewRules[i]))
+        {
+            delete NewRules[i];
+        }
+        else
+        {
+            NewRules[NumUnique++] = NewRules[i];
+        }
+    }
+
+    // Index is republished once, so devices enumerated meanwhile
+    // are matched against either all former or all new rules
+    {
+        TExclusiveLocker Locker(m_StateLock);
+        m_HideRules.Replace(NewRules, NumUnique, [this](CUsbDkHideRule *Rule) { RetireHideRule(Rule); });
+        RebuildHideRulesIndex();
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Dynamic hide rules replaced by %llu unique rules", NumUnique);
+    return STATUS_SUCCESS;
+}
+
+void CUsbDkControlDevice::RebuildHideRulesIndex()
+{
+    size_t NumRules = 0;
+    auto Counter = [&NumRules](CUsbDkHideRule *) { NumRules++; return true; };
+    m_HideRules.ForEach(Counter);
+    m_PersistentHideRules.ForEach(Counter);
+
+    CObjHolder<CUsbDkHideRulesIndex> NewIndex(new CUsbDkHideRulesIndex());
+    auto status = NewIndex ? NewIndex->Create(NumRules) : STATUS_INSUFFICIENT_RESOURCES;
+    if (NT_SUCCESS(status))
+    {
+        m_HideRules.ForEach([&NewIndex](CUsbDkHideRule *Rule)
+                            { NewIndex->Add(*Rule, CUsbDkHideRulesIndex::DYNAMIC_RULES); return true; });
+        m_PersistentHideRules.ForEach([&NewIndex](CUsbDkHideRule *Rule)
+                                      { NewIndex->Add(*Rule, CUsbDkHideRulesIndex::PERSISTENT_RULES); return true; });
+        NewIndex->Compile();
+    }
+    else
+    {
+        // Stale index must not be used, rules will be walked instead
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_CONTROLDEVICE, "%!FUNC! Failed to build hide rules index: %!STATUS!", status);
+        NewIndex.reset();
+    }
+
+    delete m_HideRulesIndex.Publish(NewIndex.detach());
+
+    // Former index is not visible to readers anymore
+    m_RetiredHideRules.Clear();
+}
+
+void CUsbDkControlDevice::GetHideStatistics(USB_DK_HIDE_STATISTICS &Statistics, size_t MaxRules, size_t &NumRulesReturned)
+{
+    auto RulesStatistics = reinterpret_cast<PUSB_DK_HIDE_RULE_STATISTICS>(&Statistics + 1);
+    size_t NumRules = 0;
+
+    m_HideStatistics.Export(Statistics);
+
+    auto Exporter = [RulesStatistics, MaxRules, &NumRules](CUsbDkHideRule *Rule, bool Persistent)
+    {
+        if (NumRules < MaxRules)
+        {
+            Rule->Export(RulesStatistics[NumRules]);
+            RulesStatistics[NumRules].Persistent = Persistent;
+        }
+        NumRules++;
+    };
+
+    {
+        TSharedLocker Locker(m_StateLock);
+        m_HideRules.ForEach([&Exporter](CUsbDkHideRule *Rule) { Exporter(Rule, false); return true; });
+        m_PersistentHideRules.ForEach([&Exporter](CUsbDkHideRule *Rule) { Exporter(Rule, true); return true; });
+    }
+
+    Statistics.NumRules = NumRules;
+    NumRulesReturned = min(NumRules, MaxRules);
+}
+
 void CUsbDkControlDevice::ClearHideRules()
 {
-    m_HideRules.Clear();
+    TExclusiveLocker Locker(m_StateLock);
+    m_HideRules.DetachAll([this](CUsbDkHideRule *Rule) { RetireHideRule(Rule); });
+    RebuildHideRulesIndex();
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! All dynamic hide rules dropped.");
 }
 
-class CHideRulesRegKey final : public CRegKey
+NTSTATUS CUsbDkControlDevice::AddRedirectRuleToSet(const USB_DK_REDIRECT_RULE &UsbDkRule, RedirectRulesSet &Set)
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! entry");
+
+    auto MatchAllMapper = [](ULONG64 Value) -> ULONG
+    { return Value == USB_DK_REDIRECT_RULE_MATCH_ALL ? USBDK_REG_HIDE_RULE_MATCH_ALL
+                                                     : static_cast<ULONG>(Value); };
+
+    auto MatcherMapper = [](ULONG64 Value) -> CUsbDkHideRuleMatcher
+    { return Value == USB_DK_REDIRECT_RULE_MATCH_ALL ? CUsbDkHideRuleMatcher()
+                                                     : CUsbDkHideRuleMatcher(static_cast<ULONG>(Value), static_cast<ULONG>(Value)); };
+
+    CObjHolder<CUsbDkRedirectRule> NewRule(new CUsbDkRedirectRule(MatchAllMapper(UsbDkRule.Class),
+                                                                  MatchAllMapper(UsbDkRule.VID),
+                                                                  MatchAllMapper(UsbDkRule.PID),
+                                                                  MatchAllMapper(UsbDkRule.BCD),
+                                                                  MatchAllMapper(UsbDkRule.Port),
+                                                                  CUsbDkInterfaceMatcher(MatcherMapper(UsbDkRule.InterfaceClass),
+                                                                                         MatcherMapper(UsbDkRule.InterfaceSubClass),
+                                                                                         MatcherMapper(UsbDkRule.InterfaceProtocol))));
+    if (!NewRule)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate new rule");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if(!Set.Add(NewRule))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! failed. Redirect rule already present.");
+        return STATUS_OBJECT_NAME_COLLISION;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Current redirect rules:");
+    Set.Dump();
+
+    NewRule.detach();
+    return STATUS_SUCCESS;
+}
+
+void CUsbDkControlDevice::ClearRedirectRules()
+{
+    TExclusiveLocker Locker(m_StateLock);
+    m_RedirectRules.Clear();
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! All dynamic redirect rules dropped.");
+}
+
+class CRulesRegKey final : public CRegKey
 {
 public:
-    NTSTATUS Open()
+    NTSTATUS Open(PCWSTR RulesSubkey)
     {
         auto DriverParamsRegPath = CDriverParamsRegistryPath::Get();
         if (DriverParamsRegPath->Length == 0)
@@ -680,39 +1422,73 @@ public:
         }
 
         CStringHolder ParamsSubkey;
-        auto status = ParamsSubkey.Attach(TEXT("\\") USBDK_HIDE_RULES_SUBKEY_NAME);
+        auto status = ParamsSubkey.Attach(RulesSubkey);
         ASSERT(NT_SUCCESS(status));
 
-        CString HideRulesRegPath;
-        status = HideRulesRegPath.Create(DriverParamsRegPath, ParamsSubkey);
+        CString RulesRegPath;
+        status = RulesRegPath.Create(DriverParamsRegPath, ParamsSubkey);
         if (!NT_SUCCESS(status))
         {
             TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-                "%!FUNC! Failed to allocate path to hide rules registry key.");
+                "%!FUNC! Failed to allocate path to rules registry key %ws.", RulesSubkey);
 
             return status;
         }
 
-        status = CRegKey::Open(*HideRulesRegPath);
+        status = CRegKey::Open(*RulesRegPath);
         if (!NT_SUCCESS(status))
         {
             TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-                "%!FUNC! Failed to open hide rules registry key.");
+                "%!FUNC! Failed to open rules registry key %ws.", RulesSubkey);
         }
 
         return status;
     }
+
+    NTSTATUS ReadBinaryValue(PCWSTR ValueName, CWdmMemoryBuffer &Buffer, PKEY_VALUE_PARTIAL_INFORMATION &Info)
+    {
+        CStringHolder ValueNameHolder;
+        auto status = ValueNameHolder.Attach(ValueName);
+        ASSERT(NT_SUCCESS(status));
+
+        status = QueryValueInfo(*ValueNameHolder, KeyValuePartialInformation, Buffer);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        Info = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(Buffer.Ptr());
+        if (Info->Type != REG_BINARY)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE,
+                "%!FUNC! Wrong data type for value %wZ: %d", ValueNameHolder, Info->Type);
+
+            return STATUS_DATA_ERROR;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    bool ValueExists(PCWSTR ValueName)
+    {
+        CStringHolder ValueNameHolder;
+        auto status = ValueNameHolder.Attach(ValueName);
+        ASSERT(NT_SUCCESS(status));
+
+        CWdmMemoryBuffer Buffer;
+        return NT_SUCCESS(QueryValueInfo(*ValueNameHolder, KeyValueBasicInformation, Buffer));
+    }
 };
 
-class CRegHideRule final : private CRegKey
+class CRegRule final : private CRegKey
 {
 public:
-    NTSTATUS Open(const CRegKey &HideRulesRegKey, const UNICODE_STRING &Name)
+    NTSTATUS Open(const CRegKey &RulesRegKey, const UNICODE_STRING &Name)
     {
-        return CRegKey::Open(HideRulesRegKey, Name);
+        return CRegKey::Open(RulesRegKey, Name);
     }
 
-    NTSTATUS Read(USB_DK_HIDE_RULE &Rule)
+    NTSTATUS Read(USB_DK_HIDE_RULE_V2 &Rule)
     {
         auto status = ReadBoolValue(USBDK_HIDE_RULE_SHOULD_HIDE, Rule.Hide);
         if (!NT_SUCCESS(status))
@@ -720,25 +1496,99 @@ public:
             return status;
         }
 
-        status = ReadDwordMaskValue(USBDK_HIDE_RULE_VID, Rule.VID);
+        status = ReadMatcherValues(USBDK_HIDE_RULE_VID, USBDK_HIDE_RULE_VID_MAX, USBDK_HIDE_RULE_VID_MASK, Rule.VID);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadMatcherValues(USBDK_HIDE_RULE_PID, USBDK_HIDE_RULE_PID_MAX, USBDK_HIDE_RULE_PID_MASK, Rule.PID);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadMatcherValues(USBDK_HIDE_RULE_BCD, USBDK_HIDE_RULE_BCD_MAX, USBDK_HIDE_RULE_BCD_MASK, Rule.BCD);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadMatcherValues(USBDK_HIDE_RULE_CLASS, USBDK_HIDE_RULE_CLASS_MAX, USBDK_HIDE_RULE_CLASS_MASK, Rule.Class);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadOptionalMatcherValues(USBDK_HIDE_RULE_INTERFACE_CLASS, USBDK_HIDE_RULE_INTERFACE_CLASS_MAX,
+                                           USBDK_HIDE_RULE_INTERFACE_CLASS_MASK, Rule.InterfaceClass);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadOptionalMatcherValues(USBDK_HIDE_RULE_INTERFACE_SUBCLASS, USBDK_HIDE_RULE_INTERFACE_SUBCLASS_MAX,
+                                           USBDK_HIDE_RULE_INTERFACE_SUBCLASS_MASK, Rule.InterfaceSubClass);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadOptionalMatcherValues(USBDK_HIDE_RULE_INTERFACE_PROTOCOL, USBDK_HIDE_RULE_INTERFACE_PROTOCOL_MAX,
+                                           USBDK_HIDE_RULE_INTERFACE_PROTOCOL_MASK, Rule.InterfaceProtocol);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS Read(USB_DK_REDIRECT_RULE &Rule)
+    {
+        auto status = ReadDwordMaskValue(USBDK_REDIRECT_RULE_VID, Rule.VID);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadDwordMaskValue(USBDK_REDIRECT_RULE_PID, Rule.PID);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadDwordMaskValue(USBDK_REDIRECT_RULE_BCD, Rule.BCD);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadDwordMaskValue(USBDK_REDIRECT_RULE_CLASS, Rule.Class);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadDwordMaskValue(USBDK_REDIRECT_RULE_PORT, Rule.Port);
         if (!NT_SUCCESS(status))
         {
             return status;
         }
 
-        status = ReadDwordMaskValue(USBDK_HIDE_RULE_PID, Rule.PID);
+        status = ReadOptionalDwordMaskValue(USBDK_REDIRECT_RULE_INTERFACE_CLASS, Rule.InterfaceClass);
         if (!NT_SUCCESS(status))
         {
             return status;
         }
 
-        status = ReadDwordMaskValue(USBDK_HIDE_RULE_BCD, Rule.BCD);
+        status = ReadOptionalDwordMaskValue(USBDK_REDIRECT_RULE_INTERFACE_SUBCLASS, Rule.InterfaceSubClass);
         if (!NT_SUCCESS(status))
         {
             return status;
         }
 
-        status = ReadDwordMaskValue(USBDK_HIDE_RULE_CLASS, Rule.Class);
+        status = ReadOptionalDwordMaskValue(USBDK_REDIRECT_RULE_INTERFACE_PROTOCOL, Rule.InterfaceProtocol);
         if (!NT_SUCCESS(status))
         {
             return status;
@@ -811,20 +1661,225 @@ private:
 
         return status;
     }
+
+    // Field value is the lower bound of the range, upper bound
+    // and mask are optional and absent for exact value rules
+    NTSTATUS ReadMatcherValues(PCWSTR MinName, PCWSTR MaxName, PCWSTR MaskName, USB_DK_HIDE_RULE_MATCHER &Matcher)
+    {
+        ULONG64 Value;
+        auto status = ReadDwordMaskValue(MinName, Value);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        HideRuleMatcherFromV1(Value, Matcher);
+
+        status = ReadOptionalDwordValue(MaxName, Matcher.Max);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        return ReadOptionalDwordValue(MaskName, Matcher.Mask);
+    }
+
+    // Absent field accepts any value
+    NTSTATUS ReadOptionalMatcherValues(PCWSTR MinName, PCWSTR MaxName, PCWSTR MaskName, USB_DK_HIDE_RULE_MATCHER &Matcher)
+    {
+        auto status = ReadMatcherValues(MinName, MaxName, MaskName, Matcher);
+        if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+        {
+            HideRuleMatcherFromV1(USB_DK_HIDE_RULE_MATCH_ALL, Matcher);
+            status = STATUS_SUCCESS;
+        }
+
+        return status;
+    }
+
+    NTSTATUS ReadOptionalDwordMaskValue(PCWSTR ValueName, ULONG64 &Value)
+    {
+        auto status = ReadDwordMaskValue(ValueName, Value);
+        if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+        {
+            Value = USB_DK_REDIRECT_RULE_MATCH_ALL;
+            status = STATUS_SUCCESS;
+        }
+
+        return status;
+    }
+
+    NTSTATUS ReadOptionalDwordValue(PCWSTR ValueName, ULONG64 &Value)
+    {
+        DWORD32 RawValue;
+        auto status = ReadDwordValue(ValueName, RawValue);
+
+        if (NT_SUCCESS(status))
+        {
+            Value = HideRuleUlongMaskFromRegistry(RawValue);
+        }
+
+        return (status == STATUS_OBJECT_NAME_NOT_FOUND) ? STATUS_SUCCESS : status;
+    }
 };
 
+// Returns error if the registry has no index of hide rules
+NTSTATUS CUsbDkControlDevice::IsPersistentHideRuleStored(const USB_DK_HIDE_RULE_V2 &UsbDkRule, bool &Stored)
+{
+    CRulesRegKey RulesKey;
+    auto status = RulesKey.Open(TEXT("\\") USBDK_HIDE_RULES_SUBKEY_NAME);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    if (!RulesKey.ValueExists(USBDK_HIDE_RULES_INDEXED))
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    WCHAR IndexName[USBDK_HIDE_RULE_INDEX_NAME_LENGTH];
+    HideRuleIndexName(UsbDkRule, IndexName);
+
+    CWdmMemoryBuffer EntryBuffer;
+    PKEY_VALUE_PARTIAL_INFORMATION Entry;
+
+    status = RulesKey.ReadBinaryValue(IndexName, EntryBuffer, Entry);
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+    {
+        Stored = false;
+        return STATUS_SUCCESS;
+    }
+    else if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    // Index entry keeps all rules of the same hash
+    Stored = false;
+    for (ULONG Offset = 0; Offset + sizeof(UsbDkRule) <= Entry->DataLength; Offset += sizeof(UsbDkRule))
+    {
+        if (RtlEqualMemory(&Entry->Data[Offset], &UsbDkRule, sizeof(UsbDkRule)))
+        {
+            Stored = true;
+            break;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS CUsbDkControlDevice::ApplyPersistentHideRuleUpdate(const USB_DK_HIDE_RULE_UPDATE &Update, CUsbDkHideRule *Rule, bool &Applied)
+{
+    // Control device is open to everyone while the registry is not,
+    // so update is applied only if the registry agrees with it
+    bool Stored;
+    auto status = IsPersistentHideRuleStored(Update.Rule, Stored);
+    if (!NT_SUCCESS(status) ||
+        (Update.Operation == HideRuleAdded && !Stored) ||
+        (Update.Operation == HideRuleDeleted && Stored))
+    {
+        Applied = false;
+        return STATUS_SUCCESS;
+    }
+
+    Applied = true;
+
+    switch (Update.Operation)
+    {
+        case HideRuleAdded:
+        {
+            return m_PersistentHideRules.Add(Rule) ? STATUS_SUCCESS : STATUS_OBJECT_NAME_COLLISION;
+        }
+        case HideRuleDeleted:
+        {
+            return m_PersistentHideRules.Detach(Rule, [this](CUsbDkHideRule *Existing) { RetireHideRule(Existing); })
+                   ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+        }
+        default:
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+}
+
+NTSTATUS CUsbDkControlDevice::UpdatePersistentHideRules(const USB_DK_HIDE_RULE_UPDATE &Update)
+{
+    CObjHolder<CUsbDkHideRule> Rule(CreateHideRule(Update.Rule));
+    if (!Rule)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate rule");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    bool Applied;
+    NTSTATUS status;
+
+    {
+        // Registry is checked under the lock, so concurrent
+        // updates and rescans cannot change it in between
+        TExclusiveLocker Locker(m_StateLock);
+
+        status = ApplyPersistentHideRuleUpdate(Update, Rule, Applied);
+        if (Applied && NT_SUCCESS(status))
+        {
+            if (Update.Operation == HideRuleAdded)
+            {
+                Rule.detach();
+            }
+
+            RebuildHideRulesIndex();
+            return STATUS_SUCCESS;
+        }
+    }
+
+    if (!Applied)
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_CONTROLDEVICE, "%!FUNC! Update %llu does not match the registry, rescanning", Update.Operation);
+        return RescanRegistry();
+    }
+
+    // Update not matching current rules means they went out of
+    // sync with the registry, caller falls back to full reload then
+    TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to apply update %llu: %!STATUS!", Update.Operation, status);
+    return status;
+}
+
 NTSTATUS CUsbDkControlDevice::ReloadPersistentHideRules()
 {
-    m_PersistentHideRules.Clear();
+    m_PersistentHideRules.DetachAll([this](CUsbDkHideRule *Rule) { RetireHideRule(Rule); });
 
-    CHideRulesRegKey RulesKey;
-    auto status = RulesKey.Open();
+    CRulesRegKey RulesKey;
+    auto status = RulesKey.Open(TEXT("\\") USBDK_HIDE_RULES_SUBKEY_NAME);
     if (NT_SUCCESS(status))
     {
+        CWdmMemoryBuffer TableBuffer;
+        PKEY_VALUE_PARTIAL_INFORMATION Table;
+
+        if (NT_SUCCESS(RulesKey.ReadBinaryValue(USBDK_HIDE_RULES_TABLE, TableBuffer, Table)))
+        {
+            USB_DK_HIDE_RULES_TABLE_HEADER Header;
+
+            if (HideRulesTableParse(&Table->Data[0], Table->DataLength, Header))
+            {
+                for (ULONG i = 0; i < Header.NumRules; i++)
+                {
+                    USB_DK_HIDE_RULE_V2 ParsedRule;
+                    HideRulesTableGetRule(&Table->Data[0], Header, i, ParsedRule);
+                    AddPersistentHideRule(ParsedRule);
+                }
+            }
+            else
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Hide rules table is malformed or of unknown version");
+            }
+        }
+
+        // Rules written by older versions are kept in subkeys
         status = RulesKey.ForEachSubKey([&RulesKey, this](PCUNICODE_STRING Name)
         {
-            CRegHideRule Rule;
-            USB_DK_HIDE_RULE ParsedRule;
+            CRegRule Rule;
+            USB_DK_HIDE_RULE_V2 ParsedRule;
 
             if (NT_SUCCESS(Rule.Open(RulesKey, *Name)) &&
                 NT_SUCCESS(Rule.Read(ParsedRule)))
@@ -839,9 +1894,38 @@ NTSTATUS CUsbDkControlDevice::ReloadPersistentHideRules()
         status = STATUS_SUCCESS;
     }
 
+    RebuildHideRulesIndex();
     return status;
 }
 
+NTSTATUS CUsbDkControlDevice::ReloadPersistentRedirectRules()
+{
+    m_PersistentRedirectRules.Clear();
+
+    CRulesRegKey RulesKey;
+    auto status = RulesKey.Open(TEXT("\\") USBDK_REDIRECT_RULES_SUBKEY_NAME);
+    if (NT_SUCCESS(status))
+    {
+        status = RulesKey.ForEachSubKey([&RulesKey, this](PCUNICODE_STRING Name)
+        {
+            CRegRule Rule;
+            USB_DK_REDIRECT_RULE ParsedRule;
+
+            if (NT_SUCCESS(Rule.Open(RulesKey, *Name)) &&
+                NT_SUCCESS(Rule.Read(ParsedRule)))
+            {
+                AddPersistentRedirectRule(ParsedRule);
+            }
+        });
+    }
+
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+    {
+        status = STATUS_SUCCESS;
+    }
+
+    return status;
+}
 
 NTSTATUS CUsbDkControlDevice::AddDeviceToSet(const USB_DK_DEVICE_ID &DeviceId, CUsbDkRedirection **NewRedirection)
 {
@@ -877,23 +1961,28 @@ NTSTATUS CUsbDkControlDevice::AddDeviceToSet(const USB_DK_DEVICE_ID &DeviceId, C
     return STATUS_SUCCESS;
 }
 
-NTSTATUS CUsbDkControlDevice::RemoveRedirect(const USB_DK_DEVICE_ID &DeviceId)
+NTSTATUS CUsbDkControlDevice::RemoveRedirect(const USB_DK_DEVICE_ID &DeviceId, bool SoftRelease)
 {
     if (NotifyRedirectorRemovalStarted(DeviceId))
     {
-        auto res = ResetUsbDevice(DeviceId);
-        if (NT_SUCCESS(res))
+        auto res = STATUS_SUCCESS;
+
+        if (!SoftRelease || !SoftReleaseUsbDevice(DeviceId))
         {
-            if (!WaitForDetachment(DeviceId))
+            res = ResetUsbDevice(DeviceId);
+            if (NT_SUCCESS(res))
             {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Wait for redirector detachment failed.");
-                return STATUS_DEVICE_NOT_CONNECTED;
+                if (!WaitForDetachment(DeviceId))
+                {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Wait for redirector detachment failed.");
+                    return STATUS_DEVICE_NOT_CONNECTED;
+                }
+            }
+            else if (res != STATUS_NOT_FOUND)
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Usb device reset failed.");
+                return res;
             }
-        }
-        else if (res != STATUS_NOT_FOUND)
-        {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Usb device reset failed.");
-            return res;
         }
 
         if (!m_Redirections.Delete(&DeviceId))
@@ -925,7 +2014,50 @@ bool CUsbDkControlDevice::NotifyRedirectorRemovalStarted(const USB_DK_DEVICE_ID
     return m_Redirections.ModifyOne(&ID, [](CUsbDkRedirection *R){ R->NotifyRedirectionRemovalStarted(); });
 }
 
-bool CUsbDkControlDevice::WaitForDetachment(const USB_DK_DEVICE_ID &ID)
+bool CUsbDkControlDevice::SoftReleaseUsbDevice(const USB_DK_DEVICE_ID &DeviceID)
+{
+    PDEVICE_OBJECT HubPDO = nullptr;
+
+    EnumUsbDevicesByID(DeviceID,
+                       [&HubPDO](CUsbDkChildDevice *Child) -> bool
+                       {
+                           if (Child->RequestSoftRelease())
+                           {
+                               HubPDO = Child->ParentPDO();
+                               ObReferenceObject(HubPDO);
+                           }
+                           return false;
+                       });
+
+    if (HubPDO == nullptr)
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_CONTROLDEVICE, "%!FUNC! Redirected device not found, falling back to reset");
+        return false;
+    }
+
+    IoInvalidateDeviceRelations(HubPDO, BusRelations);
+    ObDereferenceObject(HubPDO);
+
+    // Without reset device returns to the system within
+    // two bus relations queries of its hub
+    if (!WaitForDetachment(DeviceID, -SecondsTo100Nanoseconds(10)))
+    {
+        EnumUsbDevicesByID(DeviceID,
+                           [](CUsbDkChildDevice *Child) -> bool
+                           {
+                               Child->CancelSoftRelease();
+                               return false;
+                           });
+
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_CONTROLDEVICE, "%!FUNC! Soft release timed out, falling back to reset");
+        return false;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Device released without reset");
+    return true;
+}
+
+bool CUsbDkControlDevice::WaitForDetachment(const USB_DK_DEVICE_ID &ID, LONGLONG Timeout)
 {
     CUsbDkRedirection *Redirection;
     auto res = m_Redirections.ModifyOne(&ID, [&Redirection](CUsbDkRedirection *R)
@@ -936,7 +2068,7 @@ bool CUsbDkControlDevice::WaitForDetachment(const USB_DK_DEVICE_ID &ID)
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_WDFDEVICE, "%!FUNC! object was not found.");
         return res;
     }
-    res = Redirection->WaitForDetachment();
+    res = Redirection->WaitForDetachment(Timeout);
     Redirection->Release();
 
     return res;
@@ -944,20 +2076,22 @@ bool CUsbDkControlDevice::WaitForDetachment(const USB_DK_DEVICE_ID &ID)
 
 NTSTATUS CUsbDkRedirection::Create(const USB_DK_DEVICE_ID &Id)
 {
-    auto status = m_DeviceID.Create(Id.DeviceID);
-    if (!NT_SUCCESS(status))
-    {
-        return status;
-    }
+    m_Identity = CUsbDkIdentityPool::Intern(Id.DeviceID, Id.InstanceID);
+    return m_Identity ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
 
-    return m_InstanceID.Create(Id.InstanceID);
+NTSTATUS CUsbDkRedirection::Create(const CUsbDkChildDevice &Dev)
+{
+    Dev.Identity().Reference();
+    m_Identity = &Dev.Identity();
+    return STATUS_SUCCESS;
 }
 
 void CUsbDkRedirection::Dump() const
 {
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-                "%!FUNC! Redirect: DevID: %wZ, InstanceID: %wZ",
-                m_DeviceID, m_InstanceID);
+                "%!FUNC! Redirect: DevID: %ws, InstanceID: %ws",
+                m_Identity->DeviceID(), m_Identity->InstanceID());
 }
 
 void CUsbDkRedirection::NotifyRedirectorCreated(CUsbDkFilterDevice *RedirectorDevice)
@@ -975,9 +2109,9 @@ void CUsbDkRedirection::NotifyRedirectionRemovalStarted()
     m_RedirectionCreated.Clear();
 }
 
-bool CUsbDkRedirection::WaitForDetachment()
+bool CUsbDkRedirection::WaitForDetachment(LONGLONG Timeout)
 {
-    auto waitRes = m_RedirectionRemoved.Wait(true, -SecondsTo100Nanoseconds(120));
+    auto waitRes = m_RedirectionRemoved.Wait(true, Timeout);
     if ((waitRes == STATUS_TIMEOUT) || !NT_SUCCESS(waitRes))
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_WDFDEVICE, "%!FUNC! Wait of RedirectionRemoved event failed. %!STATUS!", waitRes);
@@ -989,20 +2123,34 @@ bool CUsbDkRedirection::WaitForDetachment()
 
 bool CUsbDkRedirection::operator==(const USB_DK_DEVICE_ID &Id) const
 {
-    return (m_DeviceID == Id.DeviceID) &&
-           (m_InstanceID == Id.InstanceID);
+    return m_Identity->Match(Id.DeviceID, Id.InstanceID);
 }
 
+// Identities are interned, equal identities are the same object
 bool CUsbDkRedirection::operator==(const CUsbDkChildDevice &Dev) const
 {
-    return (m_DeviceID == Dev.DeviceID()) &&
-           (m_InstanceID == Dev.InstanceID());
+    return static_cast<CUsbDkDeviceIdentity *>(m_Identity) == &Dev.Identity();
 }
 
 bool CUsbDkRedirection::operator==(const CUsbDkRedirection &Other) const
 {
-    return (m_DeviceID == Other.m_DeviceID) &&
-           (m_InstanceID == Other.m_InstanceID);
+    return static_cast<CUsbDkDeviceIdentity *>(m_Identity) ==
+           static_cast<CUsbDkDeviceIdentity *>(Other.m_Identity);
+}
+
+ULONG CUsbDkRedirection::HashOf(const USB_DK_DEVICE_ID &Id)
+{
+    return CUsbDkDeviceIdentity::HashOf(Id.DeviceID, Id.InstanceID);
+}
+
+ULONG CUsbDkRedirection::HashOf(const CUsbDkChildDevice &Dev)
+{
+    return Dev.Identity().Hash();
+}
+
+ULONG CUsbDkRedirection::HashOf(const CUsbDkRedirection &Redirection)
+{
+    return Redirection.m_Identity->Hash();
 }
 
 NTSTATUS CUsbDkRedirection::CreateRedirectorHandle(PHANDLE ObjectHandle)
@@ -1036,10 +2184,196 @@ NTSTATUS CUsbDkRedirection::CreateRedirectorHandle(PHANDLE ObjectHandle)
     return status;
 }
 
+static void ExportHideRuleMatcher(const CUsbDkHideRuleMatcher &Matcher, USB_DK_HIDE_RULE_MATCHER &Exported)
+{
+    auto Widen = [](ULONG Value) -> ULONG64
+    { return (Value == ULONG(-1)) ? USB_DK_HIDE_RULE_MATCH_ALL : Value; };
+
+    Exported.Min = Widen(Matcher.Min());
+    Exported.Max = Widen(Matcher.Max());
+    Exported.Mask = Widen(Matcher.Mask());
+}
+
+static ULONG64 ReadCounter(volatile LONG64 &Counter)
+{
+    return InterlockedCompareExchange64(&Counter, 0, 0);
+}
+
+void CUsbDkHideRule::Export(USB_DK_HIDE_RULE_STATISTICS &Statistics) const
+{
+    Statistics.Rule.Hide = m_Hide;
+    ExportHideRuleMatcher(m_Class, Statistics.Rule.Class);
+    ExportHideRuleMatcher(m_VID, Statistics.Rule.VID);
+    ExportHideRuleMatcher(m_PID, Statistics.Rule.PID);
+    ExportHideRuleMatcher(m_BCD, Statistics.Rule.BCD);
+    ExportHideRuleMatcher(m_Interfaces.Class(), Statistics.Rule.InterfaceClass);
+    ExportHideRuleMatcher(m_Interfaces.SubClass(), Statistics.Rule.InterfaceSubClass);
+    ExportHideRuleMatcher(m_Interfaces.Protocol(), Statistics.Rule.InterfaceProtocol);
+
+    Statistics.Hits = ReadCounter(m_Hits);
+    Statistics.LastHitTime = ReadCounter(m_LastHitTime);
+}
+
+void CUsbDkHideStatistics::Export(USB_DK_HIDE_STATISTICS &Statistics)
+{
+    Statistics.Decisions = ReadCounter(m_Decisions);
+    Statistics.HiddenDevices = ReadCounter(m_HiddenDevices);
+    Statistics.CachedDecisions = ReadCounter(m_CachedDecisions);
+    Statistics.DecisionsTime = ReadCounter(m_DecisionsTime);
+    Statistics.BusRelationsPasses = ReadCounter(m_BusRelationsPasses);
+    Statistics.BusRelationsTime = ReadCounter(m_BusRelationsTime);
+}
+
+CUsbDkDeviceListWriter::CUsbDkDeviceListWriter(USB_DK_DEVICE_LIST &List, size_t BufferLength, size_t MaxDevices)
+    : m_List(List)
+    , m_BufferLength(BufferLength)
+    , m_MaxDevices(MaxDevices)
+    , m_TotalLength(sizeof(List) + MaxDevices * sizeof(USB_DK_DEVICE_RECORD))
+    , m_Fits(m_TotalLength <= BufferLength)
+{
+    m_List.StringTableOffset = m_TotalLength;
+
+    // Strings are not looked up if the list does not fit anyway
+    if (m_Fits && (MaxDevices != 0))
+    {
+        m_StringEntries = new CDeviceListString[MaxDevices * 2];
+        if (!m_StringEntries)
+        {
+            TraceEvents(TRACE_LEVEL_WARNING, TRACE_CONTROLDEVICE, "%!FUNC! Cannot allocate strings map, strings are not deduplicated");
+        }
+    }
+}
+
+CUsbDkDeviceListWriter::~CUsbDkDeviceListWriter()
+{
+    // Entries are freed at once with their array
+    m_Strings.DetachAll([](CDeviceListString *) {});
+}
+
+bool CUsbDkDeviceListWriter::Add(CUsbDkChildDevice &Child)
+{
+    if (m_NumDevices == m_MaxDevices)
+    {
+        m_TooManyDevices = true;
+        return false;
+    }
+
+    auto DeviceIDOffset = AddString(Child.DeviceID());
+    auto InstanceIDOffset = AddString(Child.InstanceID());
+
+    // Space for records is checked on construction
+    if (m_Fits)
+    {
+        auto Record = UsbDkDeviceListRecord(&m_List, m_NumDevices);
+
+        Record->DeviceIDOffset = DeviceIDOffset;
+        Record->InstanceIDOffset = InstanceIDOffset;
+        Record->FilterID = Child.ParentID();
+        Record->Port = Child.Port();
+        Record->Speed = Child.Speed();
+        Record->DeviceDescriptor = Child.DeviceDescriptor();
+    }
+
+    m_NumDevices++;
+    return true;
+}
+
+ULONG64 CUsbDkDeviceListWriter::AddString(PCWCHAR String)
+{
+    // Lengths are with terminating null
+    auto Length = wcsnlen(String, NTSTRSAFE_UNICODE_STRING_MAX_CCH) + 1;
+    auto Table = UsbDkDeviceListString(&m_List, 0);
+
+    if (m_Fits && m_StringEntries)
+    {
+        CDeviceListString Key;
+        Key.Set(String, Length - 1);
+
+        ULONG64 Offset;
+        if (m_Strings.ModifyOne(&Key, [&Offset](CDeviceListString *Stored) { Offset = Stored->Offset; }))
+        {
+            return Offset;
+        }
+    }
+
+    auto Offset = m_TableLength;
+
+    m_TableLength += Length;
+    m_TotalLength += Length * sizeof(WCHAR);
+
+    if (m_Fits && (m_TotalLength <= m_BufferLength))
+    {
+        RtlCopyMemory(Table + Offset, String, (Length - 1) * sizeof(WCHAR));
+        Table[Offset + Length - 1] = L'\0';
+
+        // Map refers to the copy, children may go away meanwhile
+        if (m_StringEntries && (m_NumStringEntries < m_MaxDevices * 2))
+        {
+            auto Entry = &m_StringEntries[m_NumStringEntries++];
+            Entry->Set(Table + Offset, Length - 1);
+            Entry->Offset = Offset;
+            m_Strings.Add(Entry);
+        }
+    }
+    else
+    {
+        m_Fits = false;
+    }
+
+    return Offset;
+}
+
+NTSTATUS CUsbDkDeviceListWriter::Finish(size_t &OutputLength)
+{
+    m_List.TotalLength = m_TotalLength;
+    m_List.NumDevices = m_NumDevices;
+
+    // Once out of space strings are not looked up anymore,
+    // so TotalLength is enough for the list written again
+    if (!m_Fits || m_TooManyDevices)
+    {
+        OutputLength = sizeof(m_List);
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    OutputLength = m_TotalLength;
+    return STATUS_SUCCESS;
+}
+
 void CUsbDkHideRule::Dump() const
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Hide: %!bool!, C: %08X, V: %08X, P: %08X, BCD: %08X",
-                m_Hide, m_Class, m_VID, m_PID, m_BCD);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+                "%!FUNC! Hide: %!bool!, C: %08X-%08X/%08X, V: %08X-%08X/%08X, P: %08X-%08X/%08X, BCD: %08X-%08X/%08X",
+                m_Hide,
+                m_Class.Min(), m_Class.Max(), m_Class.Mask(),
+                m_VID.Min(), m_VID.Max(), m_VID.Mask(),
+                m_PID.Min(), m_PID.Max(), m_PID.Mask(),
+                m_BCD.Min(), m_BCD.Max(), m_BCD.Mask());
+
+    if (UsesInterfaces())
+    {
+        m_Interfaces.Dump();
+    }
+}
+
+void CUsbDkInterfaceMatcher::Dump() const
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+                "%!FUNC! Interface C: %08X-%08X/%08X, SC: %08X-%08X/%08X, P: %08X-%08X/%08X",
+                m_Class.Min(), m_Class.Max(), m_Class.Mask(),
+                m_SubClass.Min(), m_SubClass.Max(), m_SubClass.Mask(),
+                m_Protocol.Min(), m_Protocol.Max(), m_Protocol.Mask());
+}
+
+void CUsbDkRedirectRule::Dump() const
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! C: %08X, V: %08X, P: %08X, BCD: %08X, Port: %08X",
+                m_Class, m_VID, m_PID, m_BCD, m_Port);
+
+    if (UsesInterfaces())
+    {
+        m_Interfaces.Dump();
+    }
 }
 
 void CDriverParamsRegistryPath::CreateFrom(PCUNICODE_STRING DriverRegPath)
@@ -26,14 +26,20 @@
 #include "WdfDevice.h"
 #include "Alloc.h"
 #include "UsbDkUtil.h"
+#include "MemoryBuffer.h"
 #include "FilterDevice.h"
 #include "HiderDevice.h"
 #include "UsbDkDataHider.h"
 #include "HideRulesRegPublic.h"
+#include "HideRules.h"
 
 typedef struct tag_USB_DK_DEVICE_ID USB_DK_DEVICE_ID;
 typedef struct tag_USB_DK_DEVICE_INFO USB_DK_DEVICE_INFO;
+typedef struct tag_USB_DK_REDIRECT_RESULT USB_DK_REDIRECT_RESULT;
 typedef struct tag_USB_DK_CONFIG_DESCRIPTOR_REQUEST USB_DK_CONFIG_DESCRIPTOR_REQUEST;
+typedef struct tag_USB_DK_DEVICE_DESCRIPTORS USB_DK_DEVICE_DESCRIPTORS;
+typedef struct tag_USB_DK_DEVICE_STRINGS USB_DK_DEVICE_STRINGS;
+typedef struct tag_USB_DK_REDIRECT_RULE USB_DK_REDIRECT_RULE;
 class CUsbDkFilterDevice;
 class CWdfRequest;
 
@@ -56,6 +62,12 @@ private:
     static void UpdateRegistryParameters(CWdfRequest &Request, WDFQUEUE Queue);
     static void EnumerateDevices(CWdfRequest &Request, WDFQUEUE Queue);
     static void GetConfigurationDescriptor(CWdfRequest &Request, WDFQUEUE Queue);
+    static void GetAllDescriptors(CWdfRequest &Request, WDFQUEUE Queue);
+    static void GetDeviceStrings(CWdfRequest &Request, WDFQUEUE Queue);
+    static void AddRedirectRule(CWdfRequest &Request, WDFQUEUE Queue);
+    static void ClearRedirectRules(CWdfRequest &Request, WDFQUEUE Queue);
+    static void GetMemoryStatistics(CWdfRequest &Request);
+    static void EnumerateDevicesV2(CWdfRequest &Request, WDFQUEUE Queue);
 
     typedef NTSTATUS(CUsbDkControlDevice::*USBDevControlMethod)(const USB_DK_DEVICE_ID&);
     static void DoUSBDeviceOp(CWdfRequest &Request, WDFQUEUE Queue, USBDevControlMethod Method);
@@ -73,45 +85,146 @@ private:
     CUsbDkControlDeviceQueue& operator= (const CUsbDkControlDeviceQueue&) = delete;
 };
 
-class CUsbDkHideRule : public CAllocatable < NonPagedPool, 'RHHR' >
+// Hide decisions statistics, updated without locks
+class CUsbDkHideStatistics
+{
+public:
+    void CountDecision(bool Hide, bool Cached, ULONG64 Time)
+    {
+        InterlockedIncrement64(&m_Decisions);
+        if (Hide)
+        {
+            InterlockedIncrement64(&m_HiddenDevices);
+        }
+        if (Cached)
+        {
+            InterlockedIncrement64(&m_CachedDecisions);
+        }
+        InterlockedExchangeAdd64(&m_DecisionsTime, Time);
+    }
+
+    void CountBusRelationsPass(ULONG64 Time)
+    {
+        InterlockedIncrement64(&m_BusRelationsPasses);
+        InterlockedExchangeAdd64(&m_BusRelationsTime, Time);
+    }
+
+    void Export(USB_DK_HIDE_STATISTICS &Statistics);
+
+private:
+    volatile LONG64 m_Decisions = 0;
+    volatile LONG64 m_HiddenDevices = 0;
+    volatile LONG64 m_CachedDecisions = 0;
+    volatile LONG64 m_DecisionsTime = 0;
+    volatile LONG64 m_BusRelationsPasses = 0;
+    volatile LONG64 m_BusRelationsTime = 0;
+};
+
+// String of the device list table, keyed by its contents
+class CDeviceListString : public CAllocatable<NonPagedPool, 'SLHR'>
+{
+public:
+    void Set(PCWCHAR String, size_t Length)
+    {
+        m_String = String;
+        m_Length = Length;
+        m_Hash = UsbDkHashChars(String, Length);
+    }
+
+    PCWCHAR String() const { return m_String; }
+    size_t Length() const { return m_Length; }
+
+    bool operator== (const CDeviceListString &Other) const
+    {
+        return (m_Length == Other.m_Length) &&
+               RtlEqualMemory(m_String, Other.m_String, m_Length * sizeof(WCHAR));
+    }
+
+    static ULONG HashOf(const CDeviceListString &String)
+    { return String.m_Hash; }
+
+    ULONG64 Offset = 0;
+
+private:
+    PCWCHAR m_String = nullptr;
+    size_t m_Length = 0;
+    ULONG m_Hash = 0;
+
+    DECLARE_CWDMLIST_ENTRY(CDeviceListString);
+};
+
+// Writes compact device list into the output buffer.
+// Records are written after the header, strings go to the table
+// following MaxDevices records. Strings already in the table are
+// found via hash map living for one enumeration, so each string
+// is stored once as long as the list fits the buffer.
+class CUsbDkDeviceListWriter
+{
+public:
+    CUsbDkDeviceListWriter(USB_DK_DEVICE_LIST &List, size_t BufferLength, size_t MaxDevices);
+    ~CUsbDkDeviceListWriter();
+
+    // False if there are more devices than the list was sized for
+    bool Add(CUsbDkChildDevice &Child);
+    NTSTATUS Finish(size_t &OutputLength);
+
+private:
+    ULONG64 AddString(PCWCHAR String);
+
+    USB_DK_DEVICE_LIST &m_List;
+    size_t m_BufferLength;
+    size_t m_MaxDevices;
+    size_t m_NumDevices = 0;
+    size_t m_TotalLength;
+    ULONG64 m_TableLength = 0;
+    bool m_Fits;
+    bool m_TooManyDevices = false;
+
+    // Two strings per device at most, allocated at once
+    CObjHolder<CDeviceListString, CVectorDeleter<CDeviceListString> > m_StringEntries;
+    size_t m_NumStringEntries = 0;
+    CWdmHashMap<CDeviceListString, CRawAccess, CNonCountingObject> m_Strings;
+};
+
+class CUsbDkRedirectRule : public CAllocatable < NonPagedPool, 'RRHR' >
 {
 public:
 
-    CUsbDkHideRule(bool Hide, ULONG Class, ULONG VID, ULONG PID, ULONG BCD)
-        : m_Hide(Hide)
-        , m_Class(Class)
+    CUsbDkRedirectRule(ULONG Class, ULONG VID, ULONG PID, ULONG BCD, ULONG Port,
+                       const CUsbDkInterfaceMatcher &Interfaces)
+        : m_Class(Class)
         , m_VID(VID)
         , m_PID(PID)
         , m_BCD(BCD)
+        , m_Port(Port)
+        , m_Interfaces(Interfaces)
     {}
 
-    bool Match(const USB_DEVICE_DESCRIPTOR &Descriptor) const
+    bool Match(const CUsbDkChildDevice &Device) const
     {
+        const auto &Descriptor = Device.DeviceDescriptor();
+
         return MatchCharacteristic(m_Class, Descriptor.bDeviceClass) &&
                MatchCharacteristic(m_VID, Descriptor.idVendor)       &&
                MatchCharacteristic(m_PID, Descriptor.idProduct)      &&
-               MatchCharacteristic(m_BCD, Descriptor.bcdDevice);
+               MatchCharacteristic(m_BCD, Descriptor.bcdDevice)      &&
+               MatchCharacteristic(m_Port, Device.Port())            &&
+               m_Interfaces.Match(Device);
     }
 
-    bool ShouldHide() const
+    bool UsesInterfaces() const
     {
-        return m_Hide;
+        return !m_Interfaces.MatchesAll();
     }
 
-    bool ForceDecision() const
+    bool operator ==(const CUsbDkRedirectRule &Other) const
     {
-        //All do-not-hide rules are terminal
-        return !m_Hide;
-    }
-
-    bool operator ==(const CUsbDkHideRule &Other) const
-    {
-        return m_Hide == Other.m_Hide   &&
-               m_Class == Other.m_Class &&
+        return m_Class == Other.m_Class &&
                m_VID == Other.m_VID     &&
                m_PID == Other.m_PID     &&
-               m_BCD == Other.m_BCD;
-
+               m_BCD == Other.m_BCD     &&
+               m_Port == Other.m_Port   &&
+               m_Interfaces == Other.m_Interfaces;
     }
 
     void Dump() const;
@@ -123,16 +236,18 @@ private:
                (CharacteristicValue == CharacteristicFilter);
     }
 
-    bool    m_Hide;
     ULONG   m_Class;
     ULONG   m_VID;
     ULONG   m_PID;
     ULONG   m_BCD;
+    ULONG   m_Port;
+    CUsbDkInterfaceMatcher m_Interfaces;
 
-    DECLARE_CWDMLIST_ENTRY(CUsbDkHideRule);
+    DECLARE_CWDMLIST_ENTRY(CUsbDkRedirectRule);
 };
 
-class CUsbDkRedirection : public CAllocatable<NonPagedPool, 'NRHR'>, public CWdmRefCountingObject
+class CUsbDkRedirection : public CLookasideAllocatable<CUsbDkRedirection, NonPagedPool, 'NRHR', 32>,
+                          public CWdmRefCountingObject
 {
 public:
     enum : ULONG
@@ -141,11 +256,16 @@ public:
     };
 
     NTSTATUS Create(const USB_DK_DEVICE_ID &Id);
+    NTSTATUS Create(const CUsbDkChildDevice &Dev);
 
     bool operator==(const USB_DK_DEVICE_ID &Id) const;
     bool operator==(const CUsbDkChildDevice &Dev) const;
     bool operator==(const CUsbDkRedirection &Other) const;
 
+    static ULONG HashOf(const USB_DK_DEVICE_ID &Id);
+    static ULONG HashOf(const CUsbDkChildDevice &Dev);
+    static ULONG HashOf(const CUsbDkRedirection &Redirection);
+
     void Dump() const;
 
     void NotifyRedirectorCreated(CUsbDkFilterDevice *RedirectorDevice);
@@ -159,10 +279,35 @@ public:
     bool IsPreparedForRemove() const
     { return m_RemovalInProgress; }
 
-    NTSTATUS WaitForAttachment()
-    { return m_RedirectionCreated.Wait(true, -SecondsTo100Nanoseconds(120)); }
+    // Automatic redirection is created by redirect rule on device arrival,
+    // redirector handle is given to the first process asking for it
+    void MarkAutomatic()
+    { m_Automatic = true; }
+
+    bool IsAutomatic() const
+    { return m_Automatic; }
 
-    bool WaitForDetachment();
+    bool IsClaimed() const
+    { return m_Claimed; }
+
+    bool Claim()
+    {
+        if (!m_Automatic || m_Claimed || m_RemovalInProgress)
+        {
+            return false;
+        }
+
+        m_Claimed = true;
+        return true;
+    }
+
+    void Unclaim()
+    { m_Claimed = false; }
+
+    NTSTATUS WaitForAttachment(LONGLONG Timeout = -SecondsTo100Nanoseconds(120))
+    { return m_RedirectionCreated.Wait(true, Timeout); }
+
+    bool WaitForDetachment(LONGLONG Timeout = -SecondsTo100Nanoseconds(120));
 
     NTSTATUS CreateRedirectorHandle(PHANDLE ObjectHandle);
 
@@ -171,14 +316,15 @@ protected:
     { delete this; }
 
 private:
-    CString m_DeviceID;
-    CString m_InstanceID;
+    TDeviceIdentityHolder m_Identity;
 
     CWdmEvent m_RedirectionCreated;
     CWdmEvent m_RedirectionRemoved;
     CUsbDkFilterDevice *m_RedirectorDevice = nullptr;
 
     bool m_RemovalInProgress = false;
+    bool m_Automatic = false;
+    bool m_Claimed = false;
 
     DECLARE_CWDMLIST_ENTRY(CUsbDkRedirection);
 };
@@ -218,23 +364,69 @@ public:
 
     ULONG CountDevices();
     NTSTATUS RescanRegistry()
-    { return ReloadPersistentHideRules(); }
+    {
+        TExclusiveLocker Locker(m_StateLock);
+
+        auto status = ReloadPersistentHideRules();
+        auto redirectStatus = ReloadPersistentRedirectRules();
+        return NT_SUCCESS(status) ? redirectStatus : status;
+    }
+    NTSTATUS UpdatePersistentHideRules(const USB_DK_HIDE_RULE_UPDATE &Update);
 
     bool EnumerateDevices(USB_DK_DEVICE_INFO *outBuff, size_t numberAllocatedDevices, size_t &numberExistingDevices);
+    NTSTATUS EnumerateDevices(USB_DK_DEVICE_LIST &List, size_t BufferLength, size_t &OutputLength);
     NTSTATUS ResetUsbDevice(const USB_DK_DEVICE_ID &DeviceId);
     NTSTATUS AddRedirect(const USB_DK_DEVICE_ID &DeviceId, PHANDLE ObjectHandle);
+    NTSTATUS AddRedirectBatch(const USB_DK_DEVICE_ID *DeviceIds, USB_DK_REDIRECT_RESULT *Results, size_t NumDevices);
 
     NTSTATUS AddHideRule(const USB_DK_HIDE_RULE &UsbDkRule)
-    { return AddHideRuleToSet(UsbDkRule, m_HideRules); }
-    NTSTATUS AddPersistentHideRule(const USB_DK_HIDE_RULE &UsbDkRule)
+    {
+        USB_DK_HIDE_RULE_V2 UsbDkRuleV2;
+        HideRuleV2FromV1(UsbDkRule, UsbDkRuleV2);
+        return AddHideRule(UsbDkRuleV2);
+    }
+
+    NTSTATUS AddHideRule(const USB_DK_HIDE_RULE_V2 &UsbDkRule)
+    {
+        TExclusiveLocker Locker(m_StateLock);
+
+        auto status = AddHideRuleToSet(UsbDkRule, m_HideRules);
+        if (NT_SUCCESS(status))
+        {
+            RebuildHideRulesIndex();
+        }
+        return status;
+    }
+
+    NTSTATUS AddPersistentHideRule(const USB_DK_HIDE_RULE_V2 &UsbDkRule)
     { return AddHideRuleToSet(UsbDkRule, m_PersistentHideRules); }
 
     void ClearHideRules();
+    NTSTATUS ReplaceHideRules(const USB_DK_HIDE_RULE_V2 *UsbDkRules, size_t NumRules);
+    void GetHideStatistics(USB_DK_HIDE_STATISTICS &Statistics, size_t MaxRules, size_t &NumRulesReturned);
+    void CountBusRelationsPass(ULONG64 Time)
+    { m_HideStatistics.CountBusRelationsPass(Time); }
+
+    NTSTATUS AddRedirectRule(const USB_DK_REDIRECT_RULE &UsbDkRule)
+    {
+        TExclusiveLocker Locker(m_StateLock);
+        return AddRedirectRuleToSet(UsbDkRule, m_RedirectRules);
+    }
+    NTSTATUS AddPersistentRedirectRule(const USB_DK_REDIRECT_RULE &UsbDkRule)
+    { return AddRedirectRuleToSet(UsbDkRule, m_PersistentRedirectRules); }
 
-    NTSTATUS RemoveRedirect(const USB_DK_DEVICE_ID &DeviceId);
+    void ClearRedirectRules();
+
+    NTSTATUS RemoveRedirect(const USB_DK_DEVICE_ID &DeviceId, bool SoftRelease = false);
     NTSTATUS GetConfigurationDescriptor(const USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request,
                                         PUSB_CONFIGURATION_DESCRIPTOR Descriptor,
                                         size_t *OutputBuffLen);
+    NTSTATUS GetAllDescriptors(const USB_DK_DEVICE_ID &DeviceID,
+                               USB_DK_DEVICE_DESCRIPTORS *Descriptors,
+                               size_t *OutputBuffLen);
+    NTSTATUS GetDeviceStrings(const USB_DK_DEVICE_ID &DeviceID,
+                              USB_DK_DEVICE_STRINGS *Strings,
+                              size_t *OutputBuffLen);
 
     static bool Allocate();
     static void Deallocate()
@@ -252,7 +444,11 @@ public:
         return !DontRedirect;
     }
 
-    bool ShouldHide(const USB_DEVICE_DESCRIPTOR &DevDescriptor) const;
+    bool ShouldHide(const CUsbDkChildDevice &Dev);
+    bool ShouldAutoRedirect(const CUsbDkChildDevice &Dev) const;
+    bool HasInterfaceRules() const;
+    NTSTATUS AddAutoRedirection(const CUsbDkChildDevice &Dev);
+    void DropAutoRedirection(const CUsbDkChildDevice &Dev);
 
     template <typename TDevID>
     void NotifyRedirectionRemoved(const TDevID &Dev) const
@@ -263,26 +459,59 @@ public:
 
     bool NotifyRedirectorAttached(CRegText *DeviceID, CRegText *InstanceID, CUsbDkFilterDevice *RedirectorDevice);
     bool NotifyRedirectorRemovalStarted(const USB_DK_DEVICE_ID &ID);
-    bool WaitForDetachment(const USB_DK_DEVICE_ID &ID);
+    bool WaitForDetachment(const USB_DK_DEVICE_ID &ID, LONGLONG Timeout = -SecondsTo100Nanoseconds(120));
 
 private:
     NTSTATUS ReloadPersistentHideRules();
+    NTSTATUS ReloadPersistentRedirectRules();
+    static NTSTATUS IsPersistentHideRuleStored(const USB_DK_HIDE_RULE_V2 &UsbDkRule, bool &Stored);
+    NTSTATUS ApplyPersistentHideRuleUpdate(const USB_DK_HIDE_RULE_UPDATE &Update, CUsbDkHideRule *Rule, bool &Applied);
 
     CObjHolder<CUsbDkControlDeviceQueue> m_DeviceQueue;
     static CRefCountingHolder<CUsbDkControlDevice> *m_UsbDkControlDevice;
 
     CObjHolder<CUsbDkHiderDevice, CWdfDeviceDeleter<CUsbDkHiderDevice> > m_HiderDevice;
 
-    CWdmList<CUsbDkFilterDevice, CLockedAccess, CNonCountingObject> m_FilterDevices;
+    // Control queue is dispatched in parallel, this lock serializes
+    // changes of hide and redirect rule sets and registry rescans.
+    // Children lists and redirections are not covered, they are
+    // changed by hub filters and redirection requests under their
+    // own locks, so shared holders see each list consistent only
+    CWdmRWLock m_StateLock;
+
+    // Walked by every enumeration request, changed only when
+    // hubs come and go
+    CWdmList<CUsbDkFilterDevice, CRcuAccess, CNonCountingObject> m_FilterDevices;
 
-    typedef CWdmSet<CUsbDkRedirection, CLockedAccess, CNonCountingObject> RedirectionsSet;
+    typedef CWdmHashMap<CUsbDkRedirection, CLockedAccess, CNonCountingObject> RedirectionsSet;
     RedirectionsSet m_Redirections;
 
     typedef CWdmSet<CUsbDkHideRule, CLockedAccess, CNonCountingObject> HideRulesSet;
     HideRulesSet m_HideRules;
     HideRulesSet m_PersistentHideRules;
 
-    NTSTATUS AddHideRuleToSet(const USB_DK_HIDE_RULE &UsbDkRule, HideRulesSet &Set);
+    static CUsbDkHideRule *CreateHideRule(const USB_DK_HIDE_RULE_V2 &UsbDkRule);
+    NTSTATUS AddHideRuleToSet(const USB_DK_HIDE_RULE_V2 &UsbDkRule, HideRulesSet &Set);
+
+    // Index is rebuilt whenever hide rules change and looked up
+    // without locks, if there is no index rules are walked
+    CWdmSnapshot<CUsbDkHideRulesIndex> m_HideRulesIndex;
+    void RebuildHideRulesIndex();
+    bool EvaluateHideRules(const CUsbDkChildDevice &Dev, bool &Cached);
+
+    // Rules dropped from the sets may still be referenced by
+    // published index, they are destroyed when index is rebuilt
+    CWdmList<CUsbDkHideRule, CRawAccess, CNonCountingObject> m_RetiredHideRules;
+    void RetireHideRule(CUsbDkHideRule *Rule)
+    { m_RetiredHideRules.PushBack(Rule); }
+
+    CUsbDkHideStatistics m_HideStatistics;
+
+    typedef CWdmSet<CUsbDkRedirectRule, CLockedAccess, CNonCountingObject> RedirectRulesSet;
+    RedirectRulesSet m_RedirectRules;
+    RedirectRulesSet m_PersistentRedirectRules;
+
+    NTSTATUS AddRedirectRuleToSet(const USB_DK_REDIRECT_RULE &UsbDkRule, RedirectRulesSet &Set);
 
     template <typename TPredicate, typename TFunctor>
     bool UsbDevicesForEachIf(TPredicate Predicate, TFunctor Functor)
@@ -293,10 +522,15 @@ private:
     PDEVICE_OBJECT GetPDOByDeviceID(const USB_DK_DEVICE_ID &DeviceID);
 
     bool UsbDeviceExists(const USB_DK_DEVICE_ID &ID);
+    NTSTATUS WaitForDescriptors(const USB_DK_DEVICE_ID &ID);
+    bool SoftReleaseUsbDevice(const USB_DK_DEVICE_ID &DeviceID);
 
     static void ContextCleanup(_In_ WDFOBJECT DeviceObject);
     NTSTATUS AddDeviceToSet(const USB_DK_DEVICE_ID &DeviceId, CUsbDkRedirection **NewRedirection);
     void AddRedirectRollBack(const USB_DK_DEVICE_ID &DeviceId, bool WithReset);
+    NTSTATUS ClaimAutoRedirection(const USB_DK_DEVICE_ID &DeviceId, PHANDLE RedirectorDevice);
+
+    class CRedirectBatchSteps;
 
     NTSTATUS GetUsbDeviceConfigurationDescriptor(const USB_DK_DEVICE_ID &DeviceID,
                                                  UCHAR DescriptorIndex,
@@ -305,6 +539,10 @@ private:
 
     static void IoInCallerContext(WDFDEVICE Device, WDFREQUEST Request);
     static bool FetchBuffersForAddRedirectRequest(CWdfRequest &WdfRequest, PUSB_DK_DEVICE_ID &DeviceId, PULONG64 &RedirectorDevice);
+    static bool FetchBuffersForAddRedirectBatchRequest(CWdfRequest &WdfRequest,
+                                                       USB_DK_DEVICE_ID *&DeviceIds,
+                                                       USB_DK_REDIRECT_RESULT *&Results,
+                                                       size_t &NumDevices);
 
     friend class CUsbDkControlDeviceInit;
 };
@@ -0,0 +1,129 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+
+#include "stdafx.h"
+#include "DescriptorStore.h"
+
+CUsbDkDescriptorStore::CStore *CUsbDkDescriptorStore::m_Store = nullptr;
+
+CUsbDkDescriptorSet::CKey::CKey(TDescriptors &Descriptors)
+    : Descriptors(Descriptors)
+    , Hash(UsbDkHashBytes(Descriptors.Data(), Descriptors.DataSize()))
+{}
+
+CUsbDkDescriptorSet::CUsbDkDescriptorSet(CKey &Key)
+    : m_Descriptors(0)
+    , m_Hash(Key.Hash)
+{
+    m_Descriptors = Key.Descriptors;
+}
+
+bool CUsbDkDescriptorSet::operator ==(const CKey &Key)
+{
+    // Offsets table is a function of descriptor lengths,
+    // so equal arenas mean equal descriptor sets
+    return (m_Hash == Key.Hash)                                    &&
+           (m_Descriptors.DataSize() == Key.Descriptors.DataSize()) &&
+           RtlEqualMemory(m_Descriptors.Data(), Key.Descriptors.Data(), m_Descriptors.DataSize());
+}
+
+void CUsbDkDescriptorSet::Release()
+{
+    CUsbDkDescriptorStore::Release(this);
+}
+
+bool CUsbDkDescriptorStore::Create()
+{
+    m_Store = new CStore;
+    return m_Store != nullptr;
+}
+
+void CUsbDkDescriptorStore::Destroy()
+{
+    delete m_Store;
+    m_Store = nullptr;
+}
+
+CUsbDkDescriptorSet *CUsbDkDescriptorStore::Intern(CUsbDkDescriptorSet::TDescriptors &Descriptors)
+{
+    CUsbDkDescriptorSet::CKey Key(Descriptors);
+    CUsbDkDescriptorSet *Set = nullptr;
+
+    TSpinLocker Locker(m_Store->Lock);
+
+    if (m_Store->Sets.ModifyOne(&Key, [&Set](CUsbDkDescriptorSet *Existing)
+                                      {
+                                          Existing->Reference();
+                                          Set = Existing;
+                                      }))
+    {
+        m_Store->References++;
+        m_Store->SharedBytes += Set->AllocationSize();
+        return Set;
+    }
+
+    Set = new CUsbDkDescriptorSet(Key);
+    if (Set != nullptr)
+    {
+        m_Store->Sets.Add(Set);
+        m_Store->NumSets++;
+        m_Store->References++;
+        m_Store->StoredBytes += Set->AllocationSize();
+    }
+
+    return Set;
+}
+
+void CUsbDkDescriptorStore::Release(CUsbDkDescriptorSet *Set)
+{
+    // Last reference is dropped under the store lock, so
+    // Intern() cannot pick up set being destroyed
+    {
+        TSpinLocker Locker(m_Store->Lock);
+
+        m_Store->References--;
+
+        if (InterlockedDecrement(&Set->m_References) != 0)
+        {
+            m_Store->SharedBytes -= Set->AllocationSize();
+            return;
+        }
+
+        m_Store->Sets.Detach(Set, [](CUsbDkDescriptorSet *) {});
+        m_Store->NumSets--;
+        m_Store->StoredBytes -= Set->AllocationSize();
+    }
+
+    delete Set;
+}
+
+void CUsbDkDescriptorStore::GetStatistics(USB_DK_MEMORY_STATISTICS &Statistics)
+{
+    TSpinLocker Locker(m_Store->Lock);
+
+    Statistics.DescriptorSets = m_Store->NumSets;
+    Statistics.DescriptorSetReferences = m_Store->References;
+    Statistics.DescriptorBytes = m_Store->StoredBytes;
+    Statistics.SharedDescriptorBytes = m_Store->SharedBytes;
+}
@@ -0,0 +1,137 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+
+#pragma once
+
+#include "Alloc.h"
+#include "UsbDkUtil.h"
+#include "Public.h"
+
+class CUsbDkDescriptorStore;
+
+// Configuration descriptors of a device.
+// Sets are interned by CUsbDkDescriptorStore, devices of the same
+// model reporting byte-identical descriptors share one set.
+class CUsbDkDescriptorSet : public CAllocatable<NonPagedPool, 'SDHR'>
+{
+public:
+    typedef CBufferArena<NonPagedPool, 'CCHR', UCHAR> TDescriptors;
+
+    size_t NumConfigurations()
+    { return m_Descriptors.Size(); }
+    size_t ConfigurationDescriptorSize(size_t Index)
+    { return m_Descriptors.EntrySize(Index); }
+    void CopyConfigurationDescriptor(size_t Index, PVOID Buffer, size_t BufferLength)
+    { m_Descriptors.CopyEntry(Index, Buffer, BufferLength); }
+
+    void Reference()
+    { InterlockedIncrement(&m_References); }
+    void Release();
+
+private:
+    class CKey
+    {
+    public:
+        CKey(TDescriptors &Descriptors);
+
+        TDescriptors &Descriptors;
+        ULONG Hash;
+    };
+
+    CUsbDkDescriptorSet(CKey &Key);
+
+    // Memory the set takes, with the object itself
+    size_t AllocationSize()
+    { return sizeof(*this) + m_Descriptors.DataSize(); }
+
+    bool operator ==(const CKey &Key);
+    bool operator ==(CUsbDkDescriptorSet &Other)
+    { return (this == &Other) || (*this == CKey(Other.m_Descriptors)); }
+    static ULONG HashOf(const CKey &Key)
+    { return Key.Hash; }
+    static ULONG HashOf(const CUsbDkDescriptorSet &Set)
+    { return Set.m_Hash; }
+
+    TDescriptors m_Descriptors;
+    ULONG m_Hash;
+    volatile LONG m_References = 1;
+
+    CUsbDkDescriptorSet(const CUsbDkDescriptorSet&) = delete;
+    CUsbDkDescriptorSet& operator= (const CUsbDkDescriptorSet&) = delete;
+
+    friend class CUsbDkDescriptorStore;
+    DECLARE_CWDMLIST_ENTRY(CUsbDkDescriptorSet);
+};
+
+class CUsbDkDescriptorSetDeleter
+{
+public:
+    static void destroy(CUsbDkDescriptorSet *Set)
+    {
+        if (Set != nullptr)
+        {
+            Set->Release();
+        }
+    }
+};
+
+typedef CObjHolder<CUsbDkDescriptorSet, CUsbDkDescriptorSetDeleter> TDescriptorSetHolder;
+
+// Driver-wide store of descriptor sets, lives from DriverEntry
+// to DriverUnload, so sets may be held by any object.
+// Descriptors are copied out under children list spinlocks,
+// so sets are kept in non-paged pool.
+class CUsbDkDescriptorStore final
+{
+public:
+    // Takes descriptors over if no identical set is stored yet,
+    // returns referenced set or nullptr if out of memory
+    static CUsbDkDescriptorSet *Intern(CUsbDkDescriptorSet::TDescriptors &Descriptors);
+
+    static void GetStatistics(USB_DK_MEMORY_STATISTICS &Statistics);
+
+private:
+    static bool Create();
+    static void Destroy();
+    static void Release(CUsbDkDescriptorSet *Set);
+
+    class CStore : public CAllocatable<NonPagedPool, 'TSHR'>
+    {
+    public:
+        CWdmSpinLock Lock;
+        CWdmHashMap<CUsbDkDescriptorSet, CRawAccess, CNonCountingObject> Sets;
+
+        // Counted under the lock
+        ULONG64 NumSets = 0;
+        ULONG64 References = 0;
+        ULONG64 StoredBytes = 0;
+        ULONG64 SharedBytes = 0;
+    };
+
+    static CStore *m_Store;
+
+    friend class CUsbDkDescriptorSet;
+    friend NTSTATUS DriverEntry(PDRIVER_OBJECT, PUNICODE_STRING);
+    friend VOID DriverUnload(IN WDFDRIVER Driver);
+};
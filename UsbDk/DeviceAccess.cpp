@@ -266,6 +266,31 @@ NTSTATUS CWdmUsbDeviceAccess::GetConfigurationDescriptor(UCHAR Index, USB_CONFIG
     return STATUS_SUCCESS;
 }
 
+NTSTATUS CWdmUsbDeviceAccess::GetStringDescriptor(UCHAR Index, USHORT LanguageID, USB_STRING_DESCRIPTOR &Descriptor, size_t Length)
+{
+    RtlZeroMemory(&Descriptor, Length);
+
+    URB Urb;
+    UsbDkBuildDescriptorRequest(Urb, USB_STRING_DESCRIPTOR_TYPE, Index, Descriptor, static_cast<ULONG>(Length), LanguageID);
+
+    auto status = UsbDkSendUrbSynchronously(m_DevObj, Urb);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVACCESS, "%!FUNC! Failed to retrieve string descriptor %d.", Index);
+        return status;
+    }
+
+    if ((Descriptor.bLength < sizeof(USB_COMMON_DESCRIPTOR)) ||
+        (Descriptor.bLength > Length) ||
+        (Descriptor.bDescriptorType != USB_STRING_DESCRIPTOR_TYPE))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVACCESS, "%!FUNC! Invalid string descriptor %d received.", Index);
+        return STATUS_DEVICE_DATA_ERROR;
+    }
+
+    return STATUS_SUCCESS;
+}
+
 USB_DK_DEVICE_SPEED UsbDkWdmUsbDeviceGetSpeed(PDEVICE_OBJECT DevObj, PDRIVER_OBJECT DriverObj)
 {
 #if !TARGET_OS_WIN_XP
@@ -74,6 +74,7 @@ public:
     NTSTATUS Reset();
     NTSTATUS GetDeviceDescriptor(USB_DEVICE_DESCRIPTOR &Descriptor);
     NTSTATUS GetConfigurationDescriptor(UCHAR Index, USB_CONFIGURATION_DESCRIPTOR &Descriptor, size_t Length);
+    NTSTATUS GetStringDescriptor(UCHAR Index, USHORT LanguageID, USB_STRING_DESCRIPTOR &Descriptor, size_t Length);
 
     CWdmUsbDeviceAccess(const CWdmUsbDeviceAccess&) = delete;
     CWdmUsbDeviceAccess& operator= (const CWdmUsbDeviceAccess&) = delete;
@@ -124,10 +125,11 @@ bool UsbDkWdmUsbDeviceIsHub(PDEVICE_OBJECT PDO);
 USB_DK_DEVICE_SPEED UsbDkWdmUsbDeviceGetSpeed(PDEVICE_OBJECT PDO, PDRIVER_OBJECT DriverObject);
 
 template <typename TBuffer>
-void UsbDkBuildDescriptorRequest(URB &Urb, UCHAR Type, UCHAR Index, TBuffer &Buffer, ULONG BufferLength = sizeof(TBuffer))
+void UsbDkBuildDescriptorRequest(URB &Urb, UCHAR Type, UCHAR Index, TBuffer &Buffer, ULONG BufferLength = sizeof(TBuffer),
+                                 USHORT LanguageID = 0)
 {
     UsbBuildGetDescriptorRequest(&Urb, sizeof(struct _URB_CONTROL_DESCRIPTOR_REQUEST),
-                                 Type, Index, 0,
+                                 Type, Index, LanguageID,
                                  &Buffer, nullptr, BufferLength,
                                  nullptr);
 }
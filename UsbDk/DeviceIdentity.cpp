@@ -0,0 +1,151 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+
+#include "stdafx.h"
+#include "DeviceIdentity.h"
+
+CUsbDkIdentityPool::CPool *CUsbDkIdentityPool::m_Pool = nullptr;
+
+CUsbDkDeviceIdentity::CKey::CKey(PCWCHAR DeviceID, PCWCHAR InstanceID)
+    : DeviceID(DeviceID)
+    , InstanceID(InstanceID)
+    , DeviceIDLength(wcsnlen(DeviceID, NTSTRSAFE_UNICODE_STRING_MAX_CCH))
+    , InstanceIDLength(wcsnlen(InstanceID, NTSTRSAFE_UNICODE_STRING_MAX_CCH))
+    , Hash(CUsbDkDeviceIdentity::HashOf(DeviceID, InstanceID))
+{}
+
+CUsbDkDeviceIdentity::CUsbDkDeviceIdentity(const CKey &Key)
+    : m_DeviceID(reinterpret_cast<PWCHAR>(this + 1))
+    , m_InstanceID(m_DeviceID + Key.DeviceIDLength + 1)
+    , m_DeviceIDLength(Key.DeviceIDLength)
+    , m_InstanceIDLength(Key.InstanceIDLength)
+    , m_Hash(Key.Hash)
+{
+    RtlCopyMemory(m_DeviceID, Key.DeviceID, m_DeviceIDLength * sizeof(WCHAR));
+    m_DeviceID[m_DeviceIDLength] = L'\0';
+
+    RtlCopyMemory(m_InstanceID, Key.InstanceID, m_InstanceIDLength * sizeof(WCHAR));
+    m_InstanceID[m_InstanceIDLength] = L'\0';
+}
+
+CUsbDkDeviceIdentity *CUsbDkDeviceIdentity::Create(const CKey &Key)
+{
+    auto Size = AllocationSize(Key.DeviceIDLength, Key.InstanceIDLength);
+
+    // Freed by CAllocatable::operator delete, the tag is the same
+    auto Memory = ExAllocatePoolWithTag(NonPagedPool, Size, 'NIHR');
+    if (Memory == nullptr)
+    {
+        return nullptr;
+    }
+
+    return new (Memory) CUsbDkDeviceIdentity(Key);
+}
+
+bool CUsbDkDeviceIdentity::operator ==(const CKey &Key) const
+{
+    return (m_Hash == Key.Hash)                         &&
+           (m_DeviceIDLength == Key.DeviceIDLength)     &&
+           (m_InstanceIDLength == Key.InstanceIDLength) &&
+           RtlEqualMemory(m_DeviceID, Key.DeviceID, m_DeviceIDLength * sizeof(WCHAR)) &&
+           RtlEqualMemory(m_InstanceID, Key.InstanceID, m_InstanceIDLength * sizeof(WCHAR));
+}
+
+bool CUsbDkDeviceIdentity::operator ==(const CUsbDkDeviceIdentity &Other) const
+{
+    return (this == &Other) ||
+           (*this == CKey(Other.m_DeviceID, Other.m_InstanceID));
+}
+
+void CUsbDkDeviceIdentity::Release()
+{
+    CUsbDkIdentityPool::Release(this);
+}
+
+bool CUsbDkIdentityPool::Create()
+{
+    m_Pool = new CPool;
+    return m_Pool != nullptr;
+}
+
+void CUsbDkIdentityPool::Destroy()
+{
+    delete m_Pool;
+    m_Pool = nullptr;
+}
+
+CUsbDkDeviceIdentity *CUsbDkIdentityPool::Intern(PCWCHAR DeviceID, PCWCHAR InstanceID)
+{
+    CUsbDkDeviceIdentity::CKey Key(DeviceID, InstanceID);
+    CUsbDkDeviceIdentity *Identity = nullptr;
+
+    TSpinLocker Locker(m_Pool->Lock);
+
+    if (m_Pool->Identities.ModifyOne(&Key, [&Identity](CUsbDkDeviceIdentity *Existing)
+                                           {
+                                               Existing->Reference();
+                                               Identity = Existing;
+                                           }))
+    {
+        return Identity;
+    }
+
+    Identity = CUsbDkDeviceIdentity::Create(Key);
+    if (Identity != nullptr)
+    {
+        m_Pool->Identities.Add(Identity);
+        m_Pool->NumIdentities++;
+        m_Pool->IdentityBytes += Identity->AllocationSize();
+    }
+
+    return Identity;
+}
+
+void CUsbDkIdentityPool::Release(CUsbDkDeviceIdentity *Identity)
+{
+    // Last reference is dropped under the pool lock, so
+    // Intern() cannot pick up identity being destroyed
+    {
+        TSpinLocker Locker(m_Pool->Lock);
+
+        if (InterlockedDecrement(&Identity->m_References) != 0)
+        {
+            return;
+        }
+
+        m_Pool->Identities.Detach(Identity, [](CUsbDkDeviceIdentity *) {});
+        m_Pool->NumIdentities--;
+        m_Pool->IdentityBytes -= Identity->AllocationSize();
+    }
+
+    delete Identity;
+}
+
+void CUsbDkIdentityPool::GetStatistics(USB_DK_MEMORY_STATISTICS &Statistics)
+{
+    TSpinLocker Locker(m_Pool->Lock);
+
+    Statistics.DeviceIdentities = m_Pool->NumIdentities;
+    Statistics.DeviceIdentityBytes = m_Pool->IdentityBytes;
+}
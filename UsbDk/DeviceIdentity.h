@@ -0,0 +1,152 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+
+#pragma once
+
+#include "Alloc.h"
+#include "UsbDkUtil.h"
+#include "Public.h"
+
+class CUsbDkIdentityPool;
+
+// Device and instance IDs of a USB device.
+// Identities are interned by CUsbDkIdentityPool, there is one object
+// per distinct pair of IDs, so equal identities have the same address.
+// Hash and lengths are computed once on creation.
+class CUsbDkDeviceIdentity : public CAllocatable<NonPagedPool, 'NIHR'>
+{
+public:
+    PCWCHAR DeviceID() const
+    { return m_DeviceID; }
+    PCWCHAR InstanceID() const
+    { return m_InstanceID; }
+    ULONG Hash() const
+    { return m_Hash; }
+
+    // Exact comparison with IDs not interned yet
+    bool Match(PCWCHAR DeviceID, PCWCHAR InstanceID) const
+    {
+        return !wcscmp(m_DeviceID, DeviceID) &&
+               !wcscmp(m_InstanceID, InstanceID);
+    }
+
+    void Reference()
+    { InterlockedIncrement(&m_References); }
+    void Release();
+
+    // Hash of IDs not interned yet, equals Hash() of their identity
+    static ULONG HashOf(PCWCHAR DeviceID, PCWCHAR InstanceID)
+    { return UsbDkHashString(InstanceID, UsbDkHashString(DeviceID)); }
+
+private:
+    class CKey
+    {
+    public:
+        CKey(PCWCHAR DeviceID, PCWCHAR InstanceID);
+
+        PCWCHAR DeviceID;
+        PCWCHAR InstanceID;
+        size_t DeviceIDLength;
+        size_t InstanceIDLength;
+        ULONG Hash;
+    };
+
+    CUsbDkDeviceIdentity(const CKey &Key);
+    static CUsbDkDeviceIdentity *Create(const CKey &Key);
+    static size_t AllocationSize(size_t DeviceIDLength, size_t InstanceIDLength)
+    {
+        return sizeof(CUsbDkDeviceIdentity) +
+               (DeviceIDLength + 1 + InstanceIDLength + 1) * sizeof(WCHAR);
+    }
+    size_t AllocationSize() const
+    { return AllocationSize(m_DeviceIDLength, m_InstanceIDLength); }
+
+    bool operator ==(const CKey &Key) const;
+    bool operator ==(const CUsbDkDeviceIdentity &Other) const;
+    static ULONG HashOf(const CKey &Key)
+    { return Key.Hash; }
+    static ULONG HashOf(const CUsbDkDeviceIdentity &Identity)
+    { return Identity.m_Hash; }
+
+    // Strings follow the object in the same allocation
+    PWCHAR m_DeviceID;
+    PWCHAR m_InstanceID;
+    size_t m_DeviceIDLength;
+    size_t m_InstanceIDLength;
+    ULONG m_Hash;
+    volatile LONG m_References = 1;
+
+    CUsbDkDeviceIdentity(const CUsbDkDeviceIdentity&) = delete;
+    CUsbDkDeviceIdentity& operator= (const CUsbDkDeviceIdentity&) = delete;
+
+    friend class CUsbDkIdentityPool;
+    DECLARE_CWDMLIST_ENTRY(CUsbDkDeviceIdentity);
+};
+
+class CUsbDkDeviceIdentityDeleter
+{
+public:
+    static void destroy(CUsbDkDeviceIdentity *Identity)
+    {
+        if (Identity != nullptr)
+        {
+            Identity->Release();
+        }
+    }
+};
+
+typedef CObjHolder<CUsbDkDeviceIdentity, CUsbDkDeviceIdentityDeleter> TDeviceIdentityHolder;
+
+// Driver-wide pool of device identities, lives from DriverEntry
+// to DriverUnload, so identities may be held by any object
+class CUsbDkIdentityPool final
+{
+public:
+    // Returns referenced identity or nullptr if out of memory
+    static CUsbDkDeviceIdentity *Intern(PCWCHAR DeviceID, PCWCHAR InstanceID);
+
+    static void GetStatistics(USB_DK_MEMORY_STATISTICS &Statistics);
+
+private:
+    static bool Create();
+    static void Destroy();
+    static void Release(CUsbDkDeviceIdentity *Identity);
+
+    class CPool : public CAllocatable<NonPagedPool, 'PIHR'>
+    {
+    public:
+        CWdmSpinLock Lock;
+        CWdmHashMap<CUsbDkDeviceIdentity, CRawAccess, CNonCountingObject> Identities;
+
+        // Counted under the lock
+        ULONG64 NumIdentities = 0;
+        ULONG64 IdentityBytes = 0;
+    };
+
+    static CPool *m_Pool;
+
+    friend class CUsbDkDeviceIdentity;
+    friend NTSTATUS DriverEntry(PDRIVER_OBJECT, PUNICODE_STRING);
+    friend VOID DriverUnload(IN WDFDRIVER Driver);
+};
@@ -0,0 +1,90 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+#include "UsbDkUtil.h"
+#include "MemoryBuffer.h"
+
+// Relations index is sorted by PDO, so that each child
+// and each relation are looked up in logarithmic time
+class CDeviceRelationsIndex
+{
+public:
+    struct CEntry
+    {
+        PDEVICE_OBJECT PDO;
+        bool Registered;
+        bool Hide;
+    };
+
+    template <typename TRelations>
+    NTSTATUS Create(const TRelations &Relations)
+    {
+        m_Count = 0;
+        Relations.ForEach([this](PDEVICE_OBJECT) { m_Count++; return true; });
+
+        if (m_Count == 0)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        auto status = m_Buffer.Create(m_Count * sizeof(CEntry), NonPagedPool);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        auto Entry = Entries();
+        Relations.ForEach([&Entry](PDEVICE_OBJECT PDO)
+                          {
+                              Entry->PDO = PDO;
+                              Entry->Registered = false;
+                              Entry->Hide = false;
+                              Entry++;
+                              return true;
+                          });
+
+        UsbDkHeapSort(Entries(), m_Count, [](const CEntry &a, const CEntry &b) { return a.PDO < b.PDO; });
+        return STATUS_SUCCESS;
+    }
+
+    CEntry *Find(PDEVICE_OBJECT PDO)
+    { return UsbDkBinarySearch(Entries(), m_Count, PDO, [](const CEntry &e) { return e.PDO; }); }
+
+    template <typename TFunctor>
+    void ForEach(TFunctor Functor)
+    {
+        for (size_t i = 0; i < m_Count; i++)
+        {
+            Functor(Entries()[i]);
+        }
+    }
+
+private:
+    CEntry *Entries()
+    { return static_cast<CEntry *>(m_Buffer.Ptr()); }
+
+    CWdmMemoryBuffer m_Buffer;
+    size_t m_Count = 0;
+};
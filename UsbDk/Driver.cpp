@@ -25,6 +25,8 @@
 #include "driver.h"
 #include "ControlDevice.h"
 #include "FilterDevice.h"
+#include "DeviceIdentity.h"
+#include "DescriptorStore.h"
 #include "driver.tmh"
 
 #ifdef ALLOC_PRAGMA
@@ -75,8 +77,24 @@ DriverEntry(
         return status;
     }
 
+    if (!CUsbDkIdentityPool::Create())
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "%!FUNC! Failed to create device identity pool");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (!CUsbDkDescriptorStore::Create())
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "%!FUNC! Failed to create descriptor store");
+        CUsbDkIdentityPool::Destroy();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
     if (!CUsbDkControlDevice::Allocate())
     {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "%!FUNC! Failed to allocate control device");
+        CUsbDkDescriptorStore::Destroy();
+        CUsbDkIdentityPool::Destroy();
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
@@ -85,6 +103,15 @@ DriverEntry(
     return STATUS_SUCCESS;
 }
 
+template <typename T>
+static void DrainLookaside(PCSTR Name)
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! %s lookaside: %llu hits, %llu misses",
+                Name, T::LookasideHits(), T::LookasideMisses());
+
+    T::DrainLookaside();
+}
+
 VOID
 DriverUnload(IN WDFDRIVER Driver)
 {
@@ -96,6 +123,13 @@ DriverUnload(IN WDFDRIVER Driver)
 
     CUsbDkControlDevice::Deallocate();
 
+    CUsbDkIdentityPool::Destroy();
+    CUsbDkDescriptorStore::Destroy();
+
+    DrainLookaside<CUsbDkChildDevice>("Child devices");
+    DrainLookaside<CUsbDkRedirection>("Redirections");
+    DrainLookaside<CRegText>("Registry texts");
+
     CDriverParamsRegistryPath::Destroy();
 
     return;
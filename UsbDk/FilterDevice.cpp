@@ -28,12 +28,12 @@
 #include "DeviceAccess.h"
 #include "ControlDevice.h"
 #include "UsbDkNames.h"
+#include "DeviceRelationsIndex.h"
 
 void CUsbDkChildDevice::Dump()
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Child device 0x%p:", m_PDO);
-    m_DeviceID->Dump();
-    m_InstanceID->Dump();
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Child device 0x%p: %ws %ws",
+                m_PDO, DeviceID(), InstanceID());
 }
 
 class CUsbDkFilterDeviceInit : public CPreAllocatedDeviceInit
@@ -244,9 +244,31 @@ NTSTATUS CUsbDkHubFilterStrategy::PNPPreProcess(PIRP Irp)
                                             return;
                                         }
 
-                                        DropRemovedDevices(Relations);
-                                        AddNewDevices(Relations);
-                                        WipeHiddenDevices(Relations);
+                                        CDeviceRelationsIndex Index;
+                                        status = Index.Create(Relations);
+
+                                        if (NT_SUCCESS(status))
+                                        {
+                                            DropRemovedDevices(Index);
+                                            AddNewDevices(Index);
+
+                                            CWdmStopwatch Stopwatch;
+                                            WipeHiddenDevices(Relations, Index);
+                                            m_ControlDevice->CountBusRelationsPass(Stopwatch.Elapsed());
+                                        }
+                                        else
+                                        {
+                                            TraceEvents(TRACE_LEVEL_WARNING, TRACE_FILTERDEVICE, "%!FUNC! Failed to create device relations index: %!STATUS!", status);
+
+                                            DropRemovedDevices(Relations);
+                                            AddNewDevices(Relations);
+
+                                            CWdmStopwatch Stopwatch;
+                                            WipeHiddenDevices(Relations);
+                                            m_ControlDevice->CountBusRelationsPass(Stopwatch.Elapsed());
+                                        }
+
+                                        ReenumerateIfNeeded();
                                     });
     }
 
@@ -260,12 +282,144 @@ void CUsbDkHubFilterStrategy::DropRemovedDevices(const CDeviceRelations &Relatio
     CWdmList<CUsbDkChildDevice, CRawAccess, CNonCountingObject> ToBeDeleted;
     Children().ForEachDetachedIf([&Relations](CUsbDkChildDevice *Child) { return !Relations.Contains(*Child); },
                                  [&ToBeDeleted](CUsbDkChildDevice *Child) -> bool { ToBeDeleted.PushBack(Child); return true; });
+
+    ToBeDeleted.ForEach([this](CUsbDkChildDevice *Child) { ForgetRemovedChild(*Child); return true; });
+}
+
+void CUsbDkHubFilterStrategy::DropRemovedDevices(CDeviceRelationsIndex &Index)
+{
+    //Child device must be deleted on PASSIVE_LEVEL
+    //So we put those to non-locked list and let its destructor do the job
+    //Children still present in relations are marked as registered on the way
+    CWdmList<CUsbDkChildDevice, CRawAccess, CNonCountingObject> ToBeDeleted;
+    Children().ForEachDetachedIf([&Index](CUsbDkChildDevice *Child)
+                                 {
+                                     auto Entry = Index.Find(Child->PDO());
+                                     if (Entry == nullptr)
+                                     {
+                                         return true;
+                                     }
+
+                                     Entry->Registered = true;
+                                     return false;
+                                 },
+                                 [&ToBeDeleted](CUsbDkChildDevice *Child) -> bool { ToBeDeleted.PushBack(Child); return true; });
+
+    ToBeDeleted.ForEach([this](CUsbDkChildDevice *Child) { ForgetRemovedChild(*Child); return true; });
+}
+
+void CUsbDkHubFilterStrategy::ForgetRemovedChild(CUsbDkChildDevice &Child)
+{
+    if (Child.IsRedirected())
+    {
+        m_ControlDevice->DropAutoRedirection(Child);
+    }
+}
+
+void CUsbDkHubFilterStrategy::AddNewDevices(CDeviceRelationsIndex &Index)
+{
+    Index.ForEach([this](CDeviceRelationsIndex::CEntry &Entry)
+                  {
+                      if (!Entry.Registered)
+                      {
+                          RegisterNewChild(Entry.PDO);
+                      }
+                  });
+
+    ApplyDeferredPolicies();
+
+    // Give children that failed to provide descriptors another chance
+    Children().ForEach([](CUsbDkChildDevice *Child)
+                       {
+                           Child->RetryDescriptorsFetch();
+                           return true;
+                       });
+}
+
+void CUsbDkHubFilterStrategy::WipeHiddenDevices(CDeviceRelations &Relations, CDeviceRelationsIndex &Index)
+{
+    Children().ForEach([this, &Index](CUsbDkChildDevice *Child)
+                       {
+                           auto Entry = Index.Find(Child->PDO());
+                           if (Entry != nullptr)
+                           {
+                               Entry->Hide = ShouldHideChild(*Child);
+                           }
+                           return true;
+                       });
+
+    Relations.WipeIf([&Index](PDEVICE_OBJECT PDO)
+                     {
+                         auto Entry = Index.Find(PDO);
+                         return (Entry != nullptr) && Entry->Hide;
+                     });
+}
+
+bool CUsbDkHubFilterStrategy::ShouldHideChild(CUsbDkChildDevice &Child)
+{
+    switch (Child.SoftReleaseState())
+    {
+    case CUsbDkChildDevice::SOFT_RELEASE_PENDING:
+        // Relation reference is not handed to PnP for wiped child
+        ObDereferenceObject(Child.PDO());
+        Child.MarkAsWiped();
+        m_ReenumerationNeeded = true;
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Wiping soft released PDO 0x%p", Child.PDO());
+        return true;
+
+    case CUsbDkChildDevice::SOFT_RELEASE_WIPED:
+        Child.MarkAsReleased();
+        m_ControlDevice->NotifyRedirectionRemoved(Child);
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Reporting soft released PDO 0x%p", Child.PDO());
+        return false;
+
+    default:
+        break;
+    }
+
+    if (Child.ArePoliciesDeferred())
+    {
+        return true;
+    }
+
+    bool Hide = false;
+
+    if (!Child.IsRedirected() &&
+        !Child.IsIndicated())
+    {
+        Hide = m_ControlDevice->ShouldHide(Child);
+    }
+
+    if (!Hide)
+    {
+        Child.MarkAsIndicated();
+    }
+
+    return Hide;
+}
+
+void CUsbDkHubFilterStrategy::ReenumerateIfNeeded()
+{
+    if (m_ReenumerationNeeded)
+    {
+        m_ReenumerationNeeded = false;
+        IoInvalidateDeviceRelations(m_Owner->GetPhysicalDevice(), BusRelations);
+    }
 }
 
 void CUsbDkHubFilterStrategy::AddNewDevices(const CDeviceRelations &Relations)
 {
     Relations.ForEachIf([this](PDEVICE_OBJECT PDO){ return !IsChildRegistered(PDO); },
                         [this](PDEVICE_OBJECT PDO){ RegisterNewChild(PDO); return true; });
+
+    ApplyDeferredPolicies();
+
+    // Give children that failed to provide descriptors another chance
+    Children().ForEach([](CUsbDkChildDevice *Child)
+                       {
+                           Child->RetryDescriptorsFetch();
+                           return true;
+                       });
 }
 
 void CUsbDkHubFilterStrategy::WipeHiddenDevices(CDeviceRelations &Relations)
@@ -277,19 +431,7 @@ void CUsbDkHubFilterStrategy::WipeHiddenDevices(CDeviceRelations &Relations)
         Children().ForEachIf([PDO](CUsbDkChildDevice *Child){ return Child->Match(PDO); },
                              [this, &Hide](CUsbDkChildDevice *Child)
                              {
-                                 Hide = false;
-
-                                 if (!Child->IsRedirected() &&
-                                     !Child->IsIndicated())
-                                 {
-                                     Hide = m_ControlDevice->ShouldHide(Child->DeviceDescriptor());
-                                 }
-
-                                 if (!Hide)
-                                 {
-                                     Child->MarkAsIndicated();
-                                 }
-
+                                 Hide = ShouldHideChild(*Child);
                                  return false;
                              });
 
@@ -309,13 +451,8 @@ void CUsbDkHubFilterStrategy::RegisterNewChild(PDEVICE_OBJECT PDO)
         return;
     }
 
-    auto Speed = UsbDkWdmUsbDeviceGetSpeed(PDO, m_Owner->GetDriverObject());
-    if (Speed == NoSpeed)
-    {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot query device speed");
-        return;
-    }
-
+    // Device descriptor is required right away to apply hide rules,
+    // the rest of descriptors is fetched in background
     USB_DEVICE_DESCRIPTOR DevDescriptor;
     auto status = pdoAccess.GetDeviceDescriptor(DevDescriptor);
     if (!NT_SUCCESS(status))
@@ -336,40 +473,213 @@ void CUsbDkHubFilterStrategy::RegisterNewChild(PDEVICE_OBJECT PDO)
     DevID->Dump();
     InstanceID->Dump();
 
-    CUsbDkChildDevice::TDescriptorsCache CfgDescriptors(DevDescriptor.bNumConfigurations);
+    TDeviceIdentityHolder Identity(CUsbDkIdentityPool::Intern(*DevID->begin(), *InstanceID->begin()));
+    if (!Identity)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot allocate child device identity");
+        return;
+    }
 
-    if (!CfgDescriptors.Create())
+    CUsbDkChildDevice *Device = new CUsbDkChildDevice(Identity, Port, DevDescriptor, *m_Owner, PDO);
+
+    if (Device == nullptr)
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot create descriptors cache");
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot allocate child device instance");
+        return;
+    }
+
+    Identity.detach();
+
+    Children().PushBack(Device);
+
+    // Interface rules need interface classes, so policies are
+    // applied by relations pass following descriptors fetch
+    if (m_ControlDevice->HasInterfaceRules())
+    {
+        Device->DeferPolicies();
+    }
+
+    Device->StartDescriptorsFetch();
+
+    if (!Device->ArePoliciesDeferred())
+    {
+        ApplyRedirectionPolicy(*Device);
+    }
+}
+
+void CUsbDkHubFilterStrategy::ApplyDeferredPolicies()
+{
+    // Redirector creation is not allowed under children list lock,
+    // children are removed by relations pass only, so the one
+    // found stays valid after the lock is released
+    for (;;)
+    {
+        CUsbDkChildDevice *ReadyChild = nullptr;
+
+        Children().ForEachIf([](CUsbDkChildDevice *Child) { return Child->ArePoliciesDeferred() && !Child->IsPending(); },
+                             [&ReadyChild](CUsbDkChildDevice *Child)
+                             {
+                                 Child->MarkPoliciesApplied();
+                                 ReadyChild = Child;
+                                 return false;
+                             });
+
+        if (ReadyChild == nullptr)
+        {
+            break;
+        }
+
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Applying deferred policies to PDO 0x%p", ReadyChild->PDO());
+        ApplyRedirectionPolicy(*ReadyChild);
+    }
+}
+
+void CUsbDkHubFilterStrategy::ApplyRedirectionPolicy(CUsbDkChildDevice &Device)
+{
+    // Devices matching redirect rules are redirected on first enumeration,
+    // redirector handle is handed out later to the process asking for it
+    if (m_ControlDevice->ShouldAutoRedirect(Device) &&
+        NT_SUCCESS(m_ControlDevice->AddAutoRedirection(Device)))
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! PDO 0x%p matches redirect rule", Device.PDO());
+    }
+
+    if (m_ControlDevice->ShouldRedirect(Device))
+    {
+        if (Device.MakeRedirected())
+        {
+            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Adding new PDO 0x%p as redirected initially", Device.PDO());
+        }
+        else
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Failed to create redirector PDO for 0x%p", Device.PDO());
+            m_ControlDevice->DropAutoRedirection(Device);
+        }
+    }
+    else
+    {
+        m_ControlDevice->NotifyRedirectionRemoved(Device);
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Adding new PDO 0x%p as non-redirected initially", Device.PDO());
+    }
+}
+
+ULONG CUsbDkChildDevice::ParentID() const
+{
+    return m_ParentDevice.GetInstanceNumber();
+}
+
+PDEVICE_OBJECT CUsbDkChildDevice::ParentPDO() const
+{
+    return m_ParentDevice.GetPhysicalDevice();
+}
+
+void CUsbDkChildDevice::StartDescriptorsFetch()
+{
+    auto status = m_DescriptorsFetcher.Create(m_ParentDevice.WdfObject());
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_FILTERDEVICE,
+                    "%!FUNC! Cannot create descriptors fetch work item, fetching synchronously: %!STATUS!", status);
+        FetchDescriptors();
+        return;
+    }
+
+    m_FetcherCreated = true;
+    m_DescriptorsFetcher.Enqueue();
+}
+
+void CUsbDkChildDevice::RetryDescriptorsFetch()
+{
+    if (m_FetcherCreated &&
+        (InterlockedCompareExchange(&m_DescriptorsState, DESCRIPTORS_PENDING, DESCRIPTORS_FAILED) == DESCRIPTORS_FAILED))
+    {
+        m_DescriptorsFetcher.Enqueue();
+    }
+}
+
+void CUsbDkChildDevice::FetchDescriptorsWork(PVOID Context)
+{
+    auto Child = static_cast<CUsbDkChildDevice *>(Context);
+    Child->FetchDescriptors();
+
+    // Relations pass applies deferred policies
+    // and reports the child if it is not hidden
+    if (Child->ArePoliciesDeferred())
+    {
+        IoInvalidateDeviceRelations(Child->ParentPDO(), BusRelations);
+    }
+}
+
+void CUsbDkChildDevice::FetchDescriptors()
+{
+    CWdmUsbDeviceAccess pdoAccess(m_PDO);
+
+    auto Speed = UsbDkWdmUsbDeviceGetSpeed(m_PDO, m_ParentDevice.GetDriverObject());
+    if (Speed == NoSpeed)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot query device speed");
+        InterlockedExchange(&m_DescriptorsState, DESCRIPTORS_FAILED);
         return;
     }
 
+    TConfigDescriptorsCache CfgDescriptors(m_DevDescriptor.bNumConfigurations);
+
     if (!FetchConfigurationDescriptors(pdoAccess, CfgDescriptors))
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot fetch configuration descriptors");
+        InterlockedExchange(&m_DescriptorsState, DESCRIPTORS_FAILED);
         return;
     }
 
-    CUsbDkChildDevice *Device = new CUsbDkChildDevice(DevID, InstanceID, Port, Speed, DevDescriptor,
-                                                      CfgDescriptors, *m_Owner, PDO);
+    TDescriptorsCache StringDescriptors(STRINGS_CACHE_SIZE);
 
-    if (Device == nullptr)
+    if (!StringDescriptors.Create())
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot allocate child device instance");
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot create string descriptors cache");
+        InterlockedExchange(&m_DescriptorsState, DESCRIPTORS_FAILED);
         return;
     }
 
-    DevID.detach();
-    InstanceID.detach();
+    FetchStringDescriptors(pdoAccess, StringDescriptors);
 
-    Children().PushBack(Device);
+    TInterfaceClasses InterfaceClasses;
+    size_t NumInterfaceClasses;
+
+    if (!CollectInterfaceClasses(CfgDescriptors, InterfaceClasses, NumInterfaceClasses))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot allocate interface classes set");
+        InterlockedExchange(&m_DescriptorsState, DESCRIPTORS_FAILED);
+        return;
+    }
 
-    ApplyRedirectionPolicy(*Device);
+    auto CfgDescriptorSet = CUsbDkDescriptorStore::Intern(CfgDescriptors);
+    if (CfgDescriptorSet == nullptr)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot store configuration descriptors");
+        InterlockedExchange(&m_DescriptorsState, DESCRIPTORS_FAILED);
+        return;
+    }
+
+    // Caches are not accessed by readers until the child
+    // becomes ready, interlocked exchange publishes them
+    m_Speed = Speed;
+    m_CfgDescriptors.reset(CfgDescriptorSet);
+    m_StringDescriptors = StringDescriptors;
+    m_InterfaceClasses = InterfaceClasses.detach();
+    m_NumInterfaceClasses = NumInterfaceClasses;
+
+    InterlockedExchange(&m_DescriptorsState, DESCRIPTORS_READY);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Descriptors of child 0x%p are ready", m_PDO);
 }
 
-bool CUsbDkHubFilterStrategy::FetchConfigurationDescriptors(CWdmUsbDeviceAccess &devAccess,
-                                                            CUsbDkChildDevice::TDescriptorsCache &DescriptorsHolder)
+bool CUsbDkChildDevice::FetchConfigurationDescriptors(CWdmUsbDeviceAccess &devAccess,
+                                                      TConfigDescriptorsCache &DescriptorsHolder)
 {
+    // Headers give total lengths of all descriptors,
+    // so the cache is allocated once for all of them
+    USHORT TotalLengths[MAXUCHAR];
+
     for (size_t i = 0; i < DescriptorsHolder.Size(); i++)
     {
         USB_CONFIGURATION_DESCRIPTOR Descriptor;
@@ -381,12 +691,25 @@ bool CUsbDkHubFilterStrategy::FetchConfigurationDescriptors(CWdmUsbDeviceAccess
             return false;
         }
 
-        if(!DescriptorsHolder.EmplaceEntry(i, Descriptor.wTotalLength,
-                                           [&devAccess, &Descriptor, i](PUCHAR Buffer) -> bool
+        TotalLengths[i] = Descriptor.wTotalLength;
+    }
+
+    if (!DescriptorsHolder.Create(TotalLengths))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot create descriptors cache");
+        return false;
+    }
+
+    for (size_t i = 0; i < DescriptorsHolder.Size(); i++)
+    {
+        auto TotalLength = TotalLengths[i];
+
+        if(!DescriptorsHolder.EmplaceEntry(i,
+                                           [&devAccess, TotalLength, i](PUCHAR Buffer) -> bool
                                            {
                                                 auto status = devAccess.GetConfigurationDescriptor(static_cast<UCHAR>(i),
                                                                                                    *reinterpret_cast<PUSB_CONFIGURATION_DESCRIPTOR>(Buffer),
-                                                                                                   Descriptor.wTotalLength);
+                                                                                                   TotalLength);
                                                 if (!NT_SUCCESS(status))
                                                 {
                                                     TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Failed to read configuration descriptor %llu: %!STATUS!", i, status);
@@ -401,29 +724,187 @@ bool CUsbDkHubFilterStrategy::FetchConfigurationDescriptors(CWdmUsbDeviceAccess
     return true;
 }
 
-void CUsbDkHubFilterStrategy::ApplyRedirectionPolicy(CUsbDkChildDevice &Device)
+template <typename TFunctor>
+static void UsbDkForEachInterfaceDescriptor(PUCHAR Buffer, size_t BufferLength, TFunctor Functor)
 {
-    if (m_ControlDevice->ShouldRedirect(Device))
+    if (BufferLength < sizeof(USB_CONFIGURATION_DESCRIPTOR))
     {
-        if (Device.MakeRedirected())
+        return;
+    }
+
+    auto Length = min(BufferLength, reinterpret_cast<PUSB_CONFIGURATION_DESCRIPTOR>(Buffer)->wTotalLength);
+    size_t Offset = 0;
+
+    while (Offset + sizeof(USB_COMMON_DESCRIPTOR) <= Length)
+    {
+        auto Descriptor = reinterpret_cast<PUSB_COMMON_DESCRIPTOR>(Buffer + Offset);
+        if ((Descriptor->bLength == 0) || (Offset + Descriptor->bLength > Length))
         {
-            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Adding new PDO 0x%p as redirected initially", Device.PDO());
+            break;
         }
-        else
+
+        if ((Descriptor->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE) &&
+            (Descriptor->bLength >= sizeof(USB_INTERFACE_DESCRIPTOR)))
         {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Failed to create redirector PDO for 0x%p", Device.PDO());
+            Functor(*reinterpret_cast<PUSB_INTERFACE_DESCRIPTOR>(Descriptor));
         }
+
+        Offset += Descriptor->bLength;
     }
-    else
+}
+
+bool CUsbDkChildDevice::CollectInterfaceClasses(TConfigDescriptorsCache &CfgDescriptors,
+                                                TInterfaceClasses &InterfaceClasses,
+                                                size_t &NumInterfaceClasses)
+{
+    NumInterfaceClasses = 0;
+
+    size_t NumInterfaces = 0;
+    for (size_t i = 0; i < CfgDescriptors.Size(); i++)
     {
-        m_ControlDevice->NotifyRedirectionRemoved(Device);
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Adding new PDO 0x%p as non-redirected initially", Device.PDO());
+        UsbDkForEachInterfaceDescriptor(CfgDescriptors.Entry(i), CfgDescriptors.EntrySize(i),
+                                        [&NumInterfaces](const USB_INTERFACE_DESCRIPTOR &) { NumInterfaces++; });
     }
+
+    if (NumInterfaces == 0)
+    {
+        return true;
+    }
+
+    InterfaceClasses = TInterfaceClassesAllocator::allocate(NumInterfaces);
+    if (!InterfaceClasses)
+    {
+        return false;
+    }
+
+    ULONG *Triples = InterfaceClasses;
+    size_t NumTriples = 0;
+    for (size_t i = 0; i < CfgDescriptors.Size(); i++)
+    {
+        UsbDkForEachInterfaceDescriptor(CfgDescriptors.Entry(i), CfgDescriptors.EntrySize(i),
+                                        [Triples, &NumTriples](const USB_INTERFACE_DESCRIPTOR &Interface)
+                                        {
+                                            Triples[NumTriples++] = (ULONG(Interface.bInterfaceClass) << 16) |
+                                                                    (ULONG(Interface.bInterfaceSubClass) << 8) |
+                                                                    Interface.bInterfaceProtocol;
+                                        });
+    }
+
+    UsbDkHeapSort(Triples, NumTriples, [](ULONG a, ULONG b) { return a < b; });
+
+    for (size_t i = 0; i < NumTriples; i++)
+    {
+        if ((NumInterfaceClasses == 0) || (Triples[NumInterfaceClasses - 1] != Triples[i]))
+        {
+            Triples[NumInterfaceClasses++] = Triples[i];
+        }
+    }
+
+    return true;
 }
 
-ULONG CUsbDkChildDevice::ParentID() const
+// Strings are informational only, failure to read
+// them does not fail descriptors fetching
+
+void CUsbDkChildDevice::FetchStringDescriptors(CWdmUsbDeviceAccess &devAccess,
+                                               TDescriptorsCache &DescriptorsHolder)
 {
-    return m_ParentDevice.GetInstanceNumber();
+    if ((m_DevDescriptor.iManufacturer == 0) &&
+        (m_DevDescriptor.iProduct == 0) &&
+        (m_DevDescriptor.iSerialNumber == 0))
+    {
+        return;
+    }
+
+    UCHAR Buffer[MAXIMUM_USB_STRING_LENGTH];
+    auto &Descriptor = *reinterpret_cast<PUSB_STRING_DESCRIPTOR>(Buffer);
+
+    auto CacheDescriptor = [&DescriptorsHolder, &Descriptor](size_t CacheIndex) -> bool
+    {
+        return DescriptorsHolder.EmplaceEntry(CacheIndex, Descriptor.bLength,
+                                              [&Descriptor](PUCHAR Entry) -> bool
+                                              {
+                                                  RtlCopyMemory(Entry, &Descriptor, Descriptor.bLength);
+                                                  return true;
+                                              });
+    };
+
+    auto status = devAccess.GetStringDescriptor(0, 0, Descriptor, sizeof(Buffer));
+    if (!NT_SUCCESS(status) || (Descriptor.bLength < sizeof(USB_STRING_DESCRIPTOR)))
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_FILTERDEVICE, "%!FUNC! Failed to read language IDs table: %!STATUS!", status);
+        return;
+    }
+
+    if (!CacheDescriptor(LANGUAGE_IDS_TABLE))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Failed to cache language IDs table");
+        return;
+    }
+
+    // Strings are read in the first language device reports
+    auto LanguageID = Descriptor.bString[0];
+
+    const struct
+    {
+        UCHAR Index;
+        size_t CacheIndex;
+    } Strings[] = { { m_DevDescriptor.iManufacturer, MANUFACTURER_STRING },
+                    { m_DevDescriptor.iProduct, PRODUCT_STRING },
+                    { m_DevDescriptor.iSerialNumber, SERIAL_NUMBER_STRING } };
+
+    for (auto &String : Strings)
+    {
+        if (String.Index == 0)
+        {
+            continue;
+        }
+
+        status = devAccess.GetStringDescriptor(String.Index, LanguageID, Descriptor, sizeof(Buffer));
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_WARNING, TRACE_FILTERDEVICE, "%!FUNC! Failed to read string descriptor %d: %!STATUS!",
+                        String.Index, status);
+            continue;
+        }
+
+        if (!CacheDescriptor(String.CacheIndex))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Failed to cache string descriptor %d", String.Index);
+        }
+    }
+}
+
+void CUsbDkChildDevice::CopyString(size_t CacheIndex, PWCHAR Buffer, size_t BufferChars)
+{
+    UCHAR Descriptor[MAXIMUM_USB_STRING_LENGTH];
+    auto DescriptorLength = m_StringDescriptors.EntrySize(CacheIndex);
+
+    m_StringDescriptors.CopyEntry(CacheIndex, Descriptor, sizeof(Descriptor));
+
+    auto NumChars = (DescriptorLength > sizeof(USB_COMMON_DESCRIPTOR))
+                    ? (DescriptorLength - sizeof(USB_COMMON_DESCRIPTOR)) / sizeof(WCHAR)
+                    : 0;
+    NumChars = min(NumChars, BufferChars - 1);
+
+    RtlCopyMemory(Buffer, reinterpret_cast<PUSB_STRING_DESCRIPTOR>(Descriptor)->bString, NumChars * sizeof(WCHAR));
+    Buffer[NumChars] = L'\0';
+}
+
+void CUsbDkChildDevice::Strings(USB_DK_DEVICE_STRINGS &Strings)
+{
+    UCHAR LanguageIDs[MAXIMUM_USB_STRING_LENGTH];
+    auto TableLength = m_StringDescriptors.EntrySize(LANGUAGE_IDS_TABLE);
+
+    m_StringDescriptors.CopyEntry(LANGUAGE_IDS_TABLE, LanguageIDs, sizeof(LanguageIDs));
+
+    Strings.LanguageID = (TableLength >= sizeof(USB_STRING_DESCRIPTOR))
+                         ? reinterpret_cast<PUSB_STRING_DESCRIPTOR>(LanguageIDs)->bString[0]
+                         : 0;
+
+    CopyString(MANUFACTURER_STRING, Strings.Manufacturer, ARRAY_SIZE(Strings.Manufacturer));
+    CopyString(PRODUCT_STRING, Strings.Product, ARRAY_SIZE(Strings.Product));
+    CopyString(SERIAL_NUMBER_STRING, Strings.SerialNumber, ARRAY_SIZE(Strings.SerialNumber));
 }
 
 bool CUsbDkChildDevice::MakeRedirected()
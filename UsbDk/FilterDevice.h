@@ -26,12 +26,16 @@
 #include "WdfDevice.h"
 #include "Alloc.h"
 #include "RegText.h"
+#include "DeviceIdentity.h"
+#include "DescriptorStore.h"
 #include "Irp.h"
 #include "RedirectorStrategy.h"
+#include "WdfWorkitem.h"
 #include "Public.h"
 
 class CUsbDkControlDevice;
 class CUsbDkFilterDevice;
+class CWdmUsbDeviceAccess;
 
 typedef struct _USBDK_FILTER_DEVICE_EXTENSION {
 
@@ -43,45 +47,92 @@ typedef struct _USBDK_FILTER_DEVICE_EXTENSION {
 } USBDK_FILTER_DEVICE_EXTENSION, *PUSBDK_FILTER_DEVICE_EXTENSION;
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(USBDK_FILTER_DEVICE_EXTENSION, UsbDkFilterGetContext);
 
-class CUsbDkChildDevice : public CAllocatable<NonPagedPool, 'DCHR'>
+class CUsbDkChildDevice : public CLookasideAllocatable<CUsbDkChildDevice, NonPagedPool, 'DCHR', 64>
 {
 public:
 
     typedef CBufferSet<NonPagedPool, 'CCHR', UCHAR> TDescriptorsCache;
+    typedef CUsbDkDescriptorSet::TDescriptors TConfigDescriptorsCache;
+
+    // String descriptors cache holds raw descriptors
+    // of language IDs table and device identification strings
+    enum : size_t
+    {
+        LANGUAGE_IDS_TABLE,
+        MANUFACTURER_STRING,
+        PRODUCT_STRING,
+        SERIAL_NUMBER_STRING,
+        STRINGS_CACHE_SIZE
+    };
+
+    // Speed, configuration and string descriptors are fetched
+    // in background after the child is registered, until then
+    // the child is in pending state
+    enum : LONG
+    {
+        DESCRIPTORS_PENDING,
+        DESCRIPTORS_READY,
+        DESCRIPTORS_FAILED
+    };
 
-    CUsbDkChildDevice(CRegText *DeviceID,
-                      CRegText *InstanceID,
+    CUsbDkChildDevice(CUsbDkDeviceIdentity *Identity,
                       ULONG Port,
-                      USB_DK_DEVICE_SPEED Speed,
                       USB_DEVICE_DESCRIPTOR &DevDescriptor,
-                      TDescriptorsCache &CfgDescriptors,
                       const CUsbDkFilterDevice &ParentDevice,
                       PDEVICE_OBJECT PDO)
-        : m_DeviceID(DeviceID)
-        , m_InstanceID(InstanceID)
+        : m_Identity(Identity)
         , m_Port(Port)
-        , m_Speed(Speed)
         , m_DevDescriptor(DevDescriptor)
-        , m_CfgDescriptors(CfgDescriptors)
+        , m_StringDescriptors(0)
         , m_ParentDevice(ParentDevice)
         , m_PDO(PDO)
+        , m_DescriptorsFetcher(FetchDescriptorsWork, this)
     {}
 
     ~CUsbDkChildDevice()
     {
+        m_DescriptorsFetcher.Flush();
+
         if (!m_Indicated)
         {
             ObDereferenceObject(m_PDO);
         }
     }
 
+    void StartDescriptorsFetch();
+    void RetryDescriptorsFetch();
+
+    // Interface rules cannot be applied before descriptors are
+    // fetched, child with deferred policies is hidden until then
+    // and hub relations are invalidated once fetch is over
+    void DeferPolicies()
+    { m_PoliciesDeferred = true; }
+    void MarkPoliciesApplied()
+    { m_PoliciesDeferred = false; }
+    bool ArePoliciesDeferred() const
+    { return m_PoliciesDeferred; }
+    bool IsPending() const
+    { return m_DescriptorsState == DESCRIPTORS_PENDING; }
+    bool IsReady() const
+    { return m_DescriptorsState == DESCRIPTORS_READY; }
+    bool DescriptorsFetchFailed() const
+    { return m_DescriptorsState == DESCRIPTORS_FAILED; }
+    NTSTATUS DescriptorsStatus() const
+    {
+        return IsReady()   ? STATUS_SUCCESS :
+               IsPending() ? STATUS_DEVICE_BUSY :
+                             STATUS_DEVICE_DATA_ERROR;
+    }
+
     ULONG ParentID() const;
-    PCWCHAR DeviceID() const { return *m_DeviceID->begin(); }
-    PCWCHAR InstanceID() const { return *m_InstanceID->begin(); }
+    PDEVICE_OBJECT ParentPDO() const;
+    PCWCHAR DeviceID() const { return m_Identity->DeviceID(); }
+    PCWCHAR InstanceID() const { return m_Identity->InstanceID(); }
+    CUsbDkDeviceIdentity &Identity() const { return *m_Identity; }
     ULONG Port() const
     { return m_Port; }
     USB_DK_DEVICE_SPEED Speed() const
-    { return m_Speed; }
+    { return IsReady() ? m_Speed : NoSpeed; }
     const USB_DEVICE_DESCRIPTOR &DeviceDescriptor() const
     { return m_DevDescriptor; }
     bool IsRedirected() const
@@ -90,16 +141,49 @@ public:
 
     bool ConfigurationDescriptor(UCHAR Index, USB_CONFIGURATION_DESCRIPTOR &Buffer, size_t BufferLength)
     {
-        if (Index < m_CfgDescriptors.Size())
+        if (Index < NumConfigurations())
         {
-            m_CfgDescriptors.CopyEntry(Index, (PVOID)&Buffer, BufferLength);
+            m_CfgDescriptors->CopyConfigurationDescriptor(Index, (PVOID)&Buffer, BufferLength);
             return true;
         }
         return false;
     }
 
+    size_t NumConfigurations()
+    { return m_CfgDescriptors ? m_CfgDescriptors->NumConfigurations() : 0; }
+
+    size_t ConfigurationDescriptorSize(UCHAR Index)
+    { return m_CfgDescriptors->ConfigurationDescriptorSize(Index); }
+
+    void Strings(USB_DK_DEVICE_STRINGS &Strings);
+
+    // True if predicate accepts class, subclass and protocol of some
+    // interface of some configuration, false while descriptors
+    // are not ready
+    template <typename TPredicate>
+    bool AnyInterface(TPredicate Predicate) const
+    {
+        if (!IsReady())
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < m_NumInterfaceClasses; i++)
+        {
+            auto Triple = m_InterfaceClasses[i];
+            if (Predicate(static_cast<UCHAR>(Triple >> 16),
+                          static_cast<UCHAR>(Triple >> 8),
+                          static_cast<UCHAR>(Triple)))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
     bool Match(PCWCHAR deviceID, PCWCHAR instanceID) const
-    { return m_DeviceID->Match(deviceID) && m_InstanceID->Match(instanceID); }
+    { return !_wcsicmp(DeviceID(), deviceID) && !_wcsicmp(InstanceID(), instanceID); }
 
     bool Match(PDEVICE_OBJECT PDO) const
     { return m_PDO == PDO; }
@@ -114,19 +198,84 @@ public:
     bool IsIndicated() const
     { return m_Indicated; }
 
+    // Soft release returns redirected device to the system without reset:
+    // device is wiped from hub relations once, so PnP tears down
+    // redirector stack, and reported again to be enumerated
+    // with its original IDs
+    enum : ULONG
+    {
+        SOFT_RELEASE_NONE,
+        SOFT_RELEASE_PENDING,
+        SOFT_RELEASE_WIPED
+    };
+
+    bool RequestSoftRelease()
+    {
+        if (!m_Redirected || (m_SoftRelease != SOFT_RELEASE_NONE))
+        {
+            return false;
+        }
+
+        m_SoftRelease = SOFT_RELEASE_PENDING;
+        return true;
+    }
+
+    ULONG SoftReleaseState() const
+    { return m_SoftRelease; }
+
+    void MarkAsWiped()
+    {
+        m_SoftRelease = SOFT_RELEASE_WIPED;
+        m_Redirected = false;
+    }
+
+    void MarkAsReleased()
+    { m_SoftRelease = SOFT_RELEASE_NONE; }
+
+    // Soft release did not complete in time and device
+    // is going to be reset, relations must not act on it anymore
+    void CancelSoftRelease()
+    { m_SoftRelease = SOFT_RELEASE_NONE; }
+
 private:
-    CObjHolder<CRegText> m_DeviceID;
-    CObjHolder<CRegText> m_InstanceID;
+    TDeviceIdentityHolder m_Identity;
     ULONG m_Port;
-    USB_DK_DEVICE_SPEED m_Speed;
+    USB_DK_DEVICE_SPEED m_Speed = NoSpeed;
     USB_DEVICE_DESCRIPTOR m_DevDescriptor;
-    TDescriptorsCache m_CfgDescriptors;
+    // Shared with other devices having the same descriptors
+    TDescriptorSetHolder m_CfgDescriptors;
+    TDescriptorsCache m_StringDescriptors;
+
+    // Distinct interface (class, subclass, protocol) triples
+    // of all configurations, packed into ULONGs and sorted
+    typedef CPrimitiveAllocator<NonPagedPool, ULONG, 'ICHR'> TInterfaceClassesAllocator;
+    typedef CObjHolder<ULONG, TInterfaceClassesAllocator> TInterfaceClasses;
+    TInterfaceClasses m_InterfaceClasses;
+    size_t m_NumInterfaceClasses = 0;
+
     PDEVICE_OBJECT m_PDO;
     const CUsbDkFilterDevice &m_ParentDevice;
     bool m_Redirected = false;
     bool m_Indicated = false;
+    ULONG m_SoftRelease = SOFT_RELEASE_NONE;
+
+    volatile LONG m_DescriptorsState = DESCRIPTORS_PENDING;
+    CWdfWorkitem m_DescriptorsFetcher;
+    bool m_FetcherCreated = false;
+    volatile bool m_PoliciesDeferred = false;
+
+    static void FetchDescriptorsWork(PVOID Context);
+    void FetchDescriptors();
+    bool FetchConfigurationDescriptors(CWdmUsbDeviceAccess &devAccess,
+                                       TConfigDescriptorsCache &DescriptorsHolder);
+    void FetchStringDescriptors(CWdmUsbDeviceAccess &devAccess,
+                                TDescriptorsCache &DescriptorsHolder);
+    static bool CollectInterfaceClasses(TConfigDescriptorsCache &CfgDescriptors,
+                                        TInterfaceClasses &InterfaceClasses,
+                                        size_t &NumInterfaceClasses);
 
     bool CreateRedirectorDevice();
+    void CopyString(size_t CacheIndex, PWCHAR Buffer, size_t BufferChars);
 
     CUsbDkChildDevice(const CUsbDkChildDevice&) = delete;
     CUsbDkChildDevice& operator= (const CUsbDkChildDevice&) = delete;
@@ -135,7 +284,7 @@ private:
 };
 
 class CDeviceRelations;
-class CWdmUsbDeviceAccess;
+class CDeviceRelationsIndex;
 
 class CUsbDkHubFilterStrategy : public CUsbDkFilterStrategy
 {
@@ -150,10 +299,19 @@ private:
     void DropRemovedDevices(const CDeviceRelations &Relations);
     void AddNewDevices(const CDeviceRelations &Relations);
     void WipeHiddenDevices(CDeviceRelations &Relations);
+    void DropRemovedDevices(CDeviceRelationsIndex &Index);
+    void AddNewDevices(CDeviceRelationsIndex &Index);
+    void WipeHiddenDevices(CDeviceRelations &Relations, CDeviceRelationsIndex &Index);
+    bool ShouldHideChild(CUsbDkChildDevice &Child);
+    void ForgetRemovedChild(CUsbDkChildDevice &Child);
     void RegisterNewChild(PDEVICE_OBJECT PDO);
     void ApplyRedirectionPolicy(CUsbDkChildDevice &Device);
-    bool FetchConfigurationDescriptors(CWdmUsbDeviceAccess &devAccess,
-                                       CUsbDkChildDevice::TDescriptorsCache &DescriptorsHolder);
+    void ApplyDeferredPolicies();
+    void ReenumerateIfNeeded();
+
+    // Set when soft released child was wiped from relations
+    // and must be reported to PnP again
+    bool m_ReenumerationNeeded = false;
 
     bool IsChildRegistered(PDEVICE_OBJECT PDO)
     { return !Children().ForEachIf([PDO](CUsbDkChildDevice *Child){ return Child->Match(PDO); }, ConstFalse); }
@@ -188,6 +346,9 @@ public:
     PDRIVER_OBJECT GetDriverObject() const
     { return WdfDriverWdmGetDriverObject(m_Driver); }
 
+    PDEVICE_OBJECT GetPhysicalDevice() const
+    { return WdfDeviceWdmGetPhysicalDevice(WdfObject()); }
+
     ULONG GetInstanceNumber() const
     { return m_InstanceNumber; }
 
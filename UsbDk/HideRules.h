@@ -0,0 +1,581 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+#include "Alloc.h"
+#include "UsbDkUtil.h"
+#include "MemoryBuffer.h"
+#include "UsbDkDataHider.h"
+
+// Matches field values satisfying Min <= (Value & Mask) <= Max
+class CUsbDkHideRuleMatcher
+{
+public:
+    CUsbDkHideRuleMatcher(ULONG Min = 0, ULONG Max = ULONG(-1), ULONG Mask = ULONG(-1))
+        : m_Min(Min)
+        , m_Max(Max)
+        , m_Mask(Mask)
+    {}
+
+    bool Match(ULONG Value) const
+    {
+        auto MaskedValue = Value & m_Mask;
+        return (MaskedValue >= m_Min) && (MaskedValue <= m_Max);
+    }
+
+    // Single value of a field with given width is accepted
+    bool IsExact(ULONG FieldMask) const
+    {
+        return ((m_Mask & FieldMask) == FieldMask) && (m_Min == m_Max);
+    }
+
+    // Proper interval of a field with given width is accepted
+    bool IsRange(ULONG FieldMask) const
+    {
+        return ((m_Mask & FieldMask) == FieldMask) && (m_Min < m_Max) &&
+               ((m_Min != 0) || (m_Max < FieldMask));
+    }
+
+    bool MatchesAll() const
+    {
+        return (m_Min == 0) && ((m_Max == ULONG(-1)) || (m_Mask == 0));
+    }
+
+    ULONG Min() const
+    { return m_Min; }
+    ULONG Max() const
+    { return m_Max; }
+    ULONG Mask() const
+    { return m_Mask; }
+
+    bool operator ==(const CUsbDkHideRuleMatcher &Other) const
+    {
+        return m_Min == Other.m_Min &&
+               m_Max == Other.m_Max &&
+               m_Mask == Other.m_Mask;
+    }
+
+    bool operator <(const CUsbDkHideRuleMatcher &Other) const
+    {
+        return (m_Min != Other.m_Min) ? (m_Min < Other.m_Min) :
+               (m_Max != Other.m_Max) ? (m_Max < Other.m_Max) :
+                                        (m_Mask < Other.m_Mask);
+    }
+
+private:
+    ULONG m_Min;
+    ULONG m_Max;
+    ULONG m_Mask;
+};
+
+// Matches devices having some interface in some configuration
+// with class, subclass and protocol accepted by the matchers.
+// Devices are CUsbDkChildDevice or anything else providing
+// DeviceDescriptor() and AnyInterface() the same way
+class CUsbDkInterfaceMatcher
+{
+public:
+    CUsbDkInterfaceMatcher()
+    {}
+
+    CUsbDkInterfaceMatcher(const CUsbDkHideRuleMatcher &Class,
+                           const CUsbDkHideRuleMatcher &SubClass,
+                           const CUsbDkHideRuleMatcher &Protocol)
+        : m_Class(Class)
+        , m_SubClass(SubClass)
+        , m_Protocol(Protocol)
+    {}
+
+    bool MatchesAll() const
+    {
+        return m_Class.MatchesAll() && m_SubClass.MatchesAll() && m_Protocol.MatchesAll();
+    }
+
+    template <typename TDevice>
+    bool Match(const TDevice &Device) const
+    {
+        return MatchesAll() ||
+               Device.AnyInterface([this](UCHAR Class, UCHAR SubClass, UCHAR Protocol)
+                                   {
+                                       return m_Class.Match(Class)       &&
+                                              m_SubClass.Match(SubClass) &&
+                                              m_Protocol.Match(Protocol);
+                                   });
+    }
+
+    const CUsbDkHideRuleMatcher &Class() const
+    { return m_Class; }
+    const CUsbDkHideRuleMatcher &SubClass() const
+    { return m_SubClass; }
+    const CUsbDkHideRuleMatcher &Protocol() const
+    { return m_Protocol; }
+
+    bool operator ==(const CUsbDkInterfaceMatcher &Other) const
+    {
+        return m_Class == Other.m_Class       &&
+               m_SubClass == Other.m_SubClass &&
+               m_Protocol == Other.m_Protocol;
+    }
+
+    bool operator <(const CUsbDkInterfaceMatcher &Other) const
+    {
+        return !(m_Class == Other.m_Class)       ? (m_Class < Other.m_Class)       :
+               !(m_SubClass == Other.m_SubClass) ? (m_SubClass < Other.m_SubClass) :
+                                                   (m_Protocol < Other.m_Protocol);
+    }
+
+    void Dump() const;
+
+private:
+    CUsbDkHideRuleMatcher m_Class;
+    CUsbDkHideRuleMatcher m_SubClass;
+    CUsbDkHideRuleMatcher m_Protocol;
+};
+
+class CUsbDkHideRule : public CAllocatable < NonPagedPool, 'RHHR' >
+{
+public:
+
+    CUsbDkHideRule(bool Hide,
+                   const CUsbDkHideRuleMatcher &Class,
+                   const CUsbDkHideRuleMatcher &VID,
+                   const CUsbDkHideRuleMatcher &PID,
+                   const CUsbDkHideRuleMatcher &BCD,
+                   const CUsbDkInterfaceMatcher &Interfaces)
+        : m_Hide(Hide)
+        , m_Class(Class)
+        , m_VID(VID)
+        , m_PID(PID)
+        , m_BCD(BCD)
+        , m_Interfaces(Interfaces)
+    {}
+
+    template <typename TDevice>
+    bool Match(const TDevice &Device) const
+    {
+        const auto &Descriptor = Device.DeviceDescriptor();
+
+        return m_Class.Match(Descriptor.bDeviceClass) &&
+               m_VID.Match(Descriptor.idVendor)       &&
+               m_PID.Match(Descriptor.idProduct)      &&
+               m_BCD.Match(Descriptor.bcdDevice)      &&
+               m_Interfaces.Match(Device);
+    }
+
+    bool UsesInterfaces() const
+    {
+        return !m_Interfaces.MatchesAll();
+    }
+
+    bool ShouldHide() const
+    {
+        return m_Hide;
+    }
+
+    bool ForceDecision() const
+    {
+        //All do-not-hide rules are terminal
+        return !m_Hide;
+    }
+
+    void Export(bool &Hide,
+                CUsbDkHideRuleMatcher &Class,
+                CUsbDkHideRuleMatcher &VID,
+                CUsbDkHideRuleMatcher &PID,
+                CUsbDkHideRuleMatcher &BCD,
+                CUsbDkInterfaceMatcher &Interfaces) const
+    {
+        Hide = m_Hide;
+        Class = m_Class;
+        VID = m_VID;
+        PID = m_PID;
+        BCD = m_BCD;
+        Interfaces = m_Interfaces;
+    }
+
+    bool operator ==(const CUsbDkHideRule &Other) const
+    {
+        return m_Hide == Other.m_Hide   &&
+               m_Class == Other.m_Class &&
+               m_VID == Other.m_VID     &&
+               m_PID == Other.m_PID     &&
+               m_BCD == Other.m_BCD     &&
+               m_Interfaces == Other.m_Interfaces;
+
+    }
+
+    bool operator <(const CUsbDkHideRule &Other) const
+    {
+        return (m_Hide != Other.m_Hide)   ? (m_Hide < Other.m_Hide)   :
+               !(m_Class == Other.m_Class) ? (m_Class < Other.m_Class) :
+               !(m_VID == Other.m_VID)     ? (m_VID < Other.m_VID)     :
+               !(m_PID == Other.m_PID)     ? (m_PID < Other.m_PID)     :
+               !(m_BCD == Other.m_BCD)     ? (m_BCD < Other.m_BCD)     :
+                                             (m_Interfaces < Other.m_Interfaces);
+    }
+
+    // Counted by lock-free readers on each match
+    void CountHit() const
+    {
+        LARGE_INTEGER Now;
+        KeQuerySystemTime(&Now);
+
+        InterlockedIncrement64(&m_Hits);
+        InterlockedExchange64(&m_LastHitTime, Now.QuadPart);
+    }
+
+    void Export(USB_DK_HIDE_RULE_STATISTICS &Statistics) const;
+
+    void Dump() const;
+
+private:
+    bool                  m_Hide;
+    CUsbDkHideRuleMatcher m_Class;
+    CUsbDkHideRuleMatcher m_VID;
+    CUsbDkHideRuleMatcher m_PID;
+    CUsbDkHideRuleMatcher m_BCD;
+    CUsbDkInterfaceMatcher m_Interfaces;
+
+    mutable volatile LONG64 m_Hits = 0;
+    mutable volatile LONG64 m_LastHitTime = 0;
+
+    DECLARE_CWDMLIST_ENTRY(CUsbDkHideRule);
+};
+
+// Hide rules compiled for lookup by device characteristics.
+// Dynamic and persistent rules are walked as separate sets: within
+// a set do-not-hide rules are terminal and all hide rules lead to the
+// same decision, so the set decides to hide if device matches some
+// of its hide rules and none of its do-not-hide rules, regardless of
+// rules order. Decision of persistent set overrides decision of
+// dynamic set, a set with no matching rules decides nothing.
+// Rules are bucketed by exact VID, by VID interval, by exact class
+// for rules matching other VIDs, the rest go to global bucket.
+// Buckets are kept in one array sorted by bucket key and found by
+// binary search. VID intervals are sorted by lower bound and carry
+// running maximum of upper bounds, so only intervals that may contain
+// the VID are visited.
+// Entries refer to their rules for hit counting, so rules must
+// outlive the index.
+// Identical devices get the same decision, so decisions are cached
+// by device descriptor characteristics. Cache belongs to the index
+// and is dropped with it whenever rules change. Rules matching
+// interfaces depend on more than descriptor, such rule sets are not
+// cached. Decisions taken from the cache do not count rule hits.
+class CUsbDkHideRulesIndex : public CAllocatable<NonPagedPool, 'IHHR'>
+{
+public:
+    enum : ULONG
+    {
+        DYNAMIC_RULES,
+        PERSISTENT_RULES,
+        NUM_RULE_SETS
+    };
+
+    NTSTATUS Create(size_t NumRules);
+    void Add(const CUsbDkHideRule &Rule, ULONG Set);
+    void Compile();
+
+    template <typename TDevice>
+    bool ShouldHide(const TDevice &Device, bool &Cached) const;
+
+private:
+    struct CEntry
+    {
+        ULONG64 Key;
+        const CUsbDkHideRule *Rule;
+        ULONG Set;
+        bool Hide;
+        CUsbDkHideRuleMatcher Class;
+        CUsbDkHideRuleMatcher VID;
+        CUsbDkHideRuleMatcher PID;
+        CUsbDkHideRuleMatcher BCD;
+        CUsbDkInterfaceMatcher Interfaces;
+        ULONG VIDRangeEnd;
+
+        template <typename TDevice>
+        bool Match(const TDevice &Device) const
+        {
+            const auto &Descriptor = Device.DeviceDescriptor();
+
+            return Class.Match(Descriptor.bDeviceClass) &&
+                   VID.Match(Descriptor.idVendor)       &&
+                   PID.Match(Descriptor.idProduct)      &&
+                   BCD.Match(Descriptor.bcdDevice)      &&
+                   Interfaces.Match(Device);
+        }
+    };
+
+    enum : ULONG64
+    {
+        VID_BUCKET       = 0ULL << 32,
+        VID_RANGE_BUCKET = 1ULL << 32,
+        CLASS_BUCKET     = 2ULL << 32,
+        GLOBAL_BUCKET    = 3ULL << 32,
+        BUCKET_MASK      = ~0ULL << 32
+    };
+
+    static ULONG64 KeyOf(const CEntry &Entry)
+    { return Entry.Key; }
+
+    // Direct mapped cache of lock-free slots holding
+    // valid bit, decision and class, VID, PID, BCD tuple
+    enum : ULONG64
+    {
+        DECISION_VALID    = 1ULL << 63,
+        DECISION_HIDE     = 1ULL << 62,
+        DECISION_KEY_MASK = (1ULL << 56) - 1
+    };
+
+    enum : size_t
+    {
+        DECISION_CACHE_SIZE = 256
+    };
+
+    static ULONG64 DecisionKeyOf(const USB_DEVICE_DESCRIPTOR &Descriptor)
+    {
+        return (ULONG64(Descriptor.bDeviceClass) << 48) |
+               (ULONG64(Descriptor.idVendor) << 32)     |
+               (ULONG64(Descriptor.idProduct) << 16)    |
+               Descriptor.bcdDevice;
+    }
+
+    volatile LONG64 &DecisionSlot(ULONG64 Key) const
+    { return m_DecisionCache[(Key * 0x9E3779B97F4A7C15ULL) >> 56]; }
+
+    class CDecision
+    {
+    public:
+        // Returns false once decision cannot change anymore
+        bool Account(const CEntry &Entry);
+        bool IsDecided(ULONG Set) const
+        { return m_NotHide[Set]; }
+        bool ShouldHide() const;
+
+    private:
+        bool m_Matched[NUM_RULE_SETS] = {};
+        bool m_NotHide[NUM_RULE_SETS] = {};
+    };
+
+    template <typename TDevice>
+    bool Evaluate(const TDevice &Device) const;
+
+    // Return false once decision is final
+    template <typename TDevice>
+    bool VisitEntry(const CEntry &Entry, const TDevice &Device, CDecision &Decision) const;
+    template <typename TDevice>
+    bool VisitBucket(ULONG64 Key, const TDevice &Device, CDecision &Decision) const;
+    template <typename TDevice>
+    bool VisitVIDRanges(const TDevice &Device, CDecision &Decision) const;
+
+    CEntry *Entries() const
+    { return static_cast<CEntry *>(m_Buffer.Ptr()); }
+
+    CWdmMemoryBuffer m_Buffer;
+    size_t m_Capacity = 0;
+    size_t m_Count = 0;
+    bool m_UsesInterfaces = false;
+
+    mutable volatile LONG64 m_DecisionCache[DECISION_CACHE_SIZE] = {};
+};
+
+inline NTSTATUS CUsbDkHideRulesIndex::Create(size_t NumRules)
+{
+    m_Capacity = NumRules;
+    m_Count = 0;
+
+    return (NumRules != 0) ? m_Buffer.Create(NumRules * sizeof(CEntry), NonPagedPool)
+                           : STATUS_SUCCESS;
+}
+
+inline void CUsbDkHideRulesIndex::Add(const CUsbDkHideRule &Rule, ULONG Set)
+{
+    if (m_Count == m_Capacity)
+    {
+        ASSERT(m_Count < m_Capacity);
+        return;
+    }
+
+    auto &Entry = Entries()[m_Count++];
+
+    Entry.Rule = &Rule;
+    Entry.Set = Set;
+    Rule.Export(Entry.Hide, Entry.Class, Entry.VID, Entry.PID, Entry.BCD, Entry.Interfaces);
+    Entry.VIDRangeEnd = Entry.VID.Max();
+
+    if (!Entry.Interfaces.MatchesAll())
+    {
+        m_UsesInterfaces = true;
+    }
+
+    if (Entry.VID.IsExact(MAXUSHORT))
+    {
+        Entry.Key = VID_BUCKET | Entry.VID.Min();
+    }
+    else if (Entry.VID.IsRange(MAXUSHORT))
+    {
+        Entry.Key = VID_RANGE_BUCKET | Entry.VID.Min();
+    }
+    else if (Entry.Class.IsExact(MAXUCHAR))
+    {
+        Entry.Key = CLASS_BUCKET | Entry.Class.Min();
+    }
+    else
+    {
+        Entry.Key = GLOBAL_BUCKET;
+    }
+}
+
+inline void CUsbDkHideRulesIndex::Compile()
+{
+    UsbDkHeapSort(Entries(), m_Count, [](const CEntry &a, const CEntry &b) { return a.Key < b.Key; });
+
+    auto i = UsbDkLowerBound(Entries(), m_Count, VID_RANGE_BUCKET, KeyOf);
+    if ((i < m_Count) && ((Entries()[i].Key & BUCKET_MASK) == VID_RANGE_BUCKET))
+    {
+        for (auto RangeEnd = Entries()[i++].VIDRangeEnd;
+             (i < m_Count) && ((Entries()[i].Key & BUCKET_MASK) == VID_RANGE_BUCKET);
+             i++)
+        {
+            RangeEnd = max(RangeEnd, Entries()[i].VIDRangeEnd);
+            Entries()[i].VIDRangeEnd = RangeEnd;
+        }
+    }
+}
+
+inline bool CUsbDkHideRulesIndex::CDecision::Account(const CEntry &Entry)
+{
+    m_Matched[Entry.Set] = true;
+
+    if (!Entry.Hide)
+    {
+        m_NotHide[Entry.Set] = true;
+    }
+
+    // Nothing overrides do-not-hide rule of persistent set
+    return !m_NotHide[PERSISTENT_RULES];
+}
+
+inline bool CUsbDkHideRulesIndex::CDecision::ShouldHide() const
+{
+    if (m_Matched[PERSISTENT_RULES])
+    {
+        return !m_NotHide[PERSISTENT_RULES];
+    }
+
+    return m_Matched[DYNAMIC_RULES] && !m_NotHide[DYNAMIC_RULES];
+}
+
+template <typename TDevice>
+bool CUsbDkHideRulesIndex::VisitEntry(const CEntry &Entry, const TDevice &Device, CDecision &Decision) const
+{
+    // Rules walk of the set stops on first do-not-hide match
+    if (Decision.IsDecided(Entry.Set) || !Entry.Match(Device))
+    {
+        return true;
+    }
+
+    Entry.Rule->CountHit();
+    return Decision.Account(Entry);
+}
+
+template <typename TDevice>
+bool CUsbDkHideRulesIndex::VisitBucket(ULONG64 Key, const TDevice &Device, CDecision &Decision) const
+{
+    for (auto i = UsbDkLowerBound(Entries(), m_Count, Key, KeyOf);
+         (i < m_Count) && (Entries()[i].Key == Key);
+         i++)
+    {
+        if (!VisitEntry(Entries()[i], Device, Decision))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename TDevice>
+bool CUsbDkHideRulesIndex::VisitVIDRanges(const TDevice &Device, CDecision &Decision) const
+{
+    // Intervals starting above the VID follow the candidates,
+    // walk back until running maximum drops below the VID
+    const auto &Descriptor = Device.DeviceDescriptor();
+    auto First = UsbDkLowerBound(Entries(), m_Count, VID_RANGE_BUCKET, KeyOf);
+    auto i = UsbDkLowerBound(Entries(), m_Count, VID_RANGE_BUCKET | (Descriptor.idVendor + 1ULL), KeyOf);
+
+    while ((i > First) && (Entries()[i - 1].VIDRangeEnd >= Descriptor.idVendor))
+    {
+        if (!VisitEntry(Entries()[--i], Device, Decision))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename TDevice>
+bool CUsbDkHideRulesIndex::ShouldHide(const TDevice &Device, bool &Cached) const
+{
+    Cached = false;
+
+    if (m_UsesInterfaces)
+    {
+        return Evaluate(Device);
+    }
+
+    auto Key = DecisionKeyOf(Device.DeviceDescriptor());
+    auto &Slot = DecisionSlot(Key);
+
+    // Slot may be overwritten by a concurrent decision for another
+    // device, 64-bit interlocked read keeps it consistent on x86 too
+    auto Decision = static_cast<ULONG64>(InterlockedCompareExchange64(&Slot, 0, 0));
+    if ((Decision & (DECISION_VALID | DECISION_KEY_MASK)) == (DECISION_VALID | Key))
+    {
+        Cached = true;
+        return (Decision & DECISION_HIDE) != 0;
+    }
+
+    auto Hide = Evaluate(Device);
+
+    InterlockedExchange64(&Slot, DECISION_VALID | (Hide ? static_cast<ULONG64>(DECISION_HIDE) : 0) | Key);
+    return Hide;
+}
+
+template <typename TDevice>
+bool CUsbDkHideRulesIndex::Evaluate(const TDevice &Device) const
+{
+    const auto &Descriptor = Device.DeviceDescriptor();
+    CDecision Decision;
+
+    if (VisitBucket(VID_BUCKET | Descriptor.idVendor, Device, Decision)       &&
+        VisitVIDRanges(Device, Decision)                                      &&
+        VisitBucket(CLASS_BUCKET | Descriptor.bDeviceClass, Device, Decision))
+    {
+        VisitBucket(GLOBAL_BUCKET, Device, Decision);
+    }
+
+    return Decision.ShouldHide();
+}
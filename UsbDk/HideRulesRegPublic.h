@@ -32,11 +32,61 @@
 #define USBDK_HIDE_RULE_BCD             TEXT("BCD")
 #define USBDK_HIDE_RULE_CLASS           TEXT("Class")
 
+// Interface matchers are optional, absent value matches any interface
+#define USBDK_HIDE_RULE_INTERFACE_CLASS     TEXT("InterfaceClass")
+#define USBDK_HIDE_RULE_INTERFACE_SUBCLASS  TEXT("InterfaceSubClass")
+#define USBDK_HIDE_RULE_INTERFACE_PROTOCOL  TEXT("InterfaceProtocol")
+
+// Optional upper bound and mask of range rules, lower bound
+// is kept in the value named after the field itself
+#define USBDK_HIDE_RULE_MAX_SUFFIX      TEXT("Max")
+#define USBDK_HIDE_RULE_MASK_SUFFIX     TEXT("Mask")
+#define USBDK_HIDE_RULE_VID_MAX         USBDK_HIDE_RULE_VID USBDK_HIDE_RULE_MAX_SUFFIX
+#define USBDK_HIDE_RULE_VID_MASK        USBDK_HIDE_RULE_VID USBDK_HIDE_RULE_MASK_SUFFIX
+#define USBDK_HIDE_RULE_PID_MAX         USBDK_HIDE_RULE_PID USBDK_HIDE_RULE_MAX_SUFFIX
+#define USBDK_HIDE_RULE_PID_MASK        USBDK_HIDE_RULE_PID USBDK_HIDE_RULE_MASK_SUFFIX
+#define USBDK_HIDE_RULE_BCD_MAX         USBDK_HIDE_RULE_BCD USBDK_HIDE_RULE_MAX_SUFFIX
+#define USBDK_HIDE_RULE_BCD_MASK        USBDK_HIDE_RULE_BCD USBDK_HIDE_RULE_MASK_SUFFIX
+#define USBDK_HIDE_RULE_CLASS_MAX       USBDK_HIDE_RULE_CLASS USBDK_HIDE_RULE_MAX_SUFFIX
+#define USBDK_HIDE_RULE_CLASS_MASK      USBDK_HIDE_RULE_CLASS USBDK_HIDE_RULE_MASK_SUFFIX
+#define USBDK_HIDE_RULE_INTERFACE_CLASS_MAX     USBDK_HIDE_RULE_INTERFACE_CLASS USBDK_HIDE_RULE_MAX_SUFFIX
+#define USBDK_HIDE_RULE_INTERFACE_CLASS_MASK    USBDK_HIDE_RULE_INTERFACE_CLASS USBDK_HIDE_RULE_MASK_SUFFIX
+#define USBDK_HIDE_RULE_INTERFACE_SUBCLASS_MAX  USBDK_HIDE_RULE_INTERFACE_SUBCLASS USBDK_HIDE_RULE_MAX_SUFFIX
+#define USBDK_HIDE_RULE_INTERFACE_SUBCLASS_MASK USBDK_HIDE_RULE_INTERFACE_SUBCLASS USBDK_HIDE_RULE_MASK_SUFFIX
+#define USBDK_HIDE_RULE_INTERFACE_PROTOCOL_MAX  USBDK_HIDE_RULE_INTERFACE_PROTOCOL USBDK_HIDE_RULE_MAX_SUFFIX
+#define USBDK_HIDE_RULE_INTERFACE_PROTOCOL_MASK USBDK_HIDE_RULE_INTERFACE_PROTOCOL USBDK_HIDE_RULE_MASK_SUFFIX
+
+// All persistent hide rules may be kept in one binary value
+// of hide rules key instead of a subkey per rule
+#define USBDK_HIDE_RULES_TABLE          TEXT("HideRulesTable")
+
+// Rules of the table are also indexed by values named after
+// rule hash, each keeping all rules of the table with that hash,
+// so presence of a rule is checked by reading one value.
+// Index marker value exists once all rules of the table are indexed.
+#define USBDK_HIDE_RULES_INDEXED        TEXT("HideRulesIndexed")
+
+#define USBDK_REDIRECT_RULES_SUBKEY_NAME TEXT("RedirectRules")
+
+#define USBDK_REDIRECT_RULE_VID         USBDK_HIDE_RULE_VID
+#define USBDK_REDIRECT_RULE_PID         USBDK_HIDE_RULE_PID
+#define USBDK_REDIRECT_RULE_BCD         USBDK_HIDE_RULE_BCD
+#define USBDK_REDIRECT_RULE_CLASS       USBDK_HIDE_RULE_CLASS
+#define USBDK_REDIRECT_RULE_PORT        TEXT("Port")
+#define USBDK_REDIRECT_RULE_INTERFACE_CLASS     USBDK_HIDE_RULE_INTERFACE_CLASS
+#define USBDK_REDIRECT_RULE_INTERFACE_SUBCLASS  USBDK_HIDE_RULE_INTERFACE_SUBCLASS
+#define USBDK_REDIRECT_RULE_INTERFACE_PROTOCOL  USBDK_HIDE_RULE_INTERFACE_PROTOCOL
+
 #define USBDK_HIDE_RULES_PATH    TEXT("SYSTEM\\CurrentControlSet\\Services\\") \
                                  USBDK_DRIVER_NAME TEXT("\\")                  \
                                  USBDK_PARAMS_SUBKEY_NAME TEXT("\\")           \
                                  USBDK_HIDE_RULES_SUBKEY_NAME TEXT("\\")
 
+#define USBDK_REDIRECT_RULES_PATH TEXT("SYSTEM\\CurrentControlSet\\Services\\") \
+                                  USBDK_DRIVER_NAME TEXT("\\")                  \
+                                  USBDK_PARAMS_SUBKEY_NAME TEXT("\\")           \
+                                  USBDK_REDIRECT_RULES_SUBKEY_NAME TEXT("\\")
+
 #define USBDK_REG_HIDE_RULE_MATCH_ALL ULONG(-1)
 
 static inline ULONG64 HideRuleUlongMaskFromRegistry(DWORD Value)
@@ -45,7 +95,144 @@ static inline ULONG64 HideRuleUlongMaskFromRegistry(DWORD Value)
                                                     : Value;
 }
 
+// Registry keeps 32-bit values, 64-bit match-all of open-ended
+// bounds and masks is mapped to 32-bit match-all and back
+static inline DWORD HideRuleUlongMaskToRegistry(ULONG64 Value)
+{
+    return (Value == USB_DK_HIDE_RULE_MATCH_ALL) ? USBDK_REG_HIDE_RULE_MATCH_ALL
+                                                 : static_cast<DWORD>(Value);
+}
+
 static inline ULONG64 HideRuleBoolFromRegistry(DWORD Value)
 {
     return !!Value;
 }
+
+// Matcher accepting exactly the values accepted by
+// legacy hide rule field
+static inline void HideRuleMatcherFromV1(ULONG64 Value, USB_DK_HIDE_RULE_MATCHER &Matcher)
+{
+    if (Value == USB_DK_HIDE_RULE_MATCH_ALL)
+    {
+        Matcher.Min = 0;
+        Matcher.Max = USB_DK_HIDE_RULE_MATCH_ALL;
+    }
+    else
+    {
+        Matcher.Min = Matcher.Max = Value;
+    }
+
+    Matcher.Mask = USB_DK_HIDE_RULE_MATCH_ALL;
+}
+
+static inline void HideRuleV2FromV1(const USB_DK_HIDE_RULE &Rule, USB_DK_HIDE_RULE_V2 &RuleV2)
+{
+    RuleV2.Hide = Rule.Hide;
+    HideRuleMatcherFromV1(Rule.Class, RuleV2.Class);
+    HideRuleMatcherFromV1(Rule.VID, RuleV2.VID);
+    HideRuleMatcherFromV1(Rule.PID, RuleV2.PID);
+    HideRuleMatcherFromV1(Rule.BCD, RuleV2.BCD);
+    HideRuleMatcherFromV1(USB_DK_HIDE_RULE_MATCH_ALL, RuleV2.InterfaceClass);
+    HideRuleMatcherFromV1(USB_DK_HIDE_RULE_MATCH_ALL, RuleV2.InterfaceSubClass);
+    HideRuleMatcherFromV1(USB_DK_HIDE_RULE_MATCH_ALL, RuleV2.InterfaceProtocol);
+}
+
+// Hide rules table is a header followed by NumRules entries
+// of RuleSize bytes each. Entry starts with USB_DK_HIDE_RULE_V2,
+// later versions of the table may only append fields to entries,
+// so readers ignore the tail of entries longer than they know.
+#define USBDK_HIDE_RULES_TABLE_SIGNATURE    (0x54524844) // "DHRT"
+#define USBDK_HIDE_RULES_TABLE_VERSION      (1)
+
+typedef struct tag_USB_DK_HIDE_RULES_TABLE_HEADER
+{
+    ULONG Signature;
+    ULONG Version;
+    ULONG RuleSize;
+    ULONG NumRules;
+} USB_DK_HIDE_RULES_TABLE_HEADER;
+
+static inline ULONG64 HideRulesTableSize(ULONG NumRules)
+{
+    return sizeof(USB_DK_HIDE_RULES_TABLE_HEADER) + static_cast<ULONG64>(NumRules) * sizeof(USB_DK_HIDE_RULE_V2);
+}
+
+// Returns false if blob is not a complete table of known version
+static inline bool HideRulesTableParse(const void *Table, ULONG64 TableSize, USB_DK_HIDE_RULES_TABLE_HEADER &Header)
+{
+    if (TableSize < sizeof(Header))
+    {
+        return false;
+    }
+
+    memcpy(&Header, Table, sizeof(Header));
+
+    return (Header.Signature == USBDK_HIDE_RULES_TABLE_SIGNATURE) &&
+           (Header.Version == USBDK_HIDE_RULES_TABLE_VERSION)     &&
+           (Header.RuleSize >= sizeof(USB_DK_HIDE_RULE_V2))       &&
+           ((TableSize - sizeof(Header)) / Header.RuleSize >= Header.NumRules);
+}
+
+static inline void HideRulesTableGetRule(const void *Table, const USB_DK_HIDE_RULES_TABLE_HEADER &Header,
+                                         ULONG Index, USB_DK_HIDE_RULE_V2 &Rule)
+{
+    auto Entry = static_cast<const unsigned char *>(Table) + sizeof(Header) + static_cast<size_t>(Index) * Header.RuleSize;
+    memcpy(&Rule, Entry, sizeof(Rule));
+}
+
+// Table buffer must be HideRulesTableSize(NumRules) bytes long
+static inline void HideRulesTableInit(void *Table, ULONG NumRules)
+{
+    USB_DK_HIDE_RULES_TABLE_HEADER Header;
+    Header.Signature = USBDK_HIDE_RULES_TABLE_SIGNATURE;
+    Header.Version = USBDK_HIDE_RULES_TABLE_VERSION;
+    Header.RuleSize = sizeof(USB_DK_HIDE_RULE_V2);
+    Header.NumRules = NumRules;
+
+    memcpy(Table, &Header, sizeof(Header));
+}
+
+static inline void HideRulesTableSetRule(void *Table, ULONG Index, const USB_DK_HIDE_RULE_V2 &Rule)
+{
+    auto Entry = static_cast<unsigned char *>(Table) + sizeof(USB_DK_HIDE_RULES_TABLE_HEADER) + static_cast<size_t>(Index) * sizeof(Rule);
+    memcpy(Entry, &Rule, sizeof(Rule));
+}
+
+static inline ULONG64 HideRuleHash(const USB_DK_HIDE_RULE_V2 &Rule)
+{
+    // FNV-1a
+    auto Bytes = reinterpret_cast<const unsigned char *>(&Rule);
+    ULONG64 Hash = 0xCBF29CE484222325ULL;
+
+    for (size_t i = 0; i < sizeof(Rule); i++)
+    {
+        Hash ^= Bytes[i];
+        Hash *= 0x100000001B3ULL;
+    }
+
+    return Hash;
+}
+
+// Index value name is "HideRule" followed by 16 hex digits of rule hash
+#define USBDK_HIDE_RULE_INDEX_NAME_LENGTH   (8 + 16 + 1)
+
+template <typename TChar>
+static inline void HideRuleIndexName(const USB_DK_HIDE_RULE_V2 &Rule, TChar (&Name)[USBDK_HIDE_RULE_INDEX_NAME_LENGTH])
+{
+    static const char Prefix[] = "HideRule";
+    static const char Digits[] = "0123456789ABCDEF";
+
+    size_t Pos = 0;
+    for (; Pos < sizeof(Prefix) - 1; Pos++)
+    {
+        Name[Pos] = static_cast<TChar>(Prefix[Pos]);
+    }
+
+    auto Hash = HideRuleHash(Rule);
+    for (int Shift = 60; Shift >= 0; Shift -= 4, Pos++)
+    {
+        Name[Pos] = static_cast<TChar>(Digits[(Hash >> Shift) & 0xF]);
+    }
+
+    Name[Pos] = 0;
+}
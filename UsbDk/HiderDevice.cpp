@@ -76,6 +76,105 @@ void CUsbDkHiderDeviceQueue::SetCallbacks(WDF_IO_QUEUE_CONFIG &QueueConfig)
     QueueConfig.EvtIoDeviceControl = CUsbDkHiderDeviceQueue::DeviceControl;
 }
 
+template <typename TRule>
+void CUsbDkHiderDeviceQueue::AddHideRule(WDFQUEUE Queue, CWdfRequest &WdfRequest)
+{
+    TRule *Rule;
+
+    auto status = WdfRequest.FetchInputObject(Rule);
+    if (!NT_SUCCESS(status))
+    {
+        WdfRequest.SetBytesRead(0);
+        WdfRequest.SetStatus(status);
+        return;
+    }
+
+    auto devExt = UsbDkHiderGetContext(WdfIoQueueGetDevice(Queue));
+    auto ControlDevice = CUsbDkControlDevice::Reference(devExt->UsbDkHider->DriverHandle());
+    if (ControlDevice == nullptr)
+    {
+        WdfRequest.SetBytesRead(0);
+        WdfRequest.SetStatus(STATUS_INSUFFICIENT_RESOURCES);
+        return;
+    }
+
+    status = ControlDevice->AddHideRule(*Rule);
+
+    CUsbDkControlDevice::Release();
+    WdfRequest.SetBytesRead(sizeof(*Rule));
+    WdfRequest.SetStatus(status);
+}
+
+void CUsbDkHiderDeviceQueue::ReplaceHideRules(WDFQUEUE Queue, CWdfRequest &WdfRequest, size_t InputBufferLength)
+{
+    WdfRequest.SetBytesRead(0);
+
+    if (InputBufferLength % sizeof(USB_DK_HIDE_RULE_V2) != 0)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_HIDERDEVICE, "%!FUNC! Wrong request buffer size (%llu)", InputBufferLength);
+        WdfRequest.SetStatus(STATUS_INVALID_BUFFER_SIZE);
+        return;
+    }
+
+    // Empty request drops all dynamic rules
+    USB_DK_HIDE_RULE_V2 *Rules = nullptr;
+    size_t NumRules = 0;
+    if (InputBufferLength != 0)
+    {
+        auto status = WdfRequest.FetchInputArray(Rules, NumRules);
+        if (!NT_SUCCESS(status))
+        {
+            WdfRequest.SetStatus(status);
+            return;
+        }
+    }
+
+    auto devExt = UsbDkHiderGetContext(WdfIoQueueGetDevice(Queue));
+    auto ControlDevice = CUsbDkControlDevice::Reference(devExt->UsbDkHider->DriverHandle());
+    if (ControlDevice == nullptr)
+    {
+        WdfRequest.SetStatus(STATUS_INSUFFICIENT_RESOURCES);
+        return;
+    }
+
+    auto status = ControlDevice->ReplaceHideRules(Rules, NumRules);
+
+    CUsbDkControlDevice::Release();
+    WdfRequest.SetBytesRead(NumRules * sizeof(*Rules));
+    WdfRequest.SetStatus(status);
+}
+
+void CUsbDkHiderDeviceQueue::GetHideStatistics(WDFQUEUE Queue, CWdfRequest &WdfRequest)
+{
+    PUSB_DK_HIDE_STATISTICS Statistics;
+    size_t OutputLength;
+
+    auto status = WdfRequest.FetchOutputObject(Statistics, &OutputLength);
+    if (!NT_SUCCESS(status))
+    {
+        WdfRequest.SetStatus(status);
+        return;
+    }
+
+    auto devExt = UsbDkHiderGetContext(WdfIoQueueGetDevice(Queue));
+    auto ControlDevice = CUsbDkControlDevice::Reference(devExt->UsbDkHider->DriverHandle());
+    if (ControlDevice == nullptr)
+    {
+        WdfRequest.SetStatus(STATUS_INSUFFICIENT_RESOURCES);
+        return;
+    }
+
+    // Rules statistics follow the header as far as buffer allows
+    size_t NumRules;
+    ControlDevice->GetHideStatistics(*Statistics,
+                                     (OutputLength - sizeof(*Statistics)) / sizeof(USB_DK_HIDE_RULE_STATISTICS),
+                                     NumRules);
+
+    CUsbDkControlDevice::Release();
+    WdfRequest.SetOutputDataLen(sizeof(*Statistics) + NumRules * sizeof(USB_DK_HIDE_RULE_STATISTICS));
+    WdfRequest.SetStatus(STATUS_SUCCESS);
+}
+
 void CUsbDkHiderDeviceQueue::DeviceControl(WDFQUEUE Queue,
                                            WDFREQUEST Request,
                                            size_t OutputBufferLength,
@@ -88,30 +187,22 @@ void CUsbDkHiderDeviceQueue::DeviceControl(WDFQUEUE Queue,
     {
         case IOCTL_USBDK_ADD_HIDE_RULE:
         {
-            PUSB_DK_HIDE_RULE Rule;
-
-            auto status = WdfRequest.FetchInputObject(Rule);
-            if (!NT_SUCCESS(status))
-            {
-                WdfRequest.SetBytesRead(0);
-                WdfRequest.SetStatus(status);
-                return;
-            }
-
-            auto devExt = UsbDkHiderGetContext(WdfIoQueueGetDevice(Queue));
-            auto ControlDevice = CUsbDkControlDevice::Reference(devExt->UsbDkHider->DriverHandle());
-            if (ControlDevice == nullptr)
-            {
-                WdfRequest.SetBytesRead(0);
-                WdfRequest.SetStatus(STATUS_INSUFFICIENT_RESOURCES);
-                return;
-            }
-
-            status = ControlDevice->AddHideRule(*Rule);
-
-            CUsbDkControlDevice::Release();
-            WdfRequest.SetBytesRead(sizeof(Rule));
-            WdfRequest.SetStatus(status);
+            AddHideRule<USB_DK_HIDE_RULE>(Queue, WdfRequest);
+            return;
+        }
+        case IOCTL_USBDK_ADD_HIDE_RULE_V2:
+        {
+            AddHideRule<USB_DK_HIDE_RULE_V2>(Queue, WdfRequest);
+            return;
+        }
+        case IOCTL_USBDK_REPLACE_HIDE_RULES:
+        {
+            ReplaceHideRules(Queue, WdfRequest, InputBufferLength);
+            return;
+        }
+        case IOCTL_USBDK_GET_HIDE_STATISTICS:
+        {
+            GetHideStatistics(Queue, WdfRequest);
             return;
         }
         case IOCTL_USBDK_CLEAR_HIDE_RULES:
@@ -43,6 +43,11 @@ private:
                               size_t InputBufferLength,
                               ULONG IoControlCode);
 
+    template <typename TRule>
+    static void AddHideRule(WDFQUEUE Queue, CWdfRequest &WdfRequest);
+    static void ReplaceHideRules(WDFQUEUE Queue, CWdfRequest &WdfRequest, size_t InputBufferLength);
+    static void GetHideStatistics(WDFQUEUE Queue, CWdfRequest &WdfRequest);
+
     CUsbDkHiderDeviceQueue(const CUsbDkHiderDeviceQueue&) = delete;
     CUsbDkHiderDeviceQueue& operator= (const CUsbDkHiderDeviceQueue&) = delete;
 };
@@ -43,12 +43,32 @@
     ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x855, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS))
 #define IOCTL_USBDK_UPDATE_REG_PARAMETERS \
     ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x858, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS))
+#define IOCTL_USBDK_ADD_REDIRECT_BATCH \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x859, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
+#define IOCTL_USBDK_GET_ALL_DESCRIPTORS \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x85A, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
+#define IOCTL_USBDK_GET_DEVICE_STRINGS \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x85B, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
+#define IOCTL_USBDK_ADD_REDIRECT_RULE \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x85C, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
+#define IOCTL_USBDK_CLEAR_REDIRECT_RULES \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x85D, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
+#define IOCTL_USBDK_GET_MEMORY_STATISTICS \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x861, METHOD_BUFFERED, FILE_READ_ACCESS ))
+#define IOCTL_USBDK_ENUM_DEVICES_V2 \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x862, METHOD_BUFFERED, FILE_READ_ACCESS ))
 
 // UsbDk Hider device IOCTLs
 #define IOCTL_USBDK_ADD_HIDE_RULE \
     ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x856, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
 #define IOCTL_USBDK_CLEAR_HIDE_RULES \
     ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x857, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
+#define IOCTL_USBDK_ADD_HIDE_RULE_V2 \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x85E, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
+#define IOCTL_USBDK_REPLACE_HIDE_RULES \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x85F, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
+#define IOCTL_USBDK_GET_HIDE_STATISTICS \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x860, METHOD_BUFFERED, FILE_READ_ACCESS ))
 
 //UsbDk redirector device IOCTLs
 #define IOCTL_USBDK_DEVICE_ABORT_PIPE \
@@ -63,6 +83,8 @@
     ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x956, METHOD_BUFFERED, FILE_WRITE_ACCESS ))
 #define IOCTL_USBDK_DEVICE_READ_PIPE \
     ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x957, METHOD_BUFFERED, FILE_READ_ACCESS ))
+#define IOCTL_USBDK_DEVICE_SOFT_RELEASE \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x958, METHOD_BUFFERED, FILE_WRITE_ACCESS ))
 
 typedef struct tag_USBDK_ALTSETTINGS_IDXS
 {
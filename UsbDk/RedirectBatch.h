@@ -0,0 +1,211 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+#include "Alloc.h"
+#include "MemoryBuffer.h"
+#include "UsbDkData.h"
+
+// Redirection of several devices at once. Devices are processed in
+// phases so that resets of all devices and their re-enumeration by
+// the hub drivers overlap in time, each phase only touches devices
+// that survived previous phases. Failed devices are rolled back one
+// by one and get their own status in results.
+// TSteps performs the per-device steps of a single redirection:
+//     NTSTATUS Claim(const USB_DK_DEVICE_ID &Id, PHANDLE RedirectorHandle);
+//     NTSTATUS Add(const USB_DK_DEVICE_ID &Id, TRedirection **Redirection);
+//     NTSTATUS Reset(const USB_DK_DEVICE_ID &Id);
+//     NTSTATUS WaitForAttachment(TRedirection &Redirection, LONGLONG Deadline);
+//     NTSTATUS CreateHandle(TRedirection &Redirection, PHANDLE RedirectorHandle);
+//     void RollBack(const USB_DK_DEVICE_ID &Id, bool WithReset);
+// Claim() returns STATUS_NOT_FOUND unless the device is already
+// redirected automatically and needs no reset.
+template <typename TSteps>
+class CUsbDkRedirectBatch
+{
+public:
+    typedef typename TSteps::TRedirection TRedirection;
+
+    CUsbDkRedirectBatch(TSteps &Steps)
+        : m_Steps(Steps)
+    {}
+
+    // Input and output of buffered IOCTL share the same system buffer,
+    // so Results may overlay DeviceIds. Timeout is relative and
+    // shared by all devices, in 100ns units.
+    NTSTATUS Run(const USB_DK_DEVICE_ID *DeviceIds,
+                 USB_DK_REDIRECT_RESULT *Results,
+                 size_t NumDevices,
+                 LONGLONG Timeout)
+    {
+        auto status = Create(DeviceIds, NumDevices);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        m_Results = Results;
+
+        AddAll();
+        ResetAll();
+        WaitForAll(Timeout);
+        CreateHandles();
+
+        return STATUS_SUCCESS;
+    }
+
+    CUsbDkRedirectBatch(const CUsbDkRedirectBatch&) = delete;
+    CUsbDkRedirectBatch& operator= (const CUsbDkRedirectBatch&) = delete;
+
+private:
+    NTSTATUS Create(const USB_DK_DEVICE_ID *DeviceIds, size_t NumDevices)
+    {
+        // Device IDs must be copied before results are written
+        auto status = m_IdsBuffer.Create(NumDevices * sizeof(USB_DK_DEVICE_ID), NonPagedPool);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = m_RedirectionsBuffer.Create(NumDevices * sizeof(TRedirection *), NonPagedPool);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        RtlCopyMemory(Ids(), DeviceIds, NumDevices * sizeof(USB_DK_DEVICE_ID));
+        m_NumDevices = NumDevices;
+        return STATUS_SUCCESS;
+    }
+
+    void AddAll()
+    {
+        for (size_t i = 0; i < m_NumDevices; i++)
+        {
+            m_Results[i].RedirectorHandle = 0;
+            m_Results[i].Status = STATUS_SUCCESS;
+            Redirections()[i] = nullptr;
+
+            // Devices redirected automatically need no reset
+            HANDLE RedirectorHandle;
+            auto claimRes = m_Steps.Claim(Ids()[i], &RedirectorHandle);
+            if (claimRes != STATUS_NOT_FOUND)
+            {
+                if (NT_SUCCESS(claimRes))
+                {
+                    m_Results[i].RedirectorHandle = reinterpret_cast<ULONG_PTR>(RedirectorHandle);
+                }
+                m_Results[i].Status = static_cast<ULONG>(claimRes);
+                continue;
+            }
+
+            auto addRes = m_Steps.Add(Ids()[i], &Redirections()[i]);
+            if (!NT_SUCCESS(addRes))
+            {
+                Fail(i, addRes);
+            }
+        }
+    }
+
+    void ResetAll()
+    {
+        for (size_t i = 0; i < m_NumDevices; i++)
+        {
+            if (Redirections()[i] == nullptr)
+            {
+                continue;
+            }
+
+            auto resetRes = m_Steps.Reset(Ids()[i]);
+            if (!NT_SUCCESS(resetRes))
+            {
+                m_Steps.RollBack(Ids()[i], false);
+                Fail(i, resetRes);
+            }
+        }
+    }
+
+    void WaitForAll(LONGLONG Timeout)
+    {
+        // All devices share one deadline, so the whole batch
+        // takes no longer than a single redirection would
+        LARGE_INTEGER Deadline;
+        KeQuerySystemTime(&Deadline);
+        Deadline.QuadPart += Timeout;
+
+        for (size_t i = 0; i < m_NumDevices; i++)
+        {
+            if (Redirections()[i] == nullptr)
+            {
+                continue;
+            }
+
+            auto waitRes = m_Steps.WaitForAttachment(*Redirections()[i], Deadline.QuadPart);
+            if ((waitRes == STATUS_TIMEOUT) || !NT_SUCCESS(waitRes))
+            {
+                m_Steps.RollBack(Ids()[i], true);
+                Fail(i, (waitRes == STATUS_TIMEOUT) ? STATUS_DEVICE_NOT_CONNECTED : waitRes);
+            }
+        }
+    }
+
+    void CreateHandles()
+    {
+        for (size_t i = 0; i < m_NumDevices; i++)
+        {
+            if (Redirections()[i] == nullptr)
+            {
+                continue;
+            }
+
+            HANDLE RedirectorHandle;
+            auto handleRes = m_Steps.CreateHandle(*Redirections()[i], &RedirectorHandle);
+            if (!NT_SUCCESS(handleRes))
+            {
+                m_Steps.RollBack(Ids()[i], true);
+                Fail(i, STATUS_DEVICE_NOT_CONNECTED);
+                continue;
+            }
+
+            m_Results[i].RedirectorHandle = reinterpret_cast<ULONG_PTR>(RedirectorHandle);
+        }
+    }
+
+    void Fail(size_t Index, NTSTATUS Status)
+    {
+        m_Results[Index].Status = static_cast<ULONG>(Status);
+        Redirections()[Index] = nullptr;
+    }
+
+    USB_DK_DEVICE_ID *Ids() const
+    { return static_cast<USB_DK_DEVICE_ID *>(m_IdsBuffer.Ptr()); }
+    TRedirection **Redirections() const
+    { return static_cast<TRedirection **>(m_RedirectionsBuffer.Ptr()); }
+
+    TSteps &m_Steps;
+    CWdmMemoryBuffer m_IdsBuffer;
+    CWdmMemoryBuffer m_RedirectionsBuffer;
+    USB_DK_REDIRECT_RESULT *m_Results = nullptr;
+    size_t m_NumDevices = 0;
+};
@@ -401,10 +401,24 @@ void CUsbDkRedirectorStrategy::IoInCallerContext(WDFDEVICE Device, WDFREQUEST Re
     }
 }
 
+void CUsbDkRedirectorStrategy::TrackStateChange(const WDF_USB_CONTROL_SETUP_PACKET &SetupPacket)
+{
+    // Standard requests sent to the device (SET_CONFIGURATION,
+    // SET_FEATURE etc.) change its state without hub driver knowing,
+    // such device must be reset when returned to the system
+    if ((SetupPacket.Packet.bm.Request.Type == BMREQUEST_STANDARD) &&
+        (SetupPacket.Packet.bm.Request.Dir == BMREQUEST_HOST_TO_DEVICE))
+    {
+        m_StateChanged = true;
+    }
+}
+
 void CUsbDkRedirectorStrategy::DoControlTransfer(CRedirectorRequest &WdfRequest, WDFMEMORY DataBuffer)
 {
     PUSBDK_REDIRECTOR_REQUEST_CONTEXT context = WdfRequest.Context();
 
+    TrackStateChange(context->SetupPacket);
+
     WDFMEMORY_OFFSET TransferOffset;
     TransferOffset.BufferOffset = 0;
     if (DataBuffer != WDF_NO_HANDLE)
@@ -493,6 +507,9 @@ void CUsbDkRedirectorStrategy::IoDeviceControlConfig(WDFREQUEST Request,
         }
         case IOCTL_USBDK_DEVICE_RESET_PIPE:
         {
+            // Clears endpoint halt on the device
+            m_StateChanged = true;
+
             CWdfRequest WdfRequest(Request);
             UsbDkHandleRequestWithInput<ULONG64>(WdfRequest,
                                             [this, Request](ULONG64 *endpointAddress, size_t)
@@ -503,6 +520,9 @@ void CUsbDkRedirectorStrategy::IoDeviceControlConfig(WDFREQUEST Request,
         {
             ASSERT(m_IncomingDataQueue);
 
+            // Issues SET_INTERFACE to the device
+            m_StateChanged = true;
+
             m_IncomingDataQueue->StopSync();
             CWdfRequest WdfRequest(Request);
             UsbDkHandleRequestWithInput<USBDK_ALTSETTINGS_IDXS>(WdfRequest,
@@ -513,11 +533,19 @@ void CUsbDkRedirectorStrategy::IoDeviceControlConfig(WDFREQUEST Request,
         }
         case IOCTL_USBDK_DEVICE_RESET_DEVICE:
         {
+            m_StateChanged = true;
+
             CWdfRequest WdfRequest(Request);
             auto status = m_Target.ResetDevice(Request);
             WdfRequest.SetStatus(status);
             return;
         }
+        case IOCTL_USBDK_DEVICE_SOFT_RELEASE:
+        {
+            m_SoftReleaseRequested = true;
+            CWdfRequest(Request).SetStatus(STATUS_SUCCESS);
+            return;
+        }
     }
 }
 
@@ -688,7 +716,13 @@ void CUsbDkRedirectorStrategy::OnClose()
     USB_DK_DEVICE_ID ID;
     UsbDkFillIDStruct(&ID, *m_DeviceID->begin(), *m_InstanceID->begin());
 
-    auto status = m_ControlDevice->RemoveRedirect(ID);
+    auto SoftRelease = m_SoftReleaseRequested && !m_StateChanged;
+    if (m_SoftReleaseRequested && !SoftRelease)
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_REDIRECTOR, "%!FUNC! Device state changed, soft release is not possible");
+    }
+
+    auto status = m_ControlDevice->RemoveRedirect(ID, SoftRelease);
     if (!NT_SUCCESS(status))
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_REDIRECTOR, "%!FUNC! RemoveRedirect failed: %!STATUS!", status);
@@ -107,6 +107,7 @@ private:
     static void IsoRWCompletion(WDFREQUEST Request, WDFIOTARGET Target, PWDF_REQUEST_COMPLETION_PARAMS Params, WDFCONTEXT Context);
 
     void PatchDeviceID(PIRP Irp);
+    void TrackStateChange(const WDF_USB_CONTROL_SETUP_PACKET &SetupPacket);
 
     CWdfUsbTarget m_Target;
 
@@ -115,4 +116,10 @@ private:
 
     CObjHolder<CRegText> m_DeviceID;
     CObjHolder<CRegText> m_InstanceID;
+
+    // Device may be returned to the system without reset
+    // if owner asked for it and device state was not changed
+    // behind the back of the hub driver
+    bool m_SoftReleaseRequested = false;
+    bool m_StateChanged = false;
 };
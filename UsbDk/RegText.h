@@ -26,7 +26,7 @@
 #include "Alloc.h"
 #include "MemoryBuffer.h"
 
-class CRegText : public CAllocatable<NonPagedPool, 'TRHR'>
+class CRegText : public CLookasideAllocatable<CRegText, NonPagedPool, 'TRHR', 128>
 {
 public:
     class iterator
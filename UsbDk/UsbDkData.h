@@ -45,12 +45,103 @@ typedef struct tag_USB_DK_DEVICE_INFO
     USB_DEVICE_DESCRIPTOR DeviceDescriptor;
 } USB_DK_DEVICE_INFO, *PUSB_DK_DEVICE_INFO;
 
+// Compact device list, the header is followed by NumDevices records
+// and by the table of null-terminated strings at StringTableOffset.
+// Equal strings are stored once, records refer to them
+// by offsets in WCHARs from the table start.
+typedef struct tag_USB_DK_DEVICE_RECORD
+{
+    ULONG64 DeviceIDOffset;
+    ULONG64 InstanceIDOffset;
+    ULONG64 FilterID;
+    ULONG64 Port;
+    ULONG64 Speed;
+    USB_DEVICE_DESCRIPTOR DeviceDescriptor;
+} USB_DK_DEVICE_RECORD, *PUSB_DK_DEVICE_RECORD;
+
+typedef struct tag_USB_DK_DEVICE_LIST
+{
+    ULONG64 TotalLength;       // Buffer length enough for the whole list
+    ULONG64 NumDevices;
+    ULONG64 StringTableOffset; // In bytes from the list start
+} USB_DK_DEVICE_LIST, *PUSB_DK_DEVICE_LIST;
+
+static inline
+PUSB_DK_DEVICE_RECORD UsbDkDeviceListRecord(PUSB_DK_DEVICE_LIST List, ULONG64 Index)
+{
+    return (PUSB_DK_DEVICE_RECORD) (List + 1) + Index;
+}
+
+static inline
+PWCHAR UsbDkDeviceListString(PUSB_DK_DEVICE_LIST List, ULONG64 Offset)
+{
+    return (PWCHAR) ((PUCHAR) List + List->StringTableOffset) + Offset;
+}
+
+typedef struct tag_USB_DK_REDIRECT_RESULT
+{
+    ULONG64 RedirectorHandle;
+    ULONG64 Status; // NTSTATUS of the redirection, 0 on success
+} USB_DK_REDIRECT_RESULT, *PUSB_DK_REDIRECT_RESULT;
+
+#define USB_DK_REDIRECT_RULE_MATCH_ALL ((ULONG64)(-1))
+
+// Devices matching redirect rule are attached to redirector
+// as soon as they appear on the bus, without reset.
+// Interface fields match if some interface of some
+// configuration matches all three of them
+typedef struct tag_USB_DK_REDIRECT_RULE
+{
+    ULONG64 Class;
+    ULONG64 VID;
+    ULONG64 PID;
+    ULONG64 BCD;
+    ULONG64 Port;
+    ULONG64 InterfaceClass;
+    ULONG64 InterfaceSubClass;
+    ULONG64 InterfaceProtocol;
+} USB_DK_REDIRECT_RULE, *PUSB_DK_REDIRECT_RULE;
+
 typedef struct tag_USB_DK_CONFIG_DESCRIPTOR_REQUEST
 {
     USB_DK_DEVICE_ID ID;
     ULONG64 Index;
 } USB_DK_CONFIG_DESCRIPTOR_REQUEST, *PUSB_DK_CONFIG_DESCRIPTOR_REQUEST;
 
+// Header of all descriptors of a device, followed by
+// NumConfigurations configuration descriptors placed back to back,
+// each one wTotalLength bytes long
+typedef struct tag_USB_DK_DEVICE_DESCRIPTORS
+{
+    ULONG64 TotalLength; // Length of header and all configuration descriptors
+    ULONG64 NumConfigurations;
+    USB_DEVICE_DESCRIPTOR DeviceDescriptor;
+} USB_DK_DEVICE_DESCRIPTORS, *PUSB_DK_DEVICE_DESCRIPTORS;
+
+// String descriptor holds up to 126 UTF-16 characters
+#define USB_DK_MAX_STRING_LEN (127)
+
+typedef struct tag_USB_DK_DEVICE_STRINGS
+{
+    ULONG64 LanguageID; // Language of the strings, 0 if device provides no strings
+    WCHAR Manufacturer[USB_DK_MAX_STRING_LEN];
+    WCHAR Product[USB_DK_MAX_STRING_LEN];
+    WCHAR SerialNumber[USB_DK_MAX_STRING_LEN];
+} USB_DK_DEVICE_STRINGS, *PUSB_DK_DEVICE_STRINGS;
+
+// Non-paged memory driver keeps for attached devices, sizes are in bytes.
+// Devices with identical descriptors share one descriptor set,
+// SharedDescriptorBytes is the memory their copies would take.
+typedef struct tag_USB_DK_MEMORY_STATISTICS
+{
+    ULONG64 DescriptorSets;
+    ULONG64 DescriptorSetReferences;
+    ULONG64 DescriptorBytes;
+    ULONG64 SharedDescriptorBytes;
+    ULONG64 DeviceIdentities;
+    ULONG64 DeviceIdentityBytes;
+} USB_DK_MEMORY_STATISTICS, *PUSB_DK_MEMORY_STATISTICS;
+
 typedef struct tag_USB_DK_ISO_TARNSFER_RESULT
 {
     ULONG64 actualLength;
@@ -33,3 +33,64 @@ typedef struct tag_USB_DK_HIDE_RULE
     ULONG64 PID;
     ULONG64 BCD;
 } USB_DK_HIDE_RULE, *PUSB_DK_HIDE_RULE;
+
+// Field value matches if Min <= (Value & Mask) <= Max
+typedef struct tag_USB_DK_HIDE_RULE_MATCHER
+{
+    ULONG64 Min;
+    ULONG64 Max;
+    ULONG64 Mask;
+} USB_DK_HIDE_RULE_MATCHER, *PUSB_DK_HIDE_RULE_MATCHER;
+
+#define USB_DK_HIDE_RULE_MATCHER_ALL   { 0, (ULONG64)(-1), (ULONG64)(-1) }
+
+// Interface matchers accept device if some interface of
+// some configuration is accepted by all three of them
+typedef struct tag_USB_DK_HIDE_RULE_V2
+{
+    ULONG64 Hide;
+    USB_DK_HIDE_RULE_MATCHER Class;
+    USB_DK_HIDE_RULE_MATCHER VID;
+    USB_DK_HIDE_RULE_MATCHER PID;
+    USB_DK_HIDE_RULE_MATCHER BCD;
+    USB_DK_HIDE_RULE_MATCHER InterfaceClass;
+    USB_DK_HIDE_RULE_MATCHER InterfaceSubClass;
+    USB_DK_HIDE_RULE_MATCHER InterfaceProtocol;
+} USB_DK_HIDE_RULE_V2, *PUSB_DK_HIDE_RULE_V2;
+
+typedef enum
+{
+    HideRuleAdded = 0,
+    HideRuleDeleted
+} USB_DK_HIDE_RULE_UPDATE_OPERATION;
+
+// Times are in 100ns units, last hit time is system time
+// of the last match, 0 if rule never matched.
+// Decisions taken from driver cache do not count rule hits.
+typedef struct tag_USB_DK_HIDE_RULE_STATISTICS
+{
+    USB_DK_HIDE_RULE_V2 Rule;
+    ULONG64 Persistent;
+    ULONG64 Hits;
+    ULONG64 LastHitTime;
+} USB_DK_HIDE_RULE_STATISTICS, *PUSB_DK_HIDE_RULE_STATISTICS;
+
+// Followed by statistics of rules, NumRules is the number of
+// rules driver has, only those fitting the buffer are returned
+typedef struct tag_USB_DK_HIDE_STATISTICS
+{
+    ULONG64 Decisions;
+    ULONG64 HiddenDevices;
+    ULONG64 CachedDecisions;
+    ULONG64 DecisionsTime;
+    ULONG64 BusRelationsPasses;
+    ULONG64 BusRelationsTime;
+    ULONG64 NumRules;
+} USB_DK_HIDE_STATISTICS, *PUSB_DK_HIDE_STATISTICS;
+
+// Persistent hide rule change already written to the registry
+typedef struct tag_USB_DK_HIDE_RULE_UPDATE
+{
+    ULONG64 Operation;
+    USB_DK_HIDE_RULE_V2 Rule;
+} USB_DK_HIDE_RULE_UPDATE, *PUSB_DK_HIDE_RULE_UPDATE;
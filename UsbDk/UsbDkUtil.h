@@ -23,6 +23,8 @@
 
 #pragma once
 
+#include "Alloc.h"
+
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
 #define USHORT_MAX ((USHORT)(-1))
 
@@ -40,6 +42,37 @@ private:
     KIRQL m_OldIrql;
 };
 
+class CWdmRWLock
+{
+public:
+    CWdmRWLock()
+    { ExInitializeResourceLite(&m_Lock); }
+    ~CWdmRWLock()
+    { ExDeleteResourceLite(&m_Lock); }
+    void Lock()
+    {
+        KeEnterCriticalRegion();
+        ExAcquireResourceExclusiveLite(&m_Lock, TRUE);
+    }
+    void Unlock()
+    {
+        ExReleaseResourceLite(&m_Lock);
+        KeLeaveCriticalRegion();
+    }
+    void LockShared()
+    {
+        KeEnterCriticalRegion();
+        ExAcquireResourceSharedLite(&m_Lock, TRUE);
+    }
+    void UnlockShared()
+    { Unlock(); }
+private:
+    ERESOURCE m_Lock;
+
+    CWdmRWLock(const CWdmRWLock&) = delete;
+    CWdmRWLock& operator= (const CWdmRWLock&) = delete;
+};
+
 template <typename T>
 class CLockedContext
 {
@@ -58,7 +91,49 @@ private:
     CLockedContext& operator= (const CLockedContext&) = delete;
 };
 
+template <typename T>
+class CSharedLockedContext
+{
+public:
+    CSharedLockedContext(T &LockObject)
+        : m_LockObject(LockObject)
+    { m_LockObject.LockShared(); }
+
+    ~CSharedLockedContext()
+    { m_LockObject.UnlockShared(); }
+
+private:
+    T &m_LockObject;
+
+    CSharedLockedContext(const CSharedLockedContext&) = delete;
+    CSharedLockedContext& operator= (const CSharedLockedContext&) = delete;
+};
+
+// Read side of list access strategies, lock-free
+// strategies return token identifying the reader
+template <typename T>
+class CReadLockedContext
+{
+public:
+    CReadLockedContext(T &LockObject)
+        : m_LockObject(LockObject)
+        , m_Token(LockObject.LockRead())
+    {}
+
+    ~CReadLockedContext()
+    { m_LockObject.UnlockRead(m_Token); }
+
+private:
+    T &m_LockObject;
+    ULONG m_Token;
+
+    CReadLockedContext(const CReadLockedContext&) = delete;
+    CReadLockedContext& operator= (const CReadLockedContext&) = delete;
+};
+
 typedef CLockedContext<CWdmSpinLock> TSpinLocker;
+typedef CLockedContext<CWdmRWLock> TExclusiveLocker;
+typedef CSharedLockedContext<CWdmRWLock> TSharedLocker;
 
 class CWdmRefCounter
 {
@@ -106,6 +181,9 @@ class CLockedAccess
 public:
     void Lock() { m_Lock.Lock(); }
     void Unlock() { m_Lock.Unlock(); }
+    ULONG LockRead() { Lock(); return 0; }
+    void UnlockRead(ULONG) { Unlock(); }
+    void Synchronize() { }
 private:
     CWdmSpinLock m_Lock;
 };
@@ -115,6 +193,9 @@ class CRawAccess
 public:
     void Lock() { }
     void Unlock() { }
+    ULONG LockRead() { return 0; }
+    void UnlockRead(ULONG) { }
+    void Synchronize() { }
 };
 
 class CCountingObject
@@ -136,6 +217,9 @@ protected:
     ULONG GetCount() { return 0; }
 };
 
+template <typename TEntryType, typename TAccessStrategy, typename TCountingStrategy>
+class CWdmHashMap;
+
 #define DECLARE_CWDMLIST_ENTRY(type)                                                    \
     private:                                                                            \
         PLIST_ENTRY GetListEntry()                                                      \
@@ -147,6 +231,9 @@ protected:
         template<typename type, typename AnyAccess, typename AnyStrategy>               \
         friend class CWdmList;                                                          \
                                                                                         \
+        template<typename AnyEntry, typename AnyAccess, typename AnyStrategy>           \
+        friend class CWdmHashMap;                                                       \
+                                                                                        \
         LIST_ENTRY m_ListEntry
 
 template <typename TEntryType, typename TAccessStrategy, typename TCountingStrategy>
@@ -165,32 +252,37 @@ public:
     bool IsEmpty()
     { return IsListEmpty(&m_List) ? true : false; }
 
+    // Entries removed from the list are handed out only
+    // after readers of the access strategy left them
     TEntryType *Pop()
     {
         CLockedContext<TAccessStrategy> LockedContext(*this);
-        return Pop_LockLess();
+        auto Entry = Pop_LockLess();
+        this->Synchronize();
+        return Entry;
     }
 
     ULONG Push(TEntryType *Entry)
     {
         CLockedContext<TAccessStrategy> LockedContext(*this);
-        InsertHeadList(&m_List, Entry->GetListEntry());
-        CounterIncrement();
-        return GetCount();
+        Insert_LockLess(&m_List, Entry->GetListEntry());
+        this->CounterIncrement();
+        return this->GetCount();
     }
 
     ULONG PushBack(TEntryType *Entry)
     {
         CLockedContext<TAccessStrategy> LockedContext(*this);
-        InsertTailList(&m_List, Entry->GetListEntry());
-        CounterIncrement();
-        return GetCount();
+        Insert_LockLess(m_List.Blink, Entry->GetListEntry());
+        this->CounterIncrement();
+        return this->GetCount();
     }
 
     void Remove(TEntryType *Entry)
     {
         CLockedContext<TAccessStrategy> LockedContext(*this);
         Remove_LockLess(Entry->GetListEntry());
+        this->Synchronize();
     }
 
     template <typename TFunctor>
@@ -199,7 +291,10 @@ public:
         CLockedContext<TAccessStrategy> LockedContext(*this);
         while (!IsListEmpty(&m_List))
         {
-            if (!Functor(Pop_LockLess()))
+            auto Entry = Pop_LockLess();
+            this->Synchronize();
+
+            if (!Functor(Entry))
             {
                 return false;
             }
@@ -210,22 +305,57 @@ public:
     template <typename TPredicate, typename TFunctor>
     bool ForEachDetachedIf(TPredicate Predicate, TFunctor Functor)
     {
-        return ForEachPrepareIf(Predicate, [this](PLIST_ENTRY Entry){ Remove_LockLess(Entry); }, Functor);
+        return ForEachPrepareIf(Predicate, [this](PLIST_ENTRY Entry){ Remove_LockLess(Entry); this->Synchronize(); }, Functor);
     }
 
     template <typename TFunctor>
     bool ForEach(TFunctor Functor)
     {
-        return ForEachPrepareIf([](TEntryType*) { return true; }, [](PLIST_ENTRY){}, Functor);
+        return ForEachReadIf([](TEntryType*) { return true; }, Functor);
     }
 
     template <typename TPredicate, typename TFunctor>
     bool ForEachIf(TPredicate Predicate, TFunctor Functor)
     {
-        return ForEachPrepareIf(Predicate, [](PLIST_ENTRY){}, Functor);
+        return ForEachReadIf(Predicate, Functor);
     }
 
 private:
+    // Read side walk, list may change under lock-free readers,
+    // but removed entries keep their forward links
+    template <typename TPredicate, typename TFunctor>
+    bool ForEachReadIf(TPredicate Predicate, TFunctor Functor)
+    {
+        CReadLockedContext<TAccessStrategy> LockedContext(*this);
+
+        PLIST_ENTRY NextEntry = nullptr;
+
+        for (auto CurrEntry = m_List.Flink; CurrEntry != &m_List; CurrEntry = NextEntry)
+        {
+            NextEntry = CurrEntry->Flink;
+            auto Object = TEntryType::GetByListEntry(CurrEntry);
+
+            if (Predicate(Object) && !Functor(Object))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Entry is fully initialized before it becomes reachable
+    void Insert_LockLess(PLIST_ENTRY Prev, PLIST_ENTRY Entry)
+    {
+        auto Next = Prev->Flink;
+
+        Entry->Flink = Next;
+        Entry->Blink = Prev;
+        KeMemoryBarrier();
+        Prev->Flink = Entry;
+        Next->Blink = Entry;
+    }
+
     template <typename TPredicate, typename TPrepareFunctor, typename TFunctor>
     bool ForEachPrepareIf(TPredicate Predicate, TPrepareFunctor Prepare, TFunctor Functor)
     {
@@ -253,14 +383,14 @@ private:
 
     TEntryType *Pop_LockLess()
     {
-        CounterDecrement();
+        this->CounterDecrement();
         return TEntryType::GetByListEntry(RemoveHeadList(&m_List));
     }
 
     void Remove_LockLess(PLIST_ENTRY Entry)
     {
         RemoveEntryList(Entry);
-        CounterDecrement();
+        this->CounterDecrement();
     }
 
     LIST_ENTRY m_List;
@@ -279,7 +409,7 @@ public:
         if (!Contains_LockLess(NewEntry))
         {
             m_Objects.PushBack(NewEntry);
-            CounterIncrement();
+            this->CounterIncrement();
             return true;
         }
 
@@ -288,15 +418,22 @@ public:
 
     template <typename TEntryId>
     bool Delete(TEntryId *Id)
+    {
+        return Detach(Id, [](TEntryType *Entry) { Entry->Release(); });
+    }
+
+    // Removes entry from the set and passes it to the functor
+    template <typename TEntryId, typename TFunctor>
+    bool Detach(TEntryId *Id, TFunctor Functor)
     {
         auto Removed = false;
         CLockedContext<TAccessStrategy> LockedContext(*this);
 
         m_Objects.ForEachDetachedIf([Id](TEntryType *ExistingEntry) { return *ExistingEntry == *Id; },
-                                    [this, &Removed](TEntryType *ExistingEntry)
+                                    [this, &Removed, &Functor](TEntryType *ExistingEntry)
                                     {
-                                            ExistingEntry->Release();
-                                            CounterDecrement();
+                                            Functor(ExistingEntry);
+                                            this->CounterDecrement();
                                             Removed = true;
                                             return false;
                                     });
@@ -335,7 +472,42 @@ public:
     {
         m_Objects.Clear();
     }
+
+    // Empties the set passing all entries to the functor
+    template <typename TFunctor>
+    void DetachAll(TFunctor Functor)
+    {
+        CLockedContext<TAccessStrategy> LockedContext(*this);
+        DetachAll_LockLess(Functor);
+    }
+
+    // Swaps set content for given entries in one step, entries
+    // must be distinct, former entries are passed to the functor
+    template <typename TFunctor>
+    void Replace(TEntryType * const *Entries, size_t NumEntries, TFunctor Functor)
+    {
+        CLockedContext<TAccessStrategy> LockedContext(*this);
+
+        DetachAll_LockLess(Functor);
+
+        for (size_t i = 0; i < NumEntries; i++)
+        {
+            m_Objects.PushBack(Entries[i]);
+            this->CounterIncrement();
+        }
+    }
 private:
+    template <typename TFunctor>
+    void DetachAll_LockLess(TFunctor Functor)
+    {
+        m_Objects.ForEachDetached([this, &Functor](TEntryType *Entry)
+                                  {
+                                      Functor(Entry);
+                                      this->CounterDecrement();
+                                      return true;
+                                  });
+    }
+
     template <typename TEntryId>
     bool Contains_LockLess(TEntryId *Id)
     {
@@ -351,6 +523,281 @@ private:
     CWdmList<TEntryType, CRawAccess, CNonCountingObject> m_Objects;
 };
 
+// Set of entries hashed by identity, drop-in for CWdmSet.
+// Entries are linked by DECLARE_CWDMLIST_ENTRY, each entry type
+// provides static HashOf() for itself and for every id type it is
+// compared with, equal ids must hash equally.
+// Table doubles when load exceeds MAX_LOAD, buckets are moved to
+// the new table a few per modification, so there is no full rehash
+// under the lock. Moving finishes long before the next doubling.
+// If the new table cannot be allocated chains just grow longer.
+template <typename TEntryType, typename TAccessStrategy, typename TCountingStrategy>
+class CWdmHashMap : private TAccessStrategy, public TCountingStrategy
+{
+public:
+    CWdmHashMap()
+    { InitializeBuckets(m_InitialBuckets, INITIAL_BUCKETS); }
+
+    ~CWdmHashMap()
+    {
+        Clear();
+        FreeBuckets(m_OldBuckets);
+        FreeBuckets(m_Buckets);
+    }
+
+    bool Add(TEntryType *NewEntry)
+    {
+        CLockedContext<TAccessStrategy> LockedContext(*this);
+
+        auto Hash = TEntryType::HashOf(*NewEntry);
+        if (Find_LockLess(NewEntry, Hash) != nullptr)
+        {
+            return false;
+        }
+
+        Grow_LockLess();
+
+        InsertTailList(BucketOf(Hash), NewEntry->GetListEntry());
+        m_NumEntries++;
+        this->CounterIncrement();
+
+        MoveBuckets_LockLess();
+        return true;
+    }
+
+    template <typename TEntryId>
+    bool Delete(TEntryId *Id)
+    {
+        return Detach(Id, [](TEntryType *Entry) { Entry->Release(); });
+    }
+
+    // Removes entry from the map and passes it to the functor
+    template <typename TEntryId, typename TFunctor>
+    bool Detach(TEntryId *Id, TFunctor Functor)
+    {
+        CLockedContext<TAccessStrategy> LockedContext(*this);
+
+        auto Entry = Find_LockLess(Id, TEntryType::HashOf(*Id));
+        if (Entry == nullptr)
+        {
+            return false;
+        }
+
+        RemoveEntryList(Entry->GetListEntry());
+        m_NumEntries--;
+        this->CounterDecrement();
+        Functor(Entry);
+
+        MoveBuckets_LockLess();
+        return true;
+    }
+
+    void Dump()
+    { ForEach([](TEntryType *Entry) { Entry->Dump(); return true; }); }
+
+    template <typename TEntryId>
+    bool Contains(TEntryId *Id)
+    {
+        CLockedContext<TAccessStrategy> LockedContext(*this);
+        return Find_LockLess(Id, TEntryType::HashOf(*Id)) != nullptr;
+    }
+
+    template <typename TEntryId, typename TModifier>
+    bool ModifyOne(TEntryId *Id, TModifier ModifierFunc)
+    {
+        CLockedContext<TAccessStrategy> LockedContext(*this);
+
+        auto Entry = Find_LockLess(Id, TEntryType::HashOf(*Id));
+        if (Entry == nullptr)
+        {
+            return false;
+        }
+
+        ModifierFunc(Entry);
+        return true;
+    }
+
+    template <typename TFunctor>
+    bool ForEach(TFunctor Functor)
+    {
+        CLockedContext<TAccessStrategy> LockedContext(*this);
+
+        return ForEachInBuckets(m_OldBuckets, m_NumOldBuckets, Functor) &&
+               ForEachInBuckets(m_Buckets, m_NumBuckets, Functor);
+    }
+
+    void Clear()
+    { DetachAll([](TEntryType *Entry) { delete Entry; }); }
+
+    // Empties the map passing all entries to the functor
+    template <typename TFunctor>
+    void DetachAll(TFunctor Functor)
+    {
+        CLockedContext<TAccessStrategy> LockedContext(*this);
+
+        DetachAllFromBuckets(m_OldBuckets, m_NumOldBuckets, Functor);
+        DetachAllFromBuckets(m_Buckets, m_NumBuckets, Functor);
+    }
+
+    CWdmHashMap(const CWdmHashMap&) = delete;
+    CWdmHashMap& operator= (const CWdmHashMap&) = delete;
+
+private:
+    enum : ULONG
+    {
+        INITIAL_BUCKETS = 16,
+        MAX_LOAD = 2,
+        BUCKETS_PER_MOVE = 2,
+        BUCKETS_TAG = 'MHHR'
+    };
+
+    static void InitializeBuckets(PLIST_ENTRY Buckets, ULONG NumBuckets)
+    {
+        for (ULONG i = 0; i < NumBuckets; i++)
+        {
+            InitializeListHead(&Buckets[i]);
+        }
+    }
+
+    void FreeBuckets(PLIST_ENTRY Buckets)
+    {
+        if ((Buckets != nullptr) && (Buckets != m_InitialBuckets))
+        {
+            ExFreePoolWithTag(Buckets, BUCKETS_TAG);
+        }
+    }
+
+    PLIST_ENTRY BucketOf(ULONG Hash) const
+    { return &m_Buckets[Hash & (m_NumBuckets - 1)]; }
+
+    template <typename TEntryId>
+    static TEntryType *FindInBucket(PLIST_ENTRY Bucket, TEntryId *Id)
+    {
+        for (auto CurrEntry = Bucket->Flink; CurrEntry != Bucket; CurrEntry = CurrEntry->Flink)
+        {
+            auto Object = TEntryType::GetByListEntry(CurrEntry);
+            if (*Object == *Id)
+            {
+                return Object;
+            }
+        }
+
+        return nullptr;
+    }
+
+    template <typename TEntryId>
+    TEntryType *Find_LockLess(TEntryId *Id, ULONG Hash) const
+    {
+        // Entry not moved yet stays in old table bucket
+        if (m_OldBuckets != nullptr)
+        {
+            auto Entry = FindInBucket(&m_OldBuckets[Hash & (m_NumOldBuckets - 1)], Id);
+            if (Entry != nullptr)
+            {
+                return Entry;
+            }
+        }
+
+        return FindInBucket(BucketOf(Hash), Id);
+    }
+
+    template <typename TFunctor>
+    static bool ForEachInBuckets(PLIST_ENTRY Buckets, ULONG NumBuckets, TFunctor &Functor)
+    {
+        PLIST_ENTRY NextEntry = nullptr;
+
+        for (ULONG i = 0; (Buckets != nullptr) && (i < NumBuckets); i++)
+        {
+            for (auto CurrEntry = Buckets[i].Flink; CurrEntry != &Buckets[i]; CurrEntry = NextEntry)
+            {
+                NextEntry = CurrEntry->Flink;
+                if (!Functor(TEntryType::GetByListEntry(CurrEntry)))
+                {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    template <typename TFunctor>
+    void DetachAllFromBuckets(PLIST_ENTRY Buckets, ULONG NumBuckets, TFunctor &Functor)
+    {
+        for (ULONG i = 0; (Buckets != nullptr) && (i < NumBuckets); i++)
+        {
+            while (!IsListEmpty(&Buckets[i]))
+            {
+                auto Entry = TEntryType::GetByListEntry(RemoveHeadList(&Buckets[i]));
+                m_NumEntries--;
+                this->CounterDecrement();
+                Functor(Entry);
+            }
+        }
+    }
+
+    void Grow_LockLess()
+    {
+        if ((m_OldBuckets != nullptr) || (m_NumEntries < m_NumBuckets * MAX_LOAD))
+        {
+            return;
+        }
+
+        auto NumNewBuckets = m_NumBuckets * 2;
+        auto NewBuckets = static_cast<PLIST_ENTRY>(ExAllocatePoolWithTag(NonPagedPool,
+                                                                         NumNewBuckets * sizeof(LIST_ENTRY),
+                                                                         BUCKETS_TAG));
+        if (NewBuckets == nullptr)
+        {
+            return;
+        }
+
+        InitializeBuckets(NewBuckets, NumNewBuckets);
+
+        m_OldBuckets = m_Buckets;
+        m_NumOldBuckets = m_NumBuckets;
+        m_NextBucketToMove = 0;
+
+        m_Buckets = NewBuckets;
+        m_NumBuckets = NumNewBuckets;
+    }
+
+    void MoveBuckets_LockLess()
+    {
+        if (m_OldBuckets == nullptr)
+        {
+            return;
+        }
+
+        for (ULONG i = 0; (i < BUCKETS_PER_MOVE) && (m_NextBucketToMove < m_NumOldBuckets); i++)
+        {
+            auto Bucket = &m_OldBuckets[m_NextBucketToMove++];
+            while (!IsListEmpty(Bucket))
+            {
+                auto Entry = TEntryType::GetByListEntry(RemoveHeadList(Bucket));
+                InsertTailList(BucketOf(TEntryType::HashOf(*Entry)), Entry->GetListEntry());
+            }
+        }
+
+        if (m_NextBucketToMove == m_NumOldBuckets)
+        {
+            FreeBuckets(m_OldBuckets);
+            m_OldBuckets = nullptr;
+            m_NumOldBuckets = 0;
+        }
+    }
+
+    LIST_ENTRY m_InitialBuckets[INITIAL_BUCKETS];
+    PLIST_ENTRY m_Buckets = m_InitialBuckets;
+    ULONG m_NumBuckets = INITIAL_BUCKETS;
+
+    PLIST_ENTRY m_OldBuckets = nullptr;
+    ULONG m_NumOldBuckets = 0;
+    ULONG m_NextBucketToMove = 0;
+
+    ULONG m_NumEntries = 0;
+};
+
 class CWdmEvent : public CAllocatable<NonPagedPool, 'VEHR'>
 {
 public:
@@ -374,6 +821,37 @@ private:
     KEVENT m_Event;
 };
 
+// FNV-1a, Hash argument allows to continue hashing of other string
+static inline
+ULONG UsbDkHashBytes(const VOID *Bytes, size_t NumBytes, ULONG Hash = 2166136261UL)
+{
+    auto Data = static_cast<const UCHAR *>(Bytes);
+
+    for (size_t i = 0; i < NumBytes; i++)
+    {
+        Hash = (Hash ^ Data[i]) * 16777619UL;
+    }
+
+    return Hash;
+}
+
+static inline
+ULONG UsbDkHashChars(PCWCH Chars, size_t NumChars, ULONG Hash = 2166136261UL)
+{
+    for (size_t i = 0; i < NumChars; i++)
+    {
+        Hash = (Hash ^ Chars[i]) * 16777619UL;
+    }
+
+    return Hash;
+}
+
+static inline
+ULONG UsbDkHashString(PCWSTR String, ULONG Hash = 2166136261UL)
+{
+    return UsbDkHashChars(String, wcsnlen(String, NTSTRSAFE_UNICODE_STRING_MAX_CCH), Hash);
+}
+
 class CStringBase
 {
 public:
@@ -497,3 +975,234 @@ LONGLONG MillisecondsTo100Nanoseconds(LONGLONG Milliseconds)
 {
     return Milliseconds * 10 * 1000;
 }
+
+// Measures short intervals, usable at any IRQL
+class CWdmStopwatch
+{
+public:
+    CWdmStopwatch()
+        : m_Start(KeQueryPerformanceCounter(&m_Frequency))
+    {}
+
+    // Time since construction in 100ns units
+    ULONG64 Elapsed() const
+    {
+        auto Now = KeQueryPerformanceCounter(nullptr);
+        return static_cast<ULONG64>(Now.QuadPart - m_Start.QuadPart) * 10 * 1000 * 1000 / m_Frequency.QuadPart;
+    }
+
+private:
+    LARGE_INTEGER m_Frequency;
+    LARGE_INTEGER m_Start;
+};
+
+// Grace periods for lock-free readers.
+// Reader registers in current epoch before accessing shared data,
+// writer changes the data, advances the epoch and waits for
+// readers of the previous epoch, after that no reader can see
+// former data. Readers may run at any IRQL, Synchronize() must be
+// called at PASSIVE_LEVEL and writers must be serialized by the caller.
+class CWdmEpoch
+{
+public:
+    CWdmEpoch()
+    {}
+
+    // Returns token for Exit()
+    ULONG Enter() const
+    {
+        for (;;)
+        {
+            ULONG Epoch = m_Epoch;
+            InterlockedIncrement(&m_Readers[Epoch & 1]);
+
+            // Epoch advanced before we registered, writer may
+            // not wait for us, register in the new one
+            if (Epoch == static_cast<ULONG>(m_Epoch))
+            {
+                return Epoch & 1;
+            }
+
+            InterlockedDecrement(&m_Readers[Epoch & 1]);
+        }
+    }
+
+    void Exit(ULONG Token) const
+    { InterlockedDecrement(&m_Readers[Token]); }
+
+    void Synchronize()
+    {
+        auto PrevEpoch = InterlockedIncrement(&m_Epoch) - 1;
+
+        while (m_Readers[PrevEpoch & 1] != 0)
+        {
+            LARGE_INTEGER Interval;
+            Interval.QuadPart = -MillisecondsTo100Nanoseconds(1);
+            KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+        }
+    }
+
+private:
+    volatile LONG m_Epoch = 0;
+    mutable volatile LONG m_Readers[2] = {};
+
+    CWdmEpoch(const CWdmEpoch&) = delete;
+    CWdmEpoch& operator= (const CWdmEpoch&) = delete;
+};
+
+// List access strategy for rarely changing lists walked often.
+// Readers walk the list without locks, writers are serialized
+// by a lock and run at PASSIVE_LEVEL, removed entries are handed
+// out after a grace period.
+class CRcuAccess
+{
+public:
+    void Lock() { m_WriterLock.Lock(); }
+    void Unlock() { m_WriterLock.Unlock(); }
+    ULONG LockRead() { return m_Epoch.Enter(); }
+    void UnlockRead(ULONG Token) { m_Epoch.Exit(Token); }
+    void Synchronize() { m_Epoch.Synchronize(); }
+private:
+    CWdmRWLock m_WriterLock;
+    CWdmEpoch m_Epoch;
+};
+
+// Immutable object published to lock-free readers,
+// former object is returned after a grace period
+template <typename T>
+class CWdmSnapshot
+{
+public:
+    CWdmSnapshot()
+    {}
+
+    ~CWdmSnapshot()
+    { delete m_Current; }
+
+    // Functor gets current object or nullptr if nothing is published
+    template <typename TFunctor>
+    void Read(TFunctor Functor) const
+    {
+        auto Token = m_Epoch.Enter();
+        Functor(static_cast<const T *>(m_Current));
+        m_Epoch.Exit(Token);
+    }
+
+    // Returns previous object, no reader can access it anymore
+    T *Publish(T *Object)
+    {
+        auto Old = static_cast<T *>(InterlockedExchangePointer(reinterpret_cast<PVOID volatile *>(&m_Current), Object));
+        m_Epoch.Synchronize();
+        return Old;
+    }
+
+private:
+    T * volatile m_Current = nullptr;
+    CWdmEpoch m_Epoch;
+
+    CWdmSnapshot(const CWdmSnapshot&) = delete;
+    CWdmSnapshot& operator= (const CWdmSnapshot&) = delete;
+};
+
+// In-place heap sort, O(N log N) time, no recursion and no additional memory
+template <typename T, typename TLess>
+void UsbDkHeapSort(T *Array, size_t Count, TLess Less)
+{
+    auto SiftDown = [Array, &Less](size_t Root, size_t End)
+    {
+        for (;;)
+        {
+            auto Child = 2 * Root + 1;
+            if (Child >= End)
+            {
+                return;
+            }
+
+            if ((Child + 1 < End) && Less(Array[Child], Array[Child + 1]))
+            {
+                Child++;
+            }
+
+            if (!Less(Array[Root], Array[Child]))
+            {
+                return;
+            }
+
+            auto Temp = Array[Root];
+            Array[Root] = Array[Child];
+            Array[Child] = Temp;
+
+            Root = Child;
+        }
+    };
+
+    for (auto i = Count / 2; i-- > 0;)
+    {
+        SiftDown(i, Count);
+    }
+
+    for (auto End = Count; End > 1;)
+    {
+        End--;
+
+        auto Temp = Array[0];
+        Array[0] = Array[End];
+        Array[End] = Temp;
+
+        SiftDown(0, End);
+    }
+}
+
+// Binary search over array sorted by keys returned by KeyOf()
+template <typename T, typename TKey, typename TKeyOf>
+T *UsbDkBinarySearch(T *Array, size_t Count, const TKey &Key, TKeyOf KeyOf)
+{
+    size_t Low = 0;
+    size_t High = Count;
+
+    while (Low < High)
+    {
+        auto Middle = Low + (High - Low) / 2;
+        auto MiddleKey = KeyOf(Array[Middle]);
+
+        if (MiddleKey < Key)
+        {
+            Low = Middle + 1;
+        }
+        else if (Key < MiddleKey)
+        {
+            High = Middle;
+        }
+        else
+        {
+            return &Array[Middle];
+        }
+    }
+
+    return nullptr;
+}
+
+// Index of the first element of sorted array with key not less than Key,
+// Count if there is no such element
+template <typename T, typename TKey, typename TKeyOf>
+size_t UsbDkLowerBound(const T *Array, size_t Count, const TKey &Key, TKeyOf KeyOf)
+{
+    size_t Low = 0;
+    size_t High = Count;
+
+    while (Low < High)
+    {
+        auto Middle = Low + (High - Low) / 2;
+
+        if (KeyOf(Array[Middle]) < Key)
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+
+    return Low;
+}
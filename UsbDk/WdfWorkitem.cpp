@@ -28,6 +28,7 @@ CWdfWorkitem::~CWdfWorkitem()
 {
     if (m_hWorkItem != WDF_NO_HANDLE)
     {
+        Flush();
         WdfObjectDelete(m_hWorkItem);
     }
 }
@@ -45,6 +46,14 @@ VOID CWdfWorkitem::Callback(_In_ WDFWORKITEM WorkItem)
     ctx->workItem->m_Payload(ctx->workItem->m_PayloadCtx);
 }
 
+// Work item may be deleted by the framework together
+// with its parent before the owning object is destroyed
+VOID CWdfWorkitem::Cleanup(_In_ WDFOBJECT WorkItem)
+{
+    auto* ctx = GetWdfWorkItemContext(WorkItem);
+    ctx->workItem->m_hWorkItem = WDF_NO_HANDLE;
+}
+
 NTSTATUS CWdfWorkitem::Create(WDFOBJECT parent)
 {
     WDF_OBJECT_ATTRIBUTES  attributes;
@@ -53,9 +62,16 @@ NTSTATUS CWdfWorkitem::Create(WDFOBJECT parent)
     WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
     WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(&attributes, WdfWorkItemContext);
     attributes.ParentObject = parent;
+    attributes.EvtCleanupCallback = Cleanup;
     WDF_WORKITEM_CONFIG_INIT(&workitemConfig, Callback);
 
     auto status = WdfWorkItemCreate(&workitemConfig, &attributes, &m_hWorkItem);
+    if (!NT_SUCCESS(status))
+    {
+        m_hWorkItem = WDF_NO_HANDLE;
+        return status;
+    }
+
     auto ctx = GetWdfWorkItemContext(m_hWorkItem);
     ctx->workItem = this;
 
@@ -68,3 +84,11 @@ VOID CWdfWorkitem::Enqueue()
 
     WdfWorkItemEnqueue(m_hWorkItem);
 }
+
+VOID CWdfWorkitem::Flush()
+{
+    if (m_hWorkItem != WDF_NO_HANDLE)
+    {
+        WdfWorkItemFlush(m_hWorkItem);
+    }
+}
@@ -43,10 +43,12 @@ public:
 
     NTSTATUS Create(WDFOBJECT parent);
     VOID Enqueue();
+    VOID Flush();
 
 private:
     WDFWORKITEM m_hWorkItem = WDF_NO_HANDLE;
     static VOID Callback(_In_  WDFWORKITEM WorkItem);
+    static VOID Cleanup(_In_ WDFOBJECT WorkItem);
 
     PayloadFunc m_Payload;
     PVOID m_PayloadCtx;
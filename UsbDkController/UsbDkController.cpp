@@ -95,25 +95,23 @@ static int Controller_UninstallDriver()
 
 static void Controller_DumpConfigurationDescriptors(USB_DK_DEVICE_INFO &Device)
 {
-    for (UCHAR i = 0; i < Device.DeviceDescriptor.bNumConfigurations; i++)
-    {
-        USB_DK_CONFIG_DESCRIPTOR_REQUEST Request;
-        Request.ID = Device.ID;
-        Request.Index = i;
+    PUSB_DK_DEVICE_DESCRIPTORS Descriptors;
 
-        PUSB_CONFIGURATION_DESCRIPTOR Descriptor;
-        ULONG Length;
+    if (!UsbDk_GetAllDescriptors(&Device.ID, &Descriptors))
+    {
+        tcout << TEXT("Failed to read configuration descriptors") << endl;
+        return;
+    }
 
-        if (!UsbDk_GetConfigurationDescriptor(&Request, &Descriptor, &Length))
-        {
-            tcout << TEXT("Failed to read configuration descriptor #") << (int) i << endl;
-        }
-        else
-        {
-            tcout << TEXT("Descriptor for configuration #") << (int) i << TEXT(": size ") << Length << endl;
-            UsbDk_ReleaseConfigurationDescriptor(Descriptor);
-        }
+    auto Position = reinterpret_cast<PUCHAR>(Descriptors + 1);
+    for (ULONG64 i = 0; i < Descriptors->NumConfigurations; i++)
+    {
+        auto Descriptor = reinterpret_cast<PUSB_CONFIGURATION_DESCRIPTOR>(Position);
+        tcout << TEXT("Descriptor for configuration #") << (int) i << TEXT(": size ") << Descriptor->wTotalLength << endl;
+        Position += Descriptor->wTotalLength;
     }
+
+    UsbDk_ReleaseAllDescriptors(Descriptors);
 }
 
 static int Controller_EnumerateDevices()
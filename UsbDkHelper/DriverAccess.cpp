@@ -29,6 +29,53 @@
 void UsbDkDriverAccess::GetDevicesList(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &DeviceNumber)
 {
     DevicesArray = nullptr;
+
+    // Compact list is expanded here, so fixed size
+    // IDs are not transferred from the driver
+    unique_ptr<USB_DK_DEVICE_LIST, decltype(&ReleaseDeviceList)> List(nullptr, ReleaseDeviceList);
+    try
+    {
+        List.reset(GetDeviceList());
+    }
+    catch (const UsbDkDriverFileException &e)
+    {
+        // Drivers older than the helper do not know the compact list
+        if (e.GetErrorCode() != ERROR_INVALID_FUNCTION)
+        {
+            throw;
+        }
+
+        GetDevicesListV1(DevicesArray, DeviceNumber);
+        return;
+    }
+
+    DeviceNumber = static_cast<ULONG>(List->NumDevices);
+    if (DeviceNumber == 0)
+    {
+        return;
+    }
+
+    unique_ptr<USB_DK_DEVICE_INFO[]> Result(new USB_DK_DEVICE_INFO[DeviceNumber]);
+
+    for (ULONG i = 0; i < DeviceNumber; i++)
+    {
+        auto Record = UsbDkDeviceListRecord(List.get(), i);
+
+        UsbDkFillIDStruct(&Result[i].ID,
+                          UsbDkDeviceListString(List.get(), Record->DeviceIDOffset),
+                          UsbDkDeviceListString(List.get(), Record->InstanceIDOffset));
+
+        Result[i].FilterID = Record->FilterID;
+        Result[i].Port = Record->Port;
+        Result[i].Speed = Record->Speed;
+        Result[i].DeviceDescriptor = Record->DeviceDescriptor;
+    }
+
+    DevicesArray = Result.release();
+}
+
+void UsbDkDriverAccess::GetDevicesListV1(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &DeviceNumber)
+{
     DWORD   bytesReturned;
 
     unique_ptr<USB_DK_DEVICE_INFO[]> Result;
@@ -56,6 +103,38 @@ void UsbDkDriverAccess::GetDevicesList(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG
     DevicesArray = Result.release();
 }
 
+PUSB_DK_DEVICE_LIST UsbDkDriverAccess::GetDeviceList()
+{
+    USB_DK_DEVICE_LIST Header;
+    unique_ptr<BYTE[]> Result;
+
+    auto Buffer = &Header;
+    DWORD Length = sizeof(Header);
+
+    // Driver returns the header only when the buffer is short,
+    // header tells the length of the whole list
+    while (!Ioctl(IOCTL_USBDK_ENUM_DEVICES_V2, true, nullptr, 0,
+                  Buffer, Length))
+    {
+        Length = static_cast<DWORD>(Buffer->TotalLength);
+        Result.reset(new BYTE[Length]);
+        Buffer = reinterpret_cast<PUSB_DK_DEVICE_LIST>(Result.get());
+    }
+
+    if (!Result)
+    {
+        Result.reset(new BYTE[sizeof(Header)]);
+        *reinterpret_cast<PUSB_DK_DEVICE_LIST>(Result.get()) = Header;
+    }
+
+    return reinterpret_cast<PUSB_DK_DEVICE_LIST>(Result.release());
+}
+
+void UsbDkDriverAccess::ReleaseDeviceList(PUSB_DK_DEVICE_LIST List)
+{
+    delete[] reinterpret_cast<PBYTE>(List);
+}
+
 void UsbDkDriverAccess::ReleaseConfigurationDescriptor(PUSB_CONFIGURATION_DESCRIPTOR Descriptor)
 {
     delete[] Descriptor;
@@ -83,11 +162,59 @@ PUSB_CONFIGURATION_DESCRIPTOR UsbDkDriverAccess::GetConfigurationDescriptor(USB_
     return FullDescriptor;
 }
 
+PUSB_DK_DEVICE_DESCRIPTORS UsbDkDriverAccess::GetAllDescriptors(USB_DK_DEVICE_ID &DeviceID)
+{
+    USB_DK_DEVICE_DESCRIPTORS Header;
+    unique_ptr<BYTE[]> Result;
+
+    auto Buffer = &Header;
+    DWORD Length = sizeof(Header);
+
+    // Driver returns the header only when the buffer is short,
+    // header tells the length of the whole blob
+    while (!Ioctl(IOCTL_USBDK_GET_ALL_DESCRIPTORS, true, &DeviceID, sizeof(DeviceID),
+                  Buffer, Length))
+    {
+        Length = static_cast<DWORD>(Buffer->TotalLength);
+        Result.reset(new BYTE[Length]);
+        Buffer = reinterpret_cast<PUSB_DK_DEVICE_DESCRIPTORS>(Result.get());
+    }
+
+    if (!Result)
+    {
+        Result.reset(new BYTE[sizeof(Header)]);
+        *reinterpret_cast<PUSB_DK_DEVICE_DESCRIPTORS>(Result.get()) = Header;
+    }
+
+    return reinterpret_cast<PUSB_DK_DEVICE_DESCRIPTORS>(Result.release());
+}
+
+void UsbDkDriverAccess::ReleaseAllDescriptors(PUSB_DK_DEVICE_DESCRIPTORS Descriptors)
+{
+    delete[] reinterpret_cast<PBYTE>(Descriptors);
+}
+
+void UsbDkDriverAccess::GetDeviceStrings(USB_DK_DEVICE_ID &DeviceID, USB_DK_DEVICE_STRINGS &Strings)
+{
+    SendIoctlWithDeviceId(IOCTL_USBDK_GET_DEVICE_STRINGS, DeviceID, &Strings);
+}
+
+void UsbDkDriverAccess::GetMemoryStatistics(USB_DK_MEMORY_STATISTICS &Statistics)
+{
+    Ioctl(IOCTL_USBDK_GET_MEMORY_STATISTICS, false, nullptr, 0,
+          &Statistics, sizeof(Statistics));
+}
+
 void UsbDkDriverAccess::UpdateRegistryParameters()
 {
     Ioctl(IOCTL_USBDK_UPDATE_REG_PARAMETERS);
 }
 
+void UsbDkDriverAccess::UpdateRegistryParameters(const USB_DK_HIDE_RULE_UPDATE &Update)
+{
+    Ioctl(IOCTL_USBDK_UPDATE_REG_PARAMETERS, false, const_cast<PUSB_DK_HIDE_RULE_UPDATE>(&Update), sizeof(Update));
+}
+
 HANDLE UsbDkDriverAccess::AddRedirect(USB_DK_DEVICE_ID &DeviceID)
 {
     ULONG64 RedirectorHandle;
@@ -95,12 +222,72 @@ HANDLE UsbDkDriverAccess::AddRedirect(USB_DK_DEVICE_ID &DeviceID)
     return reinterpret_cast<HANDLE>(RedirectorHandle);
 }
 
+void UsbDkDriverAccess::AddRedirectBatch(PUSB_DK_DEVICE_ID DeviceIDs, ULONG NumberDevices, PUSB_DK_REDIRECT_RESULT Results)
+{
+    Ioctl(IOCTL_USBDK_ADD_REDIRECT_BATCH, false,
+          DeviceIDs, NumberDevices * sizeof(USB_DK_DEVICE_ID),
+          Results, NumberDevices * sizeof(USB_DK_REDIRECT_RESULT));
+}
+
+void UsbDkDriverAccess::AddRedirectRule(const USB_DK_REDIRECT_RULE &Rule)
+{
+    Ioctl(IOCTL_USBDK_ADD_REDIRECT_RULE, false, const_cast<PUSB_DK_REDIRECT_RULE>(&Rule), sizeof(Rule));
+}
+
+void UsbDkDriverAccess::ClearRedirectRules()
+{
+    Ioctl(IOCTL_USBDK_CLEAR_REDIRECT_RULES);
+}
+
 void UsbDkHiderAccess::AddHideRule(const USB_DK_HIDE_RULE &Rule)
 {
     Ioctl(IOCTL_USBDK_ADD_HIDE_RULE, false, const_cast<PUSB_DK_HIDE_RULE>(&Rule), sizeof(Rule));
 }
 
+void UsbDkHiderAccess::AddHideRule(const USB_DK_HIDE_RULE_V2 &Rule)
+{
+    Ioctl(IOCTL_USBDK_ADD_HIDE_RULE_V2, false, const_cast<PUSB_DK_HIDE_RULE_V2>(&Rule), sizeof(Rule));
+}
+
+void UsbDkHiderAccess::ReplaceHideRules(PUSB_DK_HIDE_RULE_V2 Rules, ULONG NumberRules)
+{
+    Ioctl(IOCTL_USBDK_REPLACE_HIDE_RULES, false, Rules, NumberRules * sizeof(USB_DK_HIDE_RULE_V2));
+}
+
 void UsbDkHiderAccess::ClearHideRules()
 {
     Ioctl(IOCTL_USBDK_CLEAR_HIDE_RULES);
 }
+
+PUSB_DK_HIDE_STATISTICS UsbDkHiderAccess::GetHideStatistics()
+{
+    ULONG64 NumberRules = 0;
+    unique_ptr<BYTE[]> Result;
+    PUSB_DK_HIDE_STATISTICS Statistics;
+
+    // rules may be added between calls, retry until all fit
+    do
+    {
+        auto Size = sizeof(USB_DK_HIDE_STATISTICS) + static_cast<size_t>(NumberRules) * sizeof(USB_DK_HIDE_RULE_STATISTICS);
+        Result.reset(new BYTE[Size]);
+        Statistics = reinterpret_cast<PUSB_DK_HIDE_STATISTICS>(Result.get());
+
+        DWORD bytesReturned;
+        Ioctl(IOCTL_USBDK_GET_HIDE_STATISTICS, false, nullptr, 0,
+              Statistics, static_cast<DWORD>(Size), &bytesReturned);
+
+        if (Statistics->NumRules <= NumberRules)
+        {
+            break;
+        }
+
+        NumberRules = Statistics->NumRules;
+    } while (true);
+
+    return reinterpret_cast<PUSB_DK_HIDE_STATISTICS>(Result.release());
+}
+
+void UsbDkHiderAccess::ReleaseHideStatistics(PUSB_DK_HIDE_STATISTICS Statistics)
+{
+    delete[] reinterpret_cast<PBYTE>(Statistics);
+}
@@ -47,14 +47,27 @@ public:
     {}
 
     void GetDevicesList(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &NumberDevice);
+    PUSB_DK_DEVICE_LIST GetDeviceList();
+    static void ReleaseDeviceList(PUSB_DK_DEVICE_LIST List);
     PUSB_CONFIGURATION_DESCRIPTOR GetConfigurationDescriptor(USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request, ULONG &Length);
     void UpdateRegistryParameters();
+    void UpdateRegistryParameters(const USB_DK_HIDE_RULE_UPDATE &Update);
     static void ReleaseDevicesList(PUSB_DK_DEVICE_INFO DevicesArray);
     static void ReleaseConfigurationDescriptor(PUSB_CONFIGURATION_DESCRIPTOR Descriptor);
+    PUSB_DK_DEVICE_DESCRIPTORS GetAllDescriptors(USB_DK_DEVICE_ID &DeviceID);
+    static void ReleaseAllDescriptors(PUSB_DK_DEVICE_DESCRIPTORS Descriptors);
+    void GetDeviceStrings(USB_DK_DEVICE_ID &DeviceID, USB_DK_DEVICE_STRINGS &Strings);
+    void GetMemoryStatistics(USB_DK_MEMORY_STATISTICS &Statistics);
 
     HANDLE AddRedirect(USB_DK_DEVICE_ID &DeviceID);
+    void AddRedirectBatch(PUSB_DK_DEVICE_ID DeviceIDs, ULONG NumberDevices, PUSB_DK_REDIRECT_RESULT Results);
+
+    void AddRedirectRule(const USB_DK_REDIRECT_RULE &Rule);
+    void ClearRedirectRules();
 
 private:
+    void GetDevicesListV1(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &NumberDevice);
+
     template <typename TOutputObj = char>
     void SendIoctlWithDeviceId(DWORD ControlCode, USB_DK_DEVICE_ID &Id, TOutputObj* Output = nullptr)
     {
@@ -71,5 +84,9 @@ public:
     {}
 
     void AddHideRule(const USB_DK_HIDE_RULE &Rule);
+    void AddHideRule(const USB_DK_HIDE_RULE_V2 &Rule);
+    void ReplaceHideRules(PUSB_DK_HIDE_RULE_V2 Rules, ULONG NumberRules);
     void ClearHideRules();
+    PUSB_DK_HIDE_STATISTICS GetHideStatistics();
+    static void ReleaseHideStatistics(PUSB_DK_HIDE_STATISTICS Statistics);
 };
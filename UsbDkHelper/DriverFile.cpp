@@ -71,7 +71,7 @@ TransferResult UsbDkDriverFile::Ioctl(DWORD Code,
             return TransferFailure;
         }
 
-        throw UsbDkDriverFileException(TEXT("DeviceIoControl failed"));
+        throw UsbDkDriverFileException(TEXT("DeviceIoControl failed"), err);
     }
 
     return TransferSuccess;
@@ -75,6 +75,11 @@ void UsbDkRedirectorAccess::ResetDevice()
     IoctlSync(IOCTL_USBDK_DEVICE_RESET_DEVICE);
 }
 
+void UsbDkRedirectorAccess::RequestSoftRelease()
+{
+    IoctlSync(IOCTL_USBDK_DEVICE_SOFT_RELEASE);
+}
+
 bool UsbDkRedirectorAccess::IoctlSync(DWORD Code,
                                       bool ShortBufferOk,
                                       LPVOID InBuffer,
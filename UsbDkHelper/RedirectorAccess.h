@@ -51,6 +51,7 @@ public:
     void ResetPipe(ULONG64 PipeAddress);
     void SetAltsetting(ULONG64 InterfaceIdx, ULONG64 AltSettingIdx);
     void ResetDevice();
+    void RequestSoftRelease();
 
     HANDLE GetSystemHandle() const
     { return m_hDriver; }
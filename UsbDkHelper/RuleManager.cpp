@@ -1,4 +1,5 @@
 #include "stdafx.h"
+#include "UsbDkData.h"
 #include "UsbDkDataHider.h"
 #include "UsbDkNames.h"
 #include "HideRulesRegPublic.h"
@@ -6,19 +7,43 @@
 #include "RuleManager.h"
 #include "GuidGen.h"
 
-CRulesManager::CRulesManager()
-    : m_RegAccess(HKEY_LOCAL_MACHINE, USBDK_HIDE_RULES_PATH)
+#include <algorithm>
+
+CRulesManager::CRulesManager(LPCTSTR RulesPath)
+    : m_RegAccess(HKEY_LOCAL_MACHINE, RulesPath)
 {}
 
-static bool operator == (const USB_DK_HIDE_RULE& r1, const USB_DK_HIDE_RULE& r2)
+static bool operator == (const USB_DK_HIDE_RULE_MATCHER& m1, const USB_DK_HIDE_RULE_MATCHER& m2)
+{
+    return (m1.Min == m2.Min) &&
+           (m1.Max == m2.Max) &&
+           (m1.Mask == m2.Mask);
+}
+
+static bool operator == (const USB_DK_HIDE_RULE_V2& r1, const USB_DK_HIDE_RULE_V2& r2)
 {
     return (r1.VID == r2.VID)     &&
            (r1.PID == r2.PID)     &&
            (r1.BCD == r2.BCD)     &&
            (r1.Class == r2.Class) &&
+           (r1.InterfaceClass == r2.InterfaceClass)       &&
+           (r1.InterfaceSubClass == r2.InterfaceSubClass) &&
+           (r1.InterfaceProtocol == r2.InterfaceProtocol) &&
            (r1.Hide == r2.Hide);
 }
 
+static bool operator == (const USB_DK_REDIRECT_RULE& r1, const USB_DK_REDIRECT_RULE& r2)
+{
+    return (r1.VID == r2.VID)     &&
+           (r1.PID == r2.PID)     &&
+           (r1.BCD == r2.BCD)     &&
+           (r1.Class == r2.Class) &&
+           (r1.Port == r2.Port)   &&
+           (r1.InterfaceClass == r2.InterfaceClass)       &&
+           (r1.InterfaceSubClass == r2.InterfaceSubClass) &&
+           (r1.InterfaceProtocol == r2.InterfaceProtocol);
+}
+
 DWORD CRulesManager::ReadDword(LPCTSTR RuleName, LPCTSTR ValueName) const
 {
     DWORD RawValue;
@@ -41,6 +66,14 @@ void CRulesManager::WriteDword(const tstring &RuleName, LPCTSTR ValueName, ULONG
     }
 }
 
+void CRulesManager::WriteOptionalDword(const tstring &RuleName, LPCTSTR ValueName, ULONG64 Value)
+{
+    if (Value != USB_DK_REDIRECT_RULE_MATCH_ALL)
+    {
+        WriteDword(RuleName, ValueName, static_cast<ULONG>(Value));
+    }
+}
+
 ULONG64 CRulesManager::ReadDwordMask(LPCTSTR RuleName, LPCTSTR ValueName) const
 {
     return HideRuleUlongMaskFromRegistry(ReadDword(RuleName, ValueName));
@@ -51,23 +84,134 @@ ULONG64 CRulesManager::ReadBool(LPCTSTR RuleName, LPCTSTR ValueName) const
     return HideRuleBoolFromRegistry(ReadDword(RuleName, ValueName));
 }
 
-void CRulesManager::ReadRule(LPCTSTR RuleName, USB_DK_HIDE_RULE &Rule) const
+ULONG64 CRulesManager::ReadOptionalDwordMask(LPCTSTR RuleName, LPCTSTR ValueName) const
+{
+    DWORD RawValue;
+
+    return m_RegAccess.ReadDWord(ValueName, &RawValue, RuleName) ? HideRuleUlongMaskFromRegistry(RawValue)
+                                                                 : USB_DK_HIDE_RULE_MATCH_ALL;
+}
+
+void CRulesManager::ReadMatcher(LPCTSTR RuleName, LPCTSTR ValueName, USB_DK_HIDE_RULE_MATCHER &Matcher) const
+{
+    HideRuleMatcherFromV1(ReadDwordMask(RuleName, ValueName), Matcher);
+    ReadMatcherBounds(RuleName, ValueName, Matcher);
+}
+
+void CRulesManager::ReadOptionalMatcher(LPCTSTR RuleName, LPCTSTR ValueName, USB_DK_HIDE_RULE_MATCHER &Matcher) const
 {
-    Rule.Hide  = ReadBool(RuleName, USBDK_HIDE_RULE_SHOULD_HIDE);
-    Rule.VID   = ReadDwordMask(RuleName, USBDK_HIDE_RULE_VID);
-    Rule.PID   = ReadDwordMask(RuleName, USBDK_HIDE_RULE_PID);
-    Rule.BCD   = ReadDwordMask(RuleName, USBDK_HIDE_RULE_BCD);
-    Rule.Class = ReadDwordMask(RuleName, USBDK_HIDE_RULE_CLASS);
+    HideRuleMatcherFromV1(ReadOptionalDwordMask(RuleName, ValueName), Matcher);
+    ReadMatcherBounds(RuleName, ValueName, Matcher);
 }
 
-template <typename TFunctor>
-bool CRulesManager::FindRule(const USB_DK_HIDE_RULE &Rule, TFunctor Functor)
+void CRulesManager::ReadMatcherBounds(LPCTSTR RuleName, LPCTSTR ValueName, USB_DK_HIDE_RULE_MATCHER &Matcher) const
+{
+    DWORD RawValue;
+    tstring FieldName(ValueName);
+
+    if (m_RegAccess.ReadDWord((FieldName + USBDK_HIDE_RULE_MAX_SUFFIX).c_str(), &RawValue, RuleName))
+    {
+        Matcher.Max = HideRuleUlongMaskFromRegistry(RawValue);
+    }
+
+    if (m_RegAccess.ReadDWord((FieldName + USBDK_HIDE_RULE_MASK_SUFFIX).c_str(), &RawValue, RuleName))
+    {
+        Matcher.Mask = HideRuleUlongMaskFromRegistry(RawValue);
+    }
+}
+
+void CRulesManager::ReadRule(LPCTSTR RuleName, USB_DK_HIDE_RULE_V2 &Rule) const
+{
+    Rule.Hide = ReadBool(RuleName, USBDK_HIDE_RULE_SHOULD_HIDE);
+    ReadMatcher(RuleName, USBDK_HIDE_RULE_VID, Rule.VID);
+    ReadMatcher(RuleName, USBDK_HIDE_RULE_PID, Rule.PID);
+    ReadMatcher(RuleName, USBDK_HIDE_RULE_BCD, Rule.BCD);
+    ReadMatcher(RuleName, USBDK_HIDE_RULE_CLASS, Rule.Class);
+    ReadOptionalMatcher(RuleName, USBDK_HIDE_RULE_INTERFACE_CLASS, Rule.InterfaceClass);
+    ReadOptionalMatcher(RuleName, USBDK_HIDE_RULE_INTERFACE_SUBCLASS, Rule.InterfaceSubClass);
+    ReadOptionalMatcher(RuleName, USBDK_HIDE_RULE_INTERFACE_PROTOCOL, Rule.InterfaceProtocol);
+}
+
+void CRulesManager::ReadRule(LPCTSTR RuleName, USB_DK_REDIRECT_RULE &Rule) const
+{
+    Rule.VID   = ReadDwordMask(RuleName, USBDK_REDIRECT_RULE_VID);
+    Rule.PID   = ReadDwordMask(RuleName, USBDK_REDIRECT_RULE_PID);
+    Rule.BCD   = ReadDwordMask(RuleName, USBDK_REDIRECT_RULE_BCD);
+    Rule.Class = ReadDwordMask(RuleName, USBDK_REDIRECT_RULE_CLASS);
+    Rule.Port  = ReadDwordMask(RuleName, USBDK_REDIRECT_RULE_PORT);
+    Rule.InterfaceClass    = ReadOptionalDwordMask(RuleName, USBDK_REDIRECT_RULE_INTERFACE_CLASS);
+    Rule.InterfaceSubClass = ReadOptionalDwordMask(RuleName, USBDK_REDIRECT_RULE_INTERFACE_SUBCLASS);
+    Rule.InterfaceProtocol = ReadOptionalDwordMask(RuleName, USBDK_REDIRECT_RULE_INTERFACE_PROTOCOL);
+}
+
+// Exact and match-all fields are stored the same way legacy
+// rules are, range bounds and mask are written only when needed
+void CRulesManager::WriteMatcher(const tstring &RuleName, LPCTSTR ValueName, const USB_DK_HIDE_RULE_MATCHER &Matcher)
+{
+    USB_DK_HIDE_RULE_MATCHER MatchAll = USB_DK_HIDE_RULE_MATCHER_ALL;
+    if (Matcher == MatchAll)
+    {
+        WriteDword(RuleName, ValueName, USBDK_REG_HIDE_RULE_MATCH_ALL);
+        return;
+    }
+
+    tstring FieldName(ValueName);
+
+    WriteDword(RuleName, ValueName, HideRuleUlongMaskToRegistry(Matcher.Min));
+
+    if (Matcher.Max != Matcher.Min)
+    {
+        WriteDword(RuleName, (FieldName + USBDK_HIDE_RULE_MAX_SUFFIX).c_str(), HideRuleUlongMaskToRegistry(Matcher.Max));
+    }
+
+    if (Matcher.Mask != MatchAll.Mask)
+    {
+        WriteDword(RuleName, (FieldName + USBDK_HIDE_RULE_MASK_SUFFIX).c_str(), HideRuleUlongMaskToRegistry(Matcher.Mask));
+    }
+}
+
+// Optional fields are not written at all when they match any value
+void CRulesManager::WriteOptionalMatcher(const tstring &RuleName, LPCTSTR ValueName, const USB_DK_HIDE_RULE_MATCHER &Matcher)
+{
+    USB_DK_HIDE_RULE_MATCHER MatchAll = USB_DK_HIDE_RULE_MATCHER_ALL;
+    if (!(Matcher == MatchAll))
+    {
+        WriteMatcher(RuleName, ValueName, Matcher);
+    }
+}
+
+void CRulesManager::WriteRule(const tstring &RuleName, const USB_DK_HIDE_RULE_V2 &Rule)
+{
+    WriteDword(RuleName, USBDK_HIDE_RULE_SHOULD_HIDE, static_cast<ULONG>(Rule.Hide));
+    WriteMatcher(RuleName, USBDK_HIDE_RULE_VID, Rule.VID);
+    WriteMatcher(RuleName, USBDK_HIDE_RULE_PID, Rule.PID);
+    WriteMatcher(RuleName, USBDK_HIDE_RULE_BCD, Rule.BCD);
+    WriteMatcher(RuleName, USBDK_HIDE_RULE_CLASS, Rule.Class);
+    WriteOptionalMatcher(RuleName, USBDK_HIDE_RULE_INTERFACE_CLASS, Rule.InterfaceClass);
+    WriteOptionalMatcher(RuleName, USBDK_HIDE_RULE_INTERFACE_SUBCLASS, Rule.InterfaceSubClass);
+    WriteOptionalMatcher(RuleName, USBDK_HIDE_RULE_INTERFACE_PROTOCOL, Rule.InterfaceProtocol);
+}
+
+void CRulesManager::WriteRule(const tstring &RuleName, const USB_DK_REDIRECT_RULE &Rule)
+{
+    WriteDword(RuleName, USBDK_REDIRECT_RULE_VID, static_cast<ULONG>(Rule.VID));
+    WriteDword(RuleName, USBDK_REDIRECT_RULE_PID, static_cast<ULONG>(Rule.PID));
+    WriteDword(RuleName, USBDK_REDIRECT_RULE_BCD, static_cast<ULONG>(Rule.BCD));
+    WriteDword(RuleName, USBDK_REDIRECT_RULE_CLASS, static_cast<ULONG>(Rule.Class));
+    WriteDword(RuleName, USBDK_REDIRECT_RULE_PORT, static_cast<ULONG>(Rule.Port));
+    WriteOptionalDword(RuleName, USBDK_REDIRECT_RULE_INTERFACE_CLASS, Rule.InterfaceClass);
+    WriteOptionalDword(RuleName, USBDK_REDIRECT_RULE_INTERFACE_SUBCLASS, Rule.InterfaceSubClass);
+    WriteOptionalDword(RuleName, USBDK_REDIRECT_RULE_INTERFACE_PROTOCOL, Rule.InterfaceProtocol);
+}
+
+template <typename TRule, typename TFunctor>
+bool CRulesManager::FindRule(const TRule &Rule, TFunctor Functor)
 {
     for (const auto &SubKey : m_RegAccess)
     {
         try
         {
-            USB_DK_HIDE_RULE ExistingRule;
+            TRule ExistingRule;
             ReadRule(SubKey, ExistingRule);
 
             if (Rule == ExistingRule)
@@ -87,12 +231,14 @@ bool CRulesManager::FindRule(const USB_DK_HIDE_RULE &Rule, TFunctor Functor)
     return false;
 }
 
-bool CRulesManager::RuleExists(const USB_DK_HIDE_RULE &Rule)
+template <typename TRule>
+bool CRulesManager::RuleExists(const TRule &Rule)
 {
     return FindRule(Rule, [](LPCTSTR){});
 }
 
-void CRulesManager::AddRule(const USB_DK_HIDE_RULE &Rule)
+template <typename TRule>
+void CRulesManager::AddRuleKey(const TRule &Rule)
 {
     if (RuleExists(Rule))
     {
@@ -106,14 +252,11 @@ void CRulesManager::AddRule(const USB_DK_HIDE_RULE &Rule)
         throw UsbDkRuleManagerException(TEXT("Failed to create rule key"), ERROR_FUNCTION_FAILED);
     }
 
-    WriteDword(RuleName, USBDK_HIDE_RULE_SHOULD_HIDE, static_cast<ULONG>(Rule.Hide));
-    WriteDword(RuleName, USBDK_HIDE_RULE_VID, static_cast<ULONG>(Rule.VID));
-    WriteDword(RuleName, USBDK_HIDE_RULE_PID, static_cast<ULONG>(Rule.PID));
-    WriteDword(RuleName, USBDK_HIDE_RULE_BCD, static_cast<ULONG>(Rule.BCD));
-    WriteDword(RuleName, USBDK_HIDE_RULE_CLASS, static_cast<ULONG>(Rule.Class));
+    WriteRule(RuleName, Rule);
 }
 
-void CRulesManager::DeleteRule(const USB_DK_HIDE_RULE &Rule)
+template <typename TRule>
+void CRulesManager::DeleteRuleKey(const TRule &Rule)
 {
     tstring RuleName;
 
@@ -125,3 +268,232 @@ void CRulesManager::DeleteRule(const USB_DK_HIDE_RULE &Rule)
         }
     }
 }
+
+void CRulesManager::ReadHideRulesTable(HideRulesTable &Rules)
+{
+    DWORD Type;
+    DWORD Size;
+
+    if (!m_RegAccess.GetValueInfo(USBDK_HIDE_RULES_TABLE, &Type, &Size))
+    {
+        return;
+    }
+
+    vector<BYTE> Table(Size);
+    if ((Type != REG_BINARY) ||
+        (m_RegAccess.ReadBinary(USBDK_HIDE_RULES_TABLE, Table.data(), Size) != Size))
+    {
+        throw UsbDkRuleManagerException(TEXT("Failed to read hide rules table"), ERROR_FUNCTION_FAILED);
+    }
+
+    USB_DK_HIDE_RULES_TABLE_HEADER Header;
+    if (!HideRulesTableParse(Table.data(), Table.size(), Header))
+    {
+        throw UsbDkRuleManagerException(TEXT("Hide rules table is malformed or of unknown version"), ERROR_INVALID_DATA);
+    }
+
+    Rules.resize(Header.NumRules);
+    for (ULONG i = 0; i < Header.NumRules; i++)
+    {
+        HideRulesTableGetRule(Table.data(), Header, i, Rules[i]);
+    }
+}
+
+void CRulesManager::WriteHideRulesTable(const HideRulesTable &Rules)
+{
+    auto NumRules = static_cast<ULONG>(Rules.size());
+
+    vector<BYTE> Table(static_cast<size_t>(HideRulesTableSize(NumRules)));
+    HideRulesTableInit(Table.data(), NumRules);
+    for (ULONG i = 0; i < NumRules; i++)
+    {
+        HideRulesTableSetRule(Table.data(), i, Rules[i]);
+    }
+
+    if (!m_RegAccess.WriteBinary(USBDK_HIDE_RULES_TABLE, Table.data(), static_cast<DWORD>(Table.size())))
+    {
+        throw UsbDkRuleManagerException(TEXT("Failed to write hide rules table"), ERROR_FUNCTION_FAILED);
+    }
+}
+
+void CRulesManager::ReadLegacyHideRules(HideRulesTable &Rules, vector<tstring> &RuleNames)
+{
+    for (const auto &SubKey : m_RegAccess)
+    {
+        try
+        {
+            USB_DK_HIDE_RULE_V2 Rule;
+            ReadRule(SubKey, Rule);
+
+            if (find(Rules.begin(), Rules.end(), Rule) == Rules.end())
+            {
+                Rules.push_back(Rule);
+            }
+            RuleNames.push_back(SubKey);
+        }
+        catch (const UsbDkRuleManagerException &e)
+        {
+            auto ErrorText = tstring(TEXT("Error while processing rule ")) +
+                             SubKey + TEXT(": ") + string2tstring(e.what());
+            OutputDebugString(ErrorText.c_str());
+        }
+    }
+}
+
+void CRulesManager::ReadHideRuleIndexEntry(LPCTSTR EntryName, HideRulesTable &Rules)
+{
+    DWORD Type;
+    DWORD Size;
+
+    if (!m_RegAccess.GetValueInfo(EntryName, &Type, &Size))
+    {
+        return;
+    }
+
+    if ((Type != REG_BINARY) || ((Size % sizeof(USB_DK_HIDE_RULE_V2)) != 0))
+    {
+        throw UsbDkRuleManagerException(TEXT("Hide rules index entry is malformed"), ERROR_INVALID_DATA);
+    }
+
+    Rules.resize(Size / sizeof(USB_DK_HIDE_RULE_V2));
+    if ((Size != 0) &&
+        (m_RegAccess.ReadBinary(EntryName, reinterpret_cast<LPBYTE>(Rules.data()), Size) != Size))
+    {
+        throw UsbDkRuleManagerException(TEXT("Failed to read hide rules index entry"), ERROR_FUNCTION_FAILED);
+    }
+}
+
+void CRulesManager::IndexHideRule(const USB_DK_HIDE_RULE_V2 &Rule, bool Indexed)
+{
+    TCHAR EntryName[USBDK_HIDE_RULE_INDEX_NAME_LENGTH];
+    HideRuleIndexName(Rule, EntryName);
+
+    HideRulesTable Rules;
+    ReadHideRuleIndexEntry(EntryName, Rules);
+
+    auto ExistingRule = find(Rules.begin(), Rules.end(), Rule);
+    if ((ExistingRule != Rules.end()) == Indexed)
+    {
+        return;
+    }
+
+    if (Indexed)
+    {
+        Rules.push_back(Rule);
+    }
+    else
+    {
+        Rules.erase(ExistingRule);
+    }
+
+    auto Written = Rules.empty() ? m_RegAccess.DeleteValue(EntryName)
+                                 : m_RegAccess.WriteBinary(EntryName, reinterpret_cast<LPCBYTE>(Rules.data()),
+                                                           static_cast<DWORD>(Rules.size() * sizeof(Rule)));
+    if (!Written)
+    {
+        throw UsbDkRuleManagerException(TEXT("Failed to update hide rules index"), ERROR_FUNCTION_FAILED);
+    }
+}
+
+void CRulesManager::IndexHideRulesTable(const HideRulesTable &Rules)
+{
+    for (const auto &Rule : Rules)
+    {
+        IndexHideRule(Rule, true);
+    }
+
+    if (!m_RegAccess.WriteValue(USBDK_HIDE_RULES_INDEXED, 1))
+    {
+        throw UsbDkRuleManagerException(TEXT("Failed to mark hide rules index"), ERROR_FUNCTION_FAILED);
+    }
+}
+
+// Hide rules kept in subkeys by older versions are moved
+// to the table on first modification, tables written by
+// older versions are indexed the same way
+template <typename TModifier>
+void CRulesManager::ModifyHideRulesTable(TModifier Modifier)
+{
+    HideRulesTable Rules;
+    ReadHideRulesTable(Rules);
+
+    vector<tstring> LegacyRules;
+    ReadLegacyHideRules(Rules, LegacyRules);
+
+    if (Modifier(Rules) || !LegacyRules.empty())
+    {
+        WriteHideRulesTable(Rules);
+    }
+
+    DWORD Type;
+    DWORD Size;
+    if (!m_RegAccess.GetValueInfo(USBDK_HIDE_RULES_INDEXED, &Type, &Size) || !LegacyRules.empty())
+    {
+        IndexHideRulesTable(Rules);
+    }
+
+    for (const auto &RuleName : LegacyRules)
+    {
+        if (!m_RegAccess.DeleteKey(RuleName.c_str()))
+        {
+            throw UsbDkRuleManagerException(TEXT("Failed to delete rule key"), ERROR_FUNCTION_FAILED);
+        }
+    }
+}
+
+void CRulesManager::AddRule(const USB_DK_HIDE_RULE &Rule)
+{
+    USB_DK_HIDE_RULE_V2 RuleV2;
+    HideRuleV2FromV1(Rule, RuleV2);
+    AddRule(RuleV2);
+}
+
+void CRulesManager::DeleteRule(const USB_DK_HIDE_RULE &Rule)
+{
+    USB_DK_HIDE_RULE_V2 RuleV2;
+    HideRuleV2FromV1(Rule, RuleV2);
+    DeleteRule(RuleV2);
+}
+
+void CRulesManager::AddRule(const USB_DK_HIDE_RULE_V2 &Rule)
+{
+    ModifyHideRulesTable([&Rule](HideRulesTable &Rules)
+                         {
+                             if (find(Rules.begin(), Rules.end(), Rule) != Rules.end())
+                             {
+                                 throw UsbDkRuleManagerException(TEXT("Rule already exists"), ERROR_FILE_EXISTS);
+                             }
+
+                             Rules.push_back(Rule);
+                             return true;
+                         });
+
+    IndexHideRule(Rule, true);
+}
+
+void CRulesManager::DeleteRule(const USB_DK_HIDE_RULE_V2 &Rule)
+{
+    ModifyHideRulesTable([&Rule](HideRulesTable &Rules)
+                         {
+                             auto ExistingRule = find(Rules.begin(), Rules.end(), Rule);
+                             if (ExistingRule == Rules.end())
+                             {
+                                 return false;
+                             }
+
+                             Rules.erase(ExistingRule);
+                             return true;
+                         });
+
+    IndexHideRule(Rule, false);
+}
+
+void CRulesManager::AddRule(const USB_DK_REDIRECT_RULE &Rule)
+{
+    AddRuleKey(Rule);
+}
+
+void CRulesManager::DeleteRule(const USB_DK_REDIRECT_RULE &Rule)
+{
+    DeleteRuleKey(Rule);
+}
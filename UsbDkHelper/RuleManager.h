@@ -14,21 +14,51 @@ public:
 class CRulesManager
 {
 public:
-    CRulesManager();
+    CRulesManager(LPCTSTR RulesPath);
 
     void AddRule(const USB_DK_HIDE_RULE &Rule);
     void DeleteRule(const USB_DK_HIDE_RULE &Rule);
+    void AddRule(const USB_DK_HIDE_RULE_V2 &Rule);
+    void DeleteRule(const USB_DK_HIDE_RULE_V2 &Rule);
+    void AddRule(const USB_DK_REDIRECT_RULE &Rule);
+    void DeleteRule(const USB_DK_REDIRECT_RULE &Rule);
 private:
-    template <typename TFunctor>
-    bool FindRule(const USB_DK_HIDE_RULE &Rule, TFunctor Functor);
-    bool RuleExists(const USB_DK_HIDE_RULE &Rule);
+    template <typename TRule, typename TFunctor>
+    bool FindRule(const TRule &Rule, TFunctor Functor);
+    template <typename TRule>
+    bool RuleExists(const TRule &Rule);
+    template <typename TRule>
+    void AddRuleKey(const TRule &Rule);
+    template <typename TRule>
+    void DeleteRuleKey(const TRule &Rule);
+
+    typedef vector<USB_DK_HIDE_RULE_V2> HideRulesTable;
+    template <typename TModifier>
+    void ModifyHideRulesTable(TModifier Modifier);
+    void ReadHideRulesTable(HideRulesTable &Rules);
+    void WriteHideRulesTable(const HideRulesTable &Rules);
+    void ReadLegacyHideRules(HideRulesTable &Rules, vector<tstring> &RuleNames);
+    void ReadHideRuleIndexEntry(LPCTSTR EntryName, HideRulesTable &Rules);
+    void IndexHideRule(const USB_DK_HIDE_RULE_V2 &Rule, bool Indexed);
+    void IndexHideRulesTable(const HideRulesTable &Rules);
 
     DWORD ReadDword(LPCTSTR RuleName, LPCTSTR ValueName) const;
     ULONG64 ReadDwordMask(LPCTSTR RuleName, LPCTSTR ValueName) const;
+    ULONG64 ReadOptionalDwordMask(LPCTSTR RuleName, LPCTSTR ValueName) const;
     ULONG64 ReadBool(LPCTSTR RuleName, LPCTSTR ValueName) const;
     void WriteDword(const tstring &RuleName, LPCTSTR ValueName, ULONG Value);
+    void WriteOptionalDword(const tstring &RuleName, LPCTSTR ValueName, ULONG64 Value);
+
+    void ReadMatcher(LPCTSTR RuleName, LPCTSTR ValueName, USB_DK_HIDE_RULE_MATCHER &Matcher) const;
+    void ReadOptionalMatcher(LPCTSTR RuleName, LPCTSTR ValueName, USB_DK_HIDE_RULE_MATCHER &Matcher) const;
+    void ReadMatcherBounds(LPCTSTR RuleName, LPCTSTR ValueName, USB_DK_HIDE_RULE_MATCHER &Matcher) const;
+    void WriteMatcher(const tstring &RuleName, LPCTSTR ValueName, const USB_DK_HIDE_RULE_MATCHER &Matcher);
+    void WriteOptionalMatcher(const tstring &RuleName, LPCTSTR ValueName, const USB_DK_HIDE_RULE_MATCHER &Matcher);
 
-    void ReadRule(LPCTSTR RuleName, USB_DK_HIDE_RULE &Rule) const;
+    void ReadRule(LPCTSTR RuleName, USB_DK_HIDE_RULE_V2 &Rule) const;
+    void ReadRule(LPCTSTR RuleName, USB_DK_REDIRECT_RULE &Rule) const;
+    void WriteRule(const tstring &RuleName, const USB_DK_HIDE_RULE_V2 &Rule);
+    void WriteRule(const tstring &RuleName, const USB_DK_REDIRECT_RULE &Rule);
 
     UsbDkRegAccess m_RegAccess;
 };
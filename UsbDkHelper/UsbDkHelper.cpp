@@ -30,6 +30,7 @@
 #include "Installer.h"
 #include "DriverAccess.h"
 #include "RedirectorAccess.h"
+#include "HideRulesRegPublic.h"
 #include "RuleManager.h"
 
 
@@ -109,6 +110,63 @@ DLL void UsbDk_ReleaseConfigurationDescriptor(PUSB_CONFIGURATION_DESCRIPTOR Desc
     }
 }
 
+BOOL UsbDk_GetAllDescriptors(PUSB_DK_DEVICE_ID DeviceID, PUSB_DK_DEVICE_DESCRIPTORS *Descriptors)
+{
+    try
+    {
+        UsbDkDriverAccess driver;
+        *Descriptors = driver.GetAllDescriptors(*DeviceID);
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
+void UsbDk_ReleaseAllDescriptors(PUSB_DK_DEVICE_DESCRIPTORS Descriptors)
+{
+    try
+    {
+        UsbDkDriverAccess::ReleaseAllDescriptors(Descriptors);
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+    }
+}
+
+BOOL UsbDk_GetDeviceStrings(PUSB_DK_DEVICE_ID DeviceID, PUSB_DK_DEVICE_STRINGS Strings)
+{
+    try
+    {
+        UsbDkDriverAccess driver;
+        driver.GetDeviceStrings(*DeviceID, *Strings);
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
+BOOL UsbDk_GetMemoryStatistics(PUSB_DK_MEMORY_STATISTICS Statistics)
+{
+    try
+    {
+        UsbDkDriverAccess driver;
+        driver.GetMemoryStatistics(*Statistics);
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
 BOOL UsbDk_GetDevicesList(PUSB_DK_DEVICE_INFO *DevicesArray, PULONG NumberDevices)
 {
     try
@@ -136,6 +194,33 @@ void UsbDk_ReleaseDevicesList(PUSB_DK_DEVICE_INFO DevicesArray)
     }
 }
 
+BOOL UsbDk_GetDeviceList(PUSB_DK_DEVICE_LIST *List)
+{
+    try
+    {
+        UsbDkDriverAccess driver;
+        *List = driver.GetDeviceList();
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
+void UsbDk_ReleaseDeviceList(PUSB_DK_DEVICE_LIST List)
+{
+    try
+    {
+        UsbDkDriverAccess::ReleaseDeviceList(List);
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+    }
+}
+
 HANDLE UsbDk_StartRedirect(PUSB_DK_DEVICE_ID DeviceID)
 {
     try
@@ -154,6 +239,100 @@ HANDLE UsbDk_StartRedirect(PUSB_DK_DEVICE_ID DeviceID)
     }
 }
 
+ULONG UsbDk_StartRedirectBatch(PUSB_DK_DEVICE_ID DeviceIDs, ULONG NumberDevices, PHANDLE DeviceHandles)
+{
+    ULONG NumberRedirected = 0;
+
+    for (ULONG i = 0; i < NumberDevices; i++)
+    {
+        DeviceHandles[i] = INVALID_HANDLE_VALUE;
+    }
+
+    try
+    {
+        vector<USB_DK_REDIRECT_RESULT> Results(NumberDevices);
+
+        UsbDkDriverAccess driverAccess;
+        driverAccess.AddRedirectBatch(DeviceIDs, NumberDevices, Results.data());
+
+        for (ULONG i = 0; i < NumberDevices; i++)
+        {
+            if (Results[i].Status != 0)
+            {
+                continue;
+            }
+
+            auto RedirectorHandle = reinterpret_cast<HANDLE>(Results[i].RedirectorHandle);
+            try
+            {
+                unique_ptr<REDIRECTED_DEVICE_HANDLE> deviceHandle(new REDIRECTED_DEVICE_HANDLE);
+                deviceHandle->DeviceID = DeviceIDs[i];
+                deviceHandle->RedirectorAccess.reset(new UsbDkRedirectorAccess(RedirectorHandle));
+                DeviceHandles[i] = reinterpret_cast<HANDLE>(deviceHandle.release());
+                NumberRedirected++;
+            }
+            catch (const exception &e)
+            {
+                printExceptionString(e.what());
+                CloseHandle(RedirectorHandle);
+            }
+        }
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+    }
+
+    return NumberRedirected;
+}
+
+BOOL UsbDk_StopRedirectWithoutReset(HANDLE DeviceHandle)
+{
+    try
+    {
+        UsbDkDriverAccess driverAccess;
+        unique_ptr<REDIRECTED_DEVICE_HANDLE> deviceHandle(reinterpret_cast<PREDIRECTED_DEVICE_HANDLE>(DeviceHandle));
+        deviceHandle->RedirectorAccess->RequestSoftRelease();
+        deviceHandle->RedirectorAccess.reset();
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
+BOOL UsbDk_AddRedirectRule(PUSB_DK_REDIRECT_RULE Rule)
+{
+    try
+    {
+        UsbDkDriverAccess driverAccess;
+        driverAccess.AddRedirectRule(*Rule);
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
+BOOL UsbDk_ClearRedirectRules(void)
+{
+    try
+    {
+        UsbDkDriverAccess driverAccess;
+        driverAccess.ClearRedirectRules();
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
 BOOL UsbDk_StopRedirect(HANDLE DeviceHandle)
 {
     try
@@ -294,6 +473,38 @@ BOOL UsbDk_AddHideRule(HANDLE HiderHandle, PUSB_DK_HIDE_RULE Rule)
     }
 }
 
+BOOL UsbDk_AddHideRuleV2(HANDLE HiderHandle, PUSB_DK_HIDE_RULE_V2 Rule)
+{
+    auto HiderAccess = reinterpret_cast<UsbDkHiderAccess *>(HiderHandle);
+
+    try
+    {
+        HiderAccess->AddHideRule(*Rule);
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
+BOOL UsbDk_ReplaceHideRules(HANDLE HiderHandle, PUSB_DK_HIDE_RULE_V2 Rules, ULONG NumberRules)
+{
+    auto HiderAccess = reinterpret_cast<UsbDkHiderAccess *>(HiderHandle);
+
+    try
+    {
+        HiderAccess->ReplaceHideRules(Rules, NumberRules);
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
 BOOL UsbDk_ClearHideRules(HANDLE HiderHandle)
 {
     auto HiderAccess = reinterpret_cast<UsbDkHiderAccess *>(HiderHandle);
@@ -310,22 +521,84 @@ BOOL UsbDk_ClearHideRules(HANDLE HiderHandle)
     }
 }
 
+BOOL UsbDk_GetHideStatistics(HANDLE HiderHandle, PUSB_DK_HIDE_STATISTICS *Statistics)
+{
+    auto HiderAccess = reinterpret_cast<UsbDkHiderAccess *>(HiderHandle);
+
+    try
+    {
+        *Statistics = HiderAccess->GetHideStatistics();
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
+void UsbDk_ReleaseHideStatistics(PUSB_DK_HIDE_STATISTICS Statistics)
+{
+    UsbDkHiderAccess::ReleaseHideStatistics(Statistics);
+}
+
 void UsbDk_CloseHiderHandle(HANDLE HiderHandle)
 {
     delete reinterpret_cast<UsbDkHiderAccess *>(HiderHandle);
 }
 
+// Driver applies hide rule change without re-reading all
+// persistent rules, if it fails rules are reloaded completely
 static inline
-InstallResult ModifyPersistentHideRules(const USB_DK_HIDE_RULE &Rule,
-                                        void(CRulesManager::*Modifier)(const USB_DK_HIDE_RULE&))
+void UpdateDriverRules(UsbDkDriverAccess &Driver, const USB_DK_HIDE_RULE_V2 &Rule, bool Add)
 {
+    USB_DK_HIDE_RULE_UPDATE Update;
+    Update.Operation = Add ? HideRuleAdded : HideRuleDeleted;
+    Update.Rule = Rule;
+
     try
     {
-        CRulesManager Manager;
-        (CRulesManager().*Modifier)(Rule);
+        Driver.UpdateRegistryParameters(Update);
+    }
+    catch (const UsbDkDriverFileException &e)
+    {
+        printExceptionString(e.what());
+        Driver.UpdateRegistryParameters();
+    }
+}
+
+static inline
+void UpdateDriverRules(UsbDkDriverAccess &Driver, const USB_DK_HIDE_RULE &Rule, bool Add)
+{
+    USB_DK_HIDE_RULE_V2 RuleV2;
+    HideRuleV2FromV1(Rule, RuleV2);
+    UpdateDriverRules(Driver, RuleV2, Add);
+}
+
+static inline
+void UpdateDriverRules(UsbDkDriverAccess &Driver, const USB_DK_REDIRECT_RULE &, bool)
+{
+    Driver.UpdateRegistryParameters();
+}
+
+template <typename TRule>
+static inline
+InstallResult ModifyPersistentRules(LPCTSTR RulesPath, const TRule &Rule, bool Add)
+{
+    try
+    {
+        CRulesManager Manager(RulesPath);
+        if (Add)
+        {
+            Manager.AddRule(Rule);
+        }
+        else
+        {
+            Manager.DeleteRule(Rule);
+        }
 
         UsbDkDriverAccess driver;
-        driver.UpdateRegistryParameters();
+        UpdateDriverRules(driver, Rule, Add);
 
         return InstallSuccess;
     }
@@ -343,10 +616,30 @@ InstallResult ModifyPersistentHideRules(const USB_DK_HIDE_RULE &Rule,
 
 DLL InstallResult UsbDk_AddPersistentHideRule(PUSB_DK_HIDE_RULE Rule)
 {
-    return ModifyPersistentHideRules(*Rule, &CRulesManager::AddRule);
+    return ModifyPersistentRules(USBDK_HIDE_RULES_PATH, *Rule, true);
 }
 
 DLL InstallResult UsbDk_DeletePersistentHideRule(PUSB_DK_HIDE_RULE Rule)
 {
-    return ModifyPersistentHideRules(*Rule, &CRulesManager::DeleteRule);
+    return ModifyPersistentRules(USBDK_HIDE_RULES_PATH, *Rule, false);
+}
+
+DLL InstallResult UsbDk_AddPersistentHideRuleV2(PUSB_DK_HIDE_RULE_V2 Rule)
+{
+    return ModifyPersistentRules(USBDK_HIDE_RULES_PATH, *Rule, true);
+}
+
+DLL InstallResult UsbDk_DeletePersistentHideRuleV2(PUSB_DK_HIDE_RULE_V2 Rule)
+{
+    return ModifyPersistentRules(USBDK_HIDE_RULES_PATH, *Rule, false);
+}
+
+DLL InstallResult UsbDk_AddPersistentRedirectRule(PUSB_DK_REDIRECT_RULE Rule)
+{
+    return ModifyPersistentRules(USBDK_REDIRECT_RULES_PATH, *Rule, true);
+}
+
+DLL InstallResult UsbDk_DeletePersistentRedirectRule(PUSB_DK_REDIRECT_RULE Rule)
+{
+    return ModifyPersistentRules(USBDK_REDIRECT_RULES_PATH, *Rule, false);
 }
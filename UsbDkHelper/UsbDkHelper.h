@@ -102,6 +102,36 @@ extern "C" {
     */
     DLL void             UsbDk_ReleaseDevicesList(PUSB_DK_DEVICE_INFO DevicesArray);
 
+    /* Retrieve compact list of USB devices
+    *
+    * @params
+    *    IN  - None
+    *    OUT - List  pointer to the list of devices
+    *
+    * @return
+    *  TRUE if function succeeds
+    *
+    * @note
+    *  List holds NumDevices records, use UsbDkDeviceListRecord() to
+    *  access them and UsbDkDeviceListString() to get their IDs.
+    *  It is caller's responsibility to release the list by
+    *  using UsbDk_ReleaseDeviceList
+    *
+    */
+    DLL BOOL             UsbDk_GetDeviceList(PUSB_DK_DEVICE_LIST *List);
+
+    /* Release device list returned by UsbDk_GetDeviceList
+    *
+    * @params
+    *    IN  - List  pointer to device list to be released
+    *    OUT - None
+    *
+    * @return
+    *  None
+    *
+    */
+    DLL void             UsbDk_ReleaseDeviceList(PUSB_DK_DEVICE_LIST List);
+
     /* Retrieve USB device configuration descriptor
     *
     * @params
@@ -130,6 +160,68 @@ extern "C" {
     */
     DLL void             UsbDk_ReleaseConfigurationDescriptor(PUSB_CONFIGURATION_DESCRIPTOR Descriptor);
 
+    /* Retrieve USB device descriptor and all its configuration descriptors
+    *
+    * @params
+    *    IN  - DeviceID     id of the device
+    *    OUT - Descriptors  pointer where descriptors blob will be stored
+    *
+    * @return
+    * TRUE if function succeeds
+    *
+    * @note
+    *  Blob starts with USB_DK_DEVICE_DESCRIPTORS header followed by
+    *  NumConfigurations configuration descriptors placed back to back.
+    *  The blob is released via UsbDk_ReleaseAllDescriptors
+    *
+    */
+    DLL BOOL             UsbDk_GetAllDescriptors(PUSB_DK_DEVICE_ID DeviceID,
+                                                 PUSB_DK_DEVICE_DESCRIPTORS *Descriptors);
+
+    /* Release descriptors returned by UsbDk_GetAllDescriptors
+    *
+    * @params
+    *    IN  - Descriptors - pointer to descriptors to be released
+    *    OUT - None
+    *
+    * @return
+    *  None
+    *
+    */
+    DLL void             UsbDk_ReleaseAllDescriptors(PUSB_DK_DEVICE_DESCRIPTORS Descriptors);
+
+    /* Retrieve manufacturer, product and serial number strings of USB device
+    *
+    * @params
+    *    IN  - DeviceID   id of the device
+    *    OUT - Strings    pointer to structure the strings will be stored in
+    *
+    * @return
+    * TRUE if function succeeds
+    *
+    * @note
+    *  Strings are cached by the driver when the device is attached,
+    *  no USB traffic is generated. Strings not provided by the device are empty
+    *
+    */
+    DLL BOOL             UsbDk_GetDeviceStrings(PUSB_DK_DEVICE_ID DeviceID, PUSB_DK_DEVICE_STRINGS Strings);
+
+    /* Retrieve non-paged memory driver keeps for attached devices
+    *
+    * @params
+    *    IN  - None
+    *    OUT - Statistics  pointer to structure the statistics will be stored in
+    *
+    * @return
+    * TRUE if function succeeds
+    *
+    * @note
+    *  Devices with identical configuration descriptors share one copy
+    *  of them, SharedDescriptorBytes tells how much memory this saves
+    *
+    */
+    DLL BOOL             UsbDk_GetMemoryStatistics(PUSB_DK_MEMORY_STATISTICS Statistics);
+
     /* Detach USB device from Windows and acquire it for exclusive access
     *
     * @params
@@ -145,6 +237,25 @@ extern "C" {
     */
     DLL HANDLE           UsbDk_StartRedirect(PUSB_DK_DEVICE_ID DeviceID);
 
+    /* Detach a number of USB devices from the system and acquire them
+    *
+    * @params
+    *    IN  - DeviceIDs      array of ids of devices to be acquired
+    *          NumberDevices  number of entries in DeviceIDs
+    *    OUT - DeviceHandles  array of NumberDevices handles of acquired devices,
+    *                         INVALID_HANDLE_VALUE for devices that failed
+    *
+    * @return
+    *  Number of devices acquired
+    *
+    * @note
+    *  Devices are reset and re-enumerated concurrently, so acquiring a batch
+    *  takes about as long as acquiring a single device.
+    *  Each acquired device must be returned via UsbDk_StopRedirect
+    *
+    */
+    DLL ULONG            UsbDk_StartRedirectBatch(PUSB_DK_DEVICE_ID DeviceIDs, ULONG NumberDevices, PHANDLE DeviceHandles);
+
     /* Return USB device to system
     *
     * @params
@@ -157,6 +268,107 @@ extern "C" {
     */
     DLL BOOL             UsbDk_StopRedirect(HANDLE DeviceHandle);
 
+    /* Return USB device to system without resetting it
+    *
+    * @params
+    *    IN  - DeviceHandle  handle of acquired device
+    *    OUT - None
+    *
+    * @return
+    * TRUE if function succeeds
+    *
+    * @note
+    *  Device is re-enumerated by the system without port reset, which
+    *  is much faster than UsbDk_StopRedirect(). If standard requests
+    *  changing device state were sent to the device, or device does not
+    *  re-appear in time, UsbDk falls back to reset.
+    *
+    */
+    DLL BOOL             UsbDk_StopRedirectWithoutReset(HANDLE DeviceHandle);
+
+    /* Add rule for redirecting USB devices automatically on arrival.
+    *  The rule consists of:
+    *
+    * class, vendor, product, version, port,
+    * interface class, interface subclass, interface protocol
+    *
+    * Use -1 for any of the fields to accept any value. Interface fields
+    * match if some interface of some device configuration matches all three.
+    *
+    * @params
+    *    IN  - Rule - pointer to redirect rule
+    *    OUT - None
+    *
+    * @return
+    *  TRUE if function succeeds
+    *
+    * @note
+    * 1. Matching devices are detached from the system as soon as they
+    *    appear, UsbDk_StartRedirect() then returns their handles without
+    *    resetting the device
+    * 2. Rule stays until UsbDk_ClearRedirectRules() called
+    * 3. For already attached devices the rule will be applied after
+    *    device re-plug
+    * 4. Device returned to system via UsbDk_StopRedirect() stays with
+    *    the system until it is re-plugged
+    *
+    */
+    DLL BOOL             UsbDk_AddRedirectRule(PUSB_DK_REDIRECT_RULE Rule);
+
+    /* Clear all redirect rules added by UsbDk_AddRedirectRule()
+    *
+    * @params
+    *    IN  - None
+    *    OUT - None
+    *
+    * @return
+    *  TRUE if function succeeds
+    *
+    * @note
+    *  Devices already redirected automatically stay redirected
+    *
+    */
+    DLL BOOL             UsbDk_ClearRedirectRules(void);
+
+    /* Add rule for redirecting USB devices automatically on arrival persistently.
+    *  The rule consists of:
+    *
+    * class, vendor, product, version, port,
+    * interface class, interface subclass, interface protocol
+    *
+    * Use -1 for any of the fields to accept any value. Interface fields
+    * match if some interface of some device configuration matches all three.
+    *
+    * @params
+    *    IN  - Rule - pointer to redirect rule
+    *    OUT - None
+    *
+    * @return
+    *  Rule installation status
+    *
+    * @note
+    * 1. Persistent rule stays until explicitly deleted by
+    *    UsbDk_DeletePersistentRedirectRule()
+    * 2. This API requires administrative privileges
+    *
+    */
+    DLL InstallResult    UsbDk_AddPersistentRedirectRule(PUSB_DK_REDIRECT_RULE Rule);
+
+    /* Delete specific persistent redirect rule
+    *
+    * @params
+    *    IN  - Rule - pointer to redirect rule
+    *    OUT - None
+    *
+    * @return
+    *  Rule removal status
+    *
+    * @note
+    *  This API requires administrative privileges
+    *
+    */
+    DLL InstallResult    UsbDk_DeletePersistentRedirectRule(PUSB_DK_REDIRECT_RULE Rule);
+
     /* Write to USB device pipe
     *
     * @params
@@ -81,6 +81,50 @@ extern "C" {
     */
     DLL BOOL             UsbDk_AddHideRule(HANDLE HiderHandle, PUSB_DK_HIDE_RULE Rule);
 
+    /* Add rule for detaching USB devices from OS stack,
+    *  with value ranges and masks.
+    *  Each of class, vendor, product and version fields matches
+    *  if Min <= (Value & Mask) <= Max, use USB_DK_HIDE_RULE_MATCHER_ALL
+    *  to accept any value.
+    *  Interface class, subclass and protocol fields match if some
+    *  interface of some device configuration matches all three.
+    *
+    * @params
+    *    IN  - HiderHandle  Handle to UsbDk driver
+             - Rule - pointer to hide rule
+    *    OUT - None
+    *
+    * @return
+    *  TRUE if function succeeds
+    *
+    * @note
+    * Hide rule stays until HiderHandle is closed, client process exits or
+    * UsbDk_ClearHideRules() called
+    *
+    */
+    DLL BOOL             UsbDk_AddHideRuleV2(HANDLE HiderHandle, PUSB_DK_HIDE_RULE_V2 Rule);
+
+    /* Replace all rules set by UsbDk_AddHideRule() and UsbDk_AddHideRuleV2()
+    *  with given set of rules in one step, duplicate rules are dropped.
+    *  Devices attached during the call are matched against either
+    *  previous or new rules, never against a mix of both.
+    *
+    * @params
+    *    IN  - HiderHandle  Handle to UsbDk driver
+    *        - Rules - array of hide rules
+    *        - NumberRules - number of rules in the array, 0 drops all rules
+    *    OUT - None
+    *
+    * @return
+    *  TRUE if function succeeds, previous rules stay intact otherwise
+    *
+    * @note
+    * Hide rules stay until HiderHandle is closed, client process exits or
+    * UsbDk_ClearHideRules() called
+    *
+    */
+    DLL BOOL             UsbDk_ReplaceHideRules(HANDLE HiderHandle, PUSB_DK_HIDE_RULE_V2 Rules, ULONG NumberRules);
+
     /* Clear all hider rules
     *
     * @params
@@ -93,6 +137,35 @@ extern "C" {
     */
     DLL BOOL             UsbDk_ClearHideRules(HANDLE HiderHandle);
 
+    /* Get hide decisions statistics and hit counters of
+    *  all hide rules driver currently has
+    *
+    * @params
+    *    IN  - HiderHandle  Handle to UsbDk driver
+    *    OUT - Statistics - statistics header followed by
+    *                       Statistics->NumRules rule entries
+    *
+    * @return
+    *  TRUE if function succeeds
+    *
+    * @note
+    * Statistics must be released by UsbDk_ReleaseHideStatistics
+    *
+    */
+    DLL BOOL             UsbDk_GetHideStatistics(HANDLE HiderHandle, PUSB_DK_HIDE_STATISTICS *Statistics);
+
+    /* Release statistics returned by UsbDk_GetHideStatistics
+    *
+    * @params
+    *    IN  - Statistics - statistics to release
+    *    OUT - None
+    *
+    * @return
+    * None
+    *
+    */
+    DLL void             UsbDk_ReleaseHideStatistics(PUSB_DK_HIDE_STATISTICS Statistics);
+
     /* Close Handle to UsbDk hider interface
     *
     * @params
@@ -145,6 +218,43 @@ extern "C" {
     *
     */
     DLL InstallResult    UsbDk_DeletePersistentHideRule(PUSB_DK_HIDE_RULE Rule);
+
+    /* Add persistent rule for detaching USB devices from OS stack,
+    *  with value ranges and masks, see UsbDk_AddHideRuleV2()
+    *
+    * @params
+    *    IN  - Rule - pointer to hide rule
+    *    OUT - None
+    *
+    * @return
+    *  Rule installation status
+    *
+    * @note
+    * 1. Persistent rule stays until explicitly deleted by
+    *    UsbDk_DeletePersistentHideRuleV2()
+    * 2. This API requires administrative privileges
+    * 3. For already attached devices the rule will be applied after
+    *    device re-plug or system reboot.
+    *
+    */
+    DLL InstallResult    UsbDk_AddPersistentHideRuleV2(PUSB_DK_HIDE_RULE_V2 Rule);
+
+    /* Delete specific persistent hide rule with value ranges and masks
+    *
+    * @params
+    *    IN  - Rule - pointer to hide rule
+    *    OUT - None
+    *
+    * @return
+    *  Rule removal status
+    *
+    * @note
+    * 1. This API requires administrative privileges
+    * 2. For already attached devices the rule will be applied after
+    *    device re-plug or system reboot.
+    *
+    */
+    DLL InstallResult    UsbDk_DeletePersistentHideRuleV2(PUSB_DK_HIDE_RULE_V2 Rule);
 #ifdef __cplusplus
 }
 #endif